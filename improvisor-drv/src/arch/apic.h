@@ -0,0 +1,41 @@
+#ifndef IMP_ARCH_APIC_H
+#define IMP_ARCH_APIC_H
+
+#include <ntdef.h>
+
+// Offsets of the interrupt command register halves in the xAPIC register page
+#define XAPIC_ICR_LOW 0x300
+#define XAPIC_ICR_HIGH 0x310
+
+typedef enum _APIC_DELIVERY_MODE
+{
+	APIC_DELIVERY_FIXED = 0,
+	APIC_DELIVERY_LOWEST_PRIORITY = 1,
+	APIC_DELIVERY_SMI = 2,
+	APIC_DELIVERY_NMI = 4,
+	APIC_DELIVERY_INIT = 5,
+	APIC_DELIVERY_STARTUP = 6
+} APIC_DELIVERY_MODE, *PAPIC_DELIVERY_MODE;
+
+typedef union _APIC_ICR
+{
+	UINT64 Value;
+
+	struct
+	{
+		UINT64 Vector : 8;
+		UINT64 DeliveryMode : 3;
+		UINT64 LogicalDestination : 1;
+		UINT64 DeliveryPending : 1;
+		UINT64 Reserved1 : 1;
+		UINT64 Assert : 1;
+		UINT64 LevelTriggered : 1;
+		UINT64 Reserved2 : 2;
+		UINT64 DestinationShorthand : 2;
+		UINT64 Reserved3 : 12;
+		// The whole field is the x2APIC ID in x2APIC mode, only the top 8 bits are used in xAPIC mode
+		UINT64 Destination : 32;
+	};
+} APIC_ICR, *PAPIC_ICR;
+
+#endif
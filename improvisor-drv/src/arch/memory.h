@@ -41,4 +41,19 @@ typedef union _X86_LA57
 	};
 } X86_LA57, *PX86_LA57;
 
+typedef enum _X86_INVPCID_TYPE
+{
+	INVPCID_INDIVIDUAL_ADDRESS = 0,
+	INVPCID_SINGLE_CONTEXT,
+	INVPCID_ALL_CONTEXT,
+	INVPCID_ALL_CONTEXT_RETAIN_GLOBALS
+} X86_INVPCID_TYPE, *PX86_INVPCID_TYPE;
+
+typedef struct _X86_INVPCID_DESCRIPTOR
+{
+	UINT64 Pcid : 12;
+	UINT64 Reserved1 : 52;
+	UINT64 LinearAddr;
+} X86_INVPCID_DESCRIPTOR, *PX86_INVPCID_DESCRIPTOR;
+
 #endif
@@ -32,6 +32,7 @@
 #define IA32_VMX_TRUE_PROCBASED_CTLS 0x48E
 #define IA32_VMX_TRUE_EXIT_CTLS 0x48F
 #define IA32_VMX_TRUE_ENTRY_CTLS 0x490
+#define IA32_VMX_VMFUNC 0x491
 #define IA32_VMX_CR0_FIXED0 0x486
 #define IA32_VMX_CR0_FIXED1 0x487
 #define IA32_VMX_CR4_FIXED0 0x488
@@ -40,10 +41,13 @@
 #define IA32_SYSENTER_CS 0x174
 #define IA32_SYSENTER_ESP 0x175
 #define IA32_SYSENTER_EIP 0x176
+#define IA32_X2APIC_APICID 0x802
+#define IA32_X2APIC_ICR 0x830
 #define IA32_FS_BASE 0xC0000100
 #define IA32_GS_BASE 0xC0000101
-#define IA32_STAR 0xC0000082
+#define IA32_STAR 0xC0000081
 #define IA32_LSTAR 0xC0000082
+#define IA32_CSTAR 0xC0000083
 #define IA32_EFER 0xC0000080
 #define IA32_FMASK 0xC0000084
 #define IA32_KERNEL_GS_BASE 0xC0000102
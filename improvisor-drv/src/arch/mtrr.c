@@ -11,13 +11,25 @@ typedef struct _MTRR_STATIC_REGION
 	UINT32 BlockSize;
 } MTRR_STATIC_REGION, *PMTRR_STATIC_REGION;
 
-typedef struct _MTRR_REGION_CACHE_ENTRY
+// Upper bound of the physical address space covered by the MTRR region table (IA32_MTRR_PHYSBASE_N holds 36 bits of PFN)
+#define MTRR_PHYS_ADDR_LIMIT (1ULL << 48)
+
+// A raw memory range described by either a variable or a fixed range MTRR, ranges may overlap
+typedef struct _MTRR_RANGE
+{
+	UINT64 Base;
+	UINT64 End;
+	MEMORY_TYPE Type;
+	BOOLEAN Fixed;
+} MTRR_RANGE, *PMTRR_RANGE;
+
+// A resolved region of uniform memory type, the region table is sorted and non-overlapping
+typedef struct _MTRR_REGION
 {
-	LIST_ENTRY Links;
 	UINT64 Base;
-	UINT64 Size;
+	UINT64 End;
 	MEMORY_TYPE Type;
-} MTRR_REGION_CACHE_ENTRY, *PMTRR_REGION_CACHE_ENTRY;
+} MTRR_REGION, *PMTRR_REGION;
 
 static const MTRR_STATIC_REGION sFixedMtrrRanges[] = {
 	{IA32_MTRR_FIX64K_00000, 0x00000ul, KB(64)},
@@ -33,24 +45,36 @@ static const MTRR_STATIC_REGION sFixedMtrrRanges[] = {
 	{IA32_MTRR_FIX4K_F8000, 0xF8000ul, KB(4)}
 };
 
-VMM_DATA static PMTRR_REGION_CACHE_ENTRY sMtrrRegionCacheRaw = NULL;
+// Sorted, non-overlapping table of uniform memory type regions covering [0, MTRR_PHYS_ADDR_LIMIT)
+VMM_DATA static PMTRR_REGION sMtrrRegions = NULL;
+VMM_DATA static SIZE_T sMtrrRegionCount = 0;
 
-// The head of the MTRR variable range cache list
-VMM_DATA PMTRR_REGION_CACHE_ENTRY gMtrrRegionCacheHead = NULL;
+// Cached value of IA32_MTRR_DEFAULT_TYPE::Type
+VMM_DATA static MEMORY_TYPE sMtrrDefaultType = MT_UNCACHABLE;
 
 VMM_API
-PMTRR_REGION_CACHE_ENTRY
+PMTRR_REGION
 MtrrGetContainingRegion(
 	_In_ UINT64 PhysAddr
 )
+/*++
+Routine Description:
+	Binary searches the region table for the region containing `PhysAddr`
+--*/
 {
-	PMTRR_REGION_CACHE_ENTRY CurrEntry = gMtrrRegionCacheHead;
-	while (CurrEntry != NULL)
-	{
-		if (CurrEntry->Base <= PhysAddr && PhysAddr < CurrEntry->Base + CurrEntry->Size)
-			return CurrEntry;
+	SIZE_T Low = 0;
+	SIZE_T High = sMtrrRegionCount;
 
-		CurrEntry = (PMTRR_REGION_CACHE_ENTRY)CurrEntry->Links.Blink;
+	while (Low < High)
+	{
+		const SIZE_T Mid = Low + (High - Low) / 2;
+
+		if (PhysAddr < sMtrrRegions[Mid].Base)
+			High = Mid;
+		else if (PhysAddr >= sMtrrRegions[Mid].End)
+			Low = Mid + 1;
+		else
+			return &sMtrrRegions[Mid];
 	}
 
 	return NULL;
@@ -66,11 +90,11 @@ Routine Description:
 	Returns the size of the containing MTRR region
 --*/
 {
-	PMTRR_REGION_CACHE_ENTRY Entry = MtrrGetContainingRegion(PhysAddr);
-	if (Entry == NULL)
+	PMTRR_REGION Region = MtrrGetContainingRegion(PhysAddr);
+	if (Region == NULL)
 		return 0;
 
-	return Entry->Size;
+	return Region->End - Region->Base;
 }
 
 VMM_API
@@ -80,14 +104,14 @@ MtrrGetRegionBase(
 )
 /*++
 Routine Description:
-	Returns the size of the containing MTRR region
+	Returns the base of the containing MTRR region
 --*/
 {
-	PMTRR_REGION_CACHE_ENTRY Entry = MtrrGetContainingRegion(PhysAddr);
-	if (Entry == NULL)
+	PMTRR_REGION Region = MtrrGetContainingRegion(PhysAddr);
+	if (Region == NULL)
 		return 0;
 
-	return Entry->Base;
+	return Region->Base;
 }
 
 VMM_API
@@ -98,11 +122,7 @@ Routine Description:
 	Returns the default memory type for any range outside of the VRR's
 --*/
 {
-	IA32_MTRR_DEFAULT_TYPE_MSR DefaultMtrr = { 
-		.Value = __readmsr(IA32_MTRR_DEFAULT_TYPE)
-	};
-
-	return DefaultMtrr.Type;
+	return sMtrrDefaultType;
 }
 
 VMM_API
@@ -115,11 +135,11 @@ Routine Description:
 	Returns the MTRR region type of the region containing `PhysAddr`
 --*/
 {
-	PMTRR_REGION_CACHE_ENTRY Entry = MtrrGetContainingRegion(PhysAddr);
-	if (Entry == NULL)
+	PMTRR_REGION Region = MtrrGetContainingRegion(PhysAddr);
+	if (Region == NULL)
 		return MtrrGetDefaultType();
 
-	return Entry->Type;
+	return Region->Type;
 }
 
 VMM_API
@@ -129,69 +149,155 @@ MtrrGetRegionEnd(
 )
 /*++
 Routine Description:
-	Returns the size of the containing MTRR region
+	Returns the end of the containing MTRR region
 --*/
 {
-	PMTRR_REGION_CACHE_ENTRY Entry = MtrrGetContainingRegion(PhysAddr);
-	if (Entry == NULL)
+	PMTRR_REGION Region = MtrrGetContainingRegion(PhysAddr);
+	if (Region == NULL)
 		return 0;
 
-	return Entry->Base + Entry->Size;
+	return Region->End;
 }
 
-VSC_API
-NTSTATUS
-MtrrSaveVariableRange(
-	_In_ IA32_MTRR_PHYSBASE_N_MSR Base,
-	_In_ IA32_MTRR_PHYSMASK_N_MSR Mask
+VMM_API
+UINT64
+MtrrGetUniformExtent(
+	_In_ UINT64 PhysAddr
 )
+/*++
+Routine Description:
+	Returns how many bytes from `PhysAddr` onwards share the same memory type. As adjacent regions of the
+	same type are merged when the table is built, this is the distance to the next type change
+--*/
 {
-	PMTRR_REGION_CACHE_ENTRY CurrMtrrEntry = gMtrrRegionCacheHead;
-	if (CurrMtrrEntry->Links.Flink == NULL)
-		return STATUS_INSUFFICIENT_RESOURCES;
+	PMTRR_REGION Region = MtrrGetContainingRegion(PhysAddr);
+	if (Region == NULL)
+		return 0;
 
-	CurrMtrrEntry->Type = Base.Type;
-	CurrMtrrEntry->Base = PAGE_ADDRESS(Base.Base);
+	return Region->End - PhysAddr;
+}
 
-	ULONG SizeShift = 0;
-	_BitScanForward64(&SizeShift, PAGE_ADDRESS(Mask.Mask));
+VSC_API
+MEMORY_TYPE
+MtrrCombineTypes(
+	_In_ MEMORY_TYPE Curr,
+	_In_ MEMORY_TYPE Type
+)
+/*++
+Routine Description:
+	Resolves the memory type of overlapping variable ranges using the architectural precedence rules, UC takes
+	precedence over everything and WT over WB. Any other combination is undefined and treated as UC
+--*/
+{
+	if (Curr == MT_INVALID || Curr == Type)
+		return Type;
 
-	CurrMtrrEntry->Size = 1ULL << SizeShift;
+	if (Curr == MT_UNCACHABLE || Type == MT_UNCACHABLE)
+		return MT_UNCACHABLE;
 
-	gMtrrRegionCacheHead = CurrMtrrEntry->Links.Flink;
+	if ((Curr == MT_WRITE_THROUGH && Type == MT_WRITEBACK) || (Curr == MT_WRITEBACK && Type == MT_WRITE_THROUGH))
+		return MT_WRITE_THROUGH;
 
-	return STATUS_SUCCESS;
+	return MT_UNCACHABLE;
 }
 
 VSC_API
-NTSTATUS
-MtrrSaveStaticRange(
-	_In_ MTRR_STATIC_REGION FixedRegion
+SIZE_T
+MtrrBuildRegionTable(
+	_In_ PMTRR_RANGE Ranges,
+	_In_ SIZE_T RangeCount,
+	_In_ MEMORY_TYPE DefaultType,
+	_Out_ PMTRR_REGION Regions
 )
+/*++
+Routine Description:
+	Flattens the possibly overlapping `Ranges` into a sorted, non-overlapping table of uniform memory type 
+	regions covering [0, MTRR_PHYS_ADDR_LIMIT). `Regions` must be able to hold `RangeCount * 2 + 2` entries. 
+	Fixed ranges take precedence over variable ranges, and anything not covered by a range gets `DefaultType`.
+	Returns the amount of regions written
+--*/
 {
-	for (SIZE_T i = 0; i < 8; i++)
+	SIZE_T PointCount = 0;
+
+	// Collect every boundary, the region bases are used as scratch space for them
+	Regions[PointCount++].Base = 0;
+	Regions[PointCount++].Base = MTRR_PHYS_ADDR_LIMIT;
+
+	for (SIZE_T i = 0; i < RangeCount; i++)
 	{
-		PMTRR_REGION_CACHE_ENTRY CurrMtrrEntry = gMtrrRegionCacheHead;
-		if (CurrMtrrEntry->Links.Flink == NULL)
-			return STATUS_INSUFFICIENT_RESOURCES;
+		Regions[PointCount++].Base = min(Ranges[i].Base, MTRR_PHYS_ADDR_LIMIT);
+		Regions[PointCount++].Base = min(Ranges[i].End, MTRR_PHYS_ADDR_LIMIT);
+	}
 
-		IA32_MTRR_FIXED_RANGE_MSR FixedRangeMsr = {
-			.Value = __readmsr(FixedRegion.Msr)
-		};
+	// Insertion sort, there are at most a few hundred boundaries and this only runs once
+	for (SIZE_T i = 1; i < PointCount; i++)
+	{
+		const UINT64 Point = Regions[i].Base;
+
+		SIZE_T j = i;
+		for (; j > 0 && Regions[j - 1].Base > Point; j--)
+			Regions[j].Base = Regions[j - 1].Base;
+
+		Regions[j].Base = Point;
+	}
+
+	// Remove duplicate boundaries
+	SIZE_T UniqueCount = 1;
+	for (SIZE_T i = 1; i < PointCount; i++)
+	{
+		if (Regions[i].Base != Regions[UniqueCount - 1].Base)
+			Regions[UniqueCount++].Base = Regions[i].Base;
+	}
+
+	// Each pair of boundaries is now an elementary interval with a single resolved type, the last boundary is the limit
+	SIZE_T RegionCount = 0;
+	for (SIZE_T i = 0; i + 1 < UniqueCount; i++)
+	{
+		const UINT64 Base = Regions[i].Base;
+		const UINT64 End = Regions[i + 1].Base;
+
+		MEMORY_TYPE VariableType = MT_INVALID;
+		MEMORY_TYPE FixedType = MT_INVALID;
+
+		for (SIZE_T j = 0; j < RangeCount; j++)
+		{
+			if (Ranges[j].Base > Base || Ranges[j].End < End)
+				continue;
+
+			if (Ranges[j].Fixed)
+				FixedType = Ranges[j].Type;
+			else
+				VariableType = MtrrCombineTypes(VariableType, Ranges[j].Type);
+		}
+
+		MEMORY_TYPE Type = FixedType != MT_INVALID ? FixedType : VariableType;
+		if (Type == MT_INVALID)
+			Type = DefaultType;
+
+		// Regions are written behind the boundary being read, merge with the previous region if the type matches
+		if (RegionCount > 0 && Regions[RegionCount - 1].Type == Type)
+		{
+			Regions[RegionCount - 1].End = End;
+			continue;
+		}
 
-		CurrMtrrEntry->Base = FixedRegion.Base + i * FixedRegion.BlockSize;
-		CurrMtrrEntry->Size = FixedRegion.BlockSize;
-		CurrMtrrEntry->Type = FixedRangeMsr.Types[i];
+		Regions[RegionCount].Base = Base;
+		Regions[RegionCount].End = End;
+		Regions[RegionCount].Type = Type;
 
-		gMtrrRegionCacheHead = CurrMtrrEntry->Links.Flink;
+		RegionCount++;
 	}
 
-	return STATUS_SUCCESS;
+	return RegionCount;
 }
 
 VSC_API
 NTSTATUS
 MtrrInitialise(VOID)
+/*++
+Routine Description:
+	Reads all variable and fixed range MTRRs and builds the region table used for EPT memory types
+--*/
 {
 	NTSTATUS Status = STATUS_SUCCESS;
 
@@ -203,31 +309,32 @@ MtrrInitialise(VOID)
 		.Value = __readmsr(IA32_MTRR_DEFAULT_TYPE)
 	};
 
-	SIZE_T MtrrRegionCount = MtrrCap.VariableRangeRegCount;
+	// With MTRRs disabled, UC is applied to all of physical memory
+	sMtrrDefaultType = DefaultMtrr.EnableMtrr ? DefaultMtrr.Type : MT_UNCACHABLE;
 
-	if (MtrrCap.FixedRangeRegSupport && DefaultMtrr.EnableFixedMtrr)
-	{
-		// Each static MTRR region represents 8 blocks.
-		for (SIZE_T i = 0; i < sizeof(sFixedMtrrRanges) / sizeof(*sFixedMtrrRanges); i++)
-			MtrrRegionCount += 8;
-	}
+	const BOOLEAN UseFixedRanges = DefaultMtrr.EnableMtrr && MtrrCap.FixedRangeRegSupport && DefaultMtrr.EnableFixedMtrr;
 
-	sMtrrRegionCacheRaw = ImpAllocateHostNpPool(sizeof(MTRR_REGION_CACHE_ENTRY) * MtrrRegionCount + 1);
-	if (sMtrrRegionCacheRaw == NULL)
-		return STATUS_INSUFFICIENT_RESOURCES;
+	// Each static MTRR region represents 8 blocks.
+	SIZE_T MaxRangeCount = MtrrCap.VariableRangeRegCount;
+	if (UseFixedRanges)
+		MaxRangeCount += (sizeof(sFixedMtrrRanges) / sizeof(*sFixedMtrrRanges)) * 8;
 
-	gMtrrRegionCacheHead = sMtrrRegionCacheRaw;
+	// The raw ranges are only needed while building the table, so don't record them as an allocation
+	PMTRR_RANGE Ranges = ExAllocatePoolWithTag(NonPagedPool, sizeof(MTRR_RANGE) * (MaxRangeCount + 1), POOL_TAG);
+	if (Ranges == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
 
-	for (SIZE_T i = 0; i < MtrrRegionCount + 1; i++)
+	sMtrrRegions = ImpAllocateHostNpPool(sizeof(MTRR_REGION) * (MaxRangeCount * 2 + 2));
+	if (sMtrrRegions == NULL)
 	{
-		PMTRR_REGION_CACHE_ENTRY CurrMtrrEntry = sMtrrRegionCacheRaw + i;
-
-		CurrMtrrEntry->Links.Flink = i < MtrrRegionCount	? &(CurrMtrrEntry + 1)->Links : NULL;
-		CurrMtrrEntry->Links.Blink = i > 0					? &(CurrMtrrEntry - 1)->Links : NULL;
+		Status = STATUS_INSUFFICIENT_RESOURCES;
+		goto cleanup;
 	}
 
+	SIZE_T RangeCount = 0;
+
 	// Save all variable MTRR range registers
-	for (SIZE_T i = 0; i < MtrrCap.VariableRangeRegCount; i++)
+	for (SIZE_T i = 0; DefaultMtrr.EnableMtrr && i < MtrrCap.VariableRangeRegCount; i++)
 	{
 		IA32_MTRR_PHYSBASE_N_MSR Base = {
 			.Value = __readmsr(IA32_MTRR_PHYSBASE_0 + i * 2)
@@ -240,22 +347,41 @@ MtrrInitialise(VOID)
 		if (!Mask.Valid)
 			continue;
 
-		if (!NT_SUCCESS(MtrrSaveVariableRange(Base, Mask)))
-		{
-			ImpDebugPrint("Failed to save variable MTRR region (IA32_MTRR_PHYSBASE_N: %i)...\n", IA32_MTRR_PHYSBASE_0 + i * 2);
-			return STATUS_INSUFFICIENT_RESOURCES;
-		}
+		ULONG SizeShift = 0;
+		_BitScanForward64(&SizeShift, PAGE_ADDRESS(Mask.Mask));
+
+		Ranges[RangeCount].Base = PAGE_ADDRESS(Base.Base);
+		Ranges[RangeCount].End = PAGE_ADDRESS(Base.Base) + (1ULL << SizeShift);
+		Ranges[RangeCount].Type = Base.Type;
+		Ranges[RangeCount].Fixed = FALSE;
+
+		RangeCount++;
 	}
 
 	// Save all static MTRR ranges
-	for (SIZE_T i = 0; i < sizeof(sFixedMtrrRanges) / sizeof(*sFixedMtrrRanges); i++)
+	for (SIZE_T i = 0; UseFixedRanges && i < (sizeof(sFixedMtrrRanges) / sizeof(*sFixedMtrrRanges)); i++)
 	{
-		if (!NT_SUCCESS(MtrrSaveStaticRange(sFixedMtrrRanges[i])))
+		IA32_MTRR_FIXED_RANGE_MSR FixedRangeMsr = {
+			.Value = __readmsr(sFixedMtrrRanges[i].Msr)
+		};
+
+		for (SIZE_T j = 0; j < 8; j++)
 		{
-			ImpDebugPrint("Failed to save static MTRR region #%i...\n", i);
-			return STATUS_INSUFFICIENT_RESOURCES;
+			Ranges[RangeCount].Base = sFixedMtrrRanges[i].Base + j * sFixedMtrrRanges[i].BlockSize;
+			Ranges[RangeCount].End = Ranges[RangeCount].Base + sFixedMtrrRanges[i].BlockSize;
+			Ranges[RangeCount].Type = FixedRangeMsr.Types[j];
+			Ranges[RangeCount].Fixed = TRUE;
+
+			RangeCount++;
 		}
 	}
 
-	return STATUS_SUCCESS;
+	sMtrrRegionCount = MtrrBuildRegionTable(Ranges, RangeCount, sMtrrDefaultType, sMtrrRegions);
+
+	ImpDebugPrint("Built MTRR region table with %i regions from %i ranges...\n", sMtrrRegionCount, RangeCount);
+
+cleanup:
+	ExFreePoolWithTag(Ranges, POOL_TAG);
+
+	return Status;
 }
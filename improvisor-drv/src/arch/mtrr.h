@@ -100,6 +100,11 @@ MtrrGetRegionEnd(
 	_In_ UINT64 PhysAddr
 );
 
+UINT64
+MtrrGetUniformExtent(
+	_In_ UINT64 PhysAddr
+);
+
 NTSTATUS
 MtrrInitialise(VOID);
 
@@ -41,7 +41,13 @@ EhReserveHookRecords(
 	_In_ SIZE_T Count
 )
 {
-	return LL_CREATE_POOL(&sDetourPool, EH_DETOUR_REGISTRATION, Count);
+	NTSTATUS Status = LL_CREATE_POOL(&sDetourPool, EH_DETOUR_REGISTRATION, Count);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	SpinTrackLock(&sDetourPool.Lock.Writer, "DetourPool");
+
+	return STATUS_SUCCESS;
 }
 
 NTSTATUS
@@ -215,6 +221,23 @@ Routine Description:
 	return STATUS_SUCCESS;
 }
 
+HYPERCALL_RESULT
+EhMapDetourViews(
+	_In_ PEH_DETOUR_REGISTRATION Hook
+)
+/*++
+Routine Description:
+	Maps the target page as the original page without execute access in the default EPT view, and as the shadow 
+	page with only execute access in the detour EPT view, so the first access of each kind switches views
+--*/
+{
+	HYPERCALL_RESULT HResult = VmEptRemapViewPages(EPT_VIEW_DEFAULT, Hook->GuestPhysAddr, Hook->GuestPhysAddr, PAGE_SIZE, EPT_PAGE_RW);
+	if (HResult != HRESULT_SUCCESS)
+		return HResult;
+
+	return VmEptRemapViewPages(EPT_VIEW_DETOUR, Hook->GuestPhysAddr, Hook->ShadowPhysAddr, PAGE_SIZE, EPT_PAGE_EXECUTE);
+}
+
 NTSTATUS
 EhInstallDetour(
 	_In_ PEH_DETOUR_REGISTRATION Hook
@@ -270,7 +293,7 @@ Routine Description:
 
 	ImpFreeAllocation(DetourShellcode);
 
-	if (VmEptRemapPages(Hook->GuestPhysAddr, Hook->GuestPhysAddr, PAGE_SIZE, EPT_PAGE_RW) != HRESULT_SUCCESS)
+	if (EhMapDetourViews(Hook) != HRESULT_SUCCESS)
 		return STATUS_INVALID_PARAMETER;
 
 	Hook->State = EH_DETOUR_INSTALLED;
@@ -292,7 +315,7 @@ Routine Description:
 
 	Hook->State = EH_DETOUR_DISABLED;
 
-	// Remap the GPA to RWX and make it point to the original function to avoid EPT violations for this hook
+	// Remap the GPA to RWX and make it point to the original function in every view to avoid EPT violations for this hook
 	if (VmEptRemapPages(Hook->GuestPhysAddr, Hook->GuestPhysAddr, PAGE_SIZE, EPT_PAGE_RWX) != HRESULT_SUCCESS)
 		return;
 }
@@ -311,8 +334,8 @@ Routine Description:
 
 	Hook->State = EH_DETOUR_INSTALLED;
 
-	// Remap the GPA to RW so X EPT violations occur
-	if (VmEptRemapPages(Hook->GuestPhysAddr, Hook->GuestPhysAddr, PAGE_SIZE, EPT_PAGE_RW) != HRESULT_SUCCESS)
+	// Remap the GPA in both views so X EPT violations switch to the detour view
+	if (EhMapDetourViews(Hook) != HRESULT_SUCCESS)
 		return;
 }
 
@@ -411,10 +434,10 @@ EhHandleEptViolation(
 )
 {
 	EPT_VIOLATION_EXIT_QUALIFICATION ExitQual = {
-		.Value = VmxRead(VM_EXIT_QUALIFICATION)
+		.Value = VmxCacheRead(&Vcpu->Vmx, VM_EXIT_QUALIFICATION)
 	};
 
-	UINT64 AttemptedPhysAddr = VmxRead(GUEST_PHYSICAL_ADDRESS);
+	UINT64 AttemptedPhysAddr = VmxCacheRead(&Vcpu->Vmx, GUEST_PHYSICAL_ADDRESS);
 
 	// TODO: Handle reads on same page as execution
 	// When ExitQual.ReadAccessed:
@@ -451,62 +474,20 @@ EhHandleEptViolation(
 		// Check if the EPT violation was a result of accessing the locked physical address of the detour
 		if (CurrHook->State == EH_DETOUR_INSTALLED && (UINT64)PAGE_ALIGN(AttemptedPhysAddr) == CurrHook->GuestPhysAddr)
 		{
+			// Both views already map the page, so only the EPT pointer changes and nothing needs invalidating
 			if (ExitQual.ExecuteAccessed)
 			{
-				if (!NT_SUCCESS(
-					EptMapMemoryRange(
-						Vcpu->Vmm->Ept.Pml4,
-						CurrHook->GuestPhysAddr,
-						CurrHook->ShadowPhysAddr,
-						PAGE_SIZE,
-						EPT_PAGE_EXECUTE)
-					))
-				{
-					ImpLog("EptMapMemoryRange failed mapping %llX->%llX with EPT_PAGE_EXECUTE\n", AttemptedPhysAddr, CurrHook->ShadowPhysAddr);
-					// TODO: Panic here?
-					return FALSE;
-				}
+				VcpuSwitchEptView(Vcpu, EPT_VIEW_DETOUR);
+
+				IMP_LOG_TRACE(IMP_LOG_DETOUR, "[Detour #%08X] Swapped to X page %llX\n", CurrHook->Hash, CurrHook->GuestPhysAddr);
 
 				return TRUE;
 			}
 			else if (ExitQual.ReadAccessed || ExitQual.WriteAccessed)
 			{
-				EPT_PAGE_PERMISSIONS Perms = EPT_PAGE_RW;
-
-#if 0 // I don't think this works currently, fuck knows why
-				// EPT Violation occured for reading or writing while executing on the same page, inject MTF event to swap back to EPT_PAGE_EXECUTE 
-				if (PAGE_FRAME_NUMBER(CurrHook->TargetFunction) == PAGE_FRAME_NUMBER(Vcpu->Vmx.GuestRip))
-				{
-					// Page permissions need to be RWX (reading or writing on same page as execution)
-					Perms = EPT_PAGE_RWX;
-
-					MTF_EVENT ResetEptEvent = {
-						.Type = MTF_EVENT_RESET_EPT_PERMISSIONS,
-						.GuestPhysAddr = AttemptedPhysAddr,
-						.PhysAddr = CurrHook->ShadowPhysAddr,
-						.Permissions = EPT_PAGE_EXECUTE
-					};
-
-					VcpuPushMTFEventEx(Vcpu, ResetEptEvent);
-				}
-#endif
-
-				if (!NT_SUCCESS(
-					EptMapMemoryRange(
-						Vcpu->Vmm->Ept.Pml4,
-						CurrHook->GuestPhysAddr,
-						CurrHook->GuestPhysAddr,
-						PAGE_SIZE,
-						Perms)
-				))
-				{
-					ImpLog("EptMapMemoryRange failed mapping %llX->%llX with Perms=%x\n", AttemptedPhysAddr, AttemptedPhysAddr, Perms);
-					return FALSE;
-				}
-
-#ifdef _DEBUG
-				ImpLog("[Detour #%08X] Swapped to RW page %llX\n", CurrHook->Hash, CurrHook->GuestPhysAddr);
-#endif
+				VcpuSwitchEptView(Vcpu, EPT_VIEW_DEFAULT);
+
+				IMP_LOG_TRACE(IMP_LOG_DETOUR, "[Detour #%08X] Swapped to RW page %llX\n", CurrHook->Hash, CurrHook->GuestPhysAddr);
 
 				return TRUE;
 			}
@@ -530,15 +511,17 @@ EhpHandleBreakpointPredicate(
 	_In_ PEH_DETOUR_BREAKPOINT_SEARCH Context
 )
 {
+	PVMX_STATE Vmx = &VcpuGetActiveVcpu()->Vmx;
+
 	if (Context->GuestRip == (UINT64)Reg->TargetFunction)
 	{
-		VmxWrite(GUEST_RIP, (UINT64)Reg->TargetFunction);
+		VmxCacheWrite(Vmx, GUEST_RIP, (UINT64)Reg->TargetFunction);
 		return TRUE;
 	}
 	// Handle INT 3 after the prologue instruction(s) in `EH_DETOUR_REGISTRATION::Trampoline`
 	else if (Context->GuestRip == RVA(Reg->Trampoline, Reg->PrologueSize))
 	{
-		VmxWrite(GUEST_RIP, RVA(Reg->TargetFunction, Reg->PrologueSize));
+		VmxCacheWrite(Vmx, GUEST_RIP, RVA(Reg->TargetFunction, Reg->PrologueSize));
 		return TRUE;
 	}
 
@@ -568,13 +551,13 @@ Routine Description:
 
 		if (Vcpu->Vmx.GuestRip == (UINT64)CurrHook->TargetFunction)
 		{
-			VmxWrite(GUEST_RIP, (UINT64)CurrHook->CallbackFunction);
+			VmxCacheWrite(&Vcpu->Vmx, GUEST_RIP, (UINT64)CurrHook->CallbackFunction);
 			return TRUE;
 		}
 		// Handle INT 3 after the prologue instruction(s) in `EH_HOOK_REGISTRATION::Trampoline`
 		else if (Vcpu->Vmx.GuestRip == RVA(CurrHook->Trampoline, CurrHook->PrologueSize))
 		{
-			VmxWrite(GUEST_RIP, RVA(CurrHook->TargetFunction, CurrHook->PrologueSize));
+			VmxCacheWrite(&Vcpu->Vmx, GUEST_RIP, RVA(CurrHook->TargetFunction, CurrHook->PrologueSize));
 			return TRUE;
 		}
 
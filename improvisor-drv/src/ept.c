@@ -52,18 +52,13 @@ Routine Description:
 	`Index` into `Entry`
 --*/
 {
-	// EPT allocates host page tables first, scan from the tail forward.
-	PMM_RESERVED_PT CurrPt = gHostPageTablesTail;
-	while (CurrPt != NULL)
-	{
-		if (CurrPt->TablePhysAddr == PAGE_ADDRESS(TablePfn))
-			return &((PEPT_PTE)CurrPt->TableAddr)[Index];
-
-		CurrPt = (PMM_RESERVED_PT)CurrPt->Links.Flink;
-	}
+	PEPT_PTE Table = (PEPT_PTE)MmGetHostPageTableVirtAddr(PAGE_ADDRESS(TablePfn));
 
 	// TODO: Should never happen, panic here
-	return NULL;
+	if (Table == NULL)
+		return NULL;
+
+	return &Table[Index];
 }
 
 VMM_API
@@ -102,8 +97,8 @@ Routine Description:
 	// 1. Super page technology must be supported on the current CPU
 	// 2. The PhysAddr and GuestPhysAddr we are attempting to map must be 2MB aligned
 	// 3. The size of the region we are mapping must be greater than 2MB
-	// 4. The MTRR region we are trying to map must have more than 2MB remaining
-	if (!EptCheckLargePageSupport() || Size < MB(2) || (PhysAddr & 0x1FFFFF) != 0 || (GuestPhysAddr & 0x1FFFFF) != 0 || MtrrGetRegionEnd(PhysAddr) - PhysAddr < MB(2))
+	// 4. The memory type must stay the same for at least 2MB from PhysAddr
+	if (!EptCheckLargePageSupport() || Size < MB(2) || (PhysAddr & 0x1FFFFF) != 0 || (GuestPhysAddr & 0x1FFFFF) != 0 || MtrrGetUniformExtent(PhysAddr) < MB(2))
 		return STATUS_INVALID_PARAMETER;
 
 	Pde->Present = TRUE;
@@ -129,25 +124,21 @@ EptSubvertLargePage(
 )
 /*++
 Routine Description:
-	Takes a Super PDE `Pde` and converts it into a normal PDPTE, mapping all necessary pages.
+	Takes a Super PDE `Pde` and converts it into a normal PDPTE, mapping all necessary pages. The new table is 
+	filled in before `Pde` is switched over to it in a single write, and `Pde` is left untouched on failure
 --*/
 {
 	if (!Pde->LargePage)
 		return STATUS_INVALID_PARAMETER;
 
-	Pde->LargePage = FALSE;
-	Pde->MemoryType = 0;
-
 	PEPT_PTE Pt = NULL;
-	if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt)))
+	UINT64 PtPhysAddr = 0;
+	if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt, &PtPhysAddr)))
 	{
-		ImpLog("Couldn't allocate EPT PD for '%llx' subversion...\n", GuestPhysAddr);
+		IMP_LOG_ERROR(IMP_LOG_EPT, "Couldn't allocate EPT PD for '%llx' subversion...\n", GuestPhysAddr);
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	Pde->PageFrameNumber =
-		PAGE_FRAME_NUMBER(MmGetLastAllocatedPageTable()->TablePhysAddr);
-
 	// Since we are subverting a large page, the MTRR region is constant throughout the whole memory range
 	MEMORY_TYPE RegionType = MtrrGetRegionType(PhysAddr);
 
@@ -170,6 +161,14 @@ Routine Description:
 
 		SizeSubverted += PAGE_SIZE;
 	}
+
+	EPT_PTE Split = *Pde;
+	Split.LargePage = FALSE;
+	Split.MemoryType = 0;
+	Split.PageFrameNumber = PAGE_FRAME_NUMBER(PtPhysAddr);
+
+	// Other VCPUs may be walking through the entry, so they must only ever see the large page or the whole table
+	InterlockedExchange64((volatile LONG64*)&Pde->Value, Split.Value);
 	
 	return STATUS_SUCCESS;
 }
@@ -194,8 +193,8 @@ Routine Description:
 	// 1. Super page technology must be supported on the current CPU 
 	// 2. The PhysAddr and GuestPhysAddr we are attempting to map must be 1GB aligned 
 	// 3. The size of the region we are mapping must be greater than 1GB
-	// 4. The MTRR region we are trying to map must have more than 1GB remaining
-	if (!EptCheckSuperPageSupport() || Size < GB(1) || (PhysAddr & 0x3FFFFFFF) != 0 || (GuestPhysAddr & 0x3FFFFFFF) != 0 || (MtrrGetRegionEnd(PhysAddr) - PhysAddr) < GB(1))
+	// 4. The memory type must stay the same for at least 1GB from PhysAddr
+	if (!EptCheckSuperPageSupport() || Size < GB(1) || (PhysAddr & 0x3FFFFFFF) != 0 || (GuestPhysAddr & 0x3FFFFFFF) != 0 || MtrrGetUniformExtent(PhysAddr) < GB(1))
 		return STATUS_INVALID_PARAMETER;
 
 	Pdpte->Present = TRUE;
@@ -222,25 +221,21 @@ EptSubvertSuperPage(
 /*++
 Routine Description:
 	Takes a Super PDPTE and converts it into a normal PDPTE, mapping all necessary pages. This function attempts to map 
-	the super page as large pages, and if that fails then it uses regular 4KB pages
+	the super page as large pages, and if that fails then it uses regular 4KB pages. The new tables are filled in
+	before `Pdpte` is switched over to them in a single write, and `Pdpte` is left untouched on failure
 --*/
 {
 	if (!Pdpte->LargePage)
 		return STATUS_INVALID_PARAMETER;
-
-	Pdpte->LargePage = FALSE;
-	Pdpte->MemoryType = 0;
 	
 	PEPT_PTE Pd = NULL;
-	if (!NT_SUCCESS(MmAllocateHostPageTable(&Pd)))
+	UINT64 PdPhysAddr = 0;
+	if (!NT_SUCCESS(MmAllocateHostPageTable(&Pd, &PdPhysAddr)))
 	{
-		ImpLog("Couldn't allocate EPT PD for '%llx' subversion...\n", GuestPhysAddr);
+		IMP_LOG_ERROR(IMP_LOG_EPT, "Couldn't allocate EPT PD for '%llx' subversion...\n", GuestPhysAddr);
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	Pdpte->PageFrameNumber =
-		PAGE_FRAME_NUMBER(MmGetLastAllocatedPageTable()->TablePhysAddr);
-
 	// Since we are subverting a large page, the MTRR region is constant throughout the whole memory range
 	MEMORY_TYPE RegionType = MtrrGetRegionType(PhysAddr);
 
@@ -272,9 +267,19 @@ Routine Description:
 			else
 			{
 				PEPT_PTE Pt = NULL;
-				if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt)))
+				UINT64 PtPhysAddr = 0;
+				if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt, &PtPhysAddr)))
 				{
-					ImpLog("Couldn't allocate EPT PT for '%llx' subversion...\n", PhysAddr + SizeSubverted);
+					IMP_LOG_ERROR(IMP_LOG_EPT, "Couldn't allocate EPT PT for '%llx' subversion...\n", PhysAddr + SizeSubverted);
+
+					// Nothing was published yet, so the tables can go straight back to the reserve
+					for (SIZE_T i = 0; i < 512; i++)
+					{
+						if (Pd[i].Present && !Pd[i].LargePage)
+							MmFreeHostPageTable(PAGE_ADDRESS(Pd[i].PageFrameNumber));
+					}
+
+					MmFreeHostPageTable(PdPhysAddr);
 					return STATUS_INSUFFICIENT_RESOURCES;
 				}
 
@@ -283,8 +288,7 @@ Routine Description:
 				EptApplyPermissions(Pde, EPT_PAGE_RWX);
 
 				Pde->Present = TRUE;
-				Pde->PageFrameNumber =
-					PAGE_FRAME_NUMBER(MmGetLastAllocatedPageTable()->TablePhysAddr);
+				Pde->PageFrameNumber = PAGE_FRAME_NUMBER(PtPhysAddr);
 			}
 		}
 		else
@@ -304,6 +308,14 @@ Routine Description:
 		SizeSubverted += PAGE_SIZE;
 	}
 
+	EPT_PTE Split = *Pdpte;
+	Split.LargePage = FALSE;
+	Split.MemoryType = 0;
+	Split.PageFrameNumber = PAGE_FRAME_NUMBER(PdPhysAddr);
+
+	// Other VCPUs may be walking through the entry, so they must only ever see the super page or the whole table
+	InterlockedExchange64((volatile LONG64*)&Pdpte->Value, Split.Value);
+
 	return STATUS_SUCCESS;
 }
 
@@ -322,6 +334,10 @@ Routine Description:
 	Windows API functions
 --*/
 {
+	// Memory type of the uniform MTRR region currently being mapped, only looked up again once it ends
+	MEMORY_TYPE RegionType = MT_INVALID;
+	UINT64 RegionEnd = 0;
+
 	SIZE_T SizeMapped = 0;
 	while (Size > SizeMapped)
 	{
@@ -335,9 +351,10 @@ Routine Description:
 		if (!Pml4e->Present)
 		{
 			PEPT_PTE Pdpt = NULL;
-			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pdpt)))
+			UINT64 PdptPhysAddr = 0;
+			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pdpt, &PdptPhysAddr)))
 			{
-				ImpLog("Couldn't allocate EPT PDPT for '%llx'...\n", PhysAddr + SizeMapped);
+				IMP_LOG_ERROR(IMP_LOG_EPT, "Couldn't allocate EPT PDPT for '%llx'...\n", PhysAddr + SizeMapped);
 				return STATUS_INSUFFICIENT_RESOURCES;
 			}
 
@@ -346,8 +363,7 @@ Routine Description:
 			EptApplyPermissions(Pml4e, EPT_PAGE_RWX);
 
 			Pml4e->Present = TRUE;
-			Pml4e->PageFrameNumber = 
-				PAGE_FRAME_NUMBER(MmGetLastAllocatedPageTable()->TablePhysAddr);
+			Pml4e->PageFrameNumber = PAGE_FRAME_NUMBER(PdptPhysAddr);
 		}
 		else
 			Pdpte = EptReadExistingPte(Pml4e->PageFrameNumber, Gpa.PdptIndex);
@@ -371,9 +387,10 @@ Routine Description:
 			else
 			{
 				PEPT_PTE Pd = NULL;
-				if (!NT_SUCCESS(MmAllocateHostPageTable(&Pd)))
+				UINT64 PdPhysAddr = 0;
+				if (!NT_SUCCESS(MmAllocateHostPageTable(&Pd, &PdPhysAddr)))
 				{
-					ImpLog("Couldn't allocate EPT PD for '%llx'...\n", PhysAddr + SizeMapped);
+					IMP_LOG_ERROR(IMP_LOG_EPT, "Couldn't allocate EPT PD for '%llx'...\n", PhysAddr + SizeMapped);
 					return STATUS_INSUFFICIENT_RESOURCES;
 				}
 
@@ -382,17 +399,17 @@ Routine Description:
 				EptApplyPermissions(Pdpte, EPT_PAGE_RWX);
 
 				Pdpte->Present = TRUE;
-				Pdpte->PageFrameNumber =
-					PAGE_FRAME_NUMBER(MmGetLastAllocatedPageTable()->TablePhysAddr);
+				Pdpte->PageFrameNumber = PAGE_FRAME_NUMBER(PdPhysAddr);
 			}
 		}
 		else
 		{
+			// The rest of the page has to keep mapping what it did, which isn't necessarily where this range goes
 			if (Pdpte->LargePage)
 			{
-				if (!NT_SUCCESS(EptSubvertSuperPage(Pdpte, (GuestPhysAddr + SizeMapped) & ~0x3FFFFFFF, (PhysAddr + SizeMapped) & ~0x3FFFFFFF, EPT_PAGE_RWX)))
+				if (!NT_SUCCESS(EptSubvertSuperPage(Pdpte, (GuestPhysAddr + SizeMapped) & ~0x3FFFFFFF, PAGE_ADDRESS(Pdpte->PageFrameNumber), EPT_PAGE_RWX)))
 				{
-					ImpLog("Failed to subvert PDPTE containing '%llx'...n");
+					IMP_LOG_ERROR(IMP_LOG_EPT, "Failed to subvert PDPTE containing '%llx'...\n", GuestPhysAddr + SizeMapped);
 					return STATUS_INSUFFICIENT_RESOURCES;
 				}
 			}
@@ -419,9 +436,10 @@ Routine Description:
 			else
 			{
 				PEPT_PTE Pt = NULL;
-				if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt)))
+				UINT64 PtPhysAddr = 0;
+				if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt, &PtPhysAddr)))
 				{
-					ImpLog("Couldn't allocate EPT PD for '%llx'...\n", PhysAddr + SizeMapped);
+					IMP_LOG_ERROR(IMP_LOG_EPT, "Couldn't allocate EPT PD for '%llx'...\n", PhysAddr + SizeMapped);
 					return STATUS_INSUFFICIENT_RESOURCES;
 				}
 
@@ -430,17 +448,16 @@ Routine Description:
 				EptApplyPermissions(Pde, EPT_PAGE_RWX);
 
 				Pde->Present = TRUE;
-				Pde->PageFrameNumber =
-					PAGE_FRAME_NUMBER(MmGetLastAllocatedPageTable()->TablePhysAddr);
+				Pde->PageFrameNumber = PAGE_FRAME_NUMBER(PtPhysAddr);
 			}
 		}
 		else
 		{
 			if (Pde->LargePage)
 			{
-				if (!NT_SUCCESS(EptSubvertLargePage(Pde, (GuestPhysAddr + SizeMapped) & ~0x1FFFFF, (PhysAddr + SizeMapped) & ~0x1FFFFF, EPT_PAGE_RWX)))
+				if (!NT_SUCCESS(EptSubvertLargePage(Pde, (GuestPhysAddr + SizeMapped) & ~0x1FFFFF, PAGE_ADDRESS(Pde->PageFrameNumber), EPT_PAGE_RWX)))
 				{
-					ImpLog("Failed to subvert PDE containing '%llx'...n");
+					IMP_LOG_ERROR(IMP_LOG_EPT, "Failed to subvert PDE containing '%llx'...\n", GuestPhysAddr + SizeMapped);
 					return STATUS_INSUFFICIENT_RESOURCES;
 				}
 			}
@@ -453,8 +470,14 @@ Routine Description:
 
 		EptApplyPermissions(Pte, Permissions);
 
+		if (PhysAddr + SizeMapped >= RegionEnd)
+		{
+			RegionType = MtrrGetRegionType(PhysAddr + SizeMapped);
+			RegionEnd = PhysAddr + SizeMapped + MtrrGetUniformExtent(PhysAddr + SizeMapped);
+		}
+
 		Pte->PageFrameNumber = PAGE_FRAME_NUMBER(PhysAddr + SizeMapped);
-		Pte->MemoryType = MtrrGetRegionType(PhysAddr + SizeMapped);
+		Pte->MemoryType = RegionType;
 
 		SizeMapped += PAGE_SIZE;
 	}
@@ -462,6 +485,151 @@ Routine Description:
 	return STATUS_SUCCESS;
 }
 
+VMM_API
+BOOLEAN
+EptCoalesceEntry(
+	_Inout_ PEPT_INFORMATION Ept,
+	_Inout_ PEPT_PTE Entry,
+	_In_ UINT64 ChildPageCount
+)
+/*++
+Routine Description:
+	Merges the table referenced by `Entry` back into a single large or super entry if its 512 entries map one
+	aligned, contiguous range with the same permissions and memory type. `ChildPageCount` is the amount of pages
+	mapped by each entry of the table, which is retired rather than freed as other processors may still have it
+	cached. The caller must hold the EPT lock
+--*/
+{
+	if (!Entry->Present || Entry->LargePage || Ept->RetiredTableCount >= EPT_MAX_RETIRED_TABLES)
+		return FALSE;
+
+	const UINT64 TablePfn = Entry->PageFrameNumber;
+
+	PEPT_PTE Table = EptReadExistingPte(TablePfn, 0);
+	if (Table == NULL)
+		return FALSE;
+
+	const EPT_PTE First = Table[0];
+
+	// Entries of a PD must all be large PDEs to merge into a super PDPTE, entries of a PT are always leaves
+	if (!First.Present || First.LargePage != (ChildPageCount != 1) || First.PageFrameNumber % (ChildPageCount * 512) != 0)
+		return FALSE;
+
+	// Accessed and dirty flags are set by the processor, and don't stop entries from mapping the same way
+	EPT_PTE Ignored = {
+		.Accessed = TRUE,
+		.Dirty = TRUE
+	};
+
+	for (SIZE_T i = 1; i < 512; i++)
+	{
+		EPT_PTE Expected = First;
+		Expected.PageFrameNumber += i * ChildPageCount;
+
+		if (((Table[i].Value ^ Expected.Value) & ~Ignored.Value) != 0)
+			return FALSE;
+	}
+
+	// Writes logged through the table have already been through PML, so the merged entry starts out clean
+	EPT_PTE Merged = First;
+	Merged.LargePage = TRUE;
+	Merged.Value &= ~Ignored.Value;
+
+	InterlockedExchange64((volatile LONG64*)&Entry->Value, Merged.Value);
+
+	// Only an invalidation requested after the table became unreachable is guaranteed to drop it
+	Ept->RetiredTables[Ept->RetiredTableCount].PhysAddr = PAGE_ADDRESS(TablePfn);
+	Ept->RetiredTables[Ept->RetiredTableCount].Generation = Ept->FlushGeneration + 1;
+	Ept->RetiredTableCount++;
+
+	return TRUE;
+}
+
+VMM_API
+UINT64
+EptCoalesceRange(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 Size
+)
+/*++
+Routine Description:
+	Merges the tables covering a range of every EPT view back into large and super pages wherever their entries
+	became uniform again, returning the amount of tables retired. The caller must hold the EPT lock, and queue 
+	an EPT invalidation if any were retired
+--*/
+{
+	const BOOLEAN LargePages = EptCheckLargePageSupport();
+	const BOOLEAN SuperPages = EptCheckSuperPageSupport();
+
+	if (!LargePages || Size == 0)
+		return 0;
+
+	const UINT64 Start = GuestPhysAddr & ~(GB(1) - 1);
+	const UINT64 End = GuestPhysAddr + Size;
+
+	UINT64 Retired = 0;
+	for (UINT32 View = 0; View < Ept->ViewCount; View++)
+	{
+		for (UINT64 Region = Start; Region < End; Region += GB(1))
+		{
+			EPT_GPA Gpa = {
+				.Value = Region
+			};
+
+			PEPT_PTE Pml4e = &Ept->Views[View].Pml4[Gpa.Pml4Index];
+			if (!Pml4e->Present)
+				continue;
+
+			PEPT_PTE Pdpte = EptReadExistingPte(Pml4e->PageFrameNumber, Gpa.PdptIndex);
+			if (Pdpte == NULL || !Pdpte->Present || Pdpte->LargePage)
+				continue;
+
+			// Only the PDEs overlapping the range could have changed, but all of them decide the PDPTE
+			for (UINT64 LargeRegion = max(Region, GuestPhysAddr & ~(MB(2) - 1)); LargeRegion < min(Region + GB(1), End); LargeRegion += MB(2))
+			{
+				Gpa.Value = LargeRegion;
+
+				PEPT_PTE Pde = EptReadExistingPte(Pdpte->PageFrameNumber, Gpa.PdIndex);
+				if (Pde != NULL && EptCoalesceEntry(Ept, Pde, 1))
+					Retired++;
+			}
+
+			if (SuperPages && EptCoalesceEntry(Ept, Pdpte, 512))
+			{
+				IMP_LOG_TRACE(IMP_LOG_EPT, "Coalesced %llX into a super page in view %u...\n", Region, View);
+				Retired++;
+			}
+		}
+	}
+
+	return Retired;
+}
+
+VMM_API
+VOID
+EptReleaseRetiredTables(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 Generation
+)
+/*++
+Routine Description:
+	Returns the tables retired by coalescing to the host reserve once every VCPU has invalidated its EPT up to
+	`Generation`, the lowest generation any VCPU has reached. The caller must hold the EPT lock
+--*/
+{
+	UINT32 Kept = 0;
+	for (UINT32 i = 0; i < Ept->RetiredTableCount; i++)
+	{
+		if (Ept->RetiredTables[i].Generation <= Generation)
+			MmFreeHostPageTable(Ept->RetiredTables[i].PhysAddr);
+		else
+			Ept->RetiredTables[Kept++] = Ept->RetiredTables[i];
+	}
+
+	Ept->RetiredTableCount = Kept;
+}
+
 NTSTATUS
 EptSetupIdentityMap(
 	_In_ PEPT_PTE Pml4
@@ -513,14 +681,190 @@ Routine Description:
 	return Status;
 }
 
+VMM_API
+NTSTATUS
+EptMapMemoryRangeInViews(
+	_In_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ UINT64 Size,
+	_In_ EPT_PAGE_PERMISSIONS Permissions
+)
+/*++
+Routine Description:
+	Maps a memory range identically in every EPT view, the caller must hold the EPT lock once VCPUs are running
+--*/
+{
+	for (UINT32 i = 0; i < Ept->ViewCount; i++)
+	{
+		NTSTATUS Status = EptMapMemoryRange(Ept->Views[i].Pml4, GuestPhysAddr, PhysAddr, Size, Permissions);
+		if (!NT_SUCCESS(Status))
+			return Status;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
 VOID
-EptInvalidateCache(VOID)
+EptInvalidateViews(
+	_In_ PEPT_INFORMATION Ept
+)
+/*++
+Routine Description:
+	Invalidates the translations derived from every EPT view on the current processor. There is always more than
+	one view, so a single all-context INVEPT is cheaper than a single-context one for each of them
+--*/
 {
-	EPT_INVEPT_DESCRIPTOR InveptDescriptor = {0};
+	EPT_INVEPT_DESCRIPTOR InveptDescriptor = {
+		.EptPointer = Ept->Views[EPT_VIEW_DEFAULT].EptPointer
+	};
 
 	__invept(INV_ALL_CONTEXT, &InveptDescriptor);
 }
 
+VMM_API
+PEPT_PTE
+EptGetLeafPte(
+	_In_ PEPT_PTE Pml4,
+	_In_ UINT64 GuestPhysAddr,
+	_Out_ PUINT64 LeafSize
+)
+/*++
+Routine Description:
+	Returns the entry that maps `GuestPhysAddr` and the size of the region it maps, or NULL if it isn't mapped
+--*/
+{
+	EPT_GPA Gpa = {
+		.Value = GuestPhysAddr
+	};
+
+	PEPT_PTE Pml4e = &Pml4[Gpa.Pml4Index];
+	if (!Pml4e->Present)
+		return NULL;
+
+	PEPT_PTE Pdpte = EptReadExistingPte(Pml4e->PageFrameNumber, Gpa.PdptIndex);
+	if (Pdpte == NULL || !Pdpte->Present)
+		return NULL;
+
+	if (Pdpte->LargePage)
+	{
+		*LeafSize = GB(1);
+		return Pdpte;
+	}
+
+	PEPT_PTE Pde = EptReadExistingPte(Pdpte->PageFrameNumber, Gpa.PdIndex);
+	if (Pde == NULL || !Pde->Present)
+		return NULL;
+
+	if (Pde->LargePage)
+	{
+		*LeafSize = MB(2);
+		return Pde;
+	}
+
+	PEPT_PTE Pte = EptReadExistingPte(Pde->PageFrameNumber, Gpa.PtIndex);
+	if (Pte == NULL || !Pte->Present)
+		return NULL;
+
+	*LeafSize = PAGE_SIZE;
+	return Pte;
+}
+
+VMM_API
+VOID
+EptLogDirtyPage(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr
+)
+/*++
+Routine Description:
+	Marks a page logged by page-modification logging as dirty in the dirty bitmap. Only the first write to a large
+	page is logged until its dirty flag is cleared, so every page it maps is marked. The caller must hold the EPT
+	lock
+--*/
+{
+	// The page is logged by whichever view the write went through, which may map it differently to the others
+	UINT64 LeafSize = 0;
+	for (UINT32 i = 0; i < Ept->ViewCount; i++)
+	{
+		UINT64 ViewLeafSize = 0;
+		if (EptGetLeafPte(Ept->Views[i].Pml4, GuestPhysAddr, &ViewLeafSize) != NULL)
+			LeafSize = max(LeafSize, ViewLeafSize);
+	}
+
+	if (LeafSize == 0)
+		return;
+
+	UINT64 Pfn = PAGE_FRAME_NUMBER(GuestPhysAddr & ~(LeafSize - 1));
+	const UINT64 EndPfn = min(Pfn + LeafSize / PAGE_SIZE, Ept->DirtyBitmapPageCount);
+
+	while (Pfn < EndPfn)
+	{
+		const UINT64 Bit = Pfn % 64;
+		const UINT64 Count = min(64 - Bit, EndPfn - Pfn);
+
+		InterlockedOr64(&Ept->DirtyBitmap[Pfn / 64], (Count == 64 ? ~0ULL : (1ULL << Count) - 1) << Bit);
+
+		Pfn += Count;
+	}
+}
+
+VMM_API
+UINT64
+EptCollectDirtyPages(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PageCount
+)
+/*++
+Routine Description:
+	Returns a mask of the pages, out of up to 64 starting at `GuestPhysAddr`, which were written to since they were 
+	last collected. Their dirty flags are cleared so the next write to them is logged again, the caller must hold
+	the EPT lock and invalidate the EPT on every VCPU before the guest is resumed
+--*/
+{
+	const UINT64 FirstPfn = PAGE_FRAME_NUMBER(GuestPhysAddr);
+
+	EPT_PTE DirtyFlag = {
+		.Dirty = TRUE
+	};
+
+	const UINT64 CollectCount = min(PageCount, 64);
+
+	UINT64 Dirty = 0;
+	for (UINT64 i = 0; i < CollectCount && FirstPfn + i < Ept->DirtyBitmapPageCount;)
+	{
+		const UINT64 Pfn = FirstPfn + i;
+		const UINT64 Bit = Pfn % 64;
+		const UINT64 Count = min(64 - Bit, CollectCount - i);
+		const UINT64 Word = Ept->DirtyBitmap[Pfn / 64] & ((Count == 64 ? ~0ULL : (1ULL << Count) - 1) << Bit);
+
+		// Clear the dirty flags before the bits, so a write in between is logged again rather than lost
+		UINT64 Remaining = Word;
+		ULONG Index = 0;
+		while (_BitScanForward64(&Index, Remaining))
+		{
+			for (UINT32 View = 0; View < Ept->ViewCount; View++)
+			{
+				UINT64 LeafSize = 0;
+				PEPT_PTE Leaf = EptGetLeafPte(Ept->Views[View].Pml4, PAGE_ADDRESS(Pfn - Bit + Index), &LeafSize);
+				if (Leaf != NULL)
+					InterlockedAnd64((volatile LONG64*)&Leaf->Value, ~DirtyFlag.Value);
+			}
+
+			Remaining &= Remaining - 1;
+		}
+
+		InterlockedAnd64(&Ept->DirtyBitmap[Pfn / 64], ~Word);
+
+		Dirty |= (Word >> Bit) << i;
+		i += Count;
+	}
+
+	return Dirty;
+}
+
 BOOLEAN
 EptCheckSupport(VOID)
 {
@@ -536,6 +880,76 @@ EptCheckSupport(VOID)
 	return TRUE;
 }
 
+NTSTATUS
+EptSetupDirtyBitmap(
+	_Inout_ PEPT_INFORMATION Ept
+)
+/*++
+Routine Description:
+	Allocates a dirty bitmap large enough to cover every page of RAM
+--*/
+{
+	PPHYSICAL_MEMORY_RANGE PhysMemRanges = MmGetPhysicalMemoryRanges();
+	if (PhysMemRanges == NULL)
+		return STATUS_NOT_SUPPORTED;
+
+	UINT64 HighestAddress = 0;
+	for (PPHYSICAL_MEMORY_RANGE Range = PhysMemRanges; Range->BaseAddress.QuadPart != 0 || Range->NumberOfBytes.QuadPart != 0; Range++)
+		HighestAddress = max(HighestAddress, (UINT64)(Range->BaseAddress.QuadPart + Range->NumberOfBytes.QuadPart));
+
+	ExFreePool(PhysMemRanges);
+
+	Ept->DirtyBitmapPageCount = PAGE_FRAME_NUMBER(HighestAddress + PAGE_SIZE - 1);
+	Ept->DirtyBitmap = (volatile LONG64*)ImpAllocateHostNpPool((Ept->DirtyBitmapPageCount + 63) / 64 * sizeof(UINT64));
+	if (Ept->DirtyBitmap == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EptCreateView(
+	_Inout_ PEPT_INFORMATION Ept,
+	_Out_opt_ PUINT32 ViewIndex
+)
+/*++
+Routine Description:
+	Creates a new EPT view identity mapping all of memory, and adds it to the EPTP list
+--*/
+{
+	if (Ept->ViewCount >= EPT_MAX_VIEWS)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	PEPT_PTE Pml4 = NULL;
+	UINT64 Pml4PhysAddr = 0;
+	if (!NT_SUCCESS(MmAllocateHostPageTable(&Pml4, &Pml4PhysAddr)))
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	NTSTATUS Status = EptSetupIdentityMap(Pml4);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	PEPT_VIEW View = &Ept->Views[Ept->ViewCount];
+
+	View->Pml4 = Pml4;
+
+	View->EptPointer.Value = 0;
+	View->EptPointer.MemoryType = EPT_MEMORY_WRITEBACK;
+	View->EptPointer.PageWalkLength = 3;
+	View->EptPointer.AccessDirtyFlags = Ept->DirtyLogging;
+	View->EptPointer.PML4PageFrameNumber = PAGE_FRAME_NUMBER(Pml4PhysAddr);
+
+	if (Ept->EptpList != NULL)
+		Ept->EptpList[Ept->ViewCount] = View->EptPointer.Value;
+
+	if (ViewIndex != NULL)
+		*ViewIndex = Ept->ViewCount;
+
+	Ept->ViewCount++;
+
+	return STATUS_SUCCESS;
+}
+
 NTSTATUS
 EptInitialise(
 	_Inout_ PEPT_INFORMATION Ept
@@ -548,23 +962,57 @@ Routine Description:
 {
 	NTSTATUS Status = STATUS_SUCCESS;
 
-	PEPT_PTE Pml4 = NULL;
-	if (!NT_SUCCESS(MmAllocateHostPageTable(&Pml4)))
+	// Dirty page logging costs a page-modification log entry (and a VM-exit for every 512 of them) the first time
+	// each page is written to after being collected. With accessed and dirty flags on, the processor's own reads
+	// of guest paging structures count as writes too, so it is only built in with IMPV_ENABLE_DIRTY_LOGGING
+#ifdef IMPV_ENABLE_DIRTY_LOGGING
+	IA32_VMX_EPT_VPID_CAP_MSR EptVpidCap = {
+		.Value = __readmsr(IA32_VMX_EPT_VPID_CAP)
+	};
+
+	Ept->DirtyLogging = EptVpidCap.AccessedDirtyFlagsSupport;
+#else
+	Ept->DirtyLogging = FALSE;
+#endif
+	if (Ept->DirtyLogging)
+	{
+		Status = EptSetupDirtyBitmap(Ept);
+		if (!NT_SUCCESS(Status))
+		{
+			ImpDebugPrint("Failed to allocate the dirty page bitmap, dirty page logging is disabled... (%X)\n", Status);
+			Ept->DirtyLogging = FALSE;
+			Status = STATUS_SUCCESS;
+		}
+	}
+
+	// Unused entries are left zeroed, VMFUNC fails with a VM-exit when switching to an invalid EPT pointer
+	Ept->EptpList = (PUINT64)ImpAllocateHostContiguousMemory(PAGE_SIZE);
+	if (Ept->EptpList == NULL)
 		return STATUS_INSUFFICIENT_RESOURCES;
 
-	Status = EptSetupIdentityMap(Pml4); 
+	RtlZeroMemory(Ept->EptpList, PAGE_SIZE);
+
+	Ept->EptpListPhysAddr = ImpGetPhysicalAddress(Ept->EptpList);
+	Ept->GuestViewSwitching = FALSE;
+	Ept->ViewCount = 0;
+	Ept->FlushGeneration = 0;
+	Ept->RetiredTableCount = 0;
+
+	SpinTrackLock(&Ept->Lock, "Ept");
+
+	Status = EptCreateView(Ept, NULL);
 	if (!NT_SUCCESS(Status))
 		return Status;
 
-	Ept->Pml4 = Pml4;
+	Status = EptCreateView(Ept, NULL);
+	if (!NT_SUCCESS(Status))
+		return Status;
 
-	if (!NT_SUCCESS(MmAllocateHostPageTable(&Ept->DummyPage)))
+	if (!NT_SUCCESS(MmAllocateHostPageTable(&Ept->DummyPage, &Ept->DummyPagePhysAddr)))
 		return STATUS_INSUFFICIENT_RESOURCES;
 
 	// Watermark the dummy page to avoid page combining
 	Ept->DummyPage->Watermark = 'IMPV' ^ (ULONG)__rdtsc();
 
-	Ept->DummyPagePhysAddr = MmGetLastAllocatedPageTable()->TablePhysAddr;
-
 	return Status;
 }
@@ -2,6 +2,7 @@
 #define IMP_EPT_H
 
 #include <ntdef.h>
+#include <spinlock.h>
 
 typedef enum _EPT_MEMORY_TYPE
 {
@@ -109,11 +110,64 @@ typedef union _EPT_SHADOW_PAGE
 	};
 } EPT_SHADOW_PAGE, *PEPT_SHADOW_PAGE;
 
-typedef struct _EPT_INFORMATION
+// Maximum amount of EPT views, one for each entry of the EPTP list VMFUNC switches between
+#define EPT_MAX_VIEWS 512
+// The view every VCPU starts in, detoured pages are mapped to the original page without execute access
+#define EPT_VIEW_DEFAULT 0
+// The view detoured pages are executed in, mapped to their shadow page as execute only
+#define EPT_VIEW_DETOUR 1
+
+// Amount of entries in a page-modification log, the processor fills it from the last entry down
+#define EPT_PML_ENTRY_COUNT 512
+// Value of unused page-modification log entries, logged addresses are always page aligned
+#define EPT_PML_EMPTY_ENTRY (~0ULL)
+
+// Maximum amount of page tables merged away by coalescing that can wait to be returned to the host reserve
+#define EPT_MAX_RETIRED_TABLES 64
+// Amount of retired tables past which VCPUs that haven't invalidated them are sent an NMI to make them exit
+#define EPT_RETIRED_TABLE_KICK_THRESHOLD (EPT_MAX_RETIRED_TABLES / 2)
+
+// A page table merged into a large page, which processors may still have cached until they next invalidate
+typedef struct _EPT_RETIRED_TABLE
+{
+	UINT64 PhysAddr;
+	// The invalidation generation every VCPU must have reached before the table can be reused
+	UINT64 Generation;
+} EPT_RETIRED_TABLE, *PEPT_RETIRED_TABLE;
+
+// A separate EPT hierarchy, each VCPU runs in one view at a time and switching views needs no invalidation as
+// translations are tagged by EPT pointer
+typedef struct _EPT_VIEW
 {
 	PEPT_PTE Pml4;
+	EPT_POINTER EptPointer;
+} EPT_VIEW, *PEPT_VIEW;
+
+typedef struct _EPT_INFORMATION
+{
+	// Serialises changes to the paging structures of every view and the retired table list, it is taken before
+	// the host page table lock when both are needed
+	SPINLOCK Lock;
+	EPT_VIEW Views[EPT_MAX_VIEWS];
+	UINT32 ViewCount;
+	// EPTP list VMFUNC leaf 0 switches between, the index of each entry is the index of its view
+	PUINT64 EptpList;
+	UINT64 EptpListPhysAddr;
+	// Whether the guest may switch views itself using VMFUNC, this stops VMFUNC from raising #UD which makes the
+	// hypervisor detectable, so it is off unless something in the guest needs it
+	BOOLEAN GuestViewSwitching;
 	PEPT_SHADOW_PAGE DummyPage;
 	UINT64 DummyPagePhysAddr;
+	// Whether the processor sets accessed and dirty flags in this EPT, which dirty page logging relies on
+	BOOLEAN DirtyLogging;
+	// One bit for each page of RAM, set for pages written to since they were last collected
+	volatile LONG64* DirtyBitmap;
+	UINT64 DirtyBitmapPageCount;
+	// Incremented by every EPT invalidation requested, see VcpuQueueEptInvalidation
+	volatile LONG64 FlushGeneration;
+	// Page tables merged into large pages, which other processors may still have cached
+	EPT_RETIRED_TABLE RetiredTables[EPT_MAX_RETIRED_TABLES];
+	UINT32 RetiredTableCount;
 } EPT_INFORMATION, *PEPT_INFORMATION;
 
 typedef enum _EPT_PAGE_PERMISSIONS
@@ -132,8 +186,52 @@ typedef enum _EPT_PAGE_PERMISSIONS
 	EPT_PAGE_RWUX = EPT_PAGE_READ | EPT_PAGE_WRITE | EPT_PAGE_UEXECUTE
 } EPT_PAGE_PERMISSIONS, *PEPT_PAGE_PERMISSIONS;
 
+NTSTATUS
+EptMapMemoryRangeInViews(
+	_In_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ UINT64 Size,
+	_In_ EPT_PAGE_PERMISSIONS Permissions
+);
+
+VOID
+EptInvalidateViews(
+	_In_ PEPT_INFORMATION Ept
+);
+
+PEPT_PTE
+EptGetLeafPte(
+	_In_ PEPT_PTE Pml4,
+	_In_ UINT64 GuestPhysAddr,
+	_Out_ PUINT64 LeafSize
+);
+
+UINT64
+EptCoalesceRange(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 Size
+);
+
 VOID
-EptInvalidateCache(VOID);
+EptReleaseRetiredTables(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 Generation
+);
+
+VOID
+EptLogDirtyPage(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr
+);
+
+UINT64
+EptCollectDirtyPages(
+	_Inout_ PEPT_INFORMATION Ept,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PageCount
+);
 
 BOOLEAN
 EptCheckSupport(VOID);
@@ -1,101 +1,10 @@
 #include <improvisor.h>
 #include <spinlock.h>
 #include <fmt.h>
-#include <ll.h>
-
-#define IMPV_LOG_SIZE 512
-#define IMPV_LOG_COUNT 512
 
 VMM_DATA PIMP_ALLOC_RECORD gHostAllocationsHead = NULL;
 // The raw buffer containing the host allocation records
 VMM_DATA static PIMP_ALLOC_RECORD sImpAllocRecordsRaw = NULL;
-// The linked list object pool containing log records
-VMM_DATA static LINKED_LIST_POOL sLogRecordPool;
-
-VSC_API
-NTSTATUS
-ImpReserveLogRecords(
-	_In_ SIZE_T Count
-)
-{
-	return LL_CREATE_POOL(&sLogRecordPool, IMP_LOG_RECORD, Count);
-}
-
-VMM_API
-NTSTATUS
-ImpAllocateLogRecord(
-	_Out_ PIMP_LOG_RECORD* Record
-)
-{
-	if (Record == NULL)
-		return STATUS_INVALID_PARAMETER;
-
-	PVOID Result = LlAllocate(&sLogRecordPool);
-	// If `Result` is null, there are no used entries
-	if (Result == NULL)
-		return STATUS_INSUFFICIENT_RESOURCES;
-
-	*Record = Result;
-
-	return STATUS_SUCCESS;
-}
-
-VMM_API
-VOID
-ImpLog(
-	_In_ LPCSTR Fmt, ...
-)
-/*++
-Routine Description:
-	Creates a log entry with the contents of `Fmt` formatted with variadic args
---*/
-{
-	PIMP_LOG_RECORD Log = NULL;
-	if (!NT_SUCCESS(ImpAllocateLogRecord(&Log)))
-		return;
-
-	va_list Arg;
-	va_start(Arg, Fmt);
-	vsprintf_s(Log->Buffer, 512, Fmt, Arg);
-	va_end(Arg);
-}
-
-VMM_API
-NTSTATUS
-ImpRetrieveLogRecord(
-	_Out_ PIMP_LOG_RECORD* Record
-)
-/*++
-Routine Description:
-	Returns the oldest entry from the log record pool 
---*/
-{
-	if (Record == NULL)
-		return STATUS_INVALID_PARAMETER;
-
-	// Grab the first inserted record
-	PVOID Result = LlBegin(&sLogRecordPool);
-	// If `Result` is null, there are no used entries
-	if (Result == NULL)
-		return STATUS_INSUFFICIENT_RESOURCES;
-
-	*Record = Result;
-
-	return STATUS_SUCCESS;
-}
-
-VMM_API
-VOID
-ImpFreeLogRecord(
-	_In_ PIMP_LOG_RECORD Record
-)
-/*++
-Routine Description:
-	Marks `Record` as free
---*/
-{
-	LlFree(&sLogRecordPool, &Record->Links);
-}
 
 VSC_API
 NTSTATUS
@@ -348,6 +257,31 @@ Routine Description:
 	ExFreePoolWithTag(sImpAllocRecordsRaw, POOL_TAG);
 }
 
+VMM_API
+BOOLEAN
+ImpOverlapsAllocation(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Checks if a physical range overlaps any allocation made by Imp* functions, which is how the VMM allocates 
+	everything it owns. Allocations are treated as physically contiguous, the same as when they are hidden from 
+	the guest
+--*/
+{
+	PIMP_ALLOC_RECORD CurrRecord = gHostAllocationsHead;
+	while (CurrRecord != NULL)
+	{
+		if (CurrRecord->Size != 0 && CurrRecord->PhysAddr < PhysAddr + Size && PhysAddr < CurrRecord->PhysAddr + CurrRecord->Size)
+			return TRUE;
+
+		CurrRecord = (PIMP_ALLOC_RECORD)CurrRecord->Records.Blink;
+	}
+
+	return FALSE;
+}
+
 VSC_API
 UINT64
 ImpGetPhysicalAddress(
@@ -14,15 +14,130 @@
 #define BUGCHECK_FAILED_SHUTDOWN 0x00001000
 #define BUGCHECK_UNKNOWN_VMEXIT_REASON 0x00002000
 
-// Make sure the size of buffer is a factor of PAGE_SIZE to make 
-// HYPERCALL_GET_LOG_RECORDS faster by not needing to map multiple pages
-#define IMP_LOG_SIZE (512ULL - sizeof(LIST_ENTRY))
+// Amount of raw arguments stored with each log entry
+#define IMP_LOG_MAX_ARGS 6
+// Amount of entries in each log ring, must be a power of two
+#define IMP_LOG_RING_SIZE 1024
+// Maximum size of a format string returned by HYPERCALL_GET_LOG_FORMAT, including the terminator
+#define IMP_LOG_MAX_FORMAT_SIZE 256
+// Format ID of entries that hold a piece of plain text (from HYPERCALL_ADD_LOG_RECORD) instead of arguments
+#define IMP_LOG_FORMAT_TEXT (0xFFFFFFFF)
+// VCPU ID of entries logged by the guest rather than the host
+#define IMP_LOG_GUEST_VCPU (0xFFFF)
 
-typedef struct _IMP_LOG_RECORD
+// A compact binary log entry, formatted by the consumer rather than the producer.
+//
+// Entries are exactly one cache line. The format string is referenced by its offset from the driver's image
+// base, which stays valid for as long as the driver is loaded, and can be fetched with HYPERCALL_GET_LOG_FORMAT
+typedef struct _IMP_LOG_ENTRY
 {
-	LIST_ENTRY Links;
-	CHAR Buffer[IMP_LOG_SIZE];
-} IMP_LOG_RECORD, *PIMP_LOG_RECORD;
+	UINT64 Timestamp;
+	UINT32 FormatId;
+	UINT16 VcpuId;
+	// IMP_LOG_CATEGORY and IMP_LOG_LEVEL_* the entry was logged with
+	UINT8 Category;
+	UINT8 Level;
+
+	union
+	{
+		// Laid out like a `va_list`, so they can be passed straight to a `vsprintf` family function. Slots past
+		// the arguments logged are zero
+		UINT64 Args[IMP_LOG_MAX_ARGS];
+		CHAR Text[IMP_LOG_MAX_ARGS * sizeof(UINT64)];
+	};
+} IMP_LOG_ENTRY, *PIMP_LOG_ENTRY;
+
+// A single-producer log ring. 
+//
+// The producer owns `Head` and `Overflows`, the consumer owns `Tail`, each on their own cache line. Both are 
+// free-running counters; when the ring is full, new entries are dropped and counted in `Overflows`
+typedef struct _IMP_LOG_RING
+{
+	DECLSPEC_ALIGN(64) volatile UINT64 Head;
+	volatile UINT64 Overflows;
+	DECLSPEC_ALIGN(64) volatile UINT64 Tail;
+	DECLSPEC_ALIGN(64) IMP_LOG_ENTRY Entries[IMP_LOG_RING_SIZE];
+} IMP_LOG_RING, *PIMP_LOG_RING;
+
+// Log levels, in order of increasing verbosity
+#define IMP_LOG_LEVEL_NONE 0
+#define IMP_LOG_LEVEL_ERROR 1
+#define IMP_LOG_LEVEL_WARN 2
+#define IMP_LOG_LEVEL_INFO 3
+#define IMP_LOG_LEVEL_TRACE 4
+
+// The most verbose level compiled in, logging sites of more verbose levels generate no code at all
+#ifndef IMP_LOG_COMPILED_LEVEL
+#ifdef _DEBUG
+#define IMP_LOG_COMPILED_LEVEL IMP_LOG_LEVEL_TRACE
+#else
+#define IMP_LOG_COMPILED_LEVEL IMP_LOG_LEVEL_INFO
+#endif
+#endif
+
+typedef enum _IMP_LOG_CATEGORY
+{
+	IMP_LOG_GENERAL,
+	IMP_LOG_EPT,
+	IMP_LOG_TSC,
+	IMP_LOG_HYPERCALL,
+	IMP_LOG_DETOUR,
+	IMP_LOG_PDB,
+	IMP_LOG_VMEXIT,
+	IMP_LOG_MSR,
+	IMP_LOG_CATEGORY_COUNT
+} IMP_LOG_CATEGORY, *PIMP_LOG_CATEGORY;
+
+#define IMP_LOG_CATEGORY_BIT(Category) (1UL << (Category))
+#define IMP_LOG_ALL_CATEGORIES ((1UL << IMP_LOG_CATEGORY_COUNT) - 1)
+// Categories enabled at startup, tracing of every RDTSC or VM-exit is too noisy to leave on by default
+#define IMP_LOG_DEFAULT_CATEGORIES \
+	(IMP_LOG_ALL_CATEGORIES & ~(IMP_LOG_CATEGORY_BIT(IMP_LOG_TSC) | IMP_LOG_CATEGORY_BIT(IMP_LOG_VMEXIT)))
+
+// Runtime mask of enabled categories, see HYPERCALL_SET_LOG_CATEGORIES
+extern volatile LONG gImpLogCategoryMask;
+
+// Counts the arguments following a log's format string, up to 16, so only those are copied into its entry.
+// IMP_LOG_EXPAND is needed for MSVC's preprocessor to split __VA_ARGS__ into separate arguments
+#define IMP_LOG_EXPAND(x) x
+#define IMP_LOG_ARG_COUNT_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define IMP_LOG_ARG_COUNT(...) \
+	IMP_LOG_EXPAND(IMP_LOG_ARG_COUNT_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0))
+
+// Logs in the general category regardless of the category mask
+#define ImpLog(...) \
+	ImpLogEx(IMP_LOG_GENERAL, IMP_LOG_LEVEL_INFO, IMP_LOG_ARG_COUNT(__VA_ARGS__), __VA_ARGS__)
+
+#define IMP_LOG_EMIT(Level, Category, ...) \
+	do \
+	{ \
+		if (gImpLogCategoryMask & IMP_LOG_CATEGORY_BIT(Category)) \
+			ImpLogEx((Category), (Level), IMP_LOG_ARG_COUNT(__VA_ARGS__), __VA_ARGS__); \
+	} while (0)
+
+#if IMP_LOG_COMPILED_LEVEL >= IMP_LOG_LEVEL_ERROR
+#define IMP_LOG_ERROR(Category, ...) IMP_LOG_EMIT(IMP_LOG_LEVEL_ERROR, Category, __VA_ARGS__)
+#else
+#define IMP_LOG_ERROR(Category, ...) ((VOID)0)
+#endif
+
+#if IMP_LOG_COMPILED_LEVEL >= IMP_LOG_LEVEL_WARN
+#define IMP_LOG_WARN(Category, ...) IMP_LOG_EMIT(IMP_LOG_LEVEL_WARN, Category, __VA_ARGS__)
+#else
+#define IMP_LOG_WARN(Category, ...) ((VOID)0)
+#endif
+
+#if IMP_LOG_COMPILED_LEVEL >= IMP_LOG_LEVEL_INFO
+#define IMP_LOG_INFO(Category, ...) IMP_LOG_EMIT(IMP_LOG_LEVEL_INFO, Category, __VA_ARGS__)
+#else
+#define IMP_LOG_INFO(Category, ...) ((VOID)0)
+#endif
+
+#if IMP_LOG_COMPILED_LEVEL >= IMP_LOG_LEVEL_TRACE
+#define IMP_LOG_TRACE(Category, ...) IMP_LOG_EMIT(IMP_LOG_LEVEL_TRACE, Category, __VA_ARGS__)
+#else
+#define IMP_LOG_TRACE(Category, ...) ((VOID)0)
+#endif
 
 typedef struct _IMP_ALLOC_RECORD
 {
@@ -46,19 +161,40 @@ typedef enum _IMP_ALLOC_FLAGS
 
 extern PIMP_ALLOC_RECORD gHostAllocationsHead;
 
-VOID 
-ImpLog(
+VOID
+ImpLogEx(
+	_In_ IMP_LOG_CATEGORY Category,
+	_In_ UINT8 Level,
+	_In_ SIZE_T ArgCount,
 	_In_ LPCSTR Fmt, ...
 );
 
-NTSTATUS
-ImpAllocateLogRecord(
-	_Out_ PIMP_LOG_RECORD *LogRecord
+LONG
+ImpSetLogCategories(
+	_In_ LONG Enable,
+	_In_ LONG Disable
+);
+
+VOID
+ImpLogText(
+	_In_ PCSTR Text,
+	_In_ SIZE_T Size
 );
 
 NTSTATUS
-ImpRetrieveLogRecord(
-	_Out_ PIMP_LOG_RECORD *Record
+ImpRetrieveLogEntry(
+	_Out_ PIMP_LOG_ENTRY Entry
+);
+
+UINT64
+ImpGetLogOverflowCount(VOID);
+
+UINT64
+ImpGetPendingLogCount(VOID);
+
+PCSTR
+ImpGetLogFormat(
+	_In_ UINT32 FormatId
 );
 
 NTSTATUS
@@ -66,11 +202,6 @@ ImpReserveAllocationRecords(
 	_In_ SIZE_T Count
 );
 
-VOID
-ImpFreeLogRecord(
-	_In_ PIMP_LOG_RECORD Record
-);
-
 NTSTATUS
 ImpInsertAllocRecord(
 	_In_ PVOID Address,
@@ -79,8 +210,15 @@ ImpInsertAllocRecord(
 );
 
 NTSTATUS
-ImpReserveLogRecords(
-	_In_ SIZE_T Count
+ImpReserveLogRings(
+	_In_ SIZE_T CpuCount
+);
+
+struct _VCPU;
+
+VOID
+ImpBindLogRings(
+	_In_ struct _VCPU* VcpuTable
 );
 
 PVOID
@@ -123,6 +261,12 @@ ImpFreeAllocation(
 VOID
 ImpFreeAllAllocations(VOID);
 
+BOOLEAN
+ImpOverlapsAllocation(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+);
+
 UINT64
 ImpGetPhysicalAddress(
 	_In_ PVOID Address
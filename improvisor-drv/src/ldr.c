@@ -58,7 +58,7 @@ Routine Description:
 	Status = PsLookupProcessByProcessId(gLdrLaunchParams.ClientID, &ClientProcess);
 	if (!NT_SUCCESS(Status))
 	{
-		ImpLog("LdrConsumePdbBinary: PsLookupProcessByProcessId failed for client process ID...\n");
+		IMP_LOG_ERROR(IMP_LOG_PDB, "LdrConsumePdbBinary: PsLookupProcessByProcessId failed for client process ID...\n");
 		return Status;
 	}
 
@@ -68,7 +68,7 @@ Routine Description:
 	PMDL Mdl = IoAllocateMdl(Pdbp->PdbBase, Pdbp->PdbSize, FALSE, FALSE, NULL);
 	if (Mdl == NULL)
 	{
-		ImpLog("LdrConsumePdbBinary: IoAllocateMdl failed for PDB buffer...\n");
+		IMP_LOG_ERROR(IMP_LOG_PDB, "LdrConsumePdbBinary: IoAllocateMdl failed for PDB buffer...\n");
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
@@ -83,14 +83,14 @@ Routine Description:
 
 	if (PdbBuffer == NULL)
 	{
-		ImpLog("LdrConsumePdbBinary: Failed to map and lock pages (%llX -> %llX) for %s...\n", Pdbp->PdbBase, Pdbp->PdbBase + Pdbp->PdbSize, Pdbp->FileName);
+		IMP_LOG_ERROR(IMP_LOG_PDB, "LdrConsumePdbBinary: Failed to map and lock pages (%llX -> %llX) for %s...\n", Pdbp->PdbBase, Pdbp->PdbBase + Pdbp->PdbSize, Pdbp->FileName);
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
 	Status = PdbParseFile(FNV1A_HASH(Pdbp->FileName), PdbBuffer);
 	if (!NT_SUCCESS(Status))
 	{
-		ImpLog("LdrConsumePdbBinary: PdbParseFile failed to parse %s...\n", Pdbp->FileName);
+		IMP_LOG_ERROR(IMP_LOG_PDB, "LdrConsumePdbBinary: PdbParseFile failed to parse %s...\n", Pdbp->FileName);
 		return Status;
 	}
 
@@ -191,7 +191,7 @@ Routine Description:
 
 	if (!NT_SUCCESS(Status))
 	{
-		ImpLog("Failed to wait for PDB binary... (%X)\n", Status);
+		IMP_LOG_ERROR(IMP_LOG_PDB, "Failed to wait for PDB binary... (%X)\n", Status);
 		return Status;
 	}
 
@@ -202,7 +202,7 @@ Routine Description:
 
 		if (!NT_SUCCESS(Status))
 		{
-			ImpLog("Failed to parse PDB %s... (%X)\n", Section->PdbPacket.FileName, Status);
+			IMP_LOG_ERROR(IMP_LOG_PDB, "Failed to parse PDB %s... (%X)\n", Section->PdbPacket.FileName, Status);
 			return Status;
 		}
 		
@@ -219,7 +219,7 @@ Routine Description:
 
 		if (!NT_SUCCESS(Status))
 		{
-			ImpLog("Failed to wait for PDB binary... (%X)\n", Status);
+			IMP_LOG_ERROR(IMP_LOG_PDB, "Failed to wait for PDB binary... (%X)\n", Status);
 			return Status;
 		}
 	}
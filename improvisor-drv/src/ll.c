@@ -7,12 +7,13 @@ LlCreatePool(
 	_Inout_ PLINKED_LIST_POOL Pool,
 	_In_ SIZE_T ElementEntryOffset,
 	_In_ SIZE_T ElementSize,
-	_In_ SIZE_T MaxElements
+	_In_ SIZE_T MaxElements,
+	_In_ UINT32 Flags
 )
 /*++
 Routine Description:
 	Creates a pool that can contain `MaxElements` of size `ElementSize`. This function shouldn't be called directly,
-	instead use the `LL_CREATE_POOL` macro
+	instead use the `LL_CREATE_POOL` or `LL_CREATE_PER_CPU_POOL` macros
 --*/
 {
 	PVOID Buffer = ImpAllocateHostNpPool(ElementSize * MaxElements);
@@ -24,6 +25,10 @@ Routine Description:
 	Pool->ElementSize = ElementSize;
 	Pool->ElementEntryOffset = ElementEntryOffset;
 	Pool->ElementsUsed = 0;
+	Pool->Flags = Flags;
+	Pool->Magazines = NULL;
+	Pool->MagazineCount = 0;
+	Pool->MagazineCapacity = 0;
 
 	InitializeListHead(&Pool->Used);
 	InitializeListHead(&Pool->Free);
@@ -36,5 +41,78 @@ Routine Description:
 		InsertTailList(&Pool->Free, LlElementToLink(Pool, CurrElement));
 	}
 
+	if (Flags & LL_POOL_PER_CPU)
+	{
+		const SIZE_T CpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+		Pool->Magazines = ImpAllocateHostNpPool(sizeof(LL_MAGAZINE) * CpuCount);
+		if (Pool->Magazines == NULL)
+		{
+			// Don't leave a pool behind that looks usable but has no magazines
+			ImpFreeAllocation(Buffer);
+			Pool->Buffer = NULL;
+			Pool->MaxElements = 0;
+			InitializeListHead(&Pool->Free);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		RtlZeroMemory(Pool->Magazines, sizeof(LL_MAGAZINE) * CpuCount);
+
+		// Let all magazines together hold at most half of the pool
+		Pool->MagazineCount = CpuCount;
+		Pool->MagazineCapacity = MaxElements / (CpuCount * 2);
+
+		if (Pool->MagazineCapacity > LL_MAGAZINE_SIZE)
+			Pool->MagazineCapacity = LL_MAGAZINE_SIZE;
+		else if (Pool->MagazineCapacity < 2)
+			Pool->MagazineCapacity = 2;
+	}
+
 	return STATUS_SUCCESS;
 }
+
+VMM_API
+VOID
+LlRefillMagazine(
+	_Inout_ PLINKED_LIST_POOL Pool,
+	_Inout_ PLL_MAGAZINE Magazine
+)
+/*++
+Routine Description:
+	Moves up to half a magazine's worth of elements from the shared free list into `Magazine`, so the lock
+	is only taken once every few allocations
+--*/
+{
+	SpinLockExclusive(&Pool->Lock);
+
+	while (Magazine->Count < Pool->MagazineCapacity / 2 && !IsListEmpty(&Pool->Free))
+		Magazine->Links[Magazine->Count++] = RemoveHeadList(&Pool->Free);
+
+	SpinUnlockExclusive(&Pool->Lock);
+}
+
+VMM_API
+VOID
+LlFlushMagazine(
+	_Inout_ PLINKED_LIST_POOL Pool,
+	_Inout_ PLL_MAGAZINE Magazine
+)
+/*++
+Routine Description:
+	Moves the older half of the elements in `Magazine` back into the shared free list, leaving the most 
+	recently freed (and likely cache-hot) elements in the magazine
+--*/
+{
+	const SIZE_T FlushCount = Magazine->Count / 2;
+
+	SpinLockExclusive(&Pool->Lock);
+
+	for (SIZE_T i = 0; i < FlushCount; i++)
+		InsertHeadList(&Pool->Free, Magazine->Links[i]);
+
+	SpinUnlockExclusive(&Pool->Lock);
+
+	RtlMoveMemory(Magazine->Links, Magazine->Links + FlushCount, (Magazine->Count - FlushCount) * sizeof(PLIST_ENTRY));
+
+	Magazine->Count -= FlushCount;
+}
@@ -12,7 +12,35 @@
 
 // Small wrapper to get rid of ugly `sizeof`. The `LIST_ENTRY` member of `Ty` must be called 'Links'
 #define LL_CREATE_POOL(Pool, Ty, Count)       						\
-    LlCreatePool(Pool, offsetof(Ty, Links), sizeof(Ty), (Count))  	\
+    LlCreatePool(Pool, offsetof(Ty, Links), sizeof(Ty), (Count), LL_POOL_ENUMERABLE)  	\
+
+// Creates a pool that caches free elements per CPU, it must only be used from the host with `LlAllocateLocal`
+// and `LlFreeLocal`, and can't be enumerated
+#define LL_CREATE_PER_CPU_POOL(Pool, Ty, Count)       						\
+    LlCreatePool(Pool, offsetof(Ty, Links), sizeof(Ty), (Count), LL_POOL_PER_CPU)  	\
+
+// Keep a list of used elements so the pool can be walked with `LlBegin`, `LlEnd` and `LlFind`
+#define LL_POOL_ENUMERABLE (1 << 0)
+// Cache free elements in a magazine per CPU, refilled from and flushed to the shared free list in bulk
+#define LL_POOL_PER_CPU (1 << 1)
+
+// Maximum amount of free elements a single CPU's magazine can hold
+#define LL_MAGAZINE_SIZE 16
+
+// A per-CPU cache of free elements.
+//
+// A magazine is only ever touched by its own CPU while in the host, where it can't be interrupted or 
+// preempted, so it needs no lock. Each one has its own cache line so CPUs don't share lines on the fast path
+typedef struct DECLSPEC_ALIGN(64) _LL_MAGAZINE
+{
+	// The amount of elements in `Links`
+	SIZE_T Count;
+	// The amount of elements allocated minus the amount freed on this CPU, negative if this CPU
+	// has freed elements allocated on another
+	INT64 ElementsUsed;
+	// Stack of free elements
+	PLIST_ENTRY Links[LL_MAGAZINE_SIZE];
+} LL_MAGAZINE, *PLL_MAGAZINE;
 
 // A linked list pool.
 //
@@ -31,12 +59,20 @@ typedef struct _LINKED_LIST_POOL
     SIZE_T ElementEntryOffset;
 	// The amount of elements used
 	SIZE_T ElementsUsed;
-    // Head of the list of elements
+	// LL_POOL_* flags
+	UINT32 Flags;
+    // Head of the list of elements, only maintained for `LL_POOL_ENUMERABLE` pools
     LIST_ENTRY Used;
-	// head of the list of unused elements
+	// head of the list of unused elements, the shared depot magazines are refilled from
 	LIST_ENTRY Free;
-	// The lock for the list
-	SPINLOCK Lock;
+	// The lock for the list, taken shared for enumeration and exclusive for everything else
+	RWSPINLOCK Lock;
+	// Per-CPU magazines for `LL_POOL_PER_CPU` pools, indexed by VCPU ID
+	PLL_MAGAZINE Magazines;
+	SIZE_T MagazineCount;
+	// The amount of elements each magazine holds at most, scaled down for small pools so that most
+	// elements can't be stranded in other CPUs' magazines
+	SIZE_T MagazineCapacity;
 } LINKED_LIST_POOL, *PLINKED_LIST_POOL;
 
 // Predicate callback for searching linked lists
@@ -70,12 +106,39 @@ Routine Description:
 	return RVA_PTR_T(LIST_ENTRY, Element, Pool->ElementEntryOffset);
 }
 
+FORCEINLINE
+PVOID
+LlElementAt(
+	_In_ PLINKED_LIST_POOL Pool,
+	_In_ SIZE_T Index
+)
+/*++
+Routine Description:
+	Returns the element at `Index` in the pool's buffer, regardless of whether it is used or free
+--*/
+{
+	return RVA_PTR(Pool->Buffer, Index * Pool->ElementSize);
+}
+
 NTSTATUS
 LlCreatePool(
 	_Inout_ PLINKED_LIST_POOL Pool,
     _In_ SIZE_T ElementEntryOffset,
     _In_ SIZE_T ElementSize,
-    _In_ SIZE_T MaxElements
+    _In_ SIZE_T MaxElements,
+	_In_ UINT32 Flags
+);
+
+VOID
+LlRefillMagazine(
+	_Inout_ PLINKED_LIST_POOL Pool,
+	_Inout_ PLL_MAGAZINE Magazine
+);
+
+VOID
+LlFlushMagazine(
+	_Inout_ PLINKED_LIST_POOL Pool,
+	_Inout_ PLL_MAGAZINE Magazine
 );
 
 FORCEINLINE
@@ -90,17 +153,19 @@ Routine Description:
 --*/
 {
 	// Lock the entire pool for concurrency
-	SpinLock(&Pool->Lock);
+	SpinLockExclusive(&Pool->Lock);
 
 	// Remove `Entry` from the list of used elements
 	// TODO: Validate state of `Entry`?
-	RemoveEntryList(Entry);
+	if (Pool->Flags & LL_POOL_ENUMERABLE)
+		RemoveEntryList(Entry);
+
 	// Insert `Entry` as the last inserted element in the list of free elements
 	InsertTailList(&Pool->Free, Entry);
 
 	Pool->ElementsUsed--;
 
-	SpinUnlock(&Pool->Lock);
+	SpinUnlockExclusive(&Pool->Lock);
 }
 
 FORCEINLINE
@@ -115,7 +180,7 @@ Routine Description:
 {
 	PVOID Element = NULL;
 
-	SpinLock(&Pool->Lock);
+	SpinLockExclusive(&Pool->Lock);
 
 	if (IsListEmpty(&Pool->Free) == FALSE)
 	{
@@ -126,16 +191,85 @@ Routine Description:
 		// Remove this element from the list
 		RemoveEntryList(Link);
 		// Insert `Entry` as the last inserted element in the list of used elements
-		InsertTailList(&Pool->Used, Link);
+		if (Pool->Flags & LL_POOL_ENUMERABLE)
+			InsertTailList(&Pool->Used, Link);
 
 		Pool->ElementsUsed++;
 	}
 
-	SpinUnlock(&Pool->Lock);
+	SpinUnlockExclusive(&Pool->Lock);
 
 	return Element;
 }
 
+FORCEINLINE
+PVOID
+LlAllocateLocal(
+	_Inout_ PLINKED_LIST_POOL Pool,
+	_In_ SIZE_T Cpu
+)
+/*++
+Routine Description:
+	Allocates an element from `Cpu`'s magazine of a `LL_POOL_PER_CPU` pool, only going to the shared 
+	free list when the magazine is empty. `Cpu` must be the ID of the VCPU this is called on
+--*/
+{
+	PLL_MAGAZINE Magazine = &Pool->Magazines[Cpu];
+
+	if (Magazine->Count == 0)
+	{
+		LlRefillMagazine(Pool, Magazine);
+
+		if (Magazine->Count == 0)
+			return NULL;
+	}
+
+	Magazine->ElementsUsed++;
+
+	return LlLinkToElement(Pool, Magazine->Links[--Magazine->Count]);
+}
+
+FORCEINLINE
+VOID
+LlFreeLocal(
+	_Inout_ PLINKED_LIST_POOL Pool,
+	_In_ SIZE_T Cpu,
+	_In_ PLIST_ENTRY Entry
+)
+/*++
+Routine Description:
+	Returns an element to `Cpu`'s magazine of a `LL_POOL_PER_CPU` pool, flushing half of the magazine
+	to the shared free list if it is full
+--*/
+{
+	PLL_MAGAZINE Magazine = &Pool->Magazines[Cpu];
+
+	if (Magazine->Count >= Pool->MagazineCapacity)
+		LlFlushMagazine(Pool, Magazine);
+
+	Magazine->Links[Magazine->Count++] = Entry;
+	Magazine->ElementsUsed--;
+}
+
+FORCEINLINE
+SIZE_T
+LlGetUsedCount(
+	_In_ PLINKED_LIST_POOL Pool
+)
+/*++
+Routine Description:
+	Returns the amount of elements in use. For per-CPU pools this is a snapshot summed across all 
+	magazines, which may be stale by the time it returns
+--*/
+{
+	INT64 ElementsUsed = (INT64)Pool->ElementsUsed;
+
+	for (SIZE_T i = 0; i < Pool->MagazineCount; i++)
+		ElementsUsed += Pool->Magazines[i].ElementsUsed;
+
+	return (SIZE_T)ElementsUsed;
+}
+
 FORCEINLINE
 PVOID
 LlBegin(
@@ -143,17 +277,17 @@ LlBegin(
 )
 /*++
 Routine Description:
-	Returns the first inserted element from the list of used elements
+	Returns the first inserted element from the list of used elements, the pool must be `LL_POOL_ENUMERABLE`
 --*/
 {
 	PVOID Element = NULL;
 
-	SpinLock(&Pool->Lock);
+	SpinLockShared(&Pool->Lock);
 
 	if (!IsListEmpty(&Pool->Used))
 		Element = LlLinkToElement(Pool, Pool->Used.Flink);
 
-	SpinUnlock(&Pool->Lock);
+	SpinUnlockShared(&Pool->Lock);
 
 	return Element;
 }
@@ -165,17 +299,17 @@ LlEnd(
 )
 /*++
 Routine Description:
-	Returns the last inserted element from the list of used elements
+	Returns the last inserted element from the list of used elements, the pool must be `LL_POOL_ENUMERABLE`
 --*/
 {
 	PVOID Element = NULL;
 
-	SpinLock(&Pool->Lock);
+	SpinLockShared(&Pool->Lock);
 
 	if (!IsListEmpty(&Pool->Used))
 		Element = LlLinkToElement(Pool, Pool->Used.Blink);
 
-	SpinUnlock(&Pool->Lock);
+	SpinUnlockShared(&Pool->Lock);
 
 	return Element;
 }
@@ -189,12 +323,13 @@ LlFind(
 )
 /*++
 Routine Description:
-	Iterates all elements within `Pool` and calls `Pred`, returns the element for which `Pred` returns `TRUE`
+	Iterates all elements within `Pool` and calls `Pred`, returns the element for which `Pred` returns `TRUE`.
+	The pool must be `LL_POOL_ENUMERABLE`
 --*/
 {
 	PVOID Element = NULL;
 
-	SpinLock(&Pool->Lock);
+	SpinLockShared(&Pool->Lock);
 
 	PLIST_ENTRY CurrLink = Pool->Used.Flink;
 	// Search until we hit the end of the list
@@ -206,7 +341,7 @@ Routine Description:
 		CurrLink = CurrLink->Flink;
 	}
 
-	SpinUnlock(&Pool->Lock);
+	SpinUnlockShared(&Pool->Lock);
 
 	return Element;
 }
@@ -221,6 +356,9 @@ Routine Description:
 	Returns if the list of used elements is empty or not
 --*/
 {
+	if (!(Pool->Flags & LL_POOL_ENUMERABLE))
+		return LlGetUsedCount(Pool) == 0;
+
 	return IsListEmpty(&Pool->Used);
 }
 
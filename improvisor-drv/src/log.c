@@ -0,0 +1,376 @@
+#include <improvisor.h>
+#include <arch/msr.h>
+#include <vcpu/vcpu.h>
+#include <spinlock.h>
+#include <ntimage.h>
+#include <macro.h>
+
+EXTERN_C IMAGE_DOS_HEADER __ImageBase;
+
+// Log rings of each VCPU, only ever written to by their own VCPU in the host
+VMM_DATA static PIMP_LOG_RING sLogRings = NULL;
+VMM_DATA static SIZE_T sLogRingCount = 0;
+// VCPU of each log ring, see ImpGetLogHostVcpu
+VMM_DATA static PVCPU sLogVcpus = NULL;
+// Log ring shared by everything logged from the guest, mapped in both guest and host memory
+VMM_DATA static PIMP_LOG_RING sGuestLogRing = NULL;
+VMM_DATA static SPINLOCK sGuestLogLock;
+// Serialises consumers of all log rings
+VMM_DATA static SPINLOCK sLogConsumerLock;
+// Size of the driver's image, format IDs must be inside it
+VMM_DATA static UINT32 sImageSize = 0;
+// Read by logging sites in both the guest and the host
+VMM_SDATA volatile LONG gImpLogCategoryMask = IMP_LOG_DEFAULT_CATEGORIES;
+
+VSC_API
+NTSTATUS
+ImpReserveLogRings(
+	_In_ SIZE_T CpuCount
+)
+/*++
+Routine Description:
+	Allocates a log ring for each VCPU, and the ring shared by everything logged from the guest
+--*/
+{
+	sLogRings = ImpAllocateHostNpPool(sizeof(IMP_LOG_RING) * CpuCount);
+	if (sLogRings == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	sGuestLogRing = ImpAllocateNpPoolEx(sizeof(IMP_LOG_RING), IMP_SHARED_ALLOCATION);
+	if (sGuestLogRing == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	sLogRingCount = CpuCount;
+
+	PIMAGE_NT_HEADERS NtHeaders = RVA_PTR(&__ImageBase, __ImageBase.e_lfanew);
+	sImageSize = NtHeaders->OptionalHeader.SizeOfImage;
+
+	SpinTrackLock(&sGuestLogLock, "GuestLog");
+
+	return STATUS_SUCCESS;
+}
+
+VSC_API
+VOID
+ImpBindLogRings(
+	_In_ PVCPU VcpuTable
+)
+/*++
+Routine Description:
+	Associates each VCPU ring with its VCPU, entries are only written to VCPU rings from then on
+--*/
+{
+	sLogVcpus = VcpuTable;
+}
+
+VMM_API
+PVCPU
+ImpGetLogHostVcpu(VOID)
+/*++
+Routine Description:
+	Returns the VCPU whose host this core is running, or NULL if it is running the guest. The host's FS base 
+	always points at its own VCPU, which the guest's never does as the VCPU table is hidden from it. Unlike
+	RFLAGS.IF, this doesn't depend on what the guest was doing when it logged
+--*/
+{
+	if (sLogVcpus == NULL)
+		return NULL;
+
+	const UINT64 FsBase = __readmsr(IA32_FS_BASE);
+	if (FsBase - (UINT64)sLogVcpus >= sLogRingCount * sizeof(VCPU))
+		return NULL;
+
+	return (PVCPU)FsBase;
+}
+
+VMM_API
+VOID
+ImpWriteLogEntry(
+	_Inout_ PIMP_LOG_RING Ring,
+	_In_ UINT16 VcpuId,
+	_In_ IMP_LOG_CATEGORY Category,
+	_In_ UINT8 Level,
+	_In_ SIZE_T ArgCount,
+	_In_ LPCSTR Fmt,
+	_In_ va_list Args
+)
+/*++
+Routine Description:
+	Appends an entry to `Ring`, only publishing it to the consumer once it has been completely written. If the
+	ring is full the entry is dropped and counted instead
+--*/
+{
+	const UINT64 Head = Ring->Head;
+
+	if (Head - Ring->Tail >= IMP_LOG_RING_SIZE)
+	{
+		Ring->Overflows++;
+		return;
+	}
+
+	PIMP_LOG_ENTRY Entry = &Ring->Entries[Head & (IMP_LOG_RING_SIZE - 1)];
+
+	Entry->Timestamp = __rdtsc();
+	Entry->FormatId = (UINT32)((ULONG_PTR)Fmt - (ULONG_PTR)&__ImageBase);
+	Entry->VcpuId = VcpuId;
+	Entry->Category = (UINT8)Category;
+	Entry->Level = Level;
+
+	if (ArgCount > IMP_LOG_MAX_ARGS)
+		ArgCount = IMP_LOG_MAX_ARGS;
+
+	SIZE_T i = 0;
+	for (; i < ArgCount; i++)
+		Entry->Args[i] = va_arg(Args, UINT64);
+
+	// Slots past the arguments passed are cleared rather than left with a previous entry's arguments
+	for (; i < IMP_LOG_MAX_ARGS; i++)
+		Entry->Args[i] = 0;
+
+	_WriteBarrier();
+
+	Ring->Head = Head + 1;
+}
+
+VMM_API
+VOID
+ImpLogV(
+	_In_ IMP_LOG_CATEGORY Category,
+	_In_ UINT8 Level,
+	_In_ SIZE_T ArgCount,
+	_In_ LPCSTR Fmt,
+	_In_ va_list Args
+)
+/*++
+Routine Description:
+	Logs `Fmt` and the first `ArgCount` raw arguments as a binary entry, which is only formatted once it is 
+	consumed. This makes logging cheap enough for the VM-exit path, but `%s` arguments are stored as pointers 
+	and are never dereferenced by the consumer.
+
+	The host writes into its VCPU's ring without locking, the guest has no VCPU ring of its own and shares a 
+	locked one instead
+--*/
+{
+	if (sLogRings == NULL)
+		return;
+
+	PVCPU Vcpu = ImpGetLogHostVcpu();
+	if (Vcpu != NULL)
+	{
+		ImpWriteLogEntry(&sLogRings[Vcpu->Id], Vcpu->Id, Category, Level, ArgCount, Fmt, Args);
+	}
+	else
+	{
+		// Don't let anything on this core interrupt the lock holder and log itself
+		KIRQL OldIrql;
+		KeRaiseIrql(HIGH_LEVEL, &OldIrql);
+
+		SpinLock(&sGuestLogLock);
+		ImpWriteLogEntry(sGuestLogRing, IMP_LOG_GUEST_VCPU, Category, Level, ArgCount, Fmt, Args);
+		SpinUnlock(&sGuestLogLock);
+
+		KeLowerIrql(OldIrql);
+	}
+}
+
+VMM_API
+VOID
+ImpLogEx(
+	_In_ IMP_LOG_CATEGORY Category,
+	_In_ UINT8 Level,
+	_In_ SIZE_T ArgCount,
+	_In_ LPCSTR Fmt, ...
+)
+/*++
+Routine Description:
+	Logs `Fmt` tagged with its category and level, this is what ImpLog and the IMP_LOG_* macros expand to with
+	the amount of arguments they were given
+--*/
+{
+	va_list Args;
+	va_start(Args, Fmt);
+
+	ImpLogV(Category, Level, ArgCount, Fmt, Args);
+
+	va_end(Args);
+}
+
+VMM_API
+LONG
+ImpSetLogCategories(
+	_In_ LONG Enable,
+	_In_ LONG Disable
+)
+/*++
+Routine Description:
+	Enables and disables logging categories at runtime, returning the resulting category mask
+--*/
+{
+	InterlockedAnd(&gImpLogCategoryMask, ~Disable);
+	InterlockedOr(&gImpLogCategoryMask, Enable & IMP_LOG_ALL_CATEGORIES);
+
+	return gImpLogCategoryMask;
+}
+
+VMM_API
+VOID
+ImpLogText(
+	_In_ PCSTR Text,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Logs a piece of plain text from the host, split over as many IMP_LOG_FORMAT_TEXT entries as needed. The 
+	entries are consecutive in the current VCPU's ring, so the consumer can join them back together
+--*/
+{
+	if (sLogRings == NULL)
+		return;
+
+	PVCPU Vcpu = VcpuGetActiveVcpu();
+	PIMP_LOG_RING Ring = &sLogRings[Vcpu->Id];
+
+	const UINT64 Timestamp = __rdtsc();
+
+	SIZE_T SizeLogged = 0;
+	while (Size > SizeLogged)
+	{
+		const UINT64 Head = Ring->Head;
+
+		if (Head - Ring->Tail >= IMP_LOG_RING_SIZE)
+		{
+			Ring->Overflows++;
+			return;
+		}
+
+		PIMP_LOG_ENTRY Entry = &Ring->Entries[Head & (IMP_LOG_RING_SIZE - 1)];
+
+		const SIZE_T SizeToLog = Size - SizeLogged > sizeof(Entry->Text) ? sizeof(Entry->Text) : Size - SizeLogged;
+
+		Entry->Timestamp = Timestamp;
+		Entry->FormatId = IMP_LOG_FORMAT_TEXT;
+		Entry->VcpuId = Vcpu->Id;
+		Entry->Category = IMP_LOG_GENERAL;
+		Entry->Level = IMP_LOG_LEVEL_INFO;
+
+		RtlZeroMemory(Entry->Text, sizeof(Entry->Text));
+		RtlCopyMemory(Entry->Text, Text + SizeLogged, SizeToLog);
+
+		_WriteBarrier();
+
+		Ring->Head = Head + 1;
+
+		SizeLogged += SizeToLog;
+	}
+}
+
+VMM_API
+NTSTATUS
+ImpRetrieveLogEntry(
+	_Out_ PIMP_LOG_ENTRY Entry
+)
+/*++
+Routine Description:
+	Removes the oldest entry out of all log rings and copies it to `Entry`, so entries from different VCPUs are
+	consumed in the order they were logged
+--*/
+{
+	if (sLogRings == NULL)
+		return STATUS_NO_MORE_ENTRIES;
+
+	SpinLock(&sLogConsumerLock);
+
+	PIMP_LOG_RING Oldest = NULL;
+	UINT64 OldestTimestamp = MAXUINT64;
+
+	// The guest ring sits one past the VCPU rings
+	for (SIZE_T i = 0; i <= sLogRingCount; i++)
+	{
+		PIMP_LOG_RING Ring = i < sLogRingCount ? &sLogRings[i] : sGuestLogRing;
+
+		const UINT64 Tail = Ring->Tail;
+		if (Tail == Ring->Head)
+			continue;
+
+		_ReadBarrier();
+
+		const UINT64 Timestamp = Ring->Entries[Tail & (IMP_LOG_RING_SIZE - 1)].Timestamp;
+		if (Timestamp < OldestTimestamp)
+		{
+			Oldest = Ring;
+			OldestTimestamp = Timestamp;
+		}
+	}
+
+	if (Oldest == NULL)
+	{
+		SpinUnlock(&sLogConsumerLock);
+		return STATUS_NO_MORE_ENTRIES;
+	}
+
+	*Entry = Oldest->Entries[Oldest->Tail & (IMP_LOG_RING_SIZE - 1)];
+
+	// Only hand the slot back to the producer once the entry has been copied out
+	_ReadWriteBarrier();
+
+	Oldest->Tail++;
+
+	SpinUnlock(&sLogConsumerLock);
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+UINT64
+ImpGetLogOverflowCount(VOID)
+/*++
+Routine Description:
+	Returns the total amount of entries dropped because their ring was full
+--*/
+{
+	if (sLogRings == NULL)
+		return 0;
+
+	UINT64 Overflows = sGuestLogRing->Overflows;
+
+	for (SIZE_T i = 0; i < sLogRingCount; i++)
+		Overflows += sLogRings[i].Overflows;
+
+	return Overflows;
+}
+
+VMM_API
+UINT64
+ImpGetPendingLogCount(VOID)
+/*++
+Routine Description:
+	Returns the total amount of entries waiting to be consumed across all rings, which may be slightly stale
+--*/
+{
+	if (sLogRings == NULL)
+		return 0;
+
+	UINT64 Pending = sGuestLogRing->Head - sGuestLogRing->Tail;
+
+	for (SIZE_T i = 0; i < sLogRingCount; i++)
+		Pending += sLogRings[i].Head - sLogRings[i].Tail;
+
+	return Pending;
+}
+
+VMM_API
+PCSTR
+ImpGetLogFormat(
+	_In_ UINT32 FormatId
+)
+/*++
+Routine Description:
+	Returns the address of the format string referenced by `FormatId`, or NULL if it isn't inside the image
+--*/
+{
+	if (FormatId >= sImageSize)
+		return NULL;
+
+	return RVA_PTR(&__ImageBase, FormatId);
+}
+
@@ -1,21 +1,102 @@
 #include <improvisor.h>
 #include <vcpu/vmcall.h>
+#include <ntimage.h>
+#include <mm/mm.h>
+#include <macro.h>
 #include <vmm.h>
 
 BOOLEAN gIsHypervisorRunning;
 
+PETHREAD gPtRefillThread;
+
+// Blocks of page tables the VMM accepted, only freed once it has shut down. Every block is at least a page and the
+// VMM never takes more than MM_MAX_HOST_PAGE_TABLES pages, so this can't overflow
+PVOID gDonatedPageTables[MM_MAX_HOST_PAGE_TABLES];
+SIZE_T gDonatedPageTableCount;
+
+BOOLEAN gIsProcessNotifyRegistered;
+
+EXTERN_C IMAGE_DOS_HEADER __ImageBase;
+
+VOID
+LogSanitiseFormat(
+    _In_ PCSTR Format,
+    _Out_writes_z_(Size) PCHAR Buffer,
+    _In_ SIZE_T Size
+)
+/*++
+Routine Description:
+    Copies `Format` into `Buffer` with every string conversion replaced by `%p`. Entries only hold the pointers
+    strings were logged with, which may well have been freed by the time the entry is printed
+--*/
+{
+    SIZE_T Written = 0;
+
+    while (*Format != '\0' && Written < Size - 1)
+    {
+        Buffer[Written++] = *Format;
+        if (*Format++ != '%')
+            continue;
+
+        // Flags, width and precision are kept as they are, so any `*` still consumes its argument
+        while (*Format != '\0' && strchr("-+ #0123456789.*", *Format) != NULL && Written < Size - 1)
+            Buffer[Written++] = *Format++;
+
+        const SIZE_T LengthStart = Written;
+
+        if (strncmp(Format, "I64", 3) == 0 || strncmp(Format, "I32", 3) == 0)
+        {
+            for (SIZE_T i = 0; i < 3 && Written < Size - 1; i++)
+                Buffer[Written++] = *Format++;
+        }
+
+        while (*Format != '\0' && strchr("hlLwIjzt", *Format) != NULL && Written < Size - 1)
+            Buffer[Written++] = *Format++;
+
+        if (*Format == '\0' || Written >= Size - 1)
+            break;
+
+        // Drop the length modifier of string conversions, which don't apply to pointers
+        if (*Format == 's' || *Format == 'S' || *Format == 'Z')
+        {
+            Written = LengthStart;
+            Buffer[Written++] = 'p';
+            Format++;
+        }
+        else
+            Buffer[Written++] = *Format++;
+    }
+
+    Buffer[Written] = '\0';
+}
+
+VOID
+LogPrintEntry(
+    _In_ PIMP_LOG_ENTRY Entry
+)
+{
+    // Text entries have no format, their text is split over consecutive entries
+    if (Entry->FormatId == IMP_LOG_FORMAT_TEXT)
+    {
+        DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "%.*s", (ULONG)sizeof(Entry->Text), Entry->Text);
+        return;
+    }
+
+    CHAR Format[IMP_LOG_MAX_FORMAT_SIZE];
+    LogSanitiseFormat(RVA_PTR(&__ImageBase, Entry->FormatId), Format, sizeof(Format));
+
+    // The arguments are laid out like a `va_list`, and the format ID is just the offset into our image
+    vDbgPrintExWithPrefix("LOG: ", DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, Format, (va_list)Entry->Args);
+}
+
 VOID
 LogThreadEntry(PVOID A)
 {
-    // Align this to PAGE_SIZE to avoid it crossing page boundaries on the stack 
-    // NOTE: The stack can become paged out, how should I do this instead?
-    // Allocate some storage? I'd rather not greatly reduce the amount of time taken
-    // for each hypercall to be sent, should I allocate a piece of storage per-hypercall?
-    // that is mighty smart sire (it isn't)
-    PCHAR Log = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, 'DBG');
-    //DECLSPEC_ALIGN(PAGE_SIZE) CHAR Log[512] = { 0 };
+    // Entries are written into a non-paged buffer so the VMM can always write to it
+    PHYPERCALL_LOG_RECORDS Records = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, 'DBG');
+    const SIZE_T MaxEntries = (PAGE_SIZE - FIELD_OFFSET(HYPERCALL_LOG_RECORDS, Entries)) / sizeof(IMP_LOG_ENTRY);
 
-    // `Log` might need to be touched to ensure pages are allocated, IDK..... See MiSetNonPagedPoolNoSteal
+    UINT64 Overflows = 0;
 
     while (!gIsHypervisorRunning)
         _mm_pause();
@@ -26,8 +107,8 @@ LogThreadEntry(PVOID A)
 
     while (gIsHypervisorRunning)
     {
-        // Get one log from the hypervisor and print it
-        HYPERCALL_RESULT HResult = VmGetLogRecords(Log, 1);
+        // Get a batch of logs from the hypervisor and print them
+        HYPERCALL_RESULT HResult = VmGetLogRecords(Records, MaxEntries);
         if (HResult != HRESULT_SUCCESS)
         {
             // ImpDebugPrint("VmGetLogRecords failed: %X\n", HResult);
@@ -35,7 +116,14 @@ LogThreadEntry(PVOID A)
             goto delay;
         }
 
-        ImpDebugPrint("LOG: %s", Log);
+        if (Records->Overflows != Overflows)
+        {
+            ImpDebugPrint("LOG: %llu entries dropped...\n", Records->Overflows - Overflows);
+            Overflows = Records->Overflows;
+        }
+
+        for (SIZE_T i = 0; i < Records->Count; i++)
+            LogPrintEntry(&Records->Entries[i]);
 
 #if 0
         PVOID Process = NULL;
@@ -55,16 +143,107 @@ delay:
         KeDelayExecutionThread(KernelMode, FALSE, &Time);
     }
 
+    ExFreePoolWithTag(Records, 'DBG');
+
     ImpDebugPrint("Exiting logger thread..\n");
 }
 
+VOID
+PtRefillThreadEntry(PVOID A)
+{
+    UNREFERENCED_PARAMETER(A);
+
+    PHYSICAL_ADDRESS HighestAddress = {
+        .QuadPart = MAXULONG64
+    };
+
+    LARGE_INTEGER Time = {
+        .QuadPart = -100000
+    };
+
+    while (gIsHypervisorRunning)
+    {
+        // The request is read from memory shared with the VMM, so polling it doesn't cause any VM-exits
+        SIZE_T Count = min(MmGetHostPageTableRefillRequest(), MM_HOST_PT_HIGH_WATERMARK);
+
+        // Donate smaller blocks if physical memory is too fragmented for the whole request
+        while (Count != 0)
+        {
+            PVOID Tables = MmAllocateContiguousMemory(Count * PAGE_SIZE, HighestAddress);
+            if (Tables == NULL)
+            {
+                Count /= 2;
+                continue;
+            }
+
+            // Donated pages belong to the VMM until it shuts down, so they are only freed now if it refused them
+            HYPERCALL_RESULT HResult = VmDonatePageTables(Tables, Count);
+            if (HResult == HRESULT_SUCCESS)
+            {
+                gDonatedPageTables[gDonatedPageTableCount++] = Tables;
+                break;
+            }
+
+            ImpDebugPrint("VmDonatePageTables failed: %X\n", HResult);
+            MmFreeContiguousMemory(Tables);
+
+            // Anything else may go away by itself, like a page the VMM still has a reference to, so it's retried
+            if (HResult == HRESULT_NO_DIRECT_MAP)
+                goto exit;
+
+            break;
+        }
+
+        KeDelayExecutionThread(KernelMode, FALSE, &Time);
+    }
+
+exit:
+    ImpDebugPrint("Exiting page table refill thread..\n");
+}
+
+VOID
+ProcessNotifyRoutine(
+    _In_ HANDLE ParentId,
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Create
+)
+{
+    UNREFERENCED_PARAMETER(ParentId);
+
+    // This runs before the exiting process's address space is torn down, so the VMM stops writing into pages it
+    // registered before they can be freed and reused
+    if (!Create)
+        VmReleaseProcess((ULONG_PTR)ProcessId);
+}
+
 VOID
 DriverUnload(
     IN PDRIVER_OBJECT DriverObject
 )
 {
     if (gIsHypervisorRunning)
-        VmmShutdownHypervisor();
+    {
+        // Stop the refill thread first, so nothing is donated to a VMM that is going away
+        gIsHypervisorRunning = FALSE;
+
+        if (gPtRefillThread != NULL)
+        {
+            KeWaitForSingleObject(gPtRefillThread, Executive, KernelMode, FALSE, NULL);
+            ObDereferenceObject(gPtRefillThread);
+        }
+
+        if (gIsProcessNotifyRegistered)
+            PsSetCreateProcessNotifyRoutine(ProcessNotifyRoutine, TRUE);
+
+        // Only once no VCPU can be using them anymore
+        if (NT_SUCCESS(VmmShutdownHypervisor()))
+        {
+            for (SIZE_T i = 0; i < gDonatedPageTableCount; i++)
+                MmFreeContiguousMemory(gDonatedPageTables[i]);
+
+            gDonatedPageTableCount = 0;
+        }
+    }
 
     ImpDebugPrint("Done shutting down the hypervisor, Bye\n");
 
@@ -125,6 +304,43 @@ DriverEntry(
 
     gIsHypervisorRunning = TRUE;
 
+    // Releases the rings and log streams of clients that exit without unregistering them
+    Status = PsSetCreateProcessNotifyRoutine(ProcessNotifyRoutine, FALSE);
+    if (NT_SUCCESS(Status))
+    {
+        gIsProcessNotifyRegistered = TRUE;
+    }
+    else
+    {
+        // The VMM still stops writing to a client's pages once it finds them unmapped
+        ImpDebugPrint("Failed to register process notify routine... (%X)\n", Status);
+        Status = STATUS_SUCCESS;
+    }
+
+    // Tops the host page table pool back up whenever the VMM runs low on them
+    HANDLE PtRefillThread = NULL;
+    Status = PsCreateSystemThread(
+        &PtRefillThread,
+        THREAD_ALL_ACCESS,
+        &ObjectAttributes,
+        NULL,
+        NULL,
+        (PKSTART_ROUTINE)PtRefillThreadEntry,
+        NULL
+    );
+
+    if (NT_SUCCESS(Status))
+    {
+        ObReferenceObjectByHandle(PtRefillThread, SYNCHRONIZE, *PsThreadType, KernelMode, (PVOID*)&gPtRefillThread, NULL);
+        ZwClose(PtRefillThread);
+    }
+    else
+    {
+        // The VMM can still run on the page tables it reserved up front
+        ImpDebugPrint("Failed to start page table refill thread... (%X)\n", Status);
+        Status = STATUS_SUCCESS;
+    }
+
     // Hook PsSetLoadImageNotifyRoutine
     // Check for Gdrv.sys [LDR_PARAMS::DriverName]
     // Cleanup Gdrv.sys
@@ -0,0 +1,314 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <arch/cpuid.h>
+#include <arch/mtrr.h>
+#include <arch/msr.h>
+#include <mm/dmap.h>
+#include <mm/mm.h>
+#include <macro.h>
+
+typedef struct _MM_DIRECT_MAP_RANGE
+{
+	UINT64 Base;
+	UINT64 End;
+} MM_DIRECT_MAP_RANGE, *PMM_DIRECT_MAP_RANGE;
+
+// Sorted list of physical RAM ranges that are mapped at MM_DIRECT_MAP_BASE, anything outside of these 
+// (MMIO, holes) must be mapped using a VPTE instead
+VMM_DATA static PMM_DIRECT_MAP_RANGE sDirectMapRanges = NULL;
+VMM_DATA static SIZE_T sDirectMapRangeCount = 0;
+
+VSC_API
+PMM_PTE
+MmDirectMapGetTable(
+	_Inout_ PMM_PTE Entry
+)
+/*++
+Routine Description:
+	Returns the table `Entry` points to, allocating and linking a new host page table if it isn't present yet
+--*/
+{
+	if (Entry->Present)
+		return MmGetHostPageTableVirtAddr(PAGE_ADDRESS(Entry->PageFrameNumber));
+
+	PMM_PTE Table = NULL;
+	UINT64 TablePhysAddr = 0;
+	if (!NT_SUCCESS(MmAllocateHostPageTable(&Table, &TablePhysAddr)))
+		return NULL;
+
+	Entry->Present = TRUE;
+	Entry->WriteAllowed = TRUE;
+	Entry->Accessed = TRUE;
+	Entry->Dirty = TRUE;
+	Entry->PageFrameNumber = PAGE_FRAME_NUMBER(TablePhysAddr);
+
+	return Table;
+}
+
+VSC_API
+NTSTATUS
+MmDirectMapRange(
+	_Inout_ PMM_PTE Pml4,
+	_In_ UINT64 PhysAddr,
+	_In_ UINT64 Size
+)
+/*++
+Routine Description:
+	Maps the physical range [`PhysAddr`, `PhysAddr` + `Size`) into the direct map window, using the largest page 
+	size possible. Large pages are only used when the memory type doesn't change inside of them
+--*/
+{
+	const BOOLEAN SuperPageSupport = ArchCheckFeatureFlag(X86_FEATURE_PDPE1GB);
+
+	SIZE_T SizeMapped = 0;
+	while (Size > SizeMapped)
+	{
+		const UINT64 CurrPhysAddr = PhysAddr + SizeMapped;
+		const UINT64 Remaining = Size - SizeMapped;
+
+		X86_LA48 LinearAddr = {
+			.Value = RVA(MM_DIRECT_MAP_BASE, CurrPhysAddr)
+		};
+
+		PMM_PTE Pdpt = MmDirectMapGetTable(&Pml4[LinearAddr.Pml4Index]);
+		if (Pdpt == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		PMM_PTE Pdpte = &Pdpt[LinearAddr.PdptIndex];
+
+		if (SuperPageSupport && !Pdpte->Present && (CurrPhysAddr & (GB(1) - 1)) == 0 &&
+			Remaining >= GB(1) && MtrrGetUniformExtent(CurrPhysAddr) >= GB(1))
+		{
+			Pdpte->Present = TRUE;
+			Pdpte->WriteAllowed = TRUE;
+			Pdpte->Accessed = TRUE;
+			Pdpte->Dirty = TRUE;
+			Pdpte->LargePage = TRUE;
+			Pdpte->ExecuteDisable = TRUE;
+			Pdpte->PageFrameNumber = PAGE_FRAME_NUMBER(CurrPhysAddr);
+
+			SizeMapped += GB(1);
+			continue;
+		}
+
+		PMM_PTE Pd = MmDirectMapGetTable(Pdpte);
+		if (Pd == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		PMM_PTE Pde = &Pd[LinearAddr.PdIndex];
+
+		if (!Pde->Present && (CurrPhysAddr & (MB(2) - 1)) == 0 &&
+			Remaining >= MB(2) && MtrrGetUniformExtent(CurrPhysAddr) >= MB(2))
+		{
+			Pde->Present = TRUE;
+			Pde->WriteAllowed = TRUE;
+			Pde->Accessed = TRUE;
+			Pde->Dirty = TRUE;
+			Pde->LargePage = TRUE;
+			Pde->ExecuteDisable = TRUE;
+			Pde->PageFrameNumber = PAGE_FRAME_NUMBER(CurrPhysAddr);
+
+			SizeMapped += MB(2);
+			continue;
+		}
+
+		PMM_PTE Pt = MmDirectMapGetTable(Pde);
+		if (Pt == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		PMM_PTE Pte = &Pt[LinearAddr.PtIndex];
+
+		Pte->Present = TRUE;
+		Pte->WriteAllowed = TRUE;
+		Pte->Accessed = TRUE;
+		Pte->Dirty = TRUE;
+		Pte->ExecuteDisable = TRUE;
+		Pte->PageFrameNumber = PAGE_FRAME_NUMBER(CurrPhysAddr);
+
+		SizeMapped += PAGE_SIZE;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VSC_API
+SIZE_T
+MmGetDirectMapTableReserve(VOID)
+/*++
+Routine Description:
+	Returns the amount of host page tables the direct map can need at most, which is when 1GB pages aren't
+	available: a PDPT, a PD for each GB up to the highest physical address, and a PT for each edge of a RAM range
+	or MTRR that isn't 2MB aligned. Returns 0 if the physical memory ranges can't be queried
+--*/
+{
+	PPHYSICAL_MEMORY_RANGE PhysMemRanges = MmGetPhysicalMemoryRanges();
+	if (PhysMemRanges == NULL)
+		return 0;
+
+	UINT64 HighestAddr = 0;
+	SIZE_T RangeCount = 0;
+	for (; PhysMemRanges[RangeCount].BaseAddress.QuadPart != 0 || PhysMemRanges[RangeCount].NumberOfBytes.QuadPart != 0; RangeCount++)
+		HighestAddr = max(HighestAddr, (UINT64)(PhysMemRanges[RangeCount].BaseAddress.QuadPart + PhysMemRanges[RangeCount].NumberOfBytes.QuadPart));
+
+	ExFreePool(PhysMemRanges);
+
+	IA32_MTRR_CAPABILITIES_MSR MtrrCap = {
+		.Value = __readmsr(IA32_MTRR_CAPABILITIES)
+	};
+
+	// The fixed range MTRRs all lie in the first 2MB, so they split at most one large page
+	const UINT64 PdCount = (min(HighestAddr, MM_DIRECT_MAP_SIZE) + GB(1) - 1) / GB(1);
+	const UINT64 PtCount = 2 * (RangeCount + MtrrCap.VariableRangeRegCount) + 1;
+
+	return 1 + PdCount + PtCount;
+}
+
+VSC_API
+VOID
+MmDestroyDirectMap(
+	_Inout_ PMM_PTE Pml4
+)
+/*++
+Routine Description:
+	Returns every table of a partially or fully built direct map to the host reserve and unlinks it from `Pml4`,
+	the direct map must not have been used yet
+--*/
+{
+	X86_LA48 BaseAddr = {
+		.Value = (UINT64)MM_DIRECT_MAP_BASE
+	};
+
+	PMM_PTE Pml4e = &Pml4[BaseAddr.Pml4Index];
+	if (!Pml4e->Present)
+		return;
+
+	PMM_PTE Pdpt = MmGetHostPageTableVirtAddr(PAGE_ADDRESS(Pml4e->PageFrameNumber));
+
+	for (SIZE_T i = 0; Pdpt != NULL && i < 512; i++)
+	{
+		if (!Pdpt[i].Present || Pdpt[i].LargePage)
+			continue;
+
+		PMM_PTE Pd = MmGetHostPageTableVirtAddr(PAGE_ADDRESS(Pdpt[i].PageFrameNumber));
+
+		for (SIZE_T j = 0; Pd != NULL && j < 512; j++)
+		{
+			if (Pd[j].Present && !Pd[j].LargePage)
+				MmFreeHostPageTable(PAGE_ADDRESS(Pd[j].PageFrameNumber));
+		}
+
+		MmFreeHostPageTable(PAGE_ADDRESS(Pdpt[i].PageFrameNumber));
+	}
+
+	MmFreeHostPageTable(PAGE_ADDRESS(Pml4e->PageFrameNumber));
+
+	Pml4e->Value = 0;
+}
+
+VSC_API
+NTSTATUS
+MmCreateDirectMap(
+	_Inout_ PMM_PTE Pml4
+)
+/*++
+Routine Description:
+	Maps all physical RAM reported by Windows into the host address space at MM_DIRECT_MAP_BASE, so that guest
+	physical memory can be accessed without remapping a VPTE. Must be called after all other host translations 
+	have been created, as it refuses to share the PML4 entry with anything else. Nothing is left mapped or 
+	allocated on failure
+--*/
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+
+	X86_LA48 BaseAddr = {
+		.Value = (UINT64)MM_DIRECT_MAP_BASE
+	};
+
+	if (Pml4[BaseAddr.Pml4Index].Present)
+	{
+		ImpDebugPrint("Direct map window '%llX' is already in use...\n", MM_DIRECT_MAP_BASE);
+		return STATUS_CONFLICTING_ADDRESSES;
+	}
+
+	PPHYSICAL_MEMORY_RANGE PhysMemRanges = MmGetPhysicalMemoryRanges();
+	if (PhysMemRanges == NULL)
+		return STATUS_NOT_SUPPORTED;
+
+	SIZE_T RangeCount = 0;
+	while (PhysMemRanges[RangeCount].BaseAddress.QuadPart != 0 || PhysMemRanges[RangeCount].NumberOfBytes.QuadPart != 0)
+		RangeCount++;
+
+	PMM_DIRECT_MAP_RANGE Ranges = ImpAllocateHostNpPool(sizeof(MM_DIRECT_MAP_RANGE) * (RangeCount + 1));
+	if (Ranges == NULL)
+	{
+		Status = STATUS_INSUFFICIENT_RESOURCES;
+		goto cleanup;
+	}
+
+	SIZE_T MappedRangeCount = 0;
+	for (SIZE_T i = 0; i < RangeCount; i++)
+	{
+		const UINT64 Base = PhysMemRanges[i].BaseAddress.QuadPart;
+		const UINT64 End = min(Base + PhysMemRanges[i].NumberOfBytes.QuadPart, MM_DIRECT_MAP_SIZE);
+
+		// Anything past the end of the window is left to the VPTE path
+		if (Base >= End)
+			continue;
+
+		Status = MmDirectMapRange(Pml4, Base, End - Base);
+		if (!NT_SUCCESS(Status))
+		{
+			ImpDebugPrint("Failed to direct map '%llX' with size '%llX'... (%X)\n", Base, End - Base, Status);
+
+			MmDestroyDirectMap(Pml4);
+			ImpFreeAllocation(Ranges);
+
+			goto cleanup;
+		}
+
+		// Keep the ranges sorted so lookups can stop early
+		SIZE_T j = MappedRangeCount;
+		for (; j > 0 && Ranges[j - 1].Base > Base; j--)
+			Ranges[j] = Ranges[j - 1];
+
+		Ranges[j].Base = Base;
+		Ranges[j].End = End;
+
+		MappedRangeCount++;
+	}
+
+	// Only publish the ranges once everything has been mapped, lookups fall back to VPTEs until then
+	sDirectMapRanges = Ranges;
+	sDirectMapRangeCount = MappedRangeCount;
+
+cleanup:
+	ExFreePool(PhysMemRanges);
+
+	return Status;
+}
+
+VMM_API
+PVOID
+MmGetDirectMapAddress(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Returns the host virtual address of `PhysAddr` inside the direct map, or NULL if any part of 
+	[`PhysAddr`, `PhysAddr` + `Size`) isn't RAM covered by it
+--*/
+{
+	for (SIZE_T i = 0; i < sDirectMapRangeCount; i++)
+	{
+		PMM_DIRECT_MAP_RANGE Range = &sDirectMapRanges[i];
+
+		if (PhysAddr < Range->Base)
+			break;
+
+		if (PhysAddr < Range->End)
+			return Size <= Range->End - PhysAddr ? RVA_PTR(MM_DIRECT_MAP_BASE, PhysAddr) : NULL;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef IMP_MM_DMAP_H
+#define IMP_MM_DMAP_H
+
+#include <ntdef.h>
+
+#include <mm/mm.h>
+
+// Host virtual address window which all of physical RAM is mapped into, covers a single PML4 entry (512GB)
+#define MM_DIRECT_MAP_BASE ((PVOID)0xfffffa8000000000)
+#define MM_DIRECT_MAP_SIZE (512ULL * 1024 * 1024 * 1024)
+
+SIZE_T
+MmGetDirectMapTableReserve(VOID);
+
+NTSTATUS
+MmCreateDirectMap(
+	_Inout_ PMM_PTE Pml4
+);
+
+PVOID
+MmGetDirectMapAddress(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+);
+
+#endif
@@ -6,16 +6,36 @@
 #include <macro.h>
 #include <mm/mm.h>
 #include <mm/vpte.h>
+#include <mm/dmap.h>
 #include <os/pe.h>
 
 // TODO: For host page tables, include MM_RESERVED_PT header in the raw PT list allocation
+// Free host page tables, linked through `Links.Flink`
 VMM_DATA PMM_RESERVED_PT gHostPageTablesHead = NULL;
-VMM_DATA PMM_RESERVED_PT gHostPageTablesTail = NULL;
 
-// The raw array of page tables, each comprising of 512 possible entries
+// The raw array of page tables reserved at startup, each comprising of 512 possible entries
 VMM_DATA static PVOID sPageTableListRaw = NULL;
-// The raw list of page table entries for the linked list
+// Descriptors of every reserved and donated page table, sized for MM_MAX_HOST_PAGE_TABLES up front
 VMM_DATA static PMM_RESERVED_PT sPageTableListEntries = NULL;
+// Amount of descriptors in `sPageTableListEntries` in use
+VMM_DATA static SIZE_T sPageTableCount = 0;
+// Open-addressed hash table mapping a table's PFN to its index in `sPageTableListEntries` (plus one, zero is empty)
+VMM_DATA static PUINT32 sPageTableIndex = NULL;
+// Mask for the bucket count of `sPageTableIndex`, always a power of two minus one
+VMM_DATA static SIZE_T sPageTableIndexMask = 0;
+// Guards the free list, the descriptors and the statistics, as every VCPU can allocate page tables
+VMM_DATA static SPINLOCK sPageTableLock;
+VMM_DATA static MM_HOST_PT_STATS sPageTableStats;
+// Amount of page tables the guest-side worker is asked to donate, zero if none are needed. It is polled by the
+// worker without exiting, so it lives in memory shared with the guest and is never trusted by the VMM
+VMM_DATA static volatile LONG* sPageTableRefillRequest = NULL;
+// The same pointer for the worker, VMM data is hidden from the guest once host resources are
+volatile LONG* gPageTableRefillRequest = NULL;
+// Whether donated page tables can be reached through the direct map, no refills are requested otherwise
+VMM_DATA static BOOLEAN sPageTableDonation = FALSE;
+
+// Fibonacci hashing constant (2^64 / golden ratio), spreads sequential PFNs across the buckets
+#define MM_PT_INDEX_HASH(Pfn) ((SIZE_T)(((Pfn) * 0x9E3779B97F4A7C15ULL) >> 32))
 
 // TODO: Move away from use of NTSTATUS for non-setup / windows related functions
 
@@ -53,25 +73,73 @@ Routine Description:
 	return &Table[Index];
 }
 
-VSC_API
-PMM_PTE
-MmGetHostPageTableVirtAddr(
+VMM_API
+VOID
+MmIndexHostPageTable(
+	_In_ SIZE_T EntryIndex
+)
+/*++
+Routine Description:
+	Inserts the reserved page table at `EntryIndex` into the PFN lookup table. The caller must hold the page table
+	lock once VCPUs are running, lookups don't take it
+--*/
+{
+	const UINT64 Pfn = PAGE_FRAME_NUMBER(sPageTableListEntries[EntryIndex].TablePhysAddr);
+
+	// The table is sized to at least twice the number of reserved tables, so a free bucket always exists
+	SIZE_T Bucket = MM_PT_INDEX_HASH(Pfn) & sPageTableIndexMask;
+	while (sPageTableIndex[Bucket] != 0)
+		Bucket = (Bucket + 1) & sPageTableIndexMask;
+
+	// Published with a locked write, so a lookup on another VCPU never finds the bucket before the descriptor
+	InterlockedExchange((volatile LONG*)&sPageTableIndex[Bucket], (LONG)EntryIndex + 1);
+}
+
+VMM_API
+PMM_RESERVED_PT
+MmGetHostPageTable(
 	_In_ UINT64 PhysAddr
 )
+/*++
+Routine Description:
+	Looks up the reserved host page table whose physical address is `PhysAddr` using the PFN lookup table.
+	Returns NULL if the address does not belong to a reserved page table
+--*/
 {
-	PMM_RESERVED_PT CurrTable = gHostPageTablesHead;
-	while (CurrTable != NULL)
+	const UINT64 Pfn = PAGE_FRAME_NUMBER(PhysAddr);
+
+	SIZE_T Bucket = MM_PT_INDEX_HASH(Pfn) & sPageTableIndexMask;
+	for (;;)
 	{
-		if (CurrTable->TablePhysAddr == PhysAddr)
-			return CurrTable->TableAddr;
+		// Buckets may be filled in by a donation on another VCPU, so each is read exactly once
+		const UINT32 Entry = ((volatile UINT32*)sPageTableIndex)[Bucket];
+		if (Entry == 0)
+			return NULL;
+
+		PMM_RESERVED_PT Table = &sPageTableListEntries[Entry - 1];
+		if (PAGE_FRAME_NUMBER(Table->TablePhysAddr) == Pfn)
+			return Table;
 
-		CurrTable = (PMM_RESERVED_PT)CurrTable->Links.Blink;
+		Bucket = (Bucket + 1) & sPageTableIndexMask;
 	}
+}
+
+VMM_API
+PMM_PTE
+MmGetHostPageTableVirtAddr(
+	_In_ UINT64 PhysAddr
+)
+/*++
+Routine Description:
+	Returns the host virtual address of the reserved page table at `PhysAddr`, or NULL if there is none
+--*/
+{
+	PMM_RESERVED_PT Table = MmGetHostPageTable(PhysAddr);
 
-	return NULL;
+	return Table != NULL ? Table->TableAddr : NULL;
 }
 
-VSC_API
+VMM_API
 PMM_PTE
 MmReadHostPageTableEntry(
 	_In_ UINT64 TablePfn,
@@ -174,6 +242,9 @@ Routine Description:
 {
 	NTSTATUS Status = STATUS_SUCCESS; 
 
+	if (Count > MM_MAX_HOST_PAGE_TABLES)
+		return STATUS_INVALID_PARAMETER;
+
 	sPageTableListRaw = ImpAllocateHostNpPool(PAGE_SIZE * Count);
 	if (sPageTableListRaw == NULL)
 	{
@@ -181,27 +252,64 @@ Routine Description:
 		goto panic;
 	}
 
-	sPageTableListEntries = ImpAllocateHostNpPool(sizeof(MM_RESERVED_PT) * Count);
+	// Descriptors and buckets for tables donated later are allocated now, as neither can be grown in VMX-root
+	sPageTableListEntries = ImpAllocateHostNpPool(sizeof(MM_RESERVED_PT) * MM_MAX_HOST_PAGE_TABLES);
 	if (sPageTableListEntries == NULL)
 	{
 		Status = STATUS_INSUFFICIENT_RESOURCES;
 		goto panic;
 	}
 
-	// Setup the head as the first entry in this array
-	gHostPageTablesTail = gHostPageTablesHead = sPageTableListEntries;
+	// Keep the load factor of the PFN lookup table at or below 50% so probe sequences stay short
+	SIZE_T BucketCount = 1;
+	while (BucketCount < MM_MAX_HOST_PAGE_TABLES * 2)
+		BucketCount <<= 1;
 
-	for (SIZE_T i = 0; i < Count; i++)
+	sPageTableIndex = ImpAllocateHostNpPool(sizeof(UINT32) * BucketCount);
+	if (sPageTableIndex == NULL)
+	{
+		Status = STATUS_INSUFFICIENT_RESOURCES;
+		goto panic;
+	}
+
+	sPageTableIndexMask = BucketCount - 1;
+
+	sPageTableRefillRequest = ImpAllocateNpPoolEx(sizeof(LONG), IMP_SHARED_ALLOCATION);
+	if (sPageTableRefillRequest == NULL)
+	{
+		Status = STATUS_INSUFFICIENT_RESOURCES;
+		goto panic;
+	}
+
+	gPageTableRefillRequest = sPageTableRefillRequest;
+
+	// Link the tables in reverse so they are handed out in ascending order
+	gHostPageTablesHead = NULL;
+
+	for (SIZE_T i = Count; i-- > 0;)
 	{
 		PMM_RESERVED_PT CurrTable = sPageTableListEntries + i;
 
 		CurrTable->TableAddr = (PCHAR)sPageTableListRaw + (i * PAGE_SIZE);
 		CurrTable->TablePhysAddr = ImpGetPhysicalAddress(CurrTable->TableAddr);
+		CurrTable->Allocated = FALSE;
+
+		CurrTable->Links.Flink = gHostPageTablesHead != NULL ? &gHostPageTablesHead->Links : NULL;
+		CurrTable->Links.Blink = NULL;
+
+		gHostPageTablesHead = CurrTable;
 
-		CurrTable->Links.Flink = i < Count - 1	? &(CurrTable + 1)->Links : NULL;
-		CurrTable->Links.Blink = i > 0			? &(CurrTable - 1)->Links : NULL;
+		MmIndexHostPageTable(i);
 	}
 
+	sPageTableCount = Count;
+
+	sPageTableStats.Total = Count;
+	sPageTableStats.Free = Count;
+	sPageTableStats.LowestFree = Count;
+
+	SpinTrackLock(&sPageTableLock, "HostPT");
+
 panic:
 	if (!NT_SUCCESS(Status))
 	{
@@ -209,6 +317,16 @@ panic:
 			ExFreePoolWithTag(sPageTableListRaw, POOL_TAG);
 		if (sPageTableListEntries)
 			ExFreePoolWithTag(sPageTableListEntries, POOL_TAG);
+		if (sPageTableIndex)
+			ExFreePoolWithTag(sPageTableIndex, POOL_TAG);
+		if (sPageTableRefillRequest)
+			ExFreePoolWithTag((PVOID)sPageTableRefillRequest, POOL_TAG);
+
+		sPageTableListRaw = NULL;
+		sPageTableListEntries = NULL;
+		sPageTableIndex = NULL;
+		sPageTableRefillRequest = NULL;
+		gPageTableRefillRequest = NULL;
 	}
 		
 	return Status;
@@ -217,34 +335,206 @@ panic:
 VMM_API
 NTSTATUS
 MmAllocateHostPageTable(
-	_Out_ PVOID* pTable
+	_Out_ PVOID* pTable,
+	_Out_ PUINT64 pTablePhysAddr
 )
 /*++
 Routine Description:
-	Allocates a host page table from the linked list and returns it
+	Allocates a host page table from the free list and returns both its host virtual and physical address. Once
+	fewer than MM_HOST_PT_LOW_WATERMARK tables are left, the guest-side worker is asked to donate enough to reach
+	MM_HOST_PT_HIGH_WATERMARK
 --*/
 {
-	if (gHostPageTablesHead->Links.Flink == NULL)
-		return STATUS_INSUFFICIENT_RESOURCES;
+	SpinLock(&sPageTableLock);
 
 	PMM_RESERVED_PT ReservedPt = gHostPageTablesHead;
+	if (ReservedPt == NULL)
+	{
+		sPageTableStats.Failures++;
+		SpinUnlock(&sPageTableLock);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	gHostPageTablesHead = (PMM_RESERVED_PT)ReservedPt->Links.Flink;
+	ReservedPt->Allocated = TRUE;
+
+	sPageTableStats.Allocations++;
+	sPageTableStats.Free--;
+	sPageTableStats.LowestFree = min(sPageTableStats.LowestFree, sPageTableStats.Free);
+
+	// Only one request is outstanding at a time, the worker clears it once it has donated
+	if (sPageTableDonation && sPageTableStats.Free < MM_HOST_PT_LOW_WATERMARK && *sPageTableRefillRequest == 0)
+	{
+		const SIZE_T Wanted = min(MM_HOST_PT_HIGH_WATERMARK - sPageTableStats.Free, MM_MAX_HOST_PAGE_TABLES - sPageTableCount);
+		if (Wanted != 0)
+		{
+			InterlockedExchange(sPageTableRefillRequest, (LONG)Wanted);
+			sPageTableStats.RefillRequests++;
+		}
+	}
+
+	SpinUnlock(&sPageTableLock);
 
 	*pTable = ReservedPt->TableAddr;
+	*pTablePhysAddr = ReservedPt->TablePhysAddr;
 
-	gHostPageTablesHead = (PMM_RESERVED_PT)ReservedPt->Links.Flink;
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+MmFreeHostPageTable(
+	_In_ UINT64 TablePhysAddr
+)
+/*++
+Routine Description:
+	Zeroes the host page table at `TablePhysAddr` and returns it to the reserve. The table must no longer be 
+	referenced by any paging structure, including any the processor may still have cached. Freeing a table that
+	isn't allocated fails without touching it
+--*/
+{
+	PMM_RESERVED_PT ReservedPt = MmGetHostPageTable(TablePhysAddr);
+	if (ReservedPt == NULL)
+		return STATUS_INVALID_PARAMETER;
+
+	// Linking it twice would hand the same table out to two owners, and zeroing it could wipe its new owner's
+	if (!InterlockedExchange8(&ReservedPt->Allocated, FALSE))
+	{
+		IMP_LOG_ERROR(IMP_LOG_GENERAL, "Host page table %llX freed twice...\n", TablePhysAddr);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	RtlZeroMemory(ReservedPt->TableAddr, PAGE_SIZE);
+
+	SpinLock(&sPageTableLock);
+
+	ReservedPt->Links.Flink = gHostPageTablesHead != NULL ? &gHostPageTablesHead->Links : NULL;
+	gHostPageTablesHead = ReservedPt;
+
+	sPageTableStats.Frees++;
+	sPageTableStats.Free++;
+
+	SpinUnlock(&sPageTableLock);
 
 	return STATUS_SUCCESS;
 }
 
 VMM_API
-PMM_RESERVED_PT
-MmGetLastAllocatedPageTable(VOID)
+NTSTATUS
+MmCheckDonatedPageTables(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Count
+)
 /*++
 Routine Description:
-	This function returns the last allocated host page table entry
+	Checks that `Count` physically contiguous pages from `PhysAddr` can be donated as host page tables. Each page
+	must be reachable through the direct map, and none may already belong to the VMM, be it as a host page table
+	or as part of any other allocation such as a VMCS, host stack, MSR bitmap or log ring. Returns
+	STATUS_NOT_SUPPORTED if there is no direct map, as nothing can be donated then
 --*/
 {
-	return (PMM_RESERVED_PT)gHostPageTablesHead->Links.Blink;
+	if (!sPageTableDonation)
+		return STATUS_NOT_SUPPORTED;
+
+	if (Count == 0 || PAGE_OFFSET(PhysAddr) != 0)
+		return STATUS_INVALID_PARAMETER;
+
+	if (Count > MM_MAX_HOST_PAGE_TABLES - sPageTableCount)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	if (ImpOverlapsAllocation(PhysAddr, Count * PAGE_SIZE))
+		return STATUS_INVALID_PARAMETER;
+
+	for (SIZE_T i = 0; i < Count; i++)
+	{
+		const UINT64 TablePhysAddr = PhysAddr + i * PAGE_SIZE;
+
+		// Donating a page twice would hand it out to two owners
+		if (MmGetDirectMapAddress(TablePhysAddr, PAGE_SIZE) == NULL || MmGetHostPageTable(TablePhysAddr) != NULL)
+			return STATUS_INVALID_PARAMETER;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+MmDonateHostPageTables(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Count
+)
+/*++
+Routine Description:
+	Adds `Count` physically contiguous pages from `PhysAddr`, allocated by the guest-side worker, to the free
+	list. They are accessed through the direct map as they aren't mapped in the host address space. Any VCPU can
+	allocate one as soon as it is linked, so the caller must have hidden all of them from the guest in every EPT
+	view beforehand. Either every page is added or none are
+--*/
+{
+	SpinLock(&sPageTableLock);
+
+	// Checked again under the lock, as another VCPU may have donated the same pages since the caller checked
+	NTSTATUS Status = MmCheckDonatedPageTables(PhysAddr, Count);
+	if (!NT_SUCCESS(Status))
+	{
+		SpinUnlock(&sPageTableLock);
+		return Status;
+	}
+
+	for (SIZE_T i = 0; i < Count; i++)
+	{
+		PMM_RESERVED_PT CurrTable = sPageTableListEntries + sPageTableCount;
+
+		CurrTable->TablePhysAddr = PhysAddr + i * PAGE_SIZE;
+		CurrTable->TableAddr = MmGetDirectMapAddress(CurrTable->TablePhysAddr, PAGE_SIZE);
+		CurrTable->Allocated = FALSE;
+
+		RtlZeroMemory(CurrTable->TableAddr, PAGE_SIZE);
+
+		CurrTable->Links.Flink = gHostPageTablesHead != NULL ? &gHostPageTablesHead->Links : NULL;
+		CurrTable->Links.Blink = NULL;
+
+		gHostPageTablesHead = CurrTable;
+
+		MmIndexHostPageTable(sPageTableCount++);
+	}
+
+	sPageTableStats.Total += Count;
+	sPageTableStats.Free += Count;
+	sPageTableStats.Donated += Count;
+
+	// Allocations request another refill if this one wasn't enough
+	InterlockedExchange(sPageTableRefillRequest, 0);
+
+	SpinUnlock(&sPageTableLock);
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+VOID
+MmGetHostPageTableStats(
+	_Out_ PMM_HOST_PT_STATS Stats
+)
+/*++
+Routine Description:
+	Takes a snapshot of the host page table pool's usage statistics
+--*/
+{
+	SpinLock(&sPageTableLock);
+	*Stats = sPageTableStats;
+	SpinUnlock(&sPageTableLock);
+}
+
+SIZE_T
+MmGetHostPageTableRefillRequest(VOID)
+/*++
+Routine Description:
+	Returns the amount of page tables the VMM wants donated, or zero if it has enough. This runs in the guest
+	and doesn't exit, so it is cheap enough to poll
+--*/
+{
+	return gPageTableRefillRequest != NULL ? (SIZE_T)*gPageTableRefillRequest : 0;
 }
 
 VSC_API
@@ -327,9 +617,19 @@ MmInitialise(
 {
 	NTSTATUS Status = STATUS_SUCCESS;
 
-	// Reserve 1000 page tables for the host to create its own page tables and still
-	// have access to them post-VMLAUNCH
-	Status = MmHostReservePageTables(500);
+	// Build with IMPV_DISABLE_DIRECT_MAP to always access guest memory through VPTEs
+#ifndef IMPV_DISABLE_DIRECT_MAP
+	const SIZE_T DirectMapReserve = MmGetDirectMapTableReserve();
+#else
+	const SIZE_T DirectMapReserve = 0;
+#endif
+
+	MmSupport->UseDirectMap = DirectMapReserve != 0;
+
+	// Reserve 500 page tables for the host to create its own page tables and still
+	// have access to them post-VMLAUNCH, the guest-side worker donates more through the direct map as they run low.
+	// Without the direct map nothing can be donated, so what a refill would have brought is reserved up front
+	Status = MmHostReservePageTables(500 + (MmSupport->UseDirectMap ? DirectMapReserve : MM_HOST_PT_HIGH_WATERMARK));
 	if (!NT_SUCCESS(Status))
 	{
 		ImpDebugPrint("Failed to reserve page tables for the host...\n");
@@ -347,6 +647,9 @@ MmInitialise(
 		return Status;
 	}
 
+	// The direct map may have failed to build, in which case its tables went back to the reserve instead
+	sPageTableDonation = MmSupport->UseDirectMap;
+
 	// TODO: Pool allocator
 
 	return Status;
@@ -361,11 +664,17 @@ MmReadGuestPhys(
 )
 /*++
 Routine Description:
-	This function reads physical memory by using one of the VPTEs from the guest mapping range. Buffer doesn't need to be
-	page boundary checked as it is only used in host mode
+	This function reads physical memory through the direct map, or by using one of the VPTEs from the guest mapping 
+	range if it isn't covered by it. Buffer doesn't need to be page boundary checked as it is only used in host mode
 --*/
 {
-	// TODO: Cache VPTE translations (VTLB) (Fire Performance) (Real)
+	PVOID DirectMapAddr = MmGetDirectMapAddress(PhysAddr, Size);
+	if (DirectMapAddr != NULL)
+	{
+		RtlCopyMemory(Buffer, DirectMapAddr, Size);
+		return STATUS_SUCCESS;
+	}
+
 	PMM_VPTE Vpte = NULL;
 	if (!NT_SUCCESS(MmAllocateVpte(&Vpte)))
 		return STATUS_INSUFFICIENT_RESOURCES;
@@ -400,6 +709,13 @@ Routine Description:
 	Writes the contents of `Buffer` to a physical address
 --*/
 {
+	PVOID DirectMapAddr = MmGetDirectMapAddress(PhysAddr, Size);
+	if (DirectMapAddr != NULL)
+	{
+		RtlCopyMemory(DirectMapAddr, Buffer, Size);
+		return STATUS_SUCCESS;
+	}
+
 	PMM_VPTE Vpte = NULL;
 	if (!NT_SUCCESS(MmAllocateVpte(&Vpte)))
 		return STATUS_INSUFFICIENT_RESOURCES;
@@ -434,31 +750,14 @@ Routine Description:
 	for `VirtAddr` or `Buffer`
 --*/
 {
-	NTSTATUS Status = STATUS_SUCCESS;
-
 	if (Size > PAGE_SIZE - max(PAGE_OFFSET(VirtAddr), PAGE_OFFSET(Buffer)))
 		return STATUS_INVALID_BUFFER_SIZE;
 	
-	PMM_VPTE Vpte = NULL;
-	if (NT_SUCCESS(MmAllocateVpte(&Vpte)))
-	{
-		if (NT_SUCCESS(MmMapGuestVirt(Vpte, TargetCr3, VirtAddr)))
-		{
-			RtlCopyMemory(Buffer, Vpte->MappedVirtAddr, Size);
-		}
-		else
-		{
-			Status = STATUS_INVALID_PARAMETER;
-		}
-
-		MmFreeVpte(Vpte);
-	}
-	else
-	{
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
+	UINT64 PhysAddr = 0;
+	if (!NT_SUCCESS(MmTranslateGuestVirt(TargetCr3, VirtAddr, &PhysAddr)))
+		return STATUS_INVALID_PARAMETER;
 
-	return Status;
+	return MmReadGuestPhys(PhysAddr, Size, Buffer);
 }
 
 VMM_API
@@ -475,31 +774,14 @@ Routine Description:
 	for `VirtAddr` or `Buffer`
 --*/
 {
-	NTSTATUS Status = STATUS_SUCCESS;
-
 	if (Size > PAGE_SIZE - max(PAGE_OFFSET(VirtAddr), PAGE_OFFSET(Buffer)))
 		return STATUS_INVALID_BUFFER_SIZE;
 
-	PMM_VPTE Vpte = NULL;
-	if (NT_SUCCESS(MmAllocateVpte(&Vpte)))
-	{
-		if (NT_SUCCESS(MmMapGuestVirt(Vpte, TargetCr3, VirtAddr)))
-		{
-			RtlCopyMemory(Vpte->MappedVirtAddr, Buffer, Size);
-		}
-		else
-		{
-			Status = STATUS_INVALID_PARAMETER;
-		}
-
-		MmFreeVpte(Vpte);
-	}
-	else
-	{
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
+	UINT64 PhysAddr = 0;
+	if (!NT_SUCCESS(MmTranslateGuestVirt(TargetCr3, VirtAddr, &PhysAddr)))
+		return STATUS_INVALID_PARAMETER;
 
-	return Status;
+	return MmWriteGuestPhys(PhysAddr, Size, Buffer);
 }
 
 UINT64
@@ -8,6 +8,8 @@
 typedef struct _MM_INFORMATION
 {
 	X86_CR3 Cr3;
+	// Map all of physical RAM into the host address space instead of relying on VPTEs only
+	BOOLEAN UseDirectMap;
 } MM_INFORMATION, *PMM_INFORMATION;
 
 typedef union _MM_PTE
@@ -37,27 +39,90 @@ typedef struct _MM_RESERVED_PT
 	LIST_ENTRY Links;
 	PVOID TableAddr;
 	UINT64 TablePhysAddr;
+	// Set while the table is handed out, so freeing it twice can't link it into the free list twice
+	volatile CHAR Allocated;
 } MM_RESERVED_PT, *PMM_RESERVED_PT;
 
+// Upper bound on the host page tables that can be reserved and donated, the PFN lookup table is sized for it up
+// front so donated tables can be indexed in VMX-root
+#define MM_MAX_HOST_PAGE_TABLES 8192
+// Once fewer host page tables than this are free, the guest-side worker is asked to donate more. This leaves room
+// for the tables a burst of EPT splitting needs before the worker gets to run
+#define MM_HOST_PT_LOW_WATERMARK 64
+// Amount of free host page tables a refill tops the pool back up to
+#define MM_HOST_PT_HIGH_WATERMARK 256
+
+typedef struct _MM_HOST_PT_STATS
+{
+	// Page tables reserved at startup plus those donated since
+	UINT64 Total;
+	UINT64 Free;
+	// Fewest page tables that have been free at once
+	UINT64 LowestFree;
+	UINT64 Allocations;
+	UINT64 Frees;
+	// Allocations that failed as no page tables were free
+	UINT64 Failures;
+	// Times the guest-side worker was asked for more page tables
+	UINT64 RefillRequests;
+	// Page tables donated by the guest-side worker
+	UINT64 Donated;
+} MM_HOST_PT_STATS, *PMM_HOST_PT_STATS;
+
 extern PMM_RESERVED_PT gHostPageTablesHead;
-extern PMM_RESERVED_PT gHostPageTablesTail;
 
 NTSTATUS
 MmInitialise(
 	_Inout_ PMM_INFORMATION MmSupport
 );
 
+NTSTATUS
+MmHostReservePageTables(
+	_In_ SIZE_T Count
+);
+
 NTSTATUS
 MmAllocateHostPageTable(
-	_Out_ PVOID* Table
+	_Out_ PVOID* Table,
+	_Out_ PUINT64 TablePhysAddr
+);
+
+NTSTATUS
+MmFreeHostPageTable(
+	_In_ UINT64 TablePhysAddr
+);
+
+NTSTATUS
+MmCheckDonatedPageTables(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Count
 );
 
+NTSTATUS
+MmDonateHostPageTables(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Count
+);
+
+VOID
+MmGetHostPageTableStats(
+	_Out_ PMM_HOST_PT_STATS Stats
+);
+
+SIZE_T
+MmGetHostPageTableRefillRequest(VOID);
+
 PMM_PTE
 MmReadHostPageTableEntry(
 	_In_ UINT64 TablePfn,
 	_In_ SIZE_T Index
 );
 
+PMM_RESERVED_PT
+MmGetHostPageTable(
+	_In_ UINT64 PhysAddr
+);
+
 PMM_PTE
 MmGetHostPageTableVirtAddr(
 	_In_ UINT64 PhysAddr
@@ -72,9 +137,6 @@ MmWinTranslateAddrVerbose(
 	_Out_ PMM_PTE pPte
 );
 
-PMM_RESERVED_PT
-MmGetLastAllocatedPageTable(VOID);
-
 NTSTATUS
 MmWriteGuestPhys(
 	_In_ UINT64 PhysAddr,
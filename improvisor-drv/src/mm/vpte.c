@@ -1,8 +1,11 @@
 #include <improvisor.h>
 #include <arch/memory.h>
 #include <mm/vpte.h>
+#include <mm/vtlb.h>
+#include <mm/dmap.h>
 #include <mm/mm.h>
 #include <os/pe.h>
+#include <vcpu/vcpu.h>
 #include <spinlock.h>
 #include <macro.h>
 #include <ll.h>
@@ -26,7 +29,14 @@ Routine Description:
 	mapping guest physical memory
 --*/
 {
-	return LL_CREATE_POOL(&sVirtualPTEPool, MM_VPTE, Count);
+	NTSTATUS Status = LL_CREATE_PER_CPU_POOL(&sVirtualPTEPool, MM_VPTE, Count);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	// Only taken when a VCPU's cache runs dry or overflows, tracked to tell if the caches are too small
+	SpinTrackLock(&sVirtualPTEPool.Lock.Writer, "VptePool");
+
+	return STATUS_SUCCESS;
 }
 
 VMM_API
@@ -36,13 +46,13 @@ MmAllocateVpte(
 )
 /*++
 Routine Description:
-	This function takes a VPTE entry from the head of the list.
+	This function takes a VPTE entry from the current VCPU's cache of free entries
 --*/
 {
 	if (Vpte == NULL)
 		return STATUS_INVALID_PARAMETER;
 
-	PVOID Result = LlAllocate(&sVirtualPTEPool);
+	PVOID Result = LlAllocateLocal(&sVirtualPTEPool, VcpuGetActiveVcpu()->Id);
 	// If `Result` is null, there are no used entries
 	if (Result == NULL)
 		return STATUS_INSUFFICIENT_RESOURCES;
@@ -59,11 +69,10 @@ MmFreeVpte(
 )
 /*++
 Routine Description:
-	This function frees a VPTE entry by clearing the structure, adding the entry to the end of the list
-	and removing it from its current position
+	This function frees a VPTE entry by returning it to the current VCPU's cache of free entries
 --*/
 {
-	LlFree(&sVirtualPTEPool, &Vpte->Links);
+	LlFreeLocal(&sVirtualPTEPool, VcpuGetActiveVcpu()->Id, &Vpte->Links);
 }
 
 VMM_API
@@ -76,7 +85,7 @@ Routine Description:
 	Returns the amount of VPTEs currently in use
 --*/
 {
-	return sVirtualPTEPool.ElementsUsed;
+	return LlGetUsedCount(&sVirtualPTEPool);
 }
 
 
@@ -114,7 +123,8 @@ Routine Description:
 			Pml4e->Dirty = TRUE;
 
 			PMM_PTE Pdpt = NULL;
-			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pdpt)))
+			UINT64 PdptPhysAddr = 0;
+			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pdpt, &PdptPhysAddr)))
 			{
 				ImpDebugPrint("Couldn't allocate host PDPT for '%llX'...\n", Address);
 				return STATUS_INSUFFICIENT_RESOURCES;
@@ -122,7 +132,7 @@ Routine Description:
 
 			Pdpte = &Pdpt[LinearAddr.PdptIndex];
 
-			Pml4e->PageFrameNumber = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(Pdpt));
+			Pml4e->PageFrameNumber = PAGE_FRAME_NUMBER(PdptPhysAddr);
 		}
 		else
 			Pdpte = MmReadHostPageTableEntry(Pml4e->PageFrameNumber, LinearAddr.PdptIndex);
@@ -136,14 +146,15 @@ Routine Description:
 			Pdpte->Dirty = TRUE;
 
 			PMM_PTE Pd = NULL;
-			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pd)))
+			UINT64 PdPhysAddr = 0;
+			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pd, &PdPhysAddr)))
 			{
 				ImpDebugPrint("Couldn't allocate host PD for '%llX'...\n", Address);
 				return STATUS_INSUFFICIENT_RESOURCES;
 			}
 
 			Pde = &Pd[LinearAddr.PdIndex];
-			Pdpte->PageFrameNumber = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(Pd));
+			Pdpte->PageFrameNumber = PAGE_FRAME_NUMBER(PdPhysAddr);
 		}
 		else
 			Pde = MmReadHostPageTableEntry(Pdpte->PageFrameNumber, LinearAddr.PdIndex);
@@ -157,14 +168,15 @@ Routine Description:
 			Pde->Dirty = TRUE;
 
 			PMM_PTE Pt = NULL;
-			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt)))
+			UINT64 PtPhysAddr = 0;
+			if (!NT_SUCCESS(MmAllocateHostPageTable(&Pt, &PtPhysAddr)))
 			{
 				ImpDebugPrint("Couldn't allocate host PD for '%llX'...\n", Address);
 				return STATUS_INSUFFICIENT_RESOURCES;
 			}
 
 			Pte = &Pt[LinearAddr.PtIndex];
-			Pde->PageFrameNumber = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(Pt));
+			Pde->PageFrameNumber = PAGE_FRAME_NUMBER(PtPhysAddr);
 		}
 		else
 			Pte = MmReadHostPageTableEntry(Pde->PageFrameNumber, LinearAddr.PtIndex);
@@ -177,9 +189,8 @@ Routine Description:
 			Pte->Dirty = TRUE;
 		}
 
-		PMM_VPTE Vpte = NULL;
-		if (!NT_SUCCESS(MmAllocateVpte(&Vpte)))
-			return STATUS_INSUFFICIENT_RESOURCES;
+		// The VCPUs don't exist yet, so fill in the entries directly rather than going through their caches
+		PMM_VPTE Vpte = LlElementAt(&sVirtualPTEPool, SizeMapped / PAGE_SIZE);
 
 		Vpte->Pte = Pte;
 		Vpte->MappedAddr = (PVOID)LinearAddr.Value;
@@ -187,12 +198,6 @@ Routine Description:
 		SizeMapped += PAGE_SIZE;
 	}
 
-	// Continue to free the first element of the list until there are none left
-	// NOTE: This could be sped up by just 'appending' the used list to the now empty
-	// free list and resetting the head of the used list
-	while (LlIsEmpty(&sVirtualPTEPool) == FALSE)
-		MmFreeVpte(LlBegin(&sVirtualPTEPool));
-
 	return STATUS_SUCCESS;
 }
 
@@ -231,14 +236,15 @@ Routine Description:
 		*HostPml4e = Pml4e;
 
 		PMM_PTE HostPdpt = NULL;
-		if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPdpt)))
+		UINT64 HostPdptPhysAddr = 0;
+		if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPdpt, &HostPdptPhysAddr)))
 		{
 			ImpDebugPrint("Couldn't allocate host PDPT for '%llX'...\n", Address);
 			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 
 		HostPdpte = &HostPdpt[LinearAddr.PdptIndex];
-		HostPml4e->PageFrameNumber = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(HostPdpt));
+		HostPml4e->PageFrameNumber = PAGE_FRAME_NUMBER(HostPdptPhysAddr);
 	}
 	else
 		HostPdpte = MmReadHostPageTableEntry(HostPml4e->PageFrameNumber, LinearAddr.PdptIndex);
@@ -256,14 +262,15 @@ Routine Description:
 		}
 
 		PMM_PTE HostPd = NULL;
-		if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPd)))
+		UINT64 HostPdPhysAddr = 0;
+		if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPd, &HostPdPhysAddr)))
 		{
 			ImpDebugPrint("Couldn't allocate host PD for '%llX'...\n", Address);
 			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 
 		HostPde = &HostPd[LinearAddr.PdIndex];
-		HostPdpte->PageFrameNumber = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(HostPd));
+		HostPdpte->PageFrameNumber = PAGE_FRAME_NUMBER(HostPdPhysAddr);
 	}
 	else
 	{
@@ -286,14 +293,15 @@ Routine Description:
 		}
 
 		PMM_PTE HostPt = NULL;
-		if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPt)))
+		UINT64 HostPtPhysAddr = 0;
+		if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPt, &HostPtPhysAddr)))
 		{
 			ImpDebugPrint("Couldn't allocate host PD for '%llX'...\n", Address);
 			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 
 		HostPte = &HostPt[LinearAddr.PtIndex];
-		HostPde->PageFrameNumber = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(HostPt));
+		HostPde->PageFrameNumber = PAGE_FRAME_NUMBER(HostPtPhysAddr);
 	}
 	else
 	{
@@ -416,13 +424,14 @@ Routine Description:
 	// Map 0x0000 to trap page?
 
 	PMM_PTE HostPml4 = NULL;
-	if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPml4)))
+	UINT64 HostPml4PhysAddr = 0;
+	if (!NT_SUCCESS(MmAllocateHostPageTable(&HostPml4, &HostPml4PhysAddr)))
 	{
 		ImpDebugPrint("Couldn't allocate host PML4...\n");
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	MmSupport->Cr3.PageDirectoryBase = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(HostPml4));
+	MmSupport->Cr3.PageDirectoryBase = PAGE_FRAME_NUMBER(HostPml4PhysAddr);
 
 #ifdef _DEBUG
 	// TODO: Correct this in the future, Write function to extract section info
@@ -469,6 +478,17 @@ Routine Description:
 		CurrRecord = (PIMP_ALLOC_RECORD)CurrRecord->Records.Blink;
 	}
 
+	// The direct map is created last so it can't overlap any copied translations, VPTEs are used if it fails
+	if (MmSupport->UseDirectMap)
+	{
+		Status = MmCreateDirectMap(HostPml4);
+		if (!NT_SUCCESS(Status))
+		{
+			ImpDebugPrint("Failed to create host direct map, falling back to VPTEs... (%X)\n", Status);
+			MmSupport->UseDirectMap = FALSE;
+		}
+	}
+
 	return STATUS_SUCCESS;
 }
 
@@ -494,19 +514,24 @@ Routine Description:
 
 VMM_API
 NTSTATUS
-MmMapGuestVirt(
-	_Inout_ PMM_VPTE Vpte,
+MmTranslateGuestVirt(
 	_In_ UINT64 TargetCr3,
-	_In_ UINT64 VirtAddr
+	_In_ UINT64 VirtAddr,
+	_Out_ PUINT64 PhysAddr
 )
 /*++
 Routine Description:
-	Maps a virtual address to `Vpte` by translating `VirtAddr` through `GuestCr3` and assigning `Vpte` the physical address obtained
+	Translates `VirtAddr` through the page tables of `TargetCr3` into a guest physical address. Translations are
+	looked up in the current VCPU's VTLB first, and cached in it after a successful walk
 --*/
 {
-	// TODO: Cut down on VPTE allocations during this call, can cause a lot of noise with CPUs trying to access MmAllocateVpte and MmFreeVpte
 	NTSTATUS Status = STATUS_SUCCESS;
 
+	PMM_VTLB Vtlb = &VcpuGetActiveVcpu()->Vtlb;
+
+	if (MmVtlbLookup(Vtlb, TargetCr3, VirtAddr, PhysAddr))
+		return STATUS_SUCCESS;
+
 	X86_LA48 LinearAddr = {
 		.Value = (UINT64)VirtAddr
 	};
@@ -531,6 +556,8 @@ Routine Description:
 	if (!Pte.Present)
 		return STATUS_INVALID_PARAMETER;
 
+	MM_VTLB_PAGE_SIZE PageSize = VTLB_PAGE_4KB;
+
 	if (!Pte.LargePage)
 	{
 		Status = MmReadGuestPhys(PAGE_ADDRESS(Pte.PageFrameNumber) + sizeof(MM_PTE) * LinearAddr.PdIndex, sizeof(MM_PTE), &Pte);
@@ -549,19 +576,47 @@ Routine Description:
 			if (!Pte.Present)
 				return STATUS_INVALID_PARAMETER;
 
-			MmMapGuestPhys(Vpte, PAGE_ADDRESS(Pte.PageFrameNumber) + PAGE_OFFSET(VirtAddr));			
+			*PhysAddr = PAGE_ADDRESS(Pte.PageFrameNumber) + PAGE_OFFSET(VirtAddr);
 		}
 		else
 		{
-			// Mapped as a large PDE, map the physical memory and take a 2MB offset from `VirtAddr`
-			MmMapGuestPhys(Vpte, PAGE_ADDRESS(Pte.PageFrameNumber) + (VirtAddr & (MB(2) - 1)));
+			// Mapped as a large PDE, take a 2MB offset from `VirtAddr`
+			*PhysAddr = PAGE_ADDRESS(Pte.PageFrameNumber) + (VirtAddr & (MB(2) - 1));
+			PageSize = VTLB_PAGE_2MB;
 		}		
 	}
 	else
 	{
-		// Mapped as a large PDPTE, map the physical memory and take a 1GB offset from `VirtAddr`
-		MmMapGuestPhys(Vpte, PAGE_ADDRESS(Pte.PageFrameNumber) + (VirtAddr & (GB(1) - 1)));
+		// Mapped as a large PDPTE, take a 1GB offset from `VirtAddr`
+		*PhysAddr = PAGE_ADDRESS(Pte.PageFrameNumber) + (VirtAddr & (GB(1) - 1));
+		PageSize = VTLB_PAGE_1GB;
 	}
 
+	// Only the leaf entry's permissions are cached, the guest's own TLB does the same for INVLPG purposes
+	MmVtlbInsert(Vtlb, TargetCr3, VirtAddr, *PhysAddr, PageSize, Pte.Value);
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+MmMapGuestVirt(
+	_Inout_ PMM_VPTE Vpte,
+	_In_ UINT64 TargetCr3,
+	_In_ UINT64 VirtAddr
+)
+/*++
+Routine Description:
+	Maps a virtual address to `Vpte` by translating `VirtAddr` through `GuestCr3` and assigning `Vpte` the physical address obtained
+--*/
+{
+	UINT64 PhysAddr = 0;
+
+	NTSTATUS Status = MmTranslateGuestVirt(TargetCr3, VirtAddr, &PhysAddr);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	MmMapGuestPhys(Vpte, PhysAddr);
+
 	return STATUS_SUCCESS;
 }
@@ -44,6 +44,13 @@ MmMapGuestPhys(
 	_In_ UINT64 PhysAddr
 );
 
+NTSTATUS
+MmTranslateGuestVirt(
+	_In_ UINT64 TargetCr3,
+	_In_ UINT64 VirtAddr,
+	_Out_ PUINT64 PhysAddr
+);
+
 NTSTATUS
 MmMapGuestVirt(
 	_Inout_ PMM_VPTE Vpte,
@@ -0,0 +1,298 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <mm/vtlb.h>
+#include <mm/mm.h>
+#include <macro.h>
+
+// Only the page directory base identifies an address space, PCID and bit 63 are ignored
+#define VTLB_DIRBASE(Cr3) ((Cr3) & XBITRANGE(12, 51))
+
+// Entries only hold bits 12:47 of the address, the sign extension of kernel addresses is dropped
+#define VTLB_VPN(VirtAddr) (PAGE_FRAME_NUMBER(VirtAddr) & XBITRANGE(0, 35))
+
+// Amount of 4KB pages covered by an entry of each page size
+#define VTLB_PAGE_COUNT(PageSize) (1ULL << ((PageSize) * 9))
+
+// Page number of the first 4KB page of the `PageSize` page containing `Vpn`
+#define VTLB_PAGE_BASE_VPN(Vpn, PageSize) ((Vpn) & ~(VTLB_PAGE_COUNT(PageSize) - 1))
+
+// Sets are indexed by the page number in units of the page size, so large pages don't all share set zero
+#define VTLB_SET_INDEX(Vpn, PageSize) ((SIZE_T)(((Vpn) >> ((PageSize) * 9)) & (VTLB_SET_COUNT - 1)))
+
+#define VTLB_GENERATION_MASK 0xFFFF
+
+VMM_API
+VOID
+MmVtlbInvalidateAsid(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ INT Asid
+)
+/*++
+Routine Description:
+	Invalidates all translations tagged with `Asid` and frees it. Entries from older generations of an ASID never
+	hit, so only its generation has to be advanced, the sets are cleared when it wraps around
+--*/
+{
+	Vtlb->Generations[Asid] = (Vtlb->Generations[Asid] + 1) & VTLB_GENERATION_MASK;
+	if (Vtlb->Generations[Asid] == 0)
+		RtlZeroMemory(Vtlb->Sets, sizeof(Vtlb->Sets));
+
+	Vtlb->DirBases[Asid] = 0;
+}
+
+VMM_API
+VOID
+MmVtlbFlush(
+	_Inout_ PMM_VTLB Vtlb
+)
+/*++
+Routine Description:
+	Invalidates every translation and frees all ASIDs
+--*/
+{
+	for (INT i = 0; i < VTLB_ASID_COUNT; i++)
+		MmVtlbInvalidateAsid(Vtlb, i);
+
+	Vtlb->LargePageSizes = 0;
+	Vtlb->Populated = FALSE;
+
+	InterlockedExchange(&Vtlb->FlushPending, FALSE);
+}
+
+VMM_API
+VOID
+MmVtlbEndExit(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 GuestCr3
+)
+/*++
+Routine Description:
+	Called before VM-entry with the CR3 the guest resumes with. While the guest's CR3 loads, INVLPG and INVPCID
+	exit, the translations of that address space are invalidated with the guest's own TLB and are kept. Any other
+	address space can change without this processor being told, so its translations are dropped
+--*/
+{
+	if (!Vtlb->Populated)
+		return;
+
+	if (!Vtlb->Intercepted)
+	{
+		MmVtlbFlush(Vtlb);
+		return;
+	}
+
+	for (INT i = 0; i < VTLB_ASID_COUNT; i++)
+	{
+		if (Vtlb->DirBases[i] != 0 && Vtlb->DirBases[i] != VTLB_DIRBASE(GuestCr3))
+			MmVtlbInvalidateAsid(Vtlb, i);
+	}
+}
+
+VMM_API
+INT
+MmVtlbFindAsid(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 DirBase
+)
+/*++
+Routine Description:
+	Returns the ASID assigned to `DirBase`, or -1 if it has none
+--*/
+{
+	for (INT i = 0; i < VTLB_ASID_COUNT; i++)
+	{
+		if (Vtlb->DirBases[i] == DirBase)
+			return i;
+	}
+
+	return -1;
+}
+
+VMM_API
+PMM_VTLB_ENTRY
+MmVtlbFindEntry(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ INT Asid,
+	_In_ UINT64 Vpn,
+	_In_ MM_VTLB_PAGE_SIZE PageSize
+)
+/*++
+Routine Description:
+	Returns the entry for the `PageSize` page containing `Vpn` in the address space of `Asid`, or NULL if there is
+	none. Large pages are tagged with the page number of their first 4KB page
+--*/
+{
+	MM_VTLB_ENTRY Key = {
+		.Valid = TRUE,
+		.Asid = Asid,
+		.PageSize = PageSize,
+		.VirtPageNumber = VTLB_PAGE_BASE_VPN(Vpn, PageSize),
+		.Generation = Vtlb->Generations[Asid]
+	};
+
+	PMM_VTLB_SET Set = &Vtlb->Sets[VTLB_SET_INDEX(Key.VirtPageNumber, PageSize)];
+
+	for (SIZE_T i = 0; i < VTLB_WAY_COUNT; i++)
+	{
+		if (Set->Entries[i].Tag == Key.Tag)
+			return &Set->Entries[i];
+	}
+
+	return NULL;
+}
+
+VMM_API
+BOOLEAN
+MmVtlbLookup(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 DirBase,
+	_In_ UINT64 VirtAddr,
+	_Out_ PUINT64 PhysAddr
+)
+/*++
+Routine Description:
+	Looks up the translation of `VirtAddr` in the address space of `DirBase`, returning TRUE and the physical 
+	address in `PhysAddr` on a hit
+--*/
+{
+	if (Vtlb->FlushPending)
+		MmVtlbFlush(Vtlb);
+
+	const INT Asid = MmVtlbFindAsid(Vtlb, VTLB_DIRBASE(DirBase));
+	if (Asid != -1)
+	{
+		for (MM_VTLB_PAGE_SIZE PageSize = VTLB_PAGE_4KB; PageSize <= VTLB_PAGE_1GB; PageSize++)
+		{
+			if (PageSize != VTLB_PAGE_4KB && (Vtlb->LargePageSizes & (1UL << PageSize)) == 0)
+				continue;
+
+			PMM_VTLB_ENTRY Entry = MmVtlbFindEntry(Vtlb, Asid, VTLB_VPN(VirtAddr), PageSize);
+			if (Entry != NULL)
+			{
+				const UINT64 PageMask = PAGE_ADDRESS(VTLB_PAGE_COUNT(PageSize)) - 1;
+
+				*PhysAddr = PAGE_ADDRESS(Entry->PageFrameNumber) + (VirtAddr & PageMask);
+
+				Vtlb->Stats.Hits++;
+				return TRUE;
+			}
+		}
+	}
+
+	Vtlb->Stats.Misses++;
+	return FALSE;
+}
+
+VMM_API
+VOID
+MmVtlbInsert(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 DirBase,
+	_In_ UINT64 VirtAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ MM_VTLB_PAGE_SIZE PageSize,
+	_In_ UINT64 PteValue
+)
+/*++
+Routine Description:
+	Caches the translation of `VirtAddr` to `PhysAddr` for the address space of `DirBase`, one entry covers the
+	whole `PageSize` page. If the address space has no ASID yet, the next one is taken round-robin and any 
+	translations still tagged with it are dropped
+--*/
+{
+	DirBase = VTLB_DIRBASE(DirBase);
+
+	INT Asid = MmVtlbFindAsid(Vtlb, DirBase);
+	if (Asid == -1)
+	{
+		Asid = Vtlb->NextAsid++ % VTLB_ASID_COUNT;
+
+		if (Vtlb->DirBases[Asid] != 0)
+			MmVtlbInvalidateAsid(Vtlb, Asid);
+
+		Vtlb->DirBases[Asid] = DirBase;
+	}
+
+	MM_PTE Pte = {
+		.Value = PteValue
+	};
+
+	MM_VTLB_ENTRY NewEntry = {
+		.Valid = TRUE,
+		.Asid = Asid,
+		.PageSize = PageSize,
+		.VirtPageNumber = VTLB_PAGE_BASE_VPN(VTLB_VPN(VirtAddr), PageSize),
+		.Generation = Vtlb->Generations[Asid],
+		.WriteAllowed = Pte.WriteAllowed,
+		.SupervisorOwned = Pte.SupervisorOwned,
+		.ExecuteDisable = Pte.ExecuteDisable,
+		.PageFrameNumber = VTLB_PAGE_BASE_VPN(PAGE_FRAME_NUMBER(PhysAddr), PageSize)
+	};
+
+	PMM_VTLB_SET Set = &Vtlb->Sets[VTLB_SET_INDEX(NewEntry.VirtPageNumber, PageSize)];
+
+	// Prefer an empty or stale way, otherwise evict round-robin
+	SIZE_T Way = Vtlb->NextWay++ % VTLB_WAY_COUNT;
+	for (SIZE_T i = 0; i < VTLB_WAY_COUNT; i++)
+	{
+		if (!Set->Entries[i].Valid || Set->Entries[i].Generation != Vtlb->Generations[Set->Entries[i].Asid])
+		{
+			Way = i;
+			break;
+		}
+	}
+
+	Set->Entries[Way] = NewEntry;
+
+	if (PageSize != VTLB_PAGE_4KB)
+		Vtlb->LargePageSizes |= 1UL << PageSize;
+
+	Vtlb->Populated = TRUE;
+}
+
+VMM_API
+VOID
+MmVtlbInvalidateAddress(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 VirtAddr
+)
+/*++
+Routine Description:
+	Invalidates the translations of `VirtAddr` in every address space, like INVLPG does for global pages. A
+	translation taken from a large page is dropped for the whole page, as the guest's TLB does
+--*/
+{
+	const UINT64 Vpn = VTLB_VPN(VirtAddr);
+
+	for (MM_VTLB_PAGE_SIZE PageSize = VTLB_PAGE_4KB; PageSize <= VTLB_PAGE_1GB; PageSize++)
+	{
+		if (PageSize != VTLB_PAGE_4KB && (Vtlb->LargePageSizes & (1UL << PageSize)) == 0)
+			continue;
+
+		PMM_VTLB_SET Set = &Vtlb->Sets[VTLB_SET_INDEX(Vpn, PageSize)];
+
+		for (SIZE_T i = 0; i < VTLB_WAY_COUNT; i++)
+		{
+			PMM_VTLB_ENTRY Entry = &Set->Entries[i];
+
+			if (Entry->PageSize == PageSize && Entry->VirtPageNumber == VTLB_PAGE_BASE_VPN(Vpn, PageSize))
+				Entry->Tag = 0;
+		}
+	}
+}
+
+VMM_API
+VOID
+MmVtlbInvalidateDirectory(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 DirBase
+)
+/*++
+Routine Description:
+	Invalidates all translations cached for the address space of `DirBase`
+--*/
+{
+	const INT Asid = MmVtlbFindAsid(Vtlb, VTLB_DIRBASE(DirBase));
+	if (Asid != -1)
+		MmVtlbInvalidateAsid(Vtlb, Asid);
+}
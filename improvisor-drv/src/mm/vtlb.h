@@ -0,0 +1,135 @@
+#ifndef IMP_MM_VTLB_H
+#define IMP_MM_VTLB_H
+
+#include <ntdef.h>
+
+// Amount of sets in the VTLB, must be a power of two
+#define VTLB_SET_COUNT 64
+// Amount of entries in each set, a set is exactly one cache line
+#define VTLB_WAY_COUNT 4
+// Amount of address spaces (CR3 values) that can have translations cached at once
+#define VTLB_ASID_COUNT 8
+
+typedef enum _MM_VTLB_PAGE_SIZE
+{
+	VTLB_PAGE_4KB = 0,
+	VTLB_PAGE_2MB,
+	VTLB_PAGE_1GB
+} MM_VTLB_PAGE_SIZE, *PMM_VTLB_PAGE_SIZE;
+
+typedef struct _MM_VTLB_ENTRY
+{
+	union
+	{
+		UINT64 Tag;
+
+		struct
+		{
+			UINT64 Valid : 1;
+			UINT64 Asid : 3;
+			// Size of the guest page this translation was taken from, see MM_VTLB_PAGE_SIZE
+			UINT64 PageSize : 2;
+			UINT64 Reserved1 : 6;
+			// Page number of the first 4KB page in the guest page, so large pages take a single entry
+			UINT64 VirtPageNumber : 36;
+			// The generation of the ASID this was cached in, entries from older generations never hit
+			UINT64 Generation : 16;
+		};
+	};
+
+	union
+	{
+		UINT64 Translation;
+
+		struct
+		{
+			UINT64 WriteAllowed : 1;
+			UINT64 SupervisorOwned : 1;
+			UINT64 ExecuteDisable : 1;
+			UINT64 Reserved2 : 9;
+			// The first 4KB frame of the guest page
+			UINT64 PageFrameNumber : 40;
+			UINT64 Reserved3 : 12;
+		};
+	};
+} MM_VTLB_ENTRY, *PMM_VTLB_ENTRY;
+
+typedef struct DECLSPEC_ALIGN(64) _MM_VTLB_SET
+{
+	MM_VTLB_ENTRY Entries[VTLB_WAY_COUNT];
+} MM_VTLB_SET, *PMM_VTLB_SET;
+
+typedef struct _MM_VTLB_STATS
+{
+	UINT64 Hits;
+	UINT64 Misses;
+} MM_VTLB_STATS, *PMM_VTLB_STATS;
+
+// Per-VCPU software TLB caching guest page walks, only ever touched by the owning VCPU so it needs no locking.
+//
+// Translations of the address space the guest runs in are invalidated the same way the guest's own TLB is, by the
+// MOV CR3, INVLPG and INVPCID exits, and are kept across VM-exits. Other address spaces, and every address space
+// without those intercepts, can change behind the VTLB's back, so their translations are only trusted for the
+// rest of the VM-exit they were cached in
+typedef struct _MM_VTLB
+{
+	MM_VTLB_SET Sets[VTLB_SET_COUNT];
+	// The directory base each ASID is currently assigned to, zero if the ASID is free
+	UINT64 DirBases[VTLB_ASID_COUNT];
+	UINT32 NextAsid;
+	UINT32 NextWay;
+	// The current generation of each ASID, advanced whenever the ASID is invalidated
+	UINT16 Generations[VTLB_ASID_COUNT];
+	// Bitmask of the large page sizes cached since the last flush, so lookups only probe for sizes that exist
+	UINT32 LargePageSizes;
+	// Set by other VCPUs to request a flush, the owning VCPU flushes before its next lookup
+	volatile LONG FlushPending;
+	// Whether anything was cached since the last flush, so VM-exits that never translate don't pay for one
+	BOOLEAN Populated;
+	// Whether the guest's CR3 loads, INVLPG and INVPCID exit, which lets translations live across VM-exits
+	BOOLEAN Intercepted;
+	MM_VTLB_STATS Stats;
+} MM_VTLB, *PMM_VTLB;
+
+BOOLEAN
+MmVtlbLookup(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 DirBase,
+	_In_ UINT64 VirtAddr,
+	_Out_ PUINT64 PhysAddr
+);
+
+VOID
+MmVtlbInsert(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 DirBase,
+	_In_ UINT64 VirtAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ MM_VTLB_PAGE_SIZE PageSize,
+	_In_ UINT64 PteValue
+);
+
+VOID
+MmVtlbInvalidateAddress(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 VirtAddr
+);
+
+VOID
+MmVtlbInvalidateDirectory(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 DirBase
+);
+
+VOID
+MmVtlbFlush(
+	_Inout_ PMM_VTLB Vtlb
+);
+
+VOID
+MmVtlbEndExit(
+	_Inout_ PMM_VTLB Vtlb,
+	_In_ UINT64 GuestCr3
+);
+
+#endif
@@ -991,7 +991,7 @@ Routine Description:
 		// The type index in Field will always point to a LF_FIELDLIST type record
 		return PdbSearchFieldList(Pdb, PdbLookupTypeIndex(Pdb, Lr->Field), Member);
 	else
-		ImpLog("[PDB #%08X] Structure/Class LR with ForwardRef == 0 has no field TI...\n");
+		IMP_LOG_WARN(IMP_LOG_PDB, "[PDB #%08X] Structure/Class LR with ForwardRef == 0 has no field TI...\n");
 
 	return -1;
 }
@@ -1059,7 +1059,7 @@ Routine Description:
 		} break;
 		default:
 		{
-			ImpLog("[PDB #%08X] Unknown LR Kind %i...\n", Pdb->NameHash, Curr->Kind);
+			IMP_LOG_WARN(IMP_LOG_PDB, "[PDB #%08X] Unknown LR Kind %i...\n", Pdb->NameHash, Curr->Kind);
 			// Return -1 because we can't handle this
 			return -1;
 		} break;
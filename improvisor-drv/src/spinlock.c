@@ -1,7 +1,44 @@
 #include <improvisor.h>
 #include <spinlock.h>
 
-// TODO: Copy Windows Ex functions
+// Added to a lock's `Value` to take the next ticket
+#define SPIN_TICKET_INCREMENT (0x10000)
+
+// Statistics of all tracked locks, entries are only ever added during initialisation
+VMM_DATA static SPINLOCK_STATS sLockStats[SPIN_MAX_TRACKED_LOCKS];
+VMM_DATA static volatile LONG sTrackedLockCount = 0;
+
+FORCEINLINE
+VOID
+SpinBackoff(
+	_Inout_ PUINT32 Backoff
+)
+/*++
+Routine Description:
+	Pauses for `Backoff` iterations and doubles it, up to SPIN_MAX_BACKOFF
+--*/
+{
+	for (UINT32 i = 0; i < *Backoff; i++)
+		_mm_pause();
+
+	if (*Backoff < SPIN_MAX_BACKOFF)
+		*Backoff <<= 1;
+}
+
+FORCEINLINE
+BOOLEAN
+SpinIsLocked(
+	_In_ PSPINLOCK Lock
+)
+/*++
+Routine Description:
+	Checks if a lock is owned, or if there are waiters queued on it
+--*/
+{
+	const ULONG Value = (ULONG)Lock->Value;
+
+	return (USHORT)Value != (USHORT)(Value >> 16);
+}
 
 BOOLEAN
 SpinTryLock(
@@ -9,16 +46,21 @@ SpinTryLock(
 )
 /*++
 Routine Description:
-	Attempts to lock a spinlock by first checking if it is free, then attempting to lock it if so.
-	We check if InterlockedCompareExchange's return value was 0 as if so, this means that the exchange
-	occurred and we have now locked the spinlock. If it returned something else, another thread beat us 
-	to the lock (should never happen in our case).
+	Attempts to lock a spinlock without waiting. A ticket is only taken if it would be served immediately,
+	that is if the lock is free and nobody is queued on it, so a failed attempt leaves the queue untouched
 --*/
 {
-	return (*Lock == 0 && InterlockedCompareExchange(Lock, 1, 0) == 0);
+	const ULONG Value = (ULONG)Lock->Value;
+	if ((USHORT)Value != (USHORT)(Value >> 16))
+		return FALSE;
+
+	if (InterlockedCompareExchange(&Lock->Value, (LONG)(Value + SPIN_TICKET_INCREMENT), (LONG)Value) != (LONG)Value)
+		return FALSE;
 
-	// Testing a new hook that also contains the value of how much a lock is being challenged.
-	// return InterlockedIncrement(Lock) == 1;
+	if (Lock->Stats != NULL)
+		Lock->Stats->Acquisitions++;
+
+	return TRUE;
 }
 
 VOID
@@ -27,11 +69,34 @@ SpinLock(
 )
 /*++
 Routine Description:
-	Locks a spinlock.
+	Locks a spinlock, waiting in FIFO order behind any earlier acquirers. Waiting is done with a bounded 
+	exponential backoff to keep the owner's cache line from being hammered by every waiter.
+
+	Contention is counted by the owner once it holds the lock, so the statistics need no atomics
 --*/
 {
-	while (!SpinTryLock(Lock))
-		_mm_pause();
+	const USHORT Ticket = (USHORT)((ULONG)InterlockedExchangeAdd(&Lock->Value, SPIN_TICKET_INCREMENT) >> 16);
+
+	if (Lock->Owner == Ticket)
+	{
+		if (Lock->Stats != NULL)
+			Lock->Stats->Acquisitions++;
+
+		return;
+	}
+
+	const UINT64 SpinStart = __rdtsc();
+
+	UINT32 Backoff = 1;
+	while (Lock->Owner != Ticket)
+		SpinBackoff(&Backoff);
+
+	if (Lock->Stats != NULL)
+	{
+		Lock->Stats->Acquisitions++;
+		Lock->Stats->Contentions++;
+		Lock->Stats->SpinCycles += __rdtsc() - SpinStart;
+	}
 }
 
 VOID
@@ -40,8 +105,130 @@ SpinUnlock(
 )
 /*++
 Routine Description:
-	Unlocks a spinlock
+	Unlocks a spinlock, handing it to the next ticket. Only `Owner` is incremented so a wrap can't carry
+	into `Next`
+--*/
+{
+	_InterlockedIncrement16((volatile SHORT*)&Lock->Owner);
+}
+
+VOID
+SpinLockShared(
+	_Inout_ PRWSPINLOCK Lock
+)
+/*++
+Routine Description:
+	Locks a reader/writer lock for reading. Readers announce themselves and then recheck for a writer, 
+	backing out if one got queued in between
+--*/
+{
+	UINT32 Backoff = 1;
+
+	while (TRUE)
+	{
+		if (!SpinIsLocked(&Lock->Writer))
+		{
+			InterlockedIncrement(&Lock->Readers);
+
+			if (!SpinIsLocked(&Lock->Writer))
+				return;
+
+			InterlockedDecrement(&Lock->Readers);
+		}
+
+		SpinBackoff(&Backoff);
+	}
+}
+
+VOID
+SpinUnlockShared(
+	_Inout_ PRWSPINLOCK Lock
+)
+/*++
+Routine Description:
+	Unlocks a reader/writer lock held for reading
+--*/
+{
+	InterlockedDecrement(&Lock->Readers);
+}
+
+VOID
+SpinLockExclusive(
+	_Inout_ PRWSPINLOCK Lock
+)
+/*++
+Routine Description:
+	Locks a reader/writer lock for writing. Taking `Writer` stops new readers, then the remaining readers
+	are waited out
+--*/
+{
+	SpinLock(&Lock->Writer);
+
+	UINT32 Backoff = 1;
+	while (Lock->Readers != 0)
+		SpinBackoff(&Backoff);
+}
+
+VOID
+SpinUnlockExclusive(
+	_Inout_ PRWSPINLOCK Lock
+)
+/*++
+Routine Description:
+	Unlocks a reader/writer lock held for writing
+--*/
+{
+	SpinUnlock(&Lock->Writer);
+}
+
+NTSTATUS
+SpinTrackLock(
+	_Inout_ PSPINLOCK Lock,
+	_In_ PCSTR Name
+)
+/*++
+Routine Description:
+	Starts gathering contention statistics for `Lock` under `Name`, which can be retrieved through 
+	HYPERCALL_GET_LOCK_STATS. This must be called before the lock is used
+--*/
+{
+	const LONG Index = InterlockedIncrement(&sTrackedLockCount) - 1;
+	if (Index >= SPIN_MAX_TRACKED_LOCKS)
+	{
+		InterlockedDecrement(&sTrackedLockCount);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	PSPINLOCK_STATS Stats = &sLockStats[Index];
+
+	RtlZeroMemory(Stats, sizeof(SPINLOCK_STATS));
+	// Copy the name, truncating it if needed and leaving room for the terminator
+	for (SIZE_T i = 0; i < sizeof(Stats->Name) - 1 && Name[i] != '\0'; i++)
+		Stats->Name[i] = Name[i];
+
+	Lock->Stats = Stats;
+
+	return STATUS_SUCCESS;
+}
+
+SIZE_T
+SpinGetTrackedLockCount(VOID)
+/*++
+Routine Description:
+	Returns the amount of locks with statistics being gathered
+--*/
+{
+	return sTrackedLockCount < SPIN_MAX_TRACKED_LOCKS ? sTrackedLockCount : SPIN_MAX_TRACKED_LOCKS;
+}
+
+PSPINLOCK_STATS
+SpinGetLockStats(
+	_In_ SIZE_T Index
+)
+/*++
+Routine Description:
+	Returns the statistics of the tracked lock at `Index`
 --*/
 {
-	*Lock = 0;
+	return Index < SpinGetTrackedLockCount() ? &sLockStats[Index] : NULL;
 }
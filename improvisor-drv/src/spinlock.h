@@ -3,8 +3,58 @@
 
 #include <ntdef.h>
 
-typedef volatile LONG SPINLOCK;
-typedef SPINLOCK* PSPINLOCK;
+// Upper bound of the exponential backoff, in `pause` iterations, between polls of a contended lock
+#define SPIN_MAX_BACKOFF 64
+// Maximum amount of locks that can have contention statistics gathered
+#define SPIN_MAX_TRACKED_LOCKS 16
+
+// Contention statistics of a tracked lock, only ever updated by the lock's owner
+typedef struct _SPINLOCK_STATS
+{
+	CHAR Name[16];
+	// The amount of times the lock was acquired
+	UINT64 Acquisitions;
+	// The amount of acquisitions that had to wait for another owner
+	UINT64 Contentions;
+	// TSC cycles spent waiting in contended acquisitions
+	UINT64 SpinCycles;
+} SPINLOCK_STATS, *PSPINLOCK_STATS;
+
+// A FIFO ticket lock, a zero initialised lock is unlocked.
+//
+// Each acquirer takes a ticket from `Next` and waits for `Owner` to reach it, so waiters are served in the
+// order they arrived and can't be starved by CPUs that happen to win the cache line more often
+typedef struct _SPINLOCK
+{
+	union
+	{
+		volatile LONG Value;
+
+		struct
+		{
+			volatile USHORT Owner;
+			volatile USHORT Next;
+		};
+	};
+
+	// Statistics of this lock, NULL unless it was registered with `SpinTrackLock`
+	PSPINLOCK_STATS Stats;
+} SPINLOCK, *PSPINLOCK;
+
+// A reader/writer lock for read-mostly structures, a zero initialised lock is unlocked.
+//
+// Writers are serialised (and ordered) by `Writer`, and new readers back off as soon as a writer is queued
+// so writers can't be starved by a steady stream of readers
+typedef struct _RWSPINLOCK
+{
+	SPINLOCK Writer;
+	volatile LONG Readers;
+} RWSPINLOCK, *PRWSPINLOCK;
+
+BOOLEAN
+SpinTryLock(
+	_Inout_ PSPINLOCK Lock
+);
 
 VOID
 SpinLock(
@@ -16,4 +66,38 @@ SpinUnlock(
 	_Inout_ PSPINLOCK Lock
 );
 
+VOID
+SpinLockShared(
+	_Inout_ PRWSPINLOCK Lock
+);
+
+VOID
+SpinUnlockShared(
+	_Inout_ PRWSPINLOCK Lock
+);
+
+VOID
+SpinLockExclusive(
+	_Inout_ PRWSPINLOCK Lock
+);
+
+VOID
+SpinUnlockExclusive(
+	_Inout_ PRWSPINLOCK Lock
+);
+
+NTSTATUS
+SpinTrackLock(
+	_Inout_ PSPINLOCK Lock,
+	_In_ PCSTR Name
+);
+
+SIZE_T
+SpinGetTrackedLockCount(VOID);
+
+PSPINLOCK_STATS
+SpinGetLockStats(
+	_In_ SIZE_T Index
+);
+
 #endif
@@ -0,0 +1,218 @@
+#include <improvisor.h>
+#include <vcpu/cpuid.h>
+#include <intrin.h>
+
+// Upper bound on the subleaves enumerated for a single leaf
+#define VCPU_CPUID_MAX_SUBLEAVES 16
+
+// How the subleaves of a cacheable leaf are enumerated
+typedef enum _VCPU_CPUID_SUBLEAVES
+{
+	// ECX is ignored
+	CPUID_SUBLEAVES_NONE,
+	// Subleaf 0 reports the highest valid subleaf in EAX (leaf 07H)
+	CPUID_SUBLEAVES_MAX_IN_EAX,
+	// Valid until a subleaf reports a null cache type in EAX[4:0] (leaf 04H)
+	CPUID_SUBLEAVES_CACHE_TYPE,
+	// Valid until a subleaf reports an invalid level type in ECX[15:8] (leaves 0BH and 1FH)
+	CPUID_SUBLEAVES_LEVEL_TYPE
+} VCPU_CPUID_SUBLEAVES, *PVCPU_CPUID_SUBLEAVES;
+
+typedef struct _VCPU_CPUID_CACHEABLE_LEAF
+{
+	UINT32 Leaf;
+	VCPU_CPUID_SUBLEAVES Subleaves;
+} VCPU_CPUID_CACHEABLE_LEAF, *PVCPU_CPUID_CACHEABLE_LEAF;
+
+// Leaves whose results never change once the OS has booted. Everything else is executed on the hardware
+// for each request, namely:
+//   - 0DH, XSAVE sizes depend on the XCR0 and IA32_XSS values the guest sets at any time, neither of which are
+//     switched on VM-exit, so the hardware always reports the guest's current sizes
+//   - 40000000H-4FFFFFFFH, in VMX root operation the hardware reports no hypervisor leaves, exactly as on bare metal
+VMM_RDATA static const VCPU_CPUID_CACHEABLE_LEAF sCpuidCacheableLeaves[] = {
+	{ 0x00000000, CPUID_SUBLEAVES_NONE },
+	{ 0x00000001, CPUID_SUBLEAVES_NONE },
+	{ 0x00000002, CPUID_SUBLEAVES_NONE },
+	{ 0x00000004, CPUID_SUBLEAVES_CACHE_TYPE },
+	{ 0x00000005, CPUID_SUBLEAVES_NONE },
+	{ 0x00000006, CPUID_SUBLEAVES_NONE },
+	{ 0x00000007, CPUID_SUBLEAVES_MAX_IN_EAX },
+	{ 0x0000000A, CPUID_SUBLEAVES_NONE },
+	{ 0x0000000B, CPUID_SUBLEAVES_LEVEL_TYPE },
+	{ 0x00000015, CPUID_SUBLEAVES_NONE },
+	{ 0x00000016, CPUID_SUBLEAVES_NONE },
+	{ 0x0000001F, CPUID_SUBLEAVES_LEVEL_TYPE },
+	{ 0x80000000, CPUID_SUBLEAVES_NONE },
+	{ 0x80000001, CPUID_SUBLEAVES_NONE },
+	{ 0x80000002, CPUID_SUBLEAVES_NONE },
+	{ 0x80000003, CPUID_SUBLEAVES_NONE },
+	{ 0x80000004, CPUID_SUBLEAVES_NONE },
+	{ 0x80000006, CPUID_SUBLEAVES_NONE },
+	{ 0x80000007, CPUID_SUBLEAVES_NONE },
+	{ 0x80000008, CPUID_SUBLEAVES_NONE }
+};
+
+#define CPUID_POLICY_HIDE_FEATURE(Feature) { \
+	.Leaf = FEATURE_LEAF(Feature), \
+	.Subleaf = FEATURE_HAS_SUBLEAF(Feature) ? FEATURE_SUBLEAF(Feature) : VCPU_CPUID_ANY_SUBLEAF, \
+	.Reg = FEATURE_REG(Feature), \
+	.ClearMask = FEATURE_MASK(Feature), \
+	.SetMask = 0 \
+}
+
+// Every modification made to the CPUID results seen by the guest, applied to cached and uncached leaves alike
+VMM_RDATA static const VCPU_CPUID_POLICY sCpuidPolicy[] = {
+	// Don't let the guest know it is running under a hypervisor
+	CPUID_POLICY_HIDE_FEATURE(X86_FEATURE_HYPERVISOR)
+};
+
+VMM_API
+VOID
+VcpuCpuidApplyPolicy(
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Inout_ PX86_CPUID_ARGS Result
+)
+/*++
+Routine Description:
+	Applies every rule of the CPUID policy matching a leaf and subleaf to its result
+--*/
+{
+	for (SIZE_T i = 0; i < sizeof(sCpuidPolicy) / sizeof(*sCpuidPolicy); i++)
+	{
+		const VCPU_CPUID_POLICY* Rule = &sCpuidPolicy[i];
+
+		if (Rule->Leaf != Leaf || (Rule->Subleaf != VCPU_CPUID_ANY_SUBLEAF && Rule->Subleaf != Subleaf))
+			continue;
+
+		Result->Data[Rule->Reg] &= ~Rule->ClearMask;
+		Result->Data[Rule->Reg] |= Rule->SetMask;
+	}
+}
+
+VSC_API
+BOOLEAN
+VcpuCpuidCacheResult(
+	_Inout_ PVCPU_CPUID_CACHE Cache,
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_In_ PX86_CPUID_ARGS Result
+)
+/*++
+Routine Description:
+	Stores a hardware CPUID result in the cache after applying the CPUID policy, returns FALSE if the cache is full
+--*/
+{
+	if (Cache->Count >= VCPU_CPUID_CACHE_SIZE)
+	{
+		ImpDebugPrint("CPUID cache full, leaf %XH.%X onwards are uncached...\n", Leaf, Subleaf);
+		return FALSE;
+	}
+
+	PVCPU_CPUID_ENTRY Entry = &Cache->Entries[Cache->Count++];
+
+	Entry->Leaf = Leaf;
+	Entry->Subleaf = Subleaf;
+	Entry->Result = *Result;
+
+	VcpuCpuidApplyPolicy(Leaf, Subleaf, &Entry->Result);
+
+	return TRUE;
+}
+
+VSC_API
+VOID
+VcpuCpuidFillCache(
+	_Out_ PVCPU_CPUID_CACHE Cache
+)
+/*++
+Routine Description:
+	Precomputes the results of every cacheable leaf supported by this core, this must run on the core the
+	cache belongs to
+--*/
+{
+	Cache->Count = 0;
+
+	X86_CPUID_ARGS Result = {0};
+
+	__cpuidex(Result.Data, 0x00000000, 0);
+	const UINT32 MaxBasicLeaf = (UINT32)Result.Eax;
+
+	__cpuidex(Result.Data, 0x80000000, 0);
+	const UINT32 MaxExtendedLeaf = (UINT32)Result.Eax;
+
+	for (SIZE_T i = 0; i < sizeof(sCpuidCacheableLeaves) / sizeof(*sCpuidCacheableLeaves); i++)
+	{
+		const UINT32 Leaf = sCpuidCacheableLeaves[i].Leaf;
+
+		if (Leaf > ((Leaf & 0x80000000) ? MaxExtendedLeaf : MaxBasicLeaf))
+			continue;
+
+		if (sCpuidCacheableLeaves[i].Subleaves == CPUID_SUBLEAVES_NONE)
+		{
+			__cpuidex(Result.Data, Leaf, 0);
+
+			if (!VcpuCpuidCacheResult(Cache, Leaf, VCPU_CPUID_ANY_SUBLEAF, &Result))
+				return;
+
+			continue;
+		}
+
+		// Subleaves past the last valid one aren't cached, and fall through to the hardware like any other miss
+		UINT32 SubleafCount = VCPU_CPUID_MAX_SUBLEAVES;
+		for (UINT32 Subleaf = 0; Subleaf < SubleafCount; Subleaf++)
+		{
+			__cpuidex(Result.Data, Leaf, Subleaf);
+
+			switch (sCpuidCacheableLeaves[i].Subleaves)
+			{
+			case CPUID_SUBLEAVES_MAX_IN_EAX:
+				if (Subleaf == 0)
+					SubleafCount = min((UINT32)Result.Eax + 1, VCPU_CPUID_MAX_SUBLEAVES);
+				break;
+			case CPUID_SUBLEAVES_CACHE_TYPE:
+				if ((Result.Eax & 0x1F) == 0)
+					SubleafCount = Subleaf;
+				break;
+			case CPUID_SUBLEAVES_LEVEL_TYPE:
+				if ((Result.Ecx & 0xFF00) == 0)
+					SubleafCount = Subleaf;
+				break;
+			}
+
+			if (Subleaf >= SubleafCount)
+				break;
+
+			if (!VcpuCpuidCacheResult(Cache, Leaf, Subleaf, &Result))
+				return;
+		}
+	}
+}
+
+VMM_API
+VOID
+VcpuCpuidQuery(
+	_In_ PVCPU_CPUID_CACHE Cache,
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Out_ PX86_CPUID_ARGS Result
+)
+/*++
+Routine Description:
+	Gets the result of CPUID as seen by the guest, from the cache if possible or otherwise from the hardware
+--*/
+{
+	for (UINT32 i = 0; i < Cache->Count; i++)
+	{
+		const PVCPU_CPUID_ENTRY Entry = &Cache->Entries[i];
+
+		if (Entry->Leaf == Leaf && (Entry->Subleaf == VCPU_CPUID_ANY_SUBLEAF || Entry->Subleaf == Subleaf))
+		{
+			*Result = Entry->Result;
+			return;
+		}
+	}
+
+	__cpuidex(Result->Data, Leaf, Subleaf);
+	VcpuCpuidApplyPolicy(Leaf, Subleaf, Result);
+}
@@ -0,0 +1,50 @@
+#ifndef IMP_VCPU_CPUID_H
+#define IMP_VCPU_CPUID_H
+
+#include <arch/cpuid.h>
+
+// Maximum amount of leaf/subleaf results precomputed for each VCPU
+#define VCPU_CPUID_CACHE_SIZE 48
+// Subleaf of entries and policies that apply regardless of the value of ECX
+#define VCPU_CPUID_ANY_SUBLEAF 0xFFFFFFFF
+
+// Layout is hardcoded as CPUID_ENTRY in vmexit.asm
+typedef struct _VCPU_CPUID_ENTRY
+{
+	UINT32 Leaf;
+	UINT32 Subleaf;
+	X86_CPUID_ARGS Result;
+} VCPU_CPUID_ENTRY, *PVCPU_CPUID_ENTRY;
+
+// Results of every cacheable leaf with the CPUID policy already applied, filled on the VCPU's own core as
+// some results (APIC IDs, topology) are different for each core. Layout is hardcoded as CPUID_CACHE in vmexit.asm
+typedef struct _VCPU_CPUID_CACHE
+{
+	UINT32 Count;
+	VCPU_CPUID_ENTRY Entries[VCPU_CPUID_CACHE_SIZE];
+} VCPU_CPUID_CACHE, *PVCPU_CPUID_CACHE;
+
+// A rule of the CPUID policy, clears then sets bits of one output register of a leaf
+typedef struct _VCPU_CPUID_POLICY
+{
+	UINT32 Leaf;
+	UINT32 Subleaf;
+	UINT8 Reg;
+	UINT32 ClearMask;
+	UINT32 SetMask;
+} VCPU_CPUID_POLICY, *PVCPU_CPUID_POLICY;
+
+VOID
+VcpuCpuidFillCache(
+	_Out_ PVCPU_CPUID_CACHE Cache
+);
+
+VOID
+VcpuCpuidQuery(
+	_In_ PVCPU_CPUID_CACHE Cache,
+	_In_ UINT32 Leaf,
+	_In_ UINT32 Subleaf,
+	_Out_ PX86_CPUID_ARGS Result
+);
+
+#endif
@@ -374,14 +374,15 @@ Routine Description:
 	{
 	case EXCEPTION_NON_MASKABLE_INTERRUPT:
 	{
-#if 0
-		// Start exiting on NMI interrupt windows
-		VcpuSetControl(Vcpu, VMX_CTL_NMI_WINDOW_EXITING, TRUE);
-		// Queue a new NMI
+		// Kicks to invalidate the EPT are handled entirely in the host
+		if (VcpuHandleEptFlushNmi(Vcpu))
+			break;
+
+		// The exit being handled may already have an event to deliver on VM-entry, queue the NMI for the next
+		// NMI window instead of overwriting it. If the controls were already committed for this exit, it is
+		// delivered after the next one
 		InterlockedIncrement(&Vcpu->NumQueuedNMIs);
-#else
-		VmxInjectEvent(EXCEPTION_NMI, INTERRUPT_TYPE_NMI, 0);
-#endif
+		VcpuSetControl(Vcpu, VMX_CTL_NMI_WINDOW_EXITING, TRUE);
 	} break;
 	case 0xE1:
 	{
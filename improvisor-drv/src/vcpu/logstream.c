@@ -0,0 +1,294 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <vcpu/vmcall.h>
+#include <vcpu/logstream.h>
+#include <mm/vpte.h>
+#include <mm/mm.h>
+#include <spinlock.h>
+
+// The stream spans several pages which needn't be physically contiguous, each is translated once on registration
+#define VM_LOG_STREAM_PAGE_COUNT (BYTES_TO_PAGES(sizeof(HYPERCALL_LOG_STREAM)))
+
+typedef struct _VM_LOG_STREAM_STATE
+{
+	// Serialises draining, only one VCPU writes into the stream at a time
+	SPINLOCK Lock;
+	volatile BOOLEAN Active;
+	// Address space and process of the client that registered the stream
+	UINT64 DirBase;
+	ULONG_PTR OwnerId;
+	// The stream's pages are only known to still belong to the client while they translate to the same physical pages
+	UINT64 Stream;
+	UINT64 PhysPages[VM_LOG_STREAM_PAGE_COUNT];
+	// Bitmap of the pages checked to still be mapped since the lock was taken, see VmLogStreamIsOwnerMapped
+	UINT32 MappedPages;
+	// The head is owned by the VMM and kept here so the client can't corrupt it, the shared copy is only published
+	UINT32 Head;
+} VM_LOG_STREAM_STATE, *PVM_LOG_STREAM_STATE;
+
+C_ASSERT(VM_LOG_STREAM_PAGE_COUNT <= 32);
+
+VMM_DATA static VM_LOG_STREAM_STATE sLogStream;
+
+VMM_API
+UINT64
+VmLogStreamGetPhysAddr(
+	_In_ SIZE_T Offset
+)
+/*++
+Routine Description:
+	Returns the physical address of `Offset` bytes into the registered stream. Nothing in the stream straddles a
+	page boundary, so this is enough for any single field or entry
+--*/
+{
+	return sLogStream.PhysPages[Offset / PAGE_SIZE] + PAGE_OFFSET(Offset);
+}
+
+VMM_API
+NTSTATUS
+VmLogStreamRegister(
+	_In_ UINT64 GuestCr3,
+	_In_ ULONG_PTR OwnerId,
+	_In_ UINT64 Stream
+)
+/*++
+Routine Description:
+	Registers the log stream of the client process `OwnerId`. It must be page aligned and stay resident (locked) 
+	for as long as it is registered. The stream is unregistered once the client exits, or as soon as a drain 
+	finds any of its pages no longer mapped in the client's address space. Draining starts from whatever is 
+	pending, entries already retrieved through HYPERCALL_GET_LOG_RECORDS are never delivered again
+--*/
+{
+	if (PAGE_OFFSET(Stream) != 0)
+		return STATUS_INVALID_PARAMETER;
+
+	UINT64 PhysPages[VM_LOG_STREAM_PAGE_COUNT];
+
+	for (SIZE_T i = 0; i < VM_LOG_STREAM_PAGE_COUNT; i++)
+	{
+		NTSTATUS Status = MmTranslateGuestVirt(GuestCr3, Stream + i * PAGE_SIZE, &PhysPages[i]);
+		if (!NT_SUCCESS(Status))
+			return Status;
+	}
+
+	SpinLock(&sLogStream.Lock);
+
+	sLogStream.DirBase = GuestCr3;
+	sLogStream.OwnerId = OwnerId;
+	sLogStream.Stream = Stream;
+	RtlCopyMemory(sLogStream.PhysPages, PhysPages, sizeof(PhysPages));
+	sLogStream.Head = 0;
+
+	// Reset the VMM owned index in the shared page, the client resets its own
+	MmWriteGuestPhys(VmLogStreamGetPhysAddr(FIELD_OFFSET(HYPERCALL_LOG_STREAM, Head)), sizeof(UINT32), &sLogStream.Head);
+
+	sLogStream.Active = TRUE;
+
+	SpinUnlock(&sLogStream.Lock);
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+VmLogStreamUnregister(
+	VOID
+)
+/*++
+Routine Description:
+	Unregisters the current log stream, entries not yet drained stay in the VMM's rings
+--*/
+{
+	SpinLock(&sLogStream.Lock);
+	sLogStream.Active = FALSE;
+	SpinUnlock(&sLogStream.Lock);
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+VOID
+VmLogStreamReleaseProcess(
+	_In_ ULONG_PTR ProcessId
+)
+/*++
+Routine Description:
+	Unregisters the stream if it belongs to a process that is exiting, before its pages are freed along with its
+	address space
+--*/
+{
+	SpinLock(&sLogStream.Lock);
+
+	if (sLogStream.Active && sLogStream.OwnerId == ProcessId)
+		sLogStream.Active = FALSE;
+
+	SpinUnlock(&sLogStream.Lock);
+}
+
+VMM_API
+BOOLEAN
+VmLogStreamIsOwnerMapped(
+	_In_ SIZE_T Offset
+)
+/*++
+Routine Description:
+	Checks that the page `Offset` bytes into the stream still translates to the page resolved on registration in 
+	the client's address space. Once the client is gone it can be reused for anything, so the stream must not be 
+	written to again. Each page is only translated again once per drain. Must be called with the stream lock held
+--*/
+{
+	const SIZE_T Page = Offset / PAGE_SIZE;
+
+	if (sLogStream.MappedPages & (1UL << Page))
+		return TRUE;
+
+	UINT64 PhysAddr = 0;
+	if (!NT_SUCCESS(MmTranslateGuestVirt(sLogStream.DirBase, sLogStream.Stream + Page * PAGE_SIZE, &PhysAddr)) ||
+		PhysAddr != sLogStream.PhysPages[Page])
+		return FALSE;
+
+	sLogStream.MappedPages |= 1UL << Page;
+
+	return TRUE;
+}
+
+VMM_API
+BOOLEAN
+VmLogStreamOverlapsRange(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Checks if a physical range overlaps any page of the registered log stream
+--*/
+{
+	BOOLEAN Overlaps = FALSE;
+
+	SpinLock(&sLogStream.Lock);
+
+	for (SIZE_T i = 0; sLogStream.Active && i < VM_LOG_STREAM_PAGE_COUNT && !Overlaps; i++)
+		Overlaps = sLogStream.PhysPages[i] < PhysAddr + Size && PhysAddr < sLogStream.PhysPages[i] + PAGE_SIZE;
+
+	SpinUnlock(&sLogStream.Lock);
+
+	return Overlaps;
+}
+
+VMM_API
+BOOLEAN
+VmLogStreamDrain(
+	_In_ SIZE_T MaxCount,
+	_In_ BOOLEAN Wait
+)
+/*++
+Routine Description:
+	Moves up to `MaxCount` of the oldest log entries into the stream, stopping early once it is full. If `Wait`
+	is FALSE and another VCPU is already draining, this returns immediately. Returns FALSE if no stream is
+	registered
+--*/
+{
+	if (!sLogStream.Active)
+		return FALSE;
+
+	if (Wait)
+		SpinLock(&sLogStream.Lock);
+	else if (!SpinTryLock(&sLogStream.Lock))
+		return TRUE;
+
+	// The stream may have been unregistered while waiting for the lock
+	if (!sLogStream.Active)
+	{
+		SpinUnlock(&sLogStream.Lock);
+		return FALSE;
+	}
+
+	const UINT32 PrevHead = sLogStream.Head;
+	UINT32 Tail = 0;
+
+	sLogStream.MappedPages = 0;
+
+	if (!NT_SUCCESS(MmReadGuestPhys(VmLogStreamGetPhysAddr(FIELD_OFFSET(HYPERCALL_LOG_STREAM, Tail)), sizeof(UINT32), &Tail)))
+		goto unlock;
+
+	// A tail ahead of the head, or further behind than the stream can hold, means the client corrupted it
+	if (sLogStream.Head - Tail > VM_LOG_STREAM_ENTRY_COUNT)
+		goto unlock;
+
+	BOOLEAN Unmapped = FALSE;
+
+	for (SIZE_T i = 0; i < MaxCount && sLogStream.Head - Tail < VM_LOG_STREAM_ENTRY_COUNT; i++)
+	{
+		const SIZE_T EntryOffset = FIELD_OFFSET(HYPERCALL_LOG_STREAM, Entries) + 
+			sizeof(IMP_LOG_ENTRY) * (sLogStream.Head & (VM_LOG_STREAM_ENTRY_COUNT - 1));
+
+		// Checked before the entry leaves its ring, so it isn't lost if the stream is gone
+		if (!VmLogStreamIsOwnerMapped(EntryOffset))
+		{
+			Unmapped = TRUE;
+			break;
+		}
+
+		IMP_LOG_ENTRY Entry;
+		if (!NT_SUCCESS(ImpRetrieveLogEntry(&Entry)))
+			break;
+
+		// The entry has already left its ring, so it's lost if it can't be written
+		if (!NT_SUCCESS(MmWriteGuestPhys(VmLogStreamGetPhysAddr(EntryOffset), sizeof(IMP_LOG_ENTRY), &Entry)))
+			break;
+
+		sLogStream.Head++;
+	}
+
+	if (!Unmapped && sLogStream.Head != PrevHead && !VmLogStreamIsOwnerMapped(FIELD_OFFSET(HYPERCALL_LOG_STREAM, Head)))
+		Unmapped = TRUE;
+
+	if (Unmapped)
+	{
+		IMP_LOG_WARN(IMP_LOG_HYPERCALL, "Log stream pages of process %llu were unmapped, unregistering it...\n", (UINT64)sLogStream.OwnerId);
+
+		sLogStream.Active = FALSE;
+		SpinUnlock(&sLogStream.Lock);
+
+		return FALSE;
+	}
+
+	// Publish the new head after the entries, stores aren't reordered with other stores on x86
+	if (sLogStream.Head != PrevHead)
+	{
+		const UINT64 Overflows = ImpGetLogOverflowCount();
+
+		MmWriteGuestPhys(VmLogStreamGetPhysAddr(FIELD_OFFSET(HYPERCALL_LOG_STREAM, Overflows)), sizeof(UINT64), &Overflows);
+		MmWriteGuestPhys(VmLogStreamGetPhysAddr(FIELD_OFFSET(HYPERCALL_LOG_STREAM, Head)), sizeof(UINT32), &sLogStream.Head);
+	}
+
+unlock:
+	SpinUnlock(&sLogStream.Lock);
+
+	return TRUE;
+}
+
+VMM_API
+VOID
+VmLogStreamHandleExit(
+	VOID
+)
+/*++
+Routine Description:
+	Drains a bounded batch of entries into the stream on any VM-exit, but only once at least as many entries as 
+	the client is waiting for are pending
+--*/
+{
+	if (!sLogStream.Active)
+		return;
+
+	UINT32 WaitCount = 0;
+	if (!NT_SUCCESS(MmReadGuestPhys(VmLogStreamGetPhysAddr(FIELD_OFFSET(HYPERCALL_LOG_STREAM, WaitCount)), sizeof(UINT32), &WaitCount)))
+		return;
+
+	const UINT64 Pending = ImpGetPendingLogCount();
+	if (Pending == 0 || Pending < WaitCount)
+		return;
+
+	VmLogStreamDrain(VM_LOG_STREAM_DRAIN_BATCH, FALSE);
+}
@@ -0,0 +1,43 @@
+#ifndef IMP_LOGSTREAM_H
+#define IMP_LOGSTREAM_H
+
+#include <vcpu/vcpu.h>
+
+// Maximum amount of entries drained into the log stream by a single VM-exit, bounds the time spent in it
+#define VM_LOG_STREAM_DRAIN_BATCH 64
+
+NTSTATUS
+VmLogStreamRegister(
+	_In_ UINT64 GuestCr3,
+	_In_ ULONG_PTR OwnerId,
+	_In_ UINT64 Stream
+);
+
+NTSTATUS
+VmLogStreamUnregister(
+	VOID
+);
+
+VOID
+VmLogStreamReleaseProcess(
+	_In_ ULONG_PTR ProcessId
+);
+
+BOOLEAN
+VmLogStreamOverlapsRange(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+);
+
+BOOLEAN
+VmLogStreamDrain(
+	_In_ SIZE_T MaxCount,
+	_In_ BOOLEAN Wait
+);
+
+VOID
+VmLogStreamHandleExit(
+	VOID
+);
+
+#endif
@@ -0,0 +1,178 @@
+#include <improvisor.h>
+#include <arch/msr.h>
+#include <vcpu/msr.h>
+#include <intrin.h>
+
+typedef enum _VCPU_MSR_ACTION
+{
+	// Accesses don't cause VM-exits, unless the MSR is outside of the ranges covered by the MSR bitmap in which
+	// case they are performed on the hardware
+	MSR_PASSTHROUGH,
+	// Accesses are performed on the VCPU's shadow value of the MSR, which starts out as the hardware value
+	MSR_EMULATE,
+	// Accesses are logged then performed on the hardware
+	MSR_LOG
+} VCPU_MSR_ACTION, *PVCPU_MSR_ACTION;
+
+typedef struct _VCPU_MSR_POLICY
+{
+	UINT32 Msr;
+	VCPU_MSR_ACTION Read;
+	VCPU_MSR_ACTION Write;
+} VCPU_MSR_POLICY, *PVCPU_MSR_POLICY;
+
+// Every MSR which isn't simply passed through, this must stay sorted by MSR as it is binary searched on each
+// RDMSR/WRMSR exit. The index of an entry is also the index of its shadow value in VCPU::MsrShadows
+VMM_RDATA static const VCPU_MSR_POLICY sMsrPolicy[] = {
+	// Report the value from before VmxEnableVmxon set and locked it
+	{ IA32_FEATURE_CONTROL, MSR_EMULATE, MSR_EMULATE },
+	// Log changes to the system call entry points
+	{ IA32_SYSENTER_EIP, MSR_PASSTHROUGH, MSR_LOG },
+	{ IA32_LSTAR, MSR_PASSTHROUGH, MSR_LOG },
+	{ IA32_CSTAR, MSR_PASSTHROUGH, MSR_LOG }
+};
+
+C_ASSERT(sizeof(sMsrPolicy) / sizeof(*sMsrPolicy) <= VCPU_MAX_MSR_POLICIES);
+
+VSC_API
+NTSTATUS
+VcpuMsrApplyPolicy(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Compiles the MSR policy into the VCPU's MSR bitmap, every MSR starts out passed through
+--*/
+{
+	for (SIZE_T i = 0; i < sizeof(sMsrPolicy) / sizeof(*sMsrPolicy); i++)
+	{
+		if (i != 0 && sMsrPolicy[i - 1].Msr >= sMsrPolicy[i].Msr)
+		{
+			ImpDebugPrint("MSR policy isn't sorted at %X...\n", sMsrPolicy[i].Msr);
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		if (sMsrPolicy[i].Read != MSR_PASSTHROUGH)
+			VcpuToggleExitOnMsr(Vcpu, sMsrPolicy[i].Msr, MSR_READ);
+
+		if (sMsrPolicy[i].Write != MSR_PASSTHROUGH)
+			VcpuToggleExitOnMsr(Vcpu, sMsrPolicy[i].Msr, MSR_WRITE);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VSC_API
+VOID
+VcpuMsrInitialiseShadows(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Initialises the shadow values of emulated MSRs to their hardware values, this must run on the core the VCPU
+	belongs to and before VMX operation is enabled
+--*/
+{
+	for (SIZE_T i = 0; i < sizeof(sMsrPolicy) / sizeof(*sMsrPolicy); i++)
+	{
+		if (sMsrPolicy[i].Read == MSR_EMULATE || sMsrPolicy[i].Write == MSR_EMULATE)
+			Vcpu->MsrShadows[i] = __readmsr(sMsrPolicy[i].Msr);
+	}
+}
+
+VMM_API
+SSIZE_T
+VcpuMsrFindPolicy(
+	_In_ UINT32 Msr
+)
+/*++
+Routine Description:
+	Binary searches the MSR policy, returning the index of the MSR's entry or -1 if it has none
+--*/
+{
+	SSIZE_T Low = 0;
+	SSIZE_T High = sizeof(sMsrPolicy) / sizeof(*sMsrPolicy) - 1;
+
+	while (Low <= High)
+	{
+		const SSIZE_T Mid = (Low + High) / 2;
+
+		if (sMsrPolicy[Mid].Msr == Msr)
+			return Mid;
+
+		if (sMsrPolicy[Mid].Msr < Msr)
+			Low = Mid + 1;
+		else
+			High = Mid - 1;
+	}
+
+	return -1;
+}
+
+VMM_API
+BOOLEAN
+VcpuMsrRead(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT32 Msr,
+	_Out_ PUINT64 Value
+)
+/*++
+Routine Description:
+	Emulates a guest RDMSR according to the MSR policy, returns FALSE if the MSR has no policy entry and the read
+	should fault
+--*/
+{
+	const SSIZE_T Index = VcpuMsrFindPolicy(Msr);
+	if (Index < 0)
+		return FALSE;
+
+	switch (sMsrPolicy[Index].Read)
+	{
+	case MSR_EMULATE:
+		*Value = Vcpu->MsrShadows[Index];
+		break;
+	case MSR_LOG:
+		*Value = __readmsr(Msr);
+		IMP_LOG_INFO(IMP_LOG_MSR, "[%02X] RDMSR %X = %llX\n", Vcpu->Id, Msr, *Value);
+		break;
+	default:
+		*Value = __readmsr(Msr);
+		break;
+	}
+
+	return TRUE;
+}
+
+VMM_API
+BOOLEAN
+VcpuMsrWrite(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT32 Msr,
+	_In_ UINT64 Value
+)
+/*++
+Routine Description:
+	Emulates a guest WRMSR according to the MSR policy, returns FALSE if the MSR has no policy entry and the write
+	should fault
+--*/
+{
+	const SSIZE_T Index = VcpuMsrFindPolicy(Msr);
+	if (Index < 0)
+		return FALSE;
+
+	switch (sMsrPolicy[Index].Write)
+	{
+	case MSR_EMULATE:
+		Vcpu->MsrShadows[Index] = Value;
+		break;
+	case MSR_LOG:
+		IMP_LOG_INFO(IMP_LOG_MSR, "[%02X] WRMSR %X = %llX (was %llX)\n", Vcpu->Id, Msr, Value, __readmsr(Msr));
+		__writemsr(Msr, Value);
+		break;
+	default:
+		__writemsr(Msr, Value);
+		break;
+	}
+
+	return TRUE;
+}
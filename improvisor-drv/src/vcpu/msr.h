@@ -0,0 +1,30 @@
+#ifndef IMP_VCPU_MSR_H
+#define IMP_VCPU_MSR_H
+
+#include <vcpu/vcpu.h>
+
+NTSTATUS
+VcpuMsrApplyPolicy(
+	_Inout_ PVCPU Vcpu
+);
+
+VOID
+VcpuMsrInitialiseShadows(
+	_Inout_ PVCPU Vcpu
+);
+
+BOOLEAN
+VcpuMsrRead(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT32 Msr,
+	_Out_ PUINT64 Value
+);
+
+BOOLEAN
+VcpuMsrWrite(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT32 Msr,
+	_In_ UINT64 Value
+);
+
+#endif
@@ -0,0 +1,366 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <vcpu/vmcall.h>
+#include <vcpu/ring.h>
+#include <mm/vpte.h>
+#include <mm/mm.h>
+#include <spinlock.h>
+#include <vmx.h>
+
+typedef struct _VM_RING_STATE
+{
+	// Serialises draining, only one VCPU processes the ring at a time
+	SPINLOCK Lock;
+	volatile BOOLEAN Active;
+	// Address space of the client that registered the ring, used to translate submitted addresses
+	UINT64 DirBase;
+	ULONG_PTR OwnerId;
+	// The ring pages are only known to still belong to the client while these translate to the same physical pages
+	UINT64 SubmissionRing;
+	UINT64 CompletionRing;
+	UINT64 SubmissionPhysAddr;
+	UINT64 CompletionPhysAddr;
+	// Indices owned by the VMM are kept here so the client can't corrupt them, the shared copies are only published
+	UINT32 SubmissionHead;
+	UINT32 CompletionTail;
+} VM_RING_STATE, *PVM_RING_STATE;
+
+VMM_DATA static VM_RING_STATE sRing;
+
+VMM_API
+NTSTATUS
+VmRingRegister(
+	_In_ UINT64 GuestCr3,
+	_In_ ULONG_PTR OwnerId,
+	_In_ UINT64 SubmissionRing,
+	_In_ UINT64 CompletionRing
+)
+/*++
+Routine Description:
+	Registers the submission and completion ring pages of the client process `OwnerId`. Both must be page aligned 
+	and stay resident (locked) for as long as they are registered. The ring is unregistered once the client exits, 
+	or as soon as a drain finds the pages no longer mapped in its address space
+--*/
+{
+	if (PAGE_OFFSET(SubmissionRing) != 0 || PAGE_OFFSET(CompletionRing) != 0)
+		return STATUS_INVALID_PARAMETER;
+
+	UINT64 SubmissionPhysAddr = 0, CompletionPhysAddr = 0;
+
+	NTSTATUS Status = MmTranslateGuestVirt(GuestCr3, SubmissionRing, &SubmissionPhysAddr);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	Status = MmTranslateGuestVirt(GuestCr3, CompletionRing, &CompletionPhysAddr);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	SpinLock(&sRing.Lock);
+
+	sRing.DirBase = GuestCr3;
+	sRing.OwnerId = OwnerId;
+	sRing.SubmissionRing = SubmissionRing;
+	sRing.CompletionRing = CompletionRing;
+	sRing.SubmissionPhysAddr = SubmissionPhysAddr;
+	sRing.CompletionPhysAddr = CompletionPhysAddr;
+	sRing.SubmissionHead = 0;
+	sRing.CompletionTail = 0;
+
+	// Reset the VMM owned indices in the shared pages, the client resets its own
+	MmWriteGuestPhys(SubmissionPhysAddr + FIELD_OFFSET(HYPERCALL_SUBMISSION_RING, Head), sizeof(UINT32), &sRing.SubmissionHead);
+	MmWriteGuestPhys(CompletionPhysAddr + FIELD_OFFSET(HYPERCALL_COMPLETION_RING, Tail), sizeof(UINT32), &sRing.CompletionTail);
+
+	sRing.Active = TRUE;
+
+	SpinUnlock(&sRing.Lock);
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+VmRingUnregister(
+	VOID
+)
+/*++
+Routine Description:
+	Unregisters the current ring pair, pending submissions are dropped
+--*/
+{
+	SpinLock(&sRing.Lock);
+	sRing.Active = FALSE;
+	SpinUnlock(&sRing.Lock);
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+VOID
+VmRingReleaseProcess(
+	_In_ ULONG_PTR ProcessId
+)
+/*++
+Routine Description:
+	Unregisters the ring if it belongs to a process that is exiting, before its pages are freed along with its 
+	address space
+--*/
+{
+	SpinLock(&sRing.Lock);
+
+	if (sRing.Active && sRing.OwnerId == ProcessId)
+		sRing.Active = FALSE;
+
+	SpinUnlock(&sRing.Lock);
+}
+
+VMM_API
+BOOLEAN
+VmRingIsOwnerMapped(VOID)
+/*++
+Routine Description:
+	Checks that both ring pages still translate to the pages resolved on registration in the client's address 
+	space. Once the client is gone they can be reused for anything, so the ring must not be written to again. Must
+	be called with the ring lock held
+--*/
+{
+	UINT64 SubmissionPhysAddr = 0, CompletionPhysAddr = 0;
+
+	return NT_SUCCESS(MmTranslateGuestVirt(sRing.DirBase, sRing.SubmissionRing, &SubmissionPhysAddr)) &&
+		NT_SUCCESS(MmTranslateGuestVirt(sRing.DirBase, sRing.CompletionRing, &CompletionPhysAddr)) &&
+		SubmissionPhysAddr == sRing.SubmissionPhysAddr && CompletionPhysAddr == sRing.CompletionPhysAddr;
+}
+
+VMM_API
+BOOLEAN
+VmRingOverlapsRange(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Checks if a physical range overlaps either page of the registered ring pair
+--*/
+{
+	SpinLock(&sRing.Lock);
+
+	const BOOLEAN Overlaps = sRing.Active && (
+		(sRing.SubmissionPhysAddr < PhysAddr + Size && PhysAddr < sRing.SubmissionPhysAddr + PAGE_SIZE) ||
+		(sRing.CompletionPhysAddr < PhysAddr + Size && PhysAddr < sRing.CompletionPhysAddr + PAGE_SIZE));
+
+	SpinUnlock(&sRing.Lock);
+
+	return Overlaps;
+}
+
+VMM_API
+BOOLEAN
+VmRingIsSupportedHypercall(
+	_In_ UINT64 Id
+)
+/*++
+Routine Description:
+	Only hypercalls that don't depend on or change the state of the VCPU that happens to drain the ring can be
+	submitted through it
+--*/
+{
+	switch (Id)
+	{
+	case HYPERCALL_READ_VIRT:
+	case HYPERCALL_WRITE_VIRT:
+	case HYPERCALL_READ_VIRT_BATCH:
+	case HYPERCALL_WRITE_VIRT_BATCH:
+	case HYPERCALL_GET_VPTE_COUNT:
+	case HYPERCALL_GET_VTLB_STATS:
+	case HYPERCALL_SET_LOG_CATEGORIES:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+VMM_API
+UINT64
+VmRingExecute(
+	_Inout_ PVCPU Vcpu,
+	_In_ PHYPERCALL_RING_SUBMISSION Submission
+)
+/*++
+Routine Description:
+	Executes a single submission as if its fields were passed through registers to VMCALL, returning the result
+--*/
+{
+	if (!VmRingIsSupportedHypercall(Submission->Id))
+		return HRESULT_RING_UNSUPPORTED_HCID;
+
+	GUEST_STATE GuestState = {
+		.Rax = Submission->Id,
+		.Rbx = Submission->Ext,
+		.Rcx = Submission->Buffer,
+		.Rdx = Submission->Target
+	};
+
+	HYPERCALL_INFO Hypercall = {
+		.Id = Submission->Id,
+		.Result = HRESULT_SUCCESS
+	};
+
+	VmDispatchHypercall(Vcpu, sRing.DirBase, &GuestState, &Hypercall);
+
+	return Hypercall.Result;
+}
+
+VMM_API
+BOOLEAN
+VmRingDrain(
+	_Inout_ PVCPU Vcpu,
+	_In_ SIZE_T MaxCount,
+	_In_ BOOLEAN Wait
+)
+/*++
+Routine Description:
+	Processes up to `MaxCount` pending submissions, stopping early once the submission ring is empty or the 
+	completion ring is full. If `Wait` is FALSE and another VCPU is already draining, this returns immediately. 
+	Returns FALSE if no ring is registered
+--*/
+{
+	if (!sRing.Active)
+		return FALSE;
+
+	if (Wait)
+		SpinLock(&sRing.Lock);
+	else if (!SpinTryLock(&sRing.Lock))
+		return TRUE;
+
+	// The ring may have been unregistered while waiting for the lock
+	if (!sRing.Active)
+	{
+		SpinUnlock(&sRing.Lock);
+		return FALSE;
+	}
+
+	const UINT32 PrevSubmissionHead = sRing.SubmissionHead;
+	UINT32 SubmissionTail = 0, CompletionHead = 0;
+
+	if (!NT_SUCCESS(MmReadGuestPhys(sRing.SubmissionPhysAddr + FIELD_OFFSET(HYPERCALL_SUBMISSION_RING, Tail), sizeof(UINT32), &SubmissionTail)) ||
+		!NT_SUCCESS(MmReadGuestPhys(sRing.CompletionPhysAddr + FIELD_OFFSET(HYPERCALL_COMPLETION_RING, Head), sizeof(UINT32), &CompletionHead)))
+		goto unlock;
+
+	if (SubmissionTail == sRing.SubmissionHead)
+		goto unlock;
+
+	// Nothing is written back until the pages are known to still belong to the client
+	if (!VmRingIsOwnerMapped())
+	{
+		IMP_LOG_WARN(IMP_LOG_HYPERCALL, "Ring pages of process %llu were unmapped, unregistering it...\n", (UINT64)sRing.OwnerId);
+
+		sRing.Active = FALSE;
+		SpinUnlock(&sRing.Lock);
+
+		return FALSE;
+	}
+
+	// A tail further ahead than the ring can hold means the client corrupted it, ignore the ring until it's fixed
+	if (SubmissionTail - sRing.SubmissionHead > VM_RING_ENTRY_COUNT)
+		goto unlock;
+
+	for (SIZE_T i = 0; i < MaxCount && sRing.SubmissionHead != SubmissionTail && 
+		sRing.CompletionTail - CompletionHead < VM_RING_ENTRY_COUNT; i++)
+	{
+		HYPERCALL_RING_SUBMISSION Submission = { 0 };
+
+		const UINT64 SubmissionAddr = sRing.SubmissionPhysAddr + FIELD_OFFSET(HYPERCALL_SUBMISSION_RING, Entries) + 
+			sizeof(HYPERCALL_RING_SUBMISSION) * (sRing.SubmissionHead & (VM_RING_ENTRY_COUNT - 1));
+
+		if (!NT_SUCCESS(MmReadGuestPhys(SubmissionAddr, sizeof(HYPERCALL_RING_SUBMISSION), &Submission)))
+			break;
+
+		HYPERCALL_RING_COMPLETION Completion = {
+			.UserData = Submission.UserData,
+			.Result = VmRingExecute(Vcpu, &Submission)
+		};
+
+		const UINT64 CompletionAddr = sRing.CompletionPhysAddr + FIELD_OFFSET(HYPERCALL_COMPLETION_RING, Entries) + 
+			sizeof(HYPERCALL_RING_COMPLETION) * (sRing.CompletionTail & (VM_RING_ENTRY_COUNT - 1));
+
+		if (!NT_SUCCESS(MmWriteGuestPhys(CompletionAddr, sizeof(HYPERCALL_RING_COMPLETION), &Completion)))
+			break;
+
+		sRing.SubmissionHead++;
+		sRing.CompletionTail++;
+	}
+
+	// Publish the new indices after the completions, stores aren't reordered with other stores on x86
+	if (sRing.SubmissionHead != PrevSubmissionHead)
+	{
+		MmWriteGuestPhys(sRing.CompletionPhysAddr + FIELD_OFFSET(HYPERCALL_COMPLETION_RING, Tail), sizeof(UINT32), &sRing.CompletionTail);
+		MmWriteGuestPhys(sRing.SubmissionPhysAddr + FIELD_OFFSET(HYPERCALL_SUBMISSION_RING, Head), sizeof(UINT32), &sRing.SubmissionHead);
+	}
+
+unlock:
+	SpinUnlock(&sRing.Lock);
+
+	return TRUE;
+}
+
+VMM_API
+VOID
+VmRingArmTick(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Arms the VMX preemption timer so this VCPU periodically drains the ring even without natural exits
+--*/
+{
+	VcpuSetControl(Vcpu, VMX_CTL_SAVE_VMX_PREEMPTION_VALUE, TRUE);
+	VcpuSetControl(Vcpu, VMX_CTL_VMX_PREEMPTION_TIMER, TRUE);
+
+	VmxCacheWrite(&Vcpu->Vmx, GUEST_VMX_PREEMPTION_TIMER_VALUE, VM_RING_TICK_QUANTUM);
+
+	Vcpu->RingTickArmed = TRUE;
+}
+
+VMM_API
+VOID
+VmRingHandleExit(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Drains a bounded batch of submissions opportunistically on any VM-exit, and arms the drain tick on VCPUs that haven't got it yet.
+	The TSC watchdog owns the preemption timer while spoofing, the tick is rearmed once it expires
+--*/
+{
+	if (!sRing.Active)
+		return;
+
+	if (!Vcpu->RingTickArmed && !Vcpu->Tsc.SpoofEnabled && VcpuIsControlSupported(Vcpu, VMX_CTL_VMX_PREEMPTION_TIMER))
+		VmRingArmTick(Vcpu);
+
+	VmRingDrain(Vcpu, VM_RING_DRAIN_BATCH, FALSE);
+}
+
+VMM_API
+VOID
+VmRingHandleTick(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Handles expiry of the preemption timer for the ring, rearming it while a ring is registered and disarming it
+	otherwise
+--*/
+{
+	if (sRing.Active)
+	{
+		VmRingDrain(Vcpu, VM_RING_DRAIN_BATCH, FALSE);
+		VmRingArmTick(Vcpu);
+	}
+	else if (Vcpu->RingTickArmed)
+	{
+		VcpuSetControl(Vcpu, VMX_CTL_SAVE_VMX_PREEMPTION_VALUE, FALSE);
+		VcpuSetControl(Vcpu, VMX_CTL_VMX_PREEMPTION_TIMER, FALSE);
+
+		Vcpu->RingTickArmed = FALSE;
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef IMP_RING_H
+#define IMP_RING_H
+
+#include <vcpu/vcpu.h>
+
+// The value of the VMX preemption timer used to periodically drain the submission ring
+#define VM_RING_TICK_QUANTUM 0x100000
+
+// Maximum amount of submissions executed by a single VM-exit or tick, bounds the time spent in it
+#define VM_RING_DRAIN_BATCH 16
+
+NTSTATUS
+VmRingRegister(
+	_In_ UINT64 GuestCr3,
+	_In_ ULONG_PTR OwnerId,
+	_In_ UINT64 SubmissionRing,
+	_In_ UINT64 CompletionRing
+);
+
+NTSTATUS
+VmRingUnregister(
+	VOID
+);
+
+VOID
+VmRingReleaseProcess(
+	_In_ ULONG_PTR ProcessId
+);
+
+BOOLEAN
+VmRingOverlapsRange(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+);
+
+BOOLEAN
+VmRingDrain(
+	_Inout_ PVCPU Vcpu,
+	_In_ SIZE_T MaxCount,
+	_In_ BOOLEAN Wait
+);
+
+VOID
+VmRingHandleExit(
+	_Inout_ PVCPU Vcpu
+);
+
+VOID
+VmRingHandleTick(
+	_Inout_ PVCPU Vcpu
+);
+
+#endif
@@ -0,0 +1,157 @@
+#include <improvisor.h>
+#include <vcpu/sigscan.h>
+#include <intrin.h>
+
+// Rough frequency class of bytes in x64 code and data, the rarest fully masked byte is used as the anchor
+VMM_RDATA static const UCHAR sCommonBytes[] = {
+	0x00, 0xFF, 0xCC, 0x48, 0x8B, 0x89, 0x0F, 0xE8, 0x4C, 0x24, 0x90, 0x01, 0x44, 0x85, 0xC0, 0x83, 0x74, 0x75, 0xC3, 0x10
+};
+
+VMM_API
+SIZE_T
+SigGetByteCommonness(
+	_In_ UCHAR Byte
+)
+/*++
+Routine Description:
+	Returns how common a byte is, lower is rarer. Bytes not in the table are assumed rare
+--*/
+{
+	for (SIZE_T i = 0; i < sizeof(sCommonBytes) / sizeof(*sCommonBytes); i++)
+	{
+		if (sCommonBytes[i] == Byte)
+			return sizeof(sCommonBytes) / sizeof(*sCommonBytes) - i;
+	}
+
+	return 0;
+}
+
+VMM_API
+NTSTATUS
+SigPreparePattern(
+	_Out_ PSIG_PATTERN Pattern,
+	_In_ PUCHAR Bytes,
+	_In_ PUCHAR Mask,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Prepares a pattern for scanning, each mask byte selects the bits of the corresponding pattern byte that must 
+	match. At least one byte must be fully masked to act as the prefilter anchor
+--*/
+{
+	if (Size == 0 || Size > SIG_MAX_PATTERN_SIZE)
+		return STATUS_INVALID_PARAMETER;
+
+	Pattern->Size = Size;
+	// `Size` is used as an invalid index until an anchor is found
+	Pattern->AnchorIndex = Size;
+
+	for (SIZE_T i = 0; i < Size; i++)
+	{
+		Pattern->Mask[i] = Mask[i];
+		Pattern->Bytes[i] = Bytes[i] & Mask[i];
+
+		if (Mask[i] != 0xFF)
+			continue;
+
+		if (Pattern->AnchorIndex == Size ||
+			SigGetByteCommonness(Bytes[i]) < SigGetByteCommonness(Pattern->Bytes[Pattern->AnchorIndex]))
+			Pattern->AnchorIndex = i;
+	}
+
+	if (Pattern->AnchorIndex == Size)
+		return STATUS_INVALID_PARAMETER;
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+BOOLEAN
+SigVerifyMatch(
+	_In_ PSIG_PATTERN Pattern,
+	_In_ PUCHAR Data
+)
+/*++
+Routine Description:
+	Checks the whole pattern against `Data`
+--*/
+{
+	for (SIZE_T i = 0; i < Pattern->Size; i++)
+	{
+		if ((Data[i] & Pattern->Mask[i]) != Pattern->Bytes[i])
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+VMM_API
+BOOLEAN
+SigScanBuffer(
+	_In_ PSIG_PATTERN Pattern,
+	_In_ PUCHAR Data,
+	_In_ SIZE_T Size,
+	_In_ SIZE_T StartLimit,
+	_In_ PSIG_MATCH_CALLBACK Callback,
+	_In_ PVOID Context
+)
+/*++
+Routine Description:
+	Scans `Data` for every match of `Pattern` that lies entirely inside it and starts before `StartLimit`, calling
+	`Callback` with the offset of each in ascending order. Candidates are found by comparing 16 bytes at a time 
+	against the anchor byte with SSE2, and only those are verified. Returns FALSE if the callback stopped the scan
+--*/
+{
+	if (Size < Pattern->Size)
+		return TRUE;
+
+	// The last offset a match can start at
+	SIZE_T LastStart = Size - Pattern->Size;
+	if (StartLimit <= LastStart)
+	{
+		if (StartLimit == 0)
+			return TRUE;
+
+		LastStart = StartLimit - 1;
+	}
+
+	const SIZE_T Anchor = Pattern->AnchorIndex;
+	const __m128i AnchorBytes = _mm_set1_epi8((CHAR)Pattern->Bytes[Anchor]);
+
+	// Anchor positions scanned are [Anchor, LastStart + Anchor]
+	SIZE_T Position = Anchor;
+	const SIZE_T LastPosition = LastStart + Anchor;
+
+	while (Position + 16 <= LastPosition + 1)
+	{
+		const __m128i Block = _mm_loadu_si128((__m128i*)(Data + Position));
+		ULONG Candidates = (ULONG)_mm_movemask_epi8(_mm_cmpeq_epi8(Block, AnchorBytes));
+
+		while (Candidates != 0)
+		{
+			ULONG Bit = 0;
+			_BitScanForward(&Bit, Candidates);
+			Candidates &= Candidates - 1;
+
+			const SIZE_T Start = Position + Bit - Anchor;
+			if (SigVerifyMatch(Pattern, Data + Start) && !Callback(Context, Start))
+				return FALSE;
+		}
+
+		Position += 16;
+	}
+
+	// Scalar tail for the remaining positions that don't fill a whole block
+	for (; Position <= LastPosition; Position++)
+	{
+		if (Data[Position] != Pattern->Bytes[Anchor])
+			continue;
+
+		const SIZE_T Start = Position - Anchor;
+		if (SigVerifyMatch(Pattern, Data + Start) && !Callback(Context, Start))
+			return FALSE;
+	}
+
+	return TRUE;
+}
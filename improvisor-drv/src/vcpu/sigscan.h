@@ -0,0 +1,51 @@
+#ifndef IMP_SIGSCAN_H
+#define IMP_SIGSCAN_H
+
+#include <ntdef.h>
+
+// Maximum length of a signature pattern
+#define SIG_MAX_PATTERN_SIZE 256
+
+// A prepared signature, `Bytes` is pre-masked so a byte matches if (Data & Mask) == Bytes
+typedef struct _SIG_PATTERN
+{
+	SIZE_T Size;
+	// Index of the byte used for the SIMD prefilter, always a fully masked byte
+	SIZE_T AnchorIndex;
+	UCHAR Bytes[SIG_MAX_PATTERN_SIZE];
+	UCHAR Mask[SIG_MAX_PATTERN_SIZE];
+} SIG_PATTERN, *PSIG_PATTERN;
+
+// Called for every match, return FALSE to stop scanning
+typedef BOOLEAN SIG_MATCH_CALLBACK(
+	_In_ PVOID Context,
+	_In_ SIZE_T Offset
+);
+
+typedef SIG_MATCH_CALLBACK* PSIG_MATCH_CALLBACK;
+
+NTSTATUS
+SigPreparePattern(
+	_Out_ PSIG_PATTERN Pattern,
+	_In_ PUCHAR Bytes,
+	_In_ PUCHAR Mask,
+	_In_ SIZE_T Size
+);
+
+BOOLEAN
+SigVerifyMatch(
+	_In_ PSIG_PATTERN Pattern,
+	_In_ PUCHAR Data
+);
+
+BOOLEAN
+SigScanBuffer(
+	_In_ PSIG_PATTERN Pattern,
+	_In_ PUCHAR Data,
+	_In_ SIZE_T Size,
+	_In_ SIZE_T StartLimit,
+	_In_ PSIG_MATCH_CALLBACK Callback,
+	_In_ PVOID Context
+);
+
+#endif
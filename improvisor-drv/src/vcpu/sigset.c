@@ -0,0 +1,349 @@
+#include <improvisor.h>
+#include <vcpu/sigset.h>
+
+VMM_API
+VOID
+SigSetInitialise(
+	_Out_ PSIG_SET Set
+)
+/*++
+Routine Description:
+	Empties a signature set, leaving only the root state
+--*/
+{
+	Set->PatternCount = 0;
+	Set->StateCount = 1;
+	Set->DenseCount = 1;
+
+	RtlZeroMemory(&Set->States[0], sizeof(SIG_SET_STATE));
+	RtlZeroMemory(Set->Dense[0], sizeof(Set->Dense[0]));
+
+	Set->DenseStates[0] = 0;
+}
+
+VMM_API
+UINT16
+SigSetFindChild(
+	_In_ PSIG_SET Set,
+	_In_ UINT16 State,
+	_In_ UCHAR Byte
+)
+/*++
+Routine Description:
+	Returns the child of `State` reached through `Byte`, or 0 if there is none
+--*/
+{
+	for (UINT16 Child = Set->States[State].FirstChild; Child != 0; Child = Set->States[Child].NextSibling)
+	{
+		if (Set->States[Child].Byte == Byte)
+			return Child;
+	}
+
+	return 0;
+}
+
+VMM_API
+NTSTATUS
+SigSetAddPattern(
+	_Inout_ PSIG_SET Set,
+	_In_ PUCHAR Bytes,
+	_In_ PUCHAR Mask,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Adds a masked pattern to the set, its ID is the amount of patterns added before it. The set must be compiled
+	again before scanning
+--*/
+{
+	if (Set->PatternCount >= SIG_SET_MAX_PATTERNS)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	PSIG_SET_ENTRY Entry = &Set->Patterns[Set->PatternCount];
+
+	NTSTATUS Status = SigPreparePattern(&Entry->Pattern, Bytes, Mask, Size);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	// Find the longest run of fully masked bytes, at least one exists as the pattern has an anchor
+	Entry->KeyOffset = 0;
+	Entry->KeySize = 0;
+
+	for (SIZE_T i = 0, RunStart = 0; i < Size; i++)
+	{
+		if (Mask[i] != 0xFF)
+		{
+			RunStart = i + 1;
+			continue;
+		}
+
+		if (i + 1 - RunStart > Entry->KeySize)
+		{
+			Entry->KeyOffset = RunStart;
+			Entry->KeySize = i + 1 - RunStart;
+		}
+	}
+
+	if (Set->StateCount + Entry->KeySize > SIG_SET_MAX_STATES)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	// Insert the key into the trie
+	UINT16 State = 0;
+	for (SIZE_T i = 0; i < Entry->KeySize; i++)
+	{
+		const UCHAR Byte = Entry->Pattern.Bytes[Entry->KeyOffset + i];
+
+		UINT16 Child = SigSetFindChild(Set, State, Byte);
+		if (Child == 0)
+		{
+			Child = (UINT16)Set->StateCount++;
+
+			PSIG_SET_STATE NewState = &Set->States[Child];
+			RtlZeroMemory(NewState, sizeof(SIG_SET_STATE));
+
+			NewState->Byte = Byte;
+			NewState->NextSibling = Set->States[State].FirstChild;
+			Set->States[State].FirstChild = Child;
+		}
+
+		State = Child;
+	}
+
+	Entry->NextSameKey = Set->States[State].FirstPattern;
+	Set->States[State].FirstPattern = (UINT16)++Set->PatternCount;
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+BOOLEAN
+SigSetIsPattern(
+	_In_ PSIG_SET Set,
+	_In_ SIZE_T PatternId,
+	_In_ PUCHAR Bytes,
+	_In_ PUCHAR Mask,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Checks if pattern `PatternId` of the set was added from the same masked bytes, so a compiled set can be reused
+	for the same patterns
+--*/
+{
+	if (PatternId >= Set->PatternCount)
+		return FALSE;
+
+	PSIG_PATTERN Pattern = &Set->Patterns[PatternId].Pattern;
+
+	if (Pattern->Size != Size)
+		return FALSE;
+
+	for (SIZE_T i = 0; i < Size; i++)
+	{
+		if (Pattern->Mask[i] != Mask[i] || Pattern->Bytes[i] != (Bytes[i] & Mask[i]))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+VMM_API
+UINT16
+SigSetEncodeNext(
+	_In_ PSIG_SET Set,
+	_In_ UINT16 State
+)
+/*++
+Routine Description:
+	Returns the transition table entry leading to `State`
+--*/
+{
+	PSIG_SET_STATE Target = &Set->States[State];
+
+	const UINT16 Next = Target->DenseIndex != SIG_SET_SPARSE_STATE ? Target->DenseIndex : (State | SIG_SET_NEXT_SPARSE);
+
+	return Target->FirstPattern != 0 || Target->OutputLink != 0 ? (Next | SIG_SET_NEXT_OUTPUT) : Next;
+}
+
+VMM_API
+UINT16
+SigSetDecodeNext(
+	_In_ PSIG_SET Set,
+	_In_ UINT16 Next
+)
+/*++
+Routine Description:
+	Returns the state a transition table entry leads to
+--*/
+{
+	return (Next & SIG_SET_NEXT_SPARSE) ? SIG_SET_NEXT_INDEX(Next) : Set->DenseStates[SIG_SET_NEXT_INDEX(Next)];
+}
+
+VMM_API
+UINT16
+SigSetStep(
+	_In_ PSIG_SET Set,
+	_In_ UINT16 State,
+	_In_ UCHAR Byte
+)
+/*++
+Routine Description:
+	Follows the goto function from `State`, falling back through fail links until a transition exists. A fail
+	link always leads to a shallower state, so this ends at the latest on the root's full transition table
+--*/
+{
+	UINT16 DenseIndex;
+
+	while ((DenseIndex = Set->States[State].DenseIndex) == SIG_SET_SPARSE_STATE)
+	{
+		const UINT16 Child = SigSetFindChild(Set, State, Byte);
+		if (Child != 0)
+			return Child;
+
+		State = Set->States[State].Fail;
+	}
+
+	return SigSetDecodeNext(Set, Set->Dense[DenseIndex][Byte]);
+}
+
+VMM_API
+UINT16
+SigSetStepSparse(
+	_In_ PSIG_SET Set,
+	_In_ UINT16 State,
+	_In_ UCHAR Byte
+)
+/*++
+Routine Description:
+	Follows the goto function from `State` through sibling lists and fail links only, for building the tables
+--*/
+{
+	while (TRUE)
+	{
+		const UINT16 Child = SigSetFindChild(Set, State, Byte);
+		if (Child != 0 || State == 0)
+			return Child;
+
+		State = Set->States[State].Fail;
+	}
+}
+
+VMM_API
+VOID
+SigSetCompile(
+	_Inout_ PSIG_SET Set
+)
+/*++
+Routine Description:
+	Computes the fail links and output links of the automaton in breadth-first order, then the full transition 
+	tables of the shallowest states. The fail link of a state leads to a shallower one, whose table is complete by 
+	the time it's needed
+--*/
+{
+	SIZE_T QueueHead = 0, QueueTail = 0;
+
+	for (UINT16 Child = Set->States[0].FirstChild; Child != 0; Child = Set->States[Child].NextSibling)
+	{
+		Set->States[Child].Fail = 0;
+		Set->States[Child].OutputLink = 0;
+
+		Set->Queue[QueueTail++] = Child;
+	}
+
+	while (QueueHead != QueueTail)
+	{
+		const UINT16 State = Set->Queue[QueueHead++];
+
+		for (UINT16 Child = Set->States[State].FirstChild; Child != 0; Child = Set->States[Child].NextSibling)
+		{
+			PSIG_SET_STATE ChildState = &Set->States[Child];
+
+			ChildState->Fail = SigSetStepSparse(Set, Set->States[State].Fail, ChildState->Byte);
+
+			PSIG_SET_STATE FailState = &Set->States[ChildState->Fail];
+			ChildState->OutputLink = FailState->FirstPattern != 0 ? ChildState->Fail : FailState->OutputLink;
+
+			Set->Queue[QueueTail++] = Child;
+		}
+	}
+
+	// The root and the states first in the queue get the tables
+	Set->DenseCount = min(Set->StateCount, SIG_SET_DENSE_STATES);
+
+	for (SIZE_T i = 0; i < Set->StateCount; i++)
+		Set->States[i].DenseIndex = SIG_SET_SPARSE_STATE;
+
+	for (SIZE_T i = 0; i < Set->DenseCount; i++)
+	{
+		Set->DenseStates[i] = i == 0 ? 0 : Set->Queue[i - 1];
+		Set->States[Set->DenseStates[i]].DenseIndex = (UINT16)i;
+	}
+
+	for (SIZE_T i = 0; i < Set->DenseCount; i++)
+	{
+		const UINT16 State = Set->DenseStates[i];
+		PSIG_SET_STATE DenseState = &Set->States[State];
+
+		// Bytes without a child go wherever they go from the fail state, bytes without one from the root stay there
+		for (SIZE_T Byte = 0; Byte < 256; Byte++)
+		{
+			const UINT16 Next = State != 0 ? SigSetStep(Set, DenseState->Fail, (UCHAR)Byte) : 0;
+			Set->Dense[i][Byte] = SigSetEncodeNext(Set, Next);
+		}
+
+		for (UINT16 Child = DenseState->FirstChild; Child != 0; Child = Set->States[Child].NextSibling)
+			Set->Dense[i][Set->States[Child].Byte] = SigSetEncodeNext(Set, Child);
+	}
+}
+
+VMM_API
+BOOLEAN
+SigSetScanBuffer(
+	_In_ PSIG_SET Set,
+	_Inout_ PUINT16 State,
+	_In_ PUCHAR Data,
+	_In_ SIZE_T Size,
+	_In_ PSIG_SET_MATCH_CALLBACK Callback,
+	_In_ PVOID Context
+)
+/*++
+Routine Description:
+	Feeds `Data` through the automaton starting from `State`, calling `Callback` for every pattern whose key ends 
+	at each offset. `State` is updated so a region can be scanned in consecutive pieces. Returns FALSE if the 
+	callback stopped the scan. 
+	
+	The automaton is run on transition table entries, so most bytes only take a single table lookup
+--*/
+{
+	UINT16 Next = SigSetEncodeNext(Set, *State);
+
+	for (SIZE_T i = 0; i < Size; i++)
+	{
+		if (!(Next & SIG_SET_NEXT_SPARSE))
+			Next = Set->Dense[SIG_SET_NEXT_INDEX(Next)][Data[i]];
+		else
+			Next = SigSetEncodeNext(Set, SigSetStep(Set, SIG_SET_NEXT_INDEX(Next), Data[i]));
+
+		if (!(Next & SIG_SET_NEXT_OUTPUT))
+			continue;
+
+		const UINT16 Current = SigSetDecodeNext(Set, Next);
+
+		UINT16 Output = Set->States[Current].FirstPattern != 0 ? Current : Set->States[Current].OutputLink;
+		for (; Output != 0; Output = Set->States[Output].OutputLink)
+		{
+			for (UINT16 Pattern = Set->States[Output].FirstPattern; Pattern != 0; Pattern = Set->Patterns[Pattern - 1].NextSameKey)
+			{
+				if (!Callback(Context, Pattern - 1, i))
+				{
+					*State = Current;
+					return FALSE;
+				}
+			}
+		}
+	}
+
+	*State = SigSetDecodeNext(Set, Next);
+
+	return TRUE;
+}
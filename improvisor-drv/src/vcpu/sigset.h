@@ -0,0 +1,112 @@
+#ifndef IMP_SIGSET_H
+#define IMP_SIGSET_H
+
+#include <vcpu/sigscan.h>
+
+// Maximum amount of patterns in a signature set
+#define SIG_SET_MAX_PATTERNS 64
+// Maximum amount of automaton states, a set needs at most one per key byte plus the root
+#define SIG_SET_MAX_STATES 4096
+// Amount of the shallowest states given a full transition table, scanning code rarely gets any deeper
+#define SIG_SET_DENSE_STATES 128
+// Dense index of states without a full transition table
+#define SIG_SET_SPARSE_STATE 0xFFFF
+
+// Full transition table entries hold the dense index of the next state, or its state index with
+// SIG_SET_NEXT_SPARSE set if it has no table. SIG_SET_NEXT_OUTPUT is set if any key ends at the next state
+#define SIG_SET_NEXT_SPARSE 0x8000
+#define SIG_SET_NEXT_OUTPUT 0x4000
+#define SIG_SET_NEXT_INDEX(Next) ((UINT16)((Next) & 0x3FFF))
+
+// A node of the Aho-Corasick automaton, indices are into SIG_SET::States and 0 is both the root and "none"
+typedef struct _SIG_SET_STATE
+{
+	UINT16 FirstChild;
+	UINT16 NextSibling;
+	// The longest proper suffix of this state that is also in the trie
+	UINT16 Fail;
+	// The nearest state along the fail chain with patterns ending at it
+	UINT16 OutputLink;
+	// Index + 1 of the first pattern whose key ends at this state, 0 if none
+	UINT16 FirstPattern;
+	// Index into SIG_SET::Dense of this state's transitions, or SIG_SET_SPARSE_STATE
+	UINT16 DenseIndex;
+	// The byte leading to this state from its parent
+	UCHAR Byte;
+} SIG_SET_STATE, *PSIG_SET_STATE;
+
+typedef struct _SIG_SET_ENTRY
+{
+	SIG_PATTERN Pattern;
+	// The longest fully masked run of the pattern is used as its key in the automaton
+	SIZE_T KeyOffset;
+	SIZE_T KeySize;
+	// Index + 1 of the next pattern with the same key, 0 if none
+	UINT16 NextSameKey;
+} SIG_SET_ENTRY, *PSIG_SET_ENTRY;
+
+// A set of masked patterns compiled into an Aho-Corasick automaton over their keys, so a region can be scanned
+// once for every pattern. Key hits still need verifying against the whole pattern
+typedef struct _SIG_SET
+{
+	SIZE_T PatternCount;
+	SIZE_T StateCount;
+	SIZE_T DenseCount;
+	// Transitions for every byte from the shallowest states in breadth-first order with fail links already 
+	// followed, see SIG_SET_NEXT_*. The root is always the first, deeper states walk their sibling lists
+	UINT16 Dense[SIG_SET_DENSE_STATES][256];
+	// State index of each full transition table
+	UINT16 DenseStates[SIG_SET_DENSE_STATES];
+	SIG_SET_ENTRY Patterns[SIG_SET_MAX_PATTERNS];
+	SIG_SET_STATE States[SIG_SET_MAX_STATES];
+	// Scratch space for the breadth-first traversal when compiling
+	UINT16 Queue[SIG_SET_MAX_STATES];
+} SIG_SET, *PSIG_SET;
+
+// Called for every key hit with the offset of the last key byte, return FALSE to stop scanning
+typedef BOOLEAN SIG_SET_MATCH_CALLBACK(
+	_In_ PVOID Context,
+	_In_ SIZE_T PatternId,
+	_In_ SIZE_T KeyEndOffset
+);
+
+typedef SIG_SET_MATCH_CALLBACK* PSIG_SET_MATCH_CALLBACK;
+
+VOID
+SigSetInitialise(
+	_Out_ PSIG_SET Set
+);
+
+NTSTATUS
+SigSetAddPattern(
+	_Inout_ PSIG_SET Set,
+	_In_ PUCHAR Bytes,
+	_In_ PUCHAR Mask,
+	_In_ SIZE_T Size
+);
+
+BOOLEAN
+SigSetIsPattern(
+	_In_ PSIG_SET Set,
+	_In_ SIZE_T PatternId,
+	_In_ PUCHAR Bytes,
+	_In_ PUCHAR Mask,
+	_In_ SIZE_T Size
+);
+
+VOID
+SigSetCompile(
+	_Inout_ PSIG_SET Set
+);
+
+BOOLEAN
+SigSetScanBuffer(
+	_In_ PSIG_SET Set,
+	_Inout_ PUINT16 State,
+	_In_ PUCHAR Data,
+	_In_ SIZE_T Size,
+	_In_ PSIG_SET_MATCH_CALLBACK Callback,
+	_In_ PVOID Context
+);
+
+#endif
@@ -5,11 +5,15 @@
 #include <arch/msr.h>
 #include <arch/cpu.h>
 #include <arch/cr.h>
+#include <arch/apic.h>
 #include <vcpu/interrupts.h>
 #include <vcpu/vmcall.h>
 #include <vcpu/vmexit.h>
+#include <vcpu/msr.h>
 #include <vcpu/vcpu.h>
+#include <mm/vpte.h>
 #include <detour.h>
+#include <spinlock.h>
 #include <intrin.h>
 #include <macro.h>
 #include <vmm.h>
@@ -181,8 +185,31 @@ Routine Description:
 			Vcpu->MsrBitmap + VMX_MSR_WRITE_BITMAP_OFFS + VMX_MSR_HI_BITMAP_OFFS, 
 			1024 * 8);
 
+	NTSTATUS Status = VcpuMsrApplyPolicy(Vcpu);
+	if (!NT_SUCCESS(Status))
+	{
+		ImpDebugPrint("Failed to apply the MSR policy for VCPU #%d... (%X)\n", Id, Status);
+		return Status;
+	}
+
 	VmxSetupVmxState(&Vcpu->Vmx);
 
+	// Whether pages are actually logged depends on the EPT having dirty flags, which is only decided by EptInitialise
+	if (VcpuIsControlSupported(Vcpu, VMX_CTL_ENABLE_PML))
+	{
+		Vcpu->PmlBuffer = (PUINT64)ImpAllocateHostContiguousMemory(PAGE_SIZE);
+		if (Vcpu->PmlBuffer == NULL)
+		{
+			ImpDebugPrint("Failed to allocate PML buffer for VCPU #%d...\n", Id);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		Vcpu->PmlBufferPhysical = ImpGetPhysicalAddress(Vcpu->PmlBuffer);
+
+		for (SIZE_T i = 0; i < EPT_PML_ENTRY_COUNT; i++)
+			Vcpu->PmlBuffer[i] = EPT_PML_EMPTY_ENTRY;
+	}
+
 	// VM-entry cannot change CR0.CD or CR0.NW
 #ifndef _DEBUG
 	// Currently can't properly emulate CR writes without running under the custom page tables
@@ -200,6 +227,12 @@ Routine Description:
 	VcpuSetControl(Vcpu, VMX_CTL_USE_MSR_BITMAPS, TRUE);
 	VcpuSetControl(Vcpu, VMX_CTL_SECONDARY_CTLS_ACTIVE, TRUE);
 
+	// NMIs sent by VcpuKickEptInvalidation must make the guest exit, every other NMI is queued for the guest and
+	// injected on an NMI-window exit. NMI exiting leaves the guest's NMI blocking to the hypervisor, virtual NMIs
+	// let the guest's IRET unblock the NMIs injected into it and are needed for NMI-window exiting
+	VcpuSetControl(Vcpu, VMX_CTL_NMI_EXITING, TRUE);
+	VcpuSetControl(Vcpu, VMX_CTL_VIRTUAL_NMIS, TRUE);
+
 	VcpuSetControl(Vcpu, VMX_CTL_ENABLE_RDTSCP, TRUE);
 	VcpuSetControl(Vcpu, VMX_CTL_ENABLE_XSAVES_XRSTORS, TRUE);
 	VcpuSetControl(Vcpu, VMX_CTL_ENABLE_INVPCID, TRUE);
@@ -214,10 +247,20 @@ Routine Description:
 	// Save GUEST_DEBUGCTL on VM-exit
 	VcpuSetControl(Vcpu, VMX_CTL_SAVE_DEBUG_CONTROLS, TRUE);
 
-	// Temporarily disable CR3 exiting
-	VcpuSetControl(Vcpu, VMX_CTL_CR3_LOAD_EXITING, FALSE);
 	VcpuSetControl(Vcpu, VMX_CTL_CR3_STORE_EXITING, FALSE);
 
+	// CR3 loads, INVLPG and INVPCID run without exiting, so translations are only cached for the VM-exit they were
+	// taken in. Build with IMPV_ENABLE_VTLB_INTERCEPTS to have them exit and invalidate the VTLB the same way they
+	// do the guest's TLB, which lets it keep translations across VM-exits at the cost of an exit for each of them
+#ifdef IMPV_ENABLE_VTLB_INTERCEPTS
+	VcpuSetControl(Vcpu, VMX_CTL_CR3_LOAD_EXITING, TRUE);
+	VcpuSetControl(Vcpu, VMX_CTL_INVLPG_EXITING, TRUE);
+
+	Vcpu->Vtlb.Intercepted = TRUE;
+#else
+	VcpuSetControl(Vcpu, VMX_CTL_CR3_LOAD_EXITING, FALSE);
+#endif
+
 	VTscInitialise(&Vcpu->Tsc);
 
 	return STATUS_SUCCESS;
@@ -301,13 +344,28 @@ Routine Description:
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	EPT_POINTER EptPointer = {
-		.MemoryType = EPT_MEMORY_WRITEBACK,
-		.PageWalkLength = 3,
-		.PML4PageFrameNumber = PAGE_FRAME_NUMBER(ImpGetPhysicalAddress(Vcpu->Vmm->Ept.Pml4))
-	};
+	const PEPT_INFORMATION Ept = &Vcpu->Vmm->Ept;
+
+	VmxWrite(CONTROL_EPT_POINTER, Ept->Views[EPT_VIEW_DEFAULT].EptPointer.Value);
 
-	VmxWrite(CONTROL_EPT_POINTER, EptPointer.Value);
+	// Bit 0 of IA32_VMX_VMFUNC reports support for EPTP switching
+	if (Ept->GuestViewSwitching && 
+		VcpuIsControlSupported(Vcpu, VMX_CTL_ENABLE_VM_FUNCTIONS) &&
+		(__readmsr(IA32_VMX_VMFUNC) & 1))
+	{
+		VmxWrite(CONTROL_VMFUNC_CONTROLS, 1);
+		VmxWrite(CONTROL_EPTP_LIST_ADDRESS, Ept->EptpListPhysAddr);
+
+		VcpuSetControl(Vcpu, VMX_CTL_ENABLE_VM_FUNCTIONS, TRUE);
+	}
+
+	if (Vcpu->PmlBuffer != NULL && Ept->DirtyLogging)
+	{
+		VmxWrite(CONTROL_PML_ADDRESS, Vcpu->PmlBufferPhysical);
+		VmxWrite(GUEST_PML_INDEX, EPT_PML_ENTRY_COUNT - 1);
+
+		VcpuSetControl(Vcpu, VMX_CTL_ENABLE_PML, TRUE);
+	}
 
 	// Set the VPID identifier to the current processor number.
 	VmxWrite(CONTROL_VIRTUAL_PROCESSOR_ID, 1);
@@ -474,6 +532,7 @@ Routine Description:
 	VmxWrite(CONTROL_VMEXIT_MSR_STORE_ADDRESS, ImpGetPhysicalAddress(sVmExitMsrStore));
 	// VmxWrite(CONTROL_VMENTRY_MSR_LOAD_ADDRESS, ImpGetPhysicalAddress(sVmEntryMsrLoad));
 
+	VmxWrite(CONTROL_TERTIARY_PROCBASED_CONTROLS, 0);
 	VcpuCommitVmxState(Vcpu);
 	
 	VmxWrite(HOST_RSP, (UINT64)(Vcpu->Stack->Data + 0x6000 - 16));
@@ -510,6 +569,29 @@ Routine Description:
 	PVCPU Vcpu = &Params->VmmContext->VcpuTable[CpuId];
 	
 	Vcpu->Vmm = Params->VmmContext;
+	// CPUID exits must reach VcpuHandleCpuid if they can enable TSC spoofing
+	Vcpu->FastExits = Vcpu->Vmm->UseTscSpoofing ? 0 : VCPU_FAST_EXIT_CPUID;
+	// Some CPUID results are specific to this core, so they can only be precomputed here
+	VcpuCpuidFillCache(&Vcpu->Cpuid);
+
+	// Other VCPUs address their NMIs to this processor's local APIC, see VcpuSendNmi
+	IA32_APIC_BASE_MSR ApicBase = {
+		.Value = __readmsr(IA32_APIC_BASE)
+	};
+
+	if (ApicBase.X2APICMode)
+	{
+		Vcpu->ApicId = (UINT32)__readmsr(IA32_X2APIC_APICID);
+	}
+	else
+	{
+		X86_CPUID_ARGS Args = {0};
+		__cpuidex(Args.Data, 1, 0);
+
+		Vcpu->ApicId = (UINT32)Args.Ebx >> 24;
+	}
+
+	VcpuMsrInitialiseShadows(Vcpu);
 
 	__cpu_save_state(&Vcpu->LaunchState);
 
@@ -764,15 +846,385 @@ VcpuCommitVmxState(
 )
 /*++
 Routine Description:
-	Updates the VM execution control VMCS components with the VMX state
+	Updates the VM execution control VMCS components that changed since the last commit with the VMX state
 --*/
 {
-	VmxWrite(CONTROL_PINBASED_CONTROLS, Vcpu->Vmx.Controls.PinbasedCtls);
-	VmxWrite(CONTROL_PRIMARY_PROCBASED_CONTROLS, Vcpu->Vmx.Controls.PrimaryProcbasedCtls);
-	VmxWrite(CONTROL_SECONDARY_PROCBASED_CONTROLS, Vcpu->Vmx.Controls.SecondaryProcbasedCtls);
-	VmxWrite(CONTROL_VMENTRY_CONTROLS, Vcpu->Vmx.Controls.VmEntryCtls);
-	VmxWrite(CONTROL_VMEXIT_CONTROLS, Vcpu->Vmx.Controls.VmExitCtls);
-	VmxWrite(CONTROL_TERTIARY_PROCBASED_CONTROLS, 0);
+	const UINT32 Dirty = Vcpu->Vmx.DirtyControls;
+	if (Dirty == 0)
+		return;
+
+	if (Dirty & (1UL << VMX_PINBASED_CTLS))
+		VmxWrite(CONTROL_PINBASED_CONTROLS, Vcpu->Vmx.Controls.PinbasedCtls);
+	if (Dirty & (1UL << VMX_PRIM_PROCBASED_CTLS))
+		VmxWrite(CONTROL_PRIMARY_PROCBASED_CONTROLS, Vcpu->Vmx.Controls.PrimaryProcbasedCtls);
+	if (Dirty & (1UL << VMX_SEC_PROCBASED_CTLS))
+		VmxWrite(CONTROL_SECONDARY_PROCBASED_CONTROLS, Vcpu->Vmx.Controls.SecondaryProcbasedCtls);
+	if (Dirty & (1UL << VMX_ENTRY_CTLS))
+		VmxWrite(CONTROL_VMENTRY_CONTROLS, Vcpu->Vmx.Controls.VmEntryCtls);
+	if (Dirty & (1UL << VMX_EXIT_CTLS))
+		VmxWrite(CONTROL_VMEXIT_CONTROLS, Vcpu->Vmx.Controls.VmExitCtls);
+
+	Vcpu->Vmx.DirtyControls = 0;
+}
+
+VMM_API
+VOID
+VcpuQueueEptInvalidation(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Requests every VCPU to invalidate its translations of the shared EPT before its next VM-entry. Any amount of
+	EPT changes made before then are covered by a single INVEPT on each VCPU, other VCPUs keep using their
+	cached translations until their next VM-exit
+--*/
+{
+	// The generation is bumped before any VCPU can see the request, so one that reads it after clearing its flag
+	// and invalidates afterwards has covered every request up to what it read
+	InterlockedIncrement64(&Vcpu->Vmm->Ept.FlushGeneration);
+
+	for (SIZE_T i = 0; i < Vcpu->Vmm->CpuCount; i++)
+		InterlockedExchange8(&Vcpu->Vmm->VcpuTable[i].EptFlushPending, TRUE);
+}
+
+VMM_API
+VOID
+VcpuInvalidateEpt(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Clears the EPT invalidation request of this VCPU and invalidates every EPT change requested up to now
+--*/
+{
+	const PEPT_INFORMATION Ept = &Vcpu->Vmm->Ept;
+
+	// Clear the request first, so changes made while invalidating are picked up on the next VM-entry instead
+	InterlockedExchange8(&Vcpu->EptFlushPending, FALSE);
+
+	const UINT64 Generation = Ept->FlushGeneration;
+
+	EptInvalidateViews(Ept);
+
+	Vcpu->EptFlushGeneration = Generation;
+}
+
+VMM_API
+VOID
+VcpuCommitEptInvalidation(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Performs the EPT invalidation requested through VcpuQueueEptInvalidation if there is one pending, this must
+	be done right before VM-entry. Retired EPT tables no VCPU can still have cached are released afterwards, and
+	if too many are still held back the VCPUs holding them are made to exit
+--*/
+{
+	if (!Vcpu->EptFlushPending)
+		return;
+
+	const PEPT_INFORMATION Ept = &Vcpu->Vmm->Ept;
+
+	VcpuInvalidateEpt(Vcpu);
+
+	if (Ept->RetiredTableCount == 0)
+		return;
+
+	const UINT64 Generation = Vcpu->EptFlushGeneration;
+
+	UINT64 MinGeneration = Generation;
+	for (SIZE_T i = 0; i < Vcpu->Vmm->CpuCount; i++)
+		MinGeneration = min(MinGeneration, Vcpu->Vmm->VcpuTable[i].EptFlushGeneration);
+
+	SpinLock(&Ept->Lock);
+	EptReleaseRetiredTables(Ept, MinGeneration);
+	const UINT32 Remaining = Ept->RetiredTableCount;
+	SpinUnlock(&Ept->Lock);
+
+	// A VCPU idling in HLT doesn't exit by itself, and would otherwise hold every table retired since it last
+	// did back until coalescing runs out of room
+	if (Remaining >= EPT_RETIRED_TABLE_KICK_THRESHOLD)
+		VcpuKickEptInvalidation(Vcpu, Generation);
+}
+
+VMM_API
+VOID
+VcpuWaitForXApicIcr(
+	_In_ volatile UINT32* IcrLow
+)
+/*++
+Routine Description:
+	Waits for the local APIC to finish sending the IPI last written to the xAPIC interrupt command register
+--*/
+{
+	APIC_ICR Icr = {
+		.Value = *IcrLow
+	};
+
+	while (Icr.DeliveryPending)
+	{
+		YieldProcessor();
+		Icr.Value = *IcrLow;
+	}
+}
+
+VMM_API
+BOOLEAN
+VcpuSendNmi(
+	_Inout_ PVCPU Vcpu,
+	_In_ PVCPU Target
+)
+/*++
+Routine Description:
+	Sends an NMI to the processor of `Target` through the local APIC of the current one. Outside of x2APIC mode
+	the xAPIC registers are mapped through a VPTE the VCPU keeps for good
+--*/
+{
+	IA32_APIC_BASE_MSR ApicBase = {
+		.Value = __readmsr(IA32_APIC_BASE)
+	};
+
+	APIC_ICR Icr = {
+		.DeliveryMode = APIC_DELIVERY_NMI,
+		.Assert = TRUE
+	};
+
+	if (ApicBase.X2APICMode)
+	{
+		Icr.Destination = Target->ApicId;
+		__writemsr(IA32_X2APIC_ICR, Icr.Value);
+
+		return TRUE;
+	}
+
+	if (Vcpu->ApicVpte == NULL)
+	{
+		if (!NT_SUCCESS(MmAllocateVpte(&Vcpu->ApicVpte)))
+			return FALSE;
+
+		MmMapGuestPhys(Vcpu->ApicVpte, PAGE_ADDRESS(ApicBase.APICBase));
+	}
+
+	volatile UINT32* IcrLow = RVA_PTR(Vcpu->ApicVpte->MappedVirtAddr, XAPIC_ICR_LOW);
+	volatile UINT32* IcrHigh = RVA_PTR(Vcpu->ApicVpte->MappedVirtAddr, XAPIC_ICR_HIGH);
+
+	// The ICR must not be written while an IPI is still being sent, which may be one the guest sent just before
+	// exiting. Ours is waited for as well, so the guest doesn't find it pending once its destination is put back
+	// in case the guest exited between writing the two halves of its own
+	VcpuWaitForXApicIcr(IcrLow);
+
+	const UINT32 GuestIcrHigh = *IcrHigh;
+
+	*IcrHigh = Target->ApicId << 24;
+	*IcrLow = (UINT32)Icr.Value;
+
+	VcpuWaitForXApicIcr(IcrLow);
+
+	*IcrHigh = GuestIcrHigh;
+
+	return TRUE;
+}
+
+VMM_API
+VOID
+VcpuKickEptInvalidation(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT64 Generation
+)
+/*++
+Routine Description:
+	Sends an NMI to every other running VCPU that hasn't invalidated its EPT up to `Generation`, which makes it
+	exit if it is in the guest and invalidate through VcpuHandleEptFlushNmi. A VCPU with an NMI still on its way
+	isn't sent another
+--*/
+{
+	for (SIZE_T i = 0; i < Vcpu->Vmm->CpuCount; i++)
+	{
+		PVCPU Target = &Vcpu->Vmm->VcpuTable[i];
+
+		if (Target == Vcpu || Target->EptFlushGeneration >= Generation)
+			continue;
+
+		if (Target->Mode != VCPU_MODE_GUEST && Target->Mode != VCPU_MODE_HOST)
+			continue;
+
+		if (InterlockedExchange8(&Target->EptFlushNmiPending, TRUE))
+			continue;
+
+		if (!VcpuSendNmi(Vcpu, Target))
+			InterlockedExchange8(&Target->EptFlushNmiPending, FALSE);
+	}
+}
+
+VMM_API
+VOID
+VcpuSynchroniseEptInvalidation(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Invalidates the EPT on every running VCPU before returning, rather than on their next VM-entry. Other VCPUs
+	are sent an NMI and waited for, so this must not be called with the EPT lock held
+--*/
+{
+	VcpuQueueEptInvalidation(Vcpu);
+	VcpuInvalidateEpt(Vcpu);
+
+	const UINT64 Generation = Vcpu->EptFlushGeneration;
+
+	VcpuKickEptInvalidation(Vcpu, Generation);
+
+	for (SIZE_T i = 0; i < Vcpu->Vmm->CpuCount; i++)
+	{
+		PVCPU Target = &Vcpu->Vmm->VcpuTable[i];
+
+		// A VCPU shutting down meanwhile won't answer, but won't use the EPT again either
+		while (Target->EptFlushGeneration < Generation && (Target->Mode == VCPU_MODE_GUEST || Target->Mode == VCPU_MODE_HOST))
+			YieldProcessor();
+	}
+}
+
+VMM_API
+BOOLEAN
+VcpuHandleEptFlushNmi(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Claims an NMI taken by this VCPU if it was sent by VcpuKickEptInvalidation and invalidates the EPT right away,
+	returning FALSE if it is one the guest must receive. An NMI that interrupted the host may have arrived after 
+	VcpuCommitEptInvalidation already ran for this exit, so the invalidation can't be left to VM-entry. Retired
+	tables aren't released here, as the interrupted code may hold the EPT lock.
+
+	The processor doesn't count NMIs, so one the guest should have received may be taken for the kick if both
+	arrive at once
+--*/
+{
+	if (!InterlockedExchange8(&Vcpu->EptFlushNmiPending, FALSE))
+		return FALSE;
+
+	VcpuInvalidateEpt(Vcpu);
+
+	return TRUE;
+}
+
+VMM_API
+VOID
+VcpuSwitchEptView(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT32 View
+)
+/*++
+Routine Description:
+	Switches the EPT view the VCPU runs in. Translations are tagged by EPT pointer, so neither this VCPU nor any 
+	other needs an invalidation
+--*/
+{
+	const PEPT_INFORMATION Ept = &Vcpu->Vmm->Ept;
+	if (View >= Ept->ViewCount)
+		return;
+
+	VmxCacheWrite(&Vcpu->Vmx, CONTROL_EPT_POINTER, Ept->Views[View].EptPointer.Value);
+}
+
+VMM_API
+VOID
+VcpuDrainPml(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Moves every page logged in this VCPU's page-modification log into the EPT's dirty bitmap and empties the log
+--*/
+{
+	if (Vcpu->PmlBuffer == NULL || !Vcpu->Vmm->Ept.DirtyLogging)
+		return;
+
+	// The index is decremented after each entry is logged, so it wraps around to 0xFFFF once the log is full
+	const UINT16 Index = (UINT16)VmxCacheRead(&Vcpu->Vmx, GUEST_PML_INDEX);
+
+	// Logging walks the EPT, which coalescing on another VCPU could be retiring tables from
+	SpinLock(&Vcpu->Vmm->Ept.Lock);
+
+	for (UINT32 i = (UINT16)(Index + 1); i < EPT_PML_ENTRY_COUNT; i++)
+	{
+		// Mark the page before emptying the entry, VcpuCollectPmls may be reading this log at the same time
+		EptLogDirtyPage(&Vcpu->Vmm->Ept, Vcpu->PmlBuffer[i]);
+		Vcpu->PmlBuffer[i] = EPT_PML_EMPTY_ENTRY;
+	}
+
+	SpinUnlock(&Vcpu->Vmm->Ept.Lock);
+
+	VmxCacheWrite(&Vcpu->Vmx, GUEST_PML_INDEX, EPT_PML_ENTRY_COUNT - 1);
+}
+
+VMM_API
+VOID
+VcpuCollectPmls(
+	_Inout_ PVCPU Vcpu
+)
+/*++
+Routine Description:
+	Brings the EPT's dirty bitmap up to date with the page-modification logs of every VCPU. The logs of other 
+	VCPUs can't be emptied from here as their log index is in their own VMCS, so their entries are only copied and
+	will be marked again once those VCPUs drain them
+--*/
+{
+	VcpuDrainPml(Vcpu);
+
+	SpinLock(&Vcpu->Vmm->Ept.Lock);
+
+	for (SIZE_T i = 0; i < Vcpu->Vmm->CpuCount; i++)
+	{
+		PVCPU OtherVcpu = &Vcpu->Vmm->VcpuTable[i];
+		if (OtherVcpu == Vcpu || OtherVcpu->PmlBuffer == NULL)
+			continue;
+
+		for (SIZE_T j = 0; j < EPT_PML_ENTRY_COUNT; j++)
+		{
+			const UINT64 GuestPhysAddr = ((volatile UINT64*)OtherVcpu->PmlBuffer)[j];
+			if (GuestPhysAddr != EPT_PML_EMPTY_ENTRY)
+				EptLogDirtyPage(&Vcpu->Vmm->Ept, GuestPhysAddr);
+		}
+	}
+
+	SpinUnlock(&Vcpu->Vmm->Ept.Lock);
+}
+
+VMM_API
+VOID
+VcpuCollectDirtyPages(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PageCount,
+	_Out_writes_((PageCount + 63) / 64) PUINT64 Bitmap
+)
+/*++
+Routine Description:
+	Sets a bit in `Bitmap` for each page of the range written to since it was last collected, and makes sure the
+	next write to any of them is logged again before returning. Every other VCPU is made to invalidate its EPT
+	and waited for, as one still holding a translation with a dirty flag that was just cleared wouldn't log it
+--*/
+{
+	const PEPT_INFORMATION Ept = &Vcpu->Vmm->Ept;
+
+	VcpuCollectPmls(Vcpu);
+
+	BOOLEAN Collected = FALSE;
+
+	SpinLock(&Ept->Lock);
+
+	for (UINT64 i = 0; i < PageCount; i += 64)
+	{
+		Bitmap[i / 64] = EptCollectDirtyPages(Ept, GuestPhysAddr + i * PAGE_SIZE, PageCount - i);
+		Collected |= Bitmap[i / 64] != 0;
+	}
+
+	SpinUnlock(&Ept->Lock);
+
+	if (Collected)
+		VcpuSynchroniseEptInvalidation(Vcpu);
 }
 
 VMM_API
@@ -784,9 +1236,13 @@ VcpuToggleExitOnMsr(
 )
 /*++
 Routine Description:
-	Toggles VM-exits for a specific MSR via a VCPU's MSR bitmap
+	Toggles VM-exits for a specific MSR via a VCPU's MSR bitmap. Accesses to MSRs outside of the ranges covered by
+	the bitmap always cause VM-exits
 --*/
 {
+	if (Msr > 0x1FFF && (Msr < 0xC0000000 || Msr > 0xC0001FFF))
+		return;
+
 	PRTL_BITMAP MsrBitmap = NULL;
 
 	switch (Access)
@@ -808,7 +1264,7 @@ Routine Description:
 		} break;
 	}
 	
-	RtlSetBit(MsrBitmap, Msr);
+	RtlSetBit(MsrBitmap, Msr & 0x1FFF);
 }
 
 VMM_API
@@ -831,7 +1287,7 @@ VcpuGetGuestCPL(
 )
 {
 	X86_SEGMENT_ACCESS_RIGHTS CsAr = {
-		.Value = VmxRead(GUEST_CS_ACCESS_RIGHTS)
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CS_ACCESS_RIGHTS)
 	};
 
 	return CsAr.Dpl;
@@ -873,7 +1329,7 @@ Routine Description:
 	VcpuSetControl(Vcpu, VMX_CTL_RDTSC_EXITING, TRUE);
 
 	// Write the TSC watchdog quantum
-	VmxWrite(GUEST_VMX_PREEMPTION_TIMER_VALUE, VTSC_WATCHDOG_QUANTUM + Vcpu->Tsc.VmEntryLatency);
+	VmxCacheWrite(&Vcpu->Vmx, GUEST_VMX_PREEMPTION_TIMER_VALUE, VTSC_WATCHDOG_QUANTUM + Vcpu->Tsc.VmEntryLatency);
 }
 
 VMM_API
@@ -907,7 +1363,7 @@ VcpuUpdateLastTscEventEntry(
 	if (PrevEvent->Valid)
 	{
 		// Calculate the time since the last event during this thread
-		UINT64 ElapsedTime = VTSC_WATCHDOG_QUANTUM - VmxRead(GUEST_VMX_PREEMPTION_TIMER_VALUE);
+		UINT64 ElapsedTime = VTSC_WATCHDOG_QUANTUM - VmxCacheRead(&Vcpu->Vmx, GUEST_VMX_PREEMPTION_TIMER_VALUE);
 
 		// Base the new timestamp off the last TSC event for this thread
 		UINT64 Timestamp = PrevEvent->Timestamp + PrevEvent->Latency + ElapsedTime;
@@ -916,7 +1372,7 @@ VcpuUpdateLastTscEventEntry(
 		PrevEvent->Timestamp = Timestamp;
 		PrevEvent->Latency = VcpuGetTscEventLatency(Vcpu, Type);
 
-		ImpLog("[%02X] PrevEvent->Valid: TSC = %u + %u + %u\n", Vcpu->Id, PrevEvent->Timestamp, PrevEvent->Latency, ElapsedTime);
+		IMP_LOG_TRACE(IMP_LOG_TSC, "[%02X] PrevEvent->Valid: TSC = %u + %u + %u\n", Vcpu->Id, PrevEvent->Timestamp, PrevEvent->Latency, ElapsedTime);
 	} 
 	else
 	{
@@ -929,6 +1385,6 @@ VcpuUpdateLastTscEventEntry(
 		PrevEvent->Timestamp = Timestamp;
 		PrevEvent->Latency = VcpuGetTscEventLatency(Vcpu, Type);
 
-		ImpLog("[%02X] !PrevEvent->Valid: TSC = %u + %u\n", Vcpu->Id, Timestamp, PrevEvent->Latency);
+		IMP_LOG_TRACE(IMP_LOG_TSC, "[%02X] !PrevEvent->Valid: TSC = %u + %u\n", Vcpu->Id, Timestamp, PrevEvent->Latency);
 	}
 }
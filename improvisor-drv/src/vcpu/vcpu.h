@@ -6,7 +6,9 @@
 #include <arch/segment.h>
 #include <arch/cpu.h>
 #include <vcpu/tsc.h>
+#include <vcpu/cpuid.h>
 #include <mm/mm.h>
+#include <mm/vtlb.h>
 #include <vmx.h>
 
 // Emulation was successful, continue execution
@@ -18,6 +20,37 @@
 // The hypervisor encountered an error and should shut down immediately
 #define VMM_EVENT_ABORT (0x00000003)
 
+// Exits which __vmexit_entry may handle without saving the full guest state or calling VcpuHandleExit
+#define VCPU_FAST_EXIT_CPUID (0x01)
+// Offsets of VCPU::FastExits, VCPU::EptFlushPending and VCPU::Cpuid, hardcoded as VCPU_FAST_EXITS, 
+// VCPU_EPT_FLUSH_PENDING and VCPU_CPUID in vmexit.asm
+#define VCPU_FAST_EXITS_OFFSET 9
+#define VCPU_EPT_FLUSH_PENDING_OFFSET 10
+#define VCPU_CPUID_OFFSET 12
+
+// Maximum amount of entries in the MSR policy, see vcpu/msr.c
+#define VCPU_MAX_MSR_POLICIES 16
+
+// Amount of basic exit reasons profiled, one for each entry of the VM-exit handler table
+#define VCPU_EXIT_REASON_COUNT 70
+// Amount of log2 buckets in each exit latency histogram, bucket N counts exits of [2^N, 2^(N+1)) cycles
+#define VCPU_EXIT_LATENCY_BUCKETS 32
+
+typedef struct _VCPU_EXIT_PROFILE_ENTRY
+{
+	UINT64 Count;
+	// Cycles spent in the host from the start of VcpuHandleExit until just before resuming the guest
+	UINT64 TotalCycles;
+	UINT64 MaxCycles;
+	UINT64 Histogram[VCPU_EXIT_LATENCY_BUCKETS];
+} VCPU_EXIT_PROFILE_ENTRY, *PVCPU_EXIT_PROFILE_ENTRY;
+
+// Only ever written by its own VCPU, aligned so no two VCPUs' counters share a cache line
+typedef struct DECLSPEC_ALIGN(64) _VCPU_EXIT_PROFILE
+{
+	VCPU_EXIT_PROFILE_ENTRY Reasons[VCPU_EXIT_REASON_COUNT];
+} VCPU_EXIT_PROFILE, *PVCPU_EXIT_PROFILE;
+
 #pragma pack(push, 1)
 typedef struct _GUEST_STATE
 {
@@ -38,22 +71,13 @@ typedef struct _GUEST_STATE
 	UINT64 Rip;
 	UINT64 Cr8;
 	UINT32 MxCsr;
+	// Only the volatile XMM registers are saved, XMM6-15 are preserved by every host function as per the x64 ABI
 	M128 Xmm0;
 	M128 Xmm1;
 	M128 Xmm2;
 	M128 Xmm3;
 	M128 Xmm4;
 	M128 Xmm5;
-	M128 Xmm6;
-	M128 Xmm7;
-	M128 Xmm8;
-	M128 Xmm9;
-	M128 Xmm10;
-	M128 Xmm11;
-	M128 Xmm12;
-	M128 Xmm13;
-	M128 Xmm14;
-	M128 Xmm15;
 } GUEST_STATE, *PGUEST_STATE;
 #pragma pack(pop)
 
@@ -169,7 +193,15 @@ typedef struct _VCPU
 {
 	PVOID Self;
 	UINT8 Id;
+	// VCPU_FAST_EXIT_* flags of the exits that are currently safe to handle in the fast path
+	UINT8 FastExits;
+	// Set by any VCPU changing the EPT, the fast path defers to VcpuHandleExit while this is set so the
+	// invalidation happens before the next VM-entry
+	volatile CHAR EptFlushPending;
+	VCPU_CPUID_CACHE Cpuid;
 	PCHAR MsrBitmap;
+	// Values of emulated MSRs, indexed the same as the MSR policy
+	UINT64 MsrShadows[VCPU_MAX_MSR_POLICIES];
 	RTL_BITMAP MsrLoReadBitmap;
 	RTL_BITMAP MsrHiReadBitmap;
 	RTL_BITMAP MsrLoWriteBitmap;
@@ -183,6 +215,9 @@ typedef struct _VCPU
 	UINT64 VmcsPhysical;
 	UINT64 VmxonPhysical;
 	UINT64 MsrBitmapPhysical;
+	// Page-modification log, NULL if the processor doesn't support PML
+	PUINT64 PmlBuffer;
+	UINT64 PmlBufferPhysical;
 	UINT64 Cr0ShadowableBits;
 	UINT64 Cr4ShadowableBits;
 	UINT64 SystemDirectoryBase;
@@ -195,9 +230,26 @@ typedef struct _VCPU
 	ULONG LastHypercallResult;
 	ULONG NumQueuedNMIs;
 	BOOLEAN NMIsBlocked;
+	MM_VTLB Vtlb;
+	BOOLEAN RingTickArmed;
 	struct _VMM_CONTEXT* Vmm; 
+	// Set by other VCPUs to have this one clear its exit profile on its next exit
+	volatile LONG ExitProfileResetPending;
+	VCPU_EXIT_PROFILE ExitProfile;
+	// The EPT invalidation generation this VCPU last invalidated up to, see EptReleaseRetiredTables
+	volatile UINT64 EptFlushGeneration;
+	// Set while an NMI sent by VcpuKickEptInvalidation is on its way to this VCPU
+	volatile CHAR EptFlushNmiPending;
+	// Local APIC ID of this VCPU's processor
+	UINT32 ApicId;
+	// Maps the xAPIC registers of this processor, mapped the first time it sends an IPI outside of x2APIC mode
+	struct _MM_VPTE* ApicVpte;
 } VCPU, *PVCPU;
 
+C_ASSERT(FIELD_OFFSET(VCPU, FastExits) == VCPU_FAST_EXITS_OFFSET);
+C_ASSERT(FIELD_OFFSET(VCPU, EptFlushPending) == VCPU_EPT_FLUSH_PENDING_OFFSET);
+C_ASSERT(FIELD_OFFSET(VCPU, Cpuid) == VCPU_CPUID_OFFSET);
+
 typedef enum _MSR_ACCESS
 {
 	MSR_READ,
@@ -296,6 +348,56 @@ VcpuCommitVmxState(
 	_Inout_ PVCPU Vcpu
 );
 
+VOID
+VcpuQueueEptInvalidation(
+	_Inout_ PVCPU Vcpu
+);
+
+VOID
+VcpuCommitEptInvalidation(
+	_Inout_ PVCPU Vcpu
+);
+
+VOID
+VcpuKickEptInvalidation(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT64 Generation
+);
+
+VOID
+VcpuSynchroniseEptInvalidation(
+	_Inout_ PVCPU Vcpu
+);
+
+BOOLEAN
+VcpuHandleEptFlushNmi(
+	_Inout_ PVCPU Vcpu
+);
+
+VOID
+VcpuSwitchEptView(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT32 View
+);
+
+VOID
+VcpuDrainPml(
+	_Inout_ PVCPU Vcpu
+);
+
+VOID
+VcpuCollectPmls(
+	_Inout_ PVCPU Vcpu
+);
+
+VOID
+VcpuCollectDirtyPages(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PageCount,
+	_Out_writes_((PageCount + 63) / 64) PUINT64 Bitmap
+);
+
 VOID
 VcpuToggleExitOnMsr(
 	_Inout_ PVCPU Vcpu,
@@ -2,9 +2,15 @@
 #include <arch/interrupt.h>
 #include <arch/memory.h>
 #include <vcpu/vmcall.h>
+#include <vcpu/ring.h>
+#include <vcpu/logstream.h>
+#include <vcpu/sigscan.h>
+#include <vcpu/sigset.h>
 #include <mm/vpte.h>
+#include <mm/dmap.h>
 #include <pdb/pdb.h>
 #include <mm/mm.h>
+#include <spinlock.h>
 #include <macro.h>
 #include <vmm.h>
 #include <vmx.h>
@@ -22,16 +28,106 @@ typedef union _HYPERCALL_VIRT_EX
 	};
 } HYPERCALL_VIRT_EX, *PHYPERCALL_VIRT_EX;
 
-typedef union _HYPERCALL_SIGSCAN_BUFFER
+typedef struct _HYPERCALL_SIGSCAN_BUFFER
 {
 	// The virtual address to start the scan from
 	UINT64 Address;
 	// The size of the pattern
-	SIZE_T PatternSize;
-	// Variable length array containing the pattern
+	UINT32 PatternSize;
+	// The maximum amount of matches to return
+	UINT32 MaxMatches;
+	// Variable length array containing the pattern, followed by a mask of the same size selecting the bits that must match
 	UCHAR Pattern[1];
 } HYPERCALL_SIGSCAN_BUFFER, *PHYPERCALL_SIGSCAN_BUFFER;
 
+typedef struct _HYPERCALL_SIGSCAN_RESULTS
+{
+	// The amount of matches found
+	UINT64 Count;
+	// Variable length array of the addresses matched, in ascending order
+	UINT64 Matches[1];
+} HYPERCALL_SIGSCAN_RESULTS, *PHYPERCALL_SIGSCAN_RESULTS;
+
+typedef struct _HYPERCALL_SIGSCAN_MULTI_BUFFER
+{
+	// The virtual address to start the scan from
+	UINT64 Address;
+	UINT32 PatternCount;
+	// SIGSCAN_MULTI_* flags
+	UINT32 Flags;
+	// The maximum amount of matches to return
+	UINT32 MaxMatches;
+	UINT32 Reserved;
+	// Variable length array of pattern descriptors
+	HYPERCALL_SIGSCAN_PATTERN Patterns[1];
+} HYPERCALL_SIGSCAN_MULTI_BUFFER, *PHYPERCALL_SIGSCAN_MULTI_BUFFER;
+
+typedef struct _HYPERCALL_SIGSCAN_MULTI_RESULTS
+{
+	// The amount of matches found
+	UINT64 Count;
+	// Variable length array of the matches, in the order their keys were found
+	HYPERCALL_SIGSCAN_MATCH Matches[1];
+} HYPERCALL_SIGSCAN_MULTI_RESULTS, *PHYPERCALL_SIGSCAN_MULTI_RESULTS;
+
+typedef struct _HYPERCALL_LOCK_STATS_RESULTS
+{
+	// The amount of locks written
+	UINT64 Count;
+	// Variable length array of lock statistics, in the order the locks were registered
+	SPINLOCK_STATS Locks[1];
+} HYPERCALL_LOCK_STATS_RESULTS, *PHYPERCALL_LOCK_STATS_RESULTS;
+
+typedef struct _HYPERCALL_EXIT_PROFILE_RESULTS
+{
+	// The amount of VCPUs summed into the profile
+	UINT64 VcpuCount;
+	VCPU_EXIT_PROFILE_ENTRY Reasons[VCPU_EXIT_REASON_COUNT];
+} HYPERCALL_EXIT_PROFILE_RESULTS, *PHYPERCALL_EXIT_PROFILE_RESULTS;
+
+typedef struct _VM_SIGSCAN_CONTEXT
+{
+	UINT64 GuestCr3;
+	// Guest address of the caller's HYPERCALL_SIGSCAN_RESULTS
+	UINT64 Results;
+	// Virtual address that offset 0 of the buffer being scanned corresponds to
+	UINT64 BaseAddress;
+	UINT64 Count;
+	UINT64 MaxMatches;
+	BOOLEAN Failed;
+} VM_SIGSCAN_CONTEXT, *PVM_SIGSCAN_CONTEXT;
+
+typedef struct _VM_SIGSCAN_MULTI_CONTEXT
+{
+	PSIG_SET Set;
+	UINT64 GuestCr3;
+	UINT64 DirBase;
+	// Guest address of the caller's HYPERCALL_SIGSCAN_MULTI_RESULTS
+	UINT64 Results;
+	// Bounds of the scanned range, matches must lie entirely inside it
+	UINT64 ScanStart;
+	UINT64 ScanEnd;
+	// The page currently being scanned and the virtual address it is mapped from
+	PUCHAR Page;
+	SIZE_T PageSize;
+	UINT64 PageAddr;
+	BOOLEAN FirstHitOnly;
+	// Bitmap of patterns that have been found, and how many are yet to be
+	UINT64 Found[SIG_SET_MAX_PATTERNS / 64];
+	SIZE_T Remaining;
+	UINT64 Count;
+	UINT64 MaxMatches;
+	BOOLEAN Failed;
+} VM_SIGSCAN_MULTI_CONTEXT, *PVM_SIGSCAN_MULTI_CONTEXT;
+
+// Signature set used by HYPERCALL_VIRT_SIGSCAN_MULTI, too large for the host stack so it is shared and locked.
+// It stays compiled between calls so repeated scans for the same patterns skip building the automaton
+VMM_DATA static SIG_SET sSigSet;
+VMM_DATA static BOOLEAN sSigSetCompiled;
+VMM_DATA static SPINLOCK sSigSetLock;
+// Held for the whole of a page table donation, so one that fails never gives back pages another is linking
+VMM_DATA static SPINLOCK sDonationLock;
+
 typedef union _HYPERCALL_REMAP_PAGES_EX
 {
 	UINT64 Value;
@@ -40,6 +136,9 @@ typedef union _HYPERCALL_REMAP_PAGES_EX
 	{
 		UINT64 Size : 32;
 		UINT64 Permissions : 8;
+		// Only remap the pages in `View` rather than in every EPT view
+		UINT64 SingleView : 1;
+		UINT64 View : 9;
 	};
 } HYPERCALL_REMAP_PAGES_EX, *PHYPERCALL_REMAP_PAGES_EX;
 
@@ -76,6 +175,8 @@ VmAbortHypercall(
 	_In_ UINT16 Status
 )
 {
+	IMP_LOG_WARN(IMP_LOG_HYPERCALL, "Hypercall %u failed (%X)...\n", (UINT32)Hypercall->Id, Status);
+
 	Hypercall->Result = Status;
 	return VMM_EVENT_CONTINUE;
 }
@@ -92,6 +193,7 @@ VmGetProcessCr3(
 VMM_EVENT_STATUS 
 VmFindProcessDirectoryBase(
 	_In_ PVCPU Vcpu,
+	_In_ UINT64 GuestCr3,
 	_In_ HYPERCALL_VIRT_EX VirtEx,
 	_Out_ PULONG_PTR pDirectoryBase
 )
@@ -103,7 +205,7 @@ VmFindProcessDirectoryBase(
 	switch (VirtEx.Pid)
 	{
 	case VM_SYSTEM_PID: *pDirectoryBase = Vcpu->SystemDirectoryBase; break;
-	case VM_CURRENT_PID: *pDirectoryBase = VmxRead(GUEST_CR3); break;
+	case VM_CURRENT_PID: *pDirectoryBase = GuestCr3; break;
 	default:
 	{
 		PVOID Process = WinFindProcessById(VirtEx.Pid);
@@ -116,6 +218,414 @@ VmFindProcessDirectoryBase(
 	return VMM_EVENT_CONTINUE;
 }
 
+VMM_API
+NTSTATUS
+VmTransferBatchEntry(
+	_In_ UINT64 GuestCr3,
+	_In_ UINT64 DirBase,
+	_In_ PHYPERCALL_BATCH_ENTRY Entry,
+	_In_ BOOLEAN Write,
+	_Inout_ PMM_VPTE Vpte
+)
+/*++
+Routine Description:
+	Copies a single batch entry between the caller's buffer (translated through `GuestCr3`) and the target 
+	address (translated through `DirBase`), split at page boundaries of either side
+--*/
+{
+	SIZE_T SizeCopied = 0;
+	while (Entry->Size > SizeCopied)
+	{
+		const UINT64 Buffer = Entry->Buffer + SizeCopied;
+		const UINT64 Address = Entry->Address + SizeCopied;
+
+		// MaxCopyable is the maximum amount of bytes before hitting a page boundary in either address
+		const SIZE_T MaxCopyable = PAGE_SIZE - max(PAGE_OFFSET(Buffer), PAGE_OFFSET(Address));
+		const SIZE_T SizeToCopy = Entry->Size - SizeCopied > MaxCopyable ? MaxCopyable : Entry->Size - SizeCopied;
+
+		NTSTATUS Status = MmMapGuestVirt(Vpte, GuestCr3, Buffer);
+		if (!NT_SUCCESS(Status))
+			return Status;
+
+		Status = Write ? 
+			MmWriteGuestVirt(DirBase, Address, SizeToCopy, Vpte->MappedVirtAddr) :
+			MmReadGuestVirt(DirBase, Address, SizeToCopy, Vpte->MappedVirtAddr);
+
+		if (!NT_SUCCESS(Status))
+			return Status;
+
+		SizeCopied += SizeToCopy;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+VmReadGuestBuffer(
+	_In_ UINT64 GuestCr3,
+	_In_ UINT64 VirtAddr,
+	_In_ SIZE_T Size,
+	_Out_ PVOID Buffer
+)
+/*++
+Routine Description:
+	Reads a guest buffer that may cross page boundaries
+--*/
+{
+	SIZE_T SizeRead = 0;
+	while (Size > SizeRead)
+	{
+		const SIZE_T MaxReadable = PAGE_SIZE - PAGE_OFFSET(VirtAddr + SizeRead);
+		const SIZE_T SizeToRead = Size - SizeRead > MaxReadable ? MaxReadable : Size - SizeRead;
+
+		UINT64 PhysAddr = 0;
+
+		NTSTATUS Status = MmTranslateGuestVirt(GuestCr3, VirtAddr + SizeRead, &PhysAddr);
+		if (!NT_SUCCESS(Status))
+			return Status;
+
+		Status = MmReadGuestPhys(PhysAddr, SizeToRead, RVA_PTR(Buffer, SizeRead));
+		if (!NT_SUCCESS(Status))
+			return Status;
+
+		SizeRead += SizeToRead;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+VmWriteGuestBuffer(
+	_In_ UINT64 GuestCr3,
+	_In_ UINT64 VirtAddr,
+	_In_ SIZE_T Size,
+	_In_ PVOID Buffer
+)
+/*++
+Routine Description:
+	Writes a guest buffer that may cross page boundaries
+--*/
+{
+	SIZE_T SizeWritten = 0;
+	while (Size > SizeWritten)
+	{
+		const SIZE_T MaxWritable = PAGE_SIZE - PAGE_OFFSET(VirtAddr + SizeWritten);
+		const SIZE_T SizeToWrite = Size - SizeWritten > MaxWritable ? MaxWritable : Size - SizeWritten;
+
+		UINT64 PhysAddr = 0;
+
+		NTSTATUS Status = MmTranslateGuestVirt(GuestCr3, VirtAddr + SizeWritten, &PhysAddr);
+		if (!NT_SUCCESS(Status))
+			return Status;
+
+		Status = MmWriteGuestPhys(PhysAddr, SizeToWrite, RVA_PTR(Buffer, SizeWritten));
+		if (!NT_SUCCESS(Status))
+			return Status;
+
+		SizeWritten += SizeToWrite;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+NTSTATUS
+VmReadGuestString(
+	_In_ UINT64 GuestCr3,
+	_In_ UINT64 VirtAddr,
+	_In_ SIZE_T MaxSize,
+	_Out_writes_z_(MaxSize) PCHAR Buffer
+)
+/*++
+Routine Description:
+	Reads a null-terminated guest string of at most `MaxSize` bytes including the terminator, a page at a time
+	so nothing past the end of the string is touched. The string is truncated if it is too long
+--*/
+{
+	SIZE_T SizeRead = 0;
+	while (MaxSize - 1 > SizeRead)
+	{
+		const SIZE_T MaxReadable = PAGE_SIZE - PAGE_OFFSET(VirtAddr + SizeRead);
+		const SIZE_T SizeToRead = MaxSize - 1 - SizeRead > MaxReadable ? MaxReadable : MaxSize - 1 - SizeRead;
+
+		NTSTATUS Status = VmReadGuestBuffer(GuestCr3, VirtAddr + SizeRead, SizeToRead, Buffer + SizeRead);
+		if (!NT_SUCCESS(Status))
+			return Status;
+
+		for (SIZE_T i = SizeRead; i < SizeRead + SizeToRead; i++)
+		{
+			if (Buffer[i] == '\0')
+				return STATUS_SUCCESS;
+		}
+
+		SizeRead += SizeToRead;
+	}
+
+	Buffer[SizeRead] = '\0';
+
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+BOOLEAN
+VmSigScanMatchCallback(
+	_In_ PVOID Context,
+	_In_ SIZE_T Offset
+)
+/*++
+Routine Description:
+	Appends a match to the caller's results array, stopping the scan once it is full
+--*/
+{
+	PVM_SIGSCAN_CONTEXT SigScan = Context;
+
+	const UINT64 Match = SigScan->BaseAddress + Offset;
+	const UINT64 MatchAddr = SigScan->Results + FIELD_OFFSET(HYPERCALL_SIGSCAN_RESULTS, Matches) + SigScan->Count * sizeof(UINT64);
+
+	if (!NT_SUCCESS(MmWriteGuestVirt(SigScan->GuestCr3, MatchAddr, sizeof(UINT64), (PVOID)&Match)))
+	{
+		SigScan->Failed = TRUE;
+		return FALSE;
+	}
+
+	return ++SigScan->Count < SigScan->MaxMatches;
+}
+
+VMM_API
+VOID
+VmScanGuestVirt(
+	_In_ PSIG_PATTERN Pattern,
+	_In_ UINT64 DirBase,
+	_In_ UINT64 Address,
+	_In_ SIZE_T Size,
+	_Inout_ PMM_VPTE Vpte,
+	_Inout_ PVM_SIGSCAN_CONTEXT Context
+)
+/*++
+Routine Description:
+	Scans a virtual address range of the address space of `DirBase` page by page, mapping each page only once.
+	The last (PatternSize - 1) bytes of each page are carried over so matches crossing a page boundary are found
+	by scanning the carry joined with the start of the next page. Pages that aren't present are skipped
+--*/
+{
+	// Carried bytes of the previous page followed by the head of the current one
+	UCHAR Window[(SIG_MAX_PATTERN_SIZE - 1) * 2];
+	SIZE_T CarrySize = 0;
+
+	const SIZE_T MaxCarry = Pattern->Size - 1;
+
+	SIZE_T SizeScanned = 0;
+	while (Size > SizeScanned)
+	{
+		const UINT64 PageAddr = Address + SizeScanned;
+		const SIZE_T MaxPageSize = PAGE_SIZE - PAGE_OFFSET(PageAddr);
+		const SIZE_T PageSize = Size - SizeScanned > MaxPageSize ? MaxPageSize : Size - SizeScanned;
+
+		SizeScanned += PageSize;
+
+		UINT64 PhysAddr = 0;
+		if (!NT_SUCCESS(MmTranslateGuestVirt(DirBase, PageAddr, &PhysAddr)))
+		{
+			// No match can span a page that isn't present
+			CarrySize = 0;
+			continue;
+		}
+
+		PUCHAR Page = MmGetDirectMapAddress(PhysAddr, PageSize);
+		if (Page == NULL)
+		{
+			MmMapGuestPhys(Vpte, PhysAddr);
+			Page = Vpte->MappedVirtAddr;
+		}
+
+		// Matches starting in the carried bytes of the previous page
+		if (CarrySize != 0)
+		{
+			const SIZE_T HeadSize = PageSize > MaxCarry ? MaxCarry : PageSize;
+			RtlCopyMemory(Window + CarrySize, Page, HeadSize);
+
+			Context->BaseAddress = PageAddr - CarrySize;
+			if (!SigScanBuffer(Pattern, Window, CarrySize + HeadSize, CarrySize, VmSigScanMatchCallback, Context))
+				return;
+		}
+
+		// Matches entirely inside this page
+		Context->BaseAddress = PageAddr;
+		if (!SigScanBuffer(Pattern, Page, PageSize, PageSize, VmSigScanMatchCallback, Context))
+			return;
+
+		// Keep the last bytes of everything contiguous so far for the next page
+		if (PageSize >= MaxCarry)
+		{
+			RtlCopyMemory(Window, Page + PageSize - MaxCarry, MaxCarry);
+			CarrySize = MaxCarry;
+		}
+		else
+		{
+			const SIZE_T KeptSize = CarrySize > MaxCarry - PageSize ? MaxCarry - PageSize : CarrySize;
+
+			RtlMoveMemory(Window, Window + CarrySize - KeptSize, KeptSize);
+			RtlCopyMemory(Window + KeptSize, Page, PageSize);
+			CarrySize = KeptSize + PageSize;
+		}
+	}
+}
+
+VMM_API
+BOOLEAN
+VmSigScanMultiMatchCallback(
+	_In_ PVOID Context,
+	_In_ SIZE_T PatternId,
+	_In_ SIZE_T KeyEndOffset
+)
+/*++
+Routine Description:
+	Verifies a key hit against its whole pattern and appends it to the caller's results array. The pattern is
+	verified in place if it lies inside the current page, otherwise it is read across the page boundary
+--*/
+{
+	PVM_SIGSCAN_MULTI_CONTEXT SigScan = Context;
+	PSIG_SET_ENTRY Entry = &SigScan->Set->Patterns[PatternId];
+
+	if (SigScan->FirstHitOnly && (SigScan->Found[PatternId / 64] & (1ULL << (PatternId % 64))) != 0)
+		return TRUE;
+
+	const UINT64 KeyEnd = SigScan->PageAddr + KeyEndOffset;
+	const UINT64 KeyEndIndex = Entry->KeyOffset + Entry->KeySize - 1;
+
+	// The pattern must start and end inside the scanned range
+	if (KeyEnd - SigScan->ScanStart < KeyEndIndex || KeyEnd - KeyEndIndex + Entry->Pattern.Size > SigScan->ScanEnd)
+		return TRUE;
+
+	const UINT64 Start = KeyEnd - KeyEndIndex;
+
+	if (Start >= SigScan->PageAddr && Start + Entry->Pattern.Size <= SigScan->PageAddr + SigScan->PageSize)
+	{
+		if (!SigVerifyMatch(&Entry->Pattern, SigScan->Page + (Start - SigScan->PageAddr)))
+			return TRUE;
+	}
+	else
+	{
+		UCHAR Data[SIG_MAX_PATTERN_SIZE];
+		if (!NT_SUCCESS(VmReadGuestBuffer(SigScan->DirBase, Start, Entry->Pattern.Size, Data)) || 
+			!SigVerifyMatch(&Entry->Pattern, Data))
+			return TRUE;
+	}
+
+	HYPERCALL_SIGSCAN_MATCH Match = {
+		.Address = Start,
+		.PatternId = PatternId
+	};
+
+	const UINT64 MatchAddr = SigScan->Results + FIELD_OFFSET(HYPERCALL_SIGSCAN_MULTI_RESULTS, Matches) + SigScan->Count * sizeof(HYPERCALL_SIGSCAN_MATCH);
+
+	if (!NT_SUCCESS(MmWriteGuestVirt(SigScan->GuestCr3, MatchAddr, sizeof(HYPERCALL_SIGSCAN_MATCH), &Match)))
+	{
+		SigScan->Failed = TRUE;
+		return FALSE;
+	}
+
+	if ((SigScan->Found[PatternId / 64] & (1ULL << (PatternId % 64))) == 0)
+	{
+		SigScan->Found[PatternId / 64] |= 1ULL << (PatternId % 64);
+		SigScan->Remaining--;
+	}
+
+	if (++SigScan->Count >= SigScan->MaxMatches)
+		return FALSE;
+
+	// Every pattern has been found, nothing more to report
+	return !(SigScan->FirstHitOnly && SigScan->Remaining == 0);
+}
+
+VMM_API
+NTSTATUS
+VmReadSigScanPattern(
+	_In_ UINT64 GuestCr3,
+	_In_ UINT64 Buffer,
+	_In_ SIZE_T Index,
+	_Out_writes_(SIG_MAX_PATTERN_SIZE) PUCHAR Pattern,
+	_Out_writes_(SIG_MAX_PATTERN_SIZE) PUCHAR Mask,
+	_Out_ PSIZE_T Size
+)
+/*++
+Routine Description:
+	Reads the bytes and mask of pattern `Index` of a guest HYPERCALL_SIGSCAN_MULTI_BUFFER
+--*/
+{
+	HYPERCALL_SIGSCAN_PATTERN Descriptor = { 0 };
+
+	const UINT64 DescriptorAddr = Buffer + FIELD_OFFSET(HYPERCALL_SIGSCAN_MULTI_BUFFER, Patterns) + Index * sizeof(HYPERCALL_SIGSCAN_PATTERN);
+
+	NTSTATUS Status = VmReadGuestBuffer(GuestCr3, DescriptorAddr, sizeof(HYPERCALL_SIGSCAN_PATTERN), &Descriptor);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	if (Descriptor.Size == 0 || Descriptor.Size > SIG_MAX_PATTERN_SIZE)
+		return STATUS_INVALID_PARAMETER;
+
+	Status = VmReadGuestBuffer(GuestCr3, Descriptor.Pattern, Descriptor.Size, Pattern);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	Status = VmReadGuestBuffer(GuestCr3, Descriptor.Mask, Descriptor.Size, Mask);
+	if (!NT_SUCCESS(Status))
+		return Status;
+
+	*Size = Descriptor.Size;
+	return STATUS_SUCCESS;
+}
+
+VMM_API
+VOID
+VmScanGuestVirtMulti(
+	_In_ UINT64 Address,
+	_In_ SIZE_T Size,
+	_Inout_ PMM_VPTE Vpte,
+	_Inout_ PVM_SIGSCAN_MULTI_CONTEXT Context
+)
+/*++
+Routine Description:
+	Feeds a virtual address range through the signature set's automaton page by page, mapping each page only 
+	once. The automaton state carries over between pages, and is reset at pages that aren't present
+--*/
+{
+	UINT16 State = 0;
+
+	SIZE_T SizeScanned = 0;
+	while (Size > SizeScanned)
+	{
+		const UINT64 PageAddr = Address + SizeScanned;
+		const SIZE_T MaxPageSize = PAGE_SIZE - PAGE_OFFSET(PageAddr);
+		const SIZE_T PageSize = Size - SizeScanned > MaxPageSize ? MaxPageSize : Size - SizeScanned;
+
+		SizeScanned += PageSize;
+
+		UINT64 PhysAddr = 0;
+		if (!NT_SUCCESS(MmTranslateGuestVirt(Context->DirBase, PageAddr, &PhysAddr)))
+		{
+			State = 0;
+			continue;
+		}
+
+		PUCHAR Page = MmGetDirectMapAddress(PhysAddr, PageSize);
+		if (Page == NULL)
+		{
+			MmMapGuestPhys(Vpte, PhysAddr);
+			Page = Vpte->MappedVirtAddr;
+		}
+
+		Context->Page = Page;
+		Context->PageSize = PageSize;
+		Context->PageAddr = PageAddr;
+
+		if (!SigSetScanBuffer(Context->Set, &State, Page, PageSize, VmSigScanMultiMatchCallback, Context))
+			return;
+	}
+}
+
 // TODO: Design better system for reading and writing processes
 
 VMM_API
@@ -125,8 +635,30 @@ VmHandleHypercall(
 	_In_ PGUEST_STATE GuestState,
 	_In_ PHYPERCALL_INFO Hypercall
 )
+/*++
+Routine Description:
+	Handles a hypercall made through VMCALL, in the address space of the current guest
+--*/
+{
+	return VmDispatchHypercall(Vcpu, VmxCacheRead(&Vcpu->Vmx, GUEST_CR3), GuestState, Hypercall);
+}
+
+VMM_API
+VMM_EVENT_STATUS
+VmDispatchHypercall(
+	_In_ PVCPU Vcpu,
+	_In_ UINT64 GuestCr3,
+	_In_ PGUEST_STATE GuestState,
+	_In_ PHYPERCALL_INFO Hypercall
+)
+/*++
+Routine Description:
+	Executes a hypercall with its guest addresses translated through `GuestCr3`, which is not necessarily the
+	current guest's address space when the hypercall came from the submission ring
+--*/
 {
-	UINT64 GuestCr3 = VmxRead(GUEST_CR3);
+	IMP_LOG_TRACE(IMP_LOG_HYPERCALL, "[%02X] Hypercall %u (%llX, %llX, %llX)\n", Vcpu->Id, (UINT32)Hypercall->Id, 
+		GuestState->Rbx, GuestState->Rcx, GuestState->Rdx);
 
 	Hypercall->Result = HRESULT_SUCCESS;
 
@@ -148,7 +680,7 @@ VmHandleHypercall(
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
 		UINT64 DirBase = 0;
-		if (VmFindProcessDirectoryBase(Vcpu, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
+		if (VmFindProcessDirectoryBase(Vcpu, GuestCr3, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
 		PMM_VPTE Vpte = NULL; 
@@ -191,7 +723,7 @@ VmHandleHypercall(
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
 		UINT64 DirBase = 0;
-		if (VmFindProcessDirectoryBase(Vcpu, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
+		if (VmFindProcessDirectoryBase(Vcpu, GuestCr3, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
 		PMM_VPTE Vpte = NULL;
@@ -217,12 +749,72 @@ VmHandleHypercall(
 
 		MmFreeVpte(Vpte);
 	} break;
+	case HYPERCALL_READ_VIRT_BATCH:
+	case HYPERCALL_WRITE_VIRT_BATCH:
+	{
+		// RCX holds the entry array and RDX the status bitmap, one bit per entry set if it succeeded
+		if (GuestState->Rcx == 0 || (GuestState->Rcx & (sizeof(HYPERCALL_BATCH_ENTRY) - 1)) != 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SOURCE_ADDR);
+
+		if (GuestState->Rdx == 0 || (GuestState->Rdx & (sizeof(UINT64) - 1)) != 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		// The size field holds the amount of entries for batched calls
+		HYPERCALL_VIRT_EX VirtEx = {
+			.Value = GuestState->Rbx
+		};
+
+		if (VirtEx.Pid == 0 || VirtEx.Size == 0 || VirtEx.Size > VM_MAX_BATCH_ENTRIES)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		// The directory base is only resolved once for the whole batch
+		UINT64 DirBase = 0;
+		if (VmFindProcessDirectoryBase(Vcpu, GuestCr3, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		PMM_VPTE Vpte = NULL;
+		if (!NT_SUCCESS(MmAllocateVpte(&Vpte)))
+			return VmAbortHypercall(Hypercall, HRESULT_INSUFFICIENT_RESOURCES);
+
+		const BOOLEAN Write = Hypercall->Id == HYPERCALL_WRITE_VIRT_BATCH;
+
+		UINT64 StatusBits = 0;
+		BOOLEAN Incomplete = FALSE;
+
+		for (SIZE_T i = 0; i < VirtEx.Size; i++)
+		{
+			// Entries are aligned to their size so they never cross a page boundary
+			HYPERCALL_BATCH_ENTRY Entry = { 0 };
+			if (NT_SUCCESS(MmReadGuestVirt(GuestCr3, GuestState->Rcx + i * sizeof(HYPERCALL_BATCH_ENTRY), sizeof(HYPERCALL_BATCH_ENTRY), &Entry)) &&
+				NT_SUCCESS(VmTransferBatchEntry(GuestCr3, DirBase, &Entry, Write, Vpte)))
+				StatusBits |= 1ULL << (i % 64);
+			else
+				Incomplete = TRUE;
+
+			// Flush the status bits every 64 entries, and for the final partial word
+			if (i % 64 == 63 || i == VirtEx.Size - 1)
+			{
+				if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx + (i / 64) * sizeof(UINT64), sizeof(UINT64), &StatusBits)))
+				{
+					MmFreeVpte(Vpte);
+					return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+				}
+
+				StatusBits = 0;
+			}
+		}
+
+		MmFreeVpte(Vpte);
+
+		if (Incomplete)
+			return VmAbortHypercall(Hypercall, HRESULT_BATCH_INCOMPLETE);
+	} break;
 	case HYPERCALL_VIRT_SIGSCAN: 
 	{
 		if (GuestState->Rcx == 0)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIGSCAN_BUFFER);
 
-		if (GuestState->Rdx == 0)
+		if (GuestState->Rdx == 0 || (GuestState->Rdx & (sizeof(UINT64) - 1)) != 0)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
 
 		HYPERCALL_VIRT_EX VirtEx = {
@@ -233,49 +825,148 @@ VmHandleHypercall(
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
 		UINT64 DirBase = 0;
-		if (VmFindProcessDirectoryBase(Vcpu, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
+		if (VmFindProcessDirectoryBase(Vcpu, GuestCr3, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
+		HYPERCALL_SIGSCAN_BUFFER SigScan = { 0 };
+		if (!NT_SUCCESS(VmReadGuestBuffer(GuestCr3, GuestState->Rcx, FIELD_OFFSET(HYPERCALL_SIGSCAN_BUFFER, Pattern), &SigScan)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIGSCAN_BUFFER);
+
+		if (SigScan.PatternSize == 0 || SigScan.PatternSize > SIG_MAX_PATTERN_SIZE || SigScan.MaxMatches == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIGSCAN_BUFFER);
+
+		// Read the pattern and mask straight into the prepared pattern's buffers, then prepare it in place
+		SIG_PATTERN Pattern = { 0 };
+
+		const UINT64 PatternAddr = GuestState->Rcx + FIELD_OFFSET(HYPERCALL_SIGSCAN_BUFFER, Pattern);
+		if (!NT_SUCCESS(VmReadGuestBuffer(GuestCr3, PatternAddr, SigScan.PatternSize, Pattern.Bytes)) ||
+			!NT_SUCCESS(VmReadGuestBuffer(GuestCr3, PatternAddr + SigScan.PatternSize, SigScan.PatternSize, Pattern.Mask)) ||
+			!NT_SUCCESS(SigPreparePattern(&Pattern, Pattern.Bytes, Pattern.Mask, SigScan.PatternSize)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIGSCAN_BUFFER);
+
 		PMM_VPTE Vpte = NULL;
 		if (!NT_SUCCESS(MmAllocateVpte(&Vpte)))
 			return VmAbortHypercall(Hypercall, HRESULT_INSUFFICIENT_RESOURCES);
 
-		// Map the signature scan buffer, we do this instead of copying it using MmReadGuestVirt as HYPERCALL_SIGSCAN_BUFFER is a variable-length struct
-		if (!NT_SUCCESS(MmMapGuestVirt(Vpte, GuestCr3, GuestState->Rcx)))
+		VM_SIGSCAN_CONTEXT Context = {
+			.GuestCr3 = GuestCr3,
+			.Results = GuestState->Rdx,
+			.MaxMatches = SigScan.MaxMatches
+		};
+
+		VmScanGuestVirt(&Pattern, DirBase, SigScan.Address, VirtEx.Size, Vpte, &Context);
+
+		MmFreeVpte(Vpte);
+
+		if (Context.Failed)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		// Write the amount of matches to the target's count
+		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx + FIELD_OFFSET(HYPERCALL_SIGSCAN_RESULTS, Count), sizeof(UINT64), &Context.Count)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+	} break;
+	case HYPERCALL_VIRT_SIGSCAN_MULTI:
+	{
+		if (GuestState->Rcx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIGSCAN_BUFFER);
+
+		if (GuestState->Rdx == 0 || (GuestState->Rdx & (sizeof(UINT64) - 1)) != 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		HYPERCALL_VIRT_EX VirtEx = {
+			.Value = GuestState->Rbx
+		};
+
+		if (VirtEx.Pid == 0 || VirtEx.Size == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		UINT64 DirBase = 0;
+		if (VmFindProcessDirectoryBase(Vcpu, GuestCr3, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		HYPERCALL_SIGSCAN_MULTI_BUFFER SigScan = { 0 };
+		if (!NT_SUCCESS(VmReadGuestBuffer(GuestCr3, GuestState->Rcx, FIELD_OFFSET(HYPERCALL_SIGSCAN_MULTI_BUFFER, Patterns), &SigScan)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIGSCAN_BUFFER);
+
+		if (SigScan.PatternCount == 0 || SigScan.PatternCount > SIG_SET_MAX_PATTERNS || SigScan.MaxMatches == 0)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIGSCAN_BUFFER);
 
-		PHYPERCALL_SIGSCAN_BUFFER SigScan = Vpte->MappedVirtAddr;
+		PMM_VPTE Vpte = NULL;
+		if (!NT_SUCCESS(MmAllocateVpte(&Vpte)))
+			return VmAbortHypercall(Hypercall, HRESULT_INSUFFICIENT_RESOURCES);
+
+		SpinLock(&sSigSetLock);
 
-		SIZE_T SizeScanned = 0;
-		while (SizeScanned < VirtEx.Size - SigScan->PatternSize)
+		HYPERCALL_RESULT Result = HRESULT_SUCCESS;
+
+		UCHAR Pattern[SIG_MAX_PATTERN_SIZE], Mask[SIG_MAX_PATTERN_SIZE];
+		SIZE_T Size = 0;
+
+		// Reuse the set compiled by the last call if it was given the same patterns
+		BOOLEAN Reuse = sSigSetCompiled && sSigSet.PatternCount == SigScan.PatternCount;
+
+		for (SIZE_T i = 0; Reuse && i < SigScan.PatternCount; i++)
 		{
-			// Temporary data holding the bytes currently being checked against our pattern
-			// NOTE: This limites the pattern length to 128 or whatever size this array becomes
-			UCHAR Data[128] = { 0 };
+			if (!NT_SUCCESS(VmReadSigScanPattern(GuestCr3, GuestState->Rcx, i, Pattern, Mask, &Size)))
+			{
+				Result = HRESULT_INVALID_SIGSCAN_BUFFER;
+				break;
+			}
+
+			Reuse = SigSetIsPattern(&sSigSet, i, Pattern, Mask, Size);
+		}
 
-			// Read `HYPERCALL_SIGSCAN_BUFFER::PatternSize` bytes
-			if (!NT_SUCCESS(MmReadGuestVirt(DirBase, SigScan->Address + SizeScanned, SigScan->PatternSize, Data)))
-				return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIZE);
+		if (Result == HRESULT_SUCCESS && !Reuse)
+		{
+			// Compile every pattern into the shared signature set, it is left unusable if any pattern is invalid
+			sSigSetCompiled = FALSE;
+			SigSetInitialise(&sSigSet);
 
-			SIZE_T i = 0;
-			for (i; i < SigScan->PatternSize; i++)
+			for (SIZE_T i = 0; i < SigScan.PatternCount; i++)
 			{
-				// If the current byte doesn't match and the current pattern byte isn't a wildcard, check the next address in the space
-				if (Data[i] != SigScan->Pattern[i] && SigScan->Pattern[i] != 0xCC)
+				if (!NT_SUCCESS(VmReadSigScanPattern(GuestCr3, GuestState->Rcx, i, Pattern, Mask, &Size)) ||
+					!NT_SUCCESS(SigSetAddPattern(&sSigSet, Pattern, Mask, Size)))
+				{
+					Result = HRESULT_INVALID_SIGSCAN_BUFFER;
 					break;
+				}
 			}
 
-			// If `i` == `HYPERCALL_SIGSCAN_BUFFER::PatternSize`, then we achieved a full match
-			if (i == SigScan->PatternSize)
-				break;
-			else
-				// Advance to the next byte and try again
-				SizeScanned += 1;
+			if (Result == HRESULT_SUCCESS)
+			{
+				SigSetCompile(&sSigSet);
+				sSigSetCompiled = TRUE;
+			}
 		}
 
-		// Write the result to the target variable
-		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx, sizeof(UINT64), RVA_PTR(SigScan->Address, SizeScanned))))
-			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+		if (Result == HRESULT_SUCCESS)
+		{
+			VM_SIGSCAN_MULTI_CONTEXT Context = {
+				.Set = &sSigSet,
+				.GuestCr3 = GuestCr3,
+				.DirBase = DirBase,
+				.Results = GuestState->Rdx,
+				.ScanStart = SigScan.Address,
+				.ScanEnd = SigScan.Address + VirtEx.Size,
+				.FirstHitOnly = (SigScan.Flags & SIGSCAN_MULTI_FIRST_HIT) != 0,
+				.Remaining = SigScan.PatternCount,
+				.MaxMatches = SigScan.MaxMatches
+			};
+
+			VmScanGuestVirtMulti(SigScan.Address, VirtEx.Size, Vpte, &Context);
+
+			// Write the amount of matches to the target's count
+			if (Context.Failed ||
+				!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx + FIELD_OFFSET(HYPERCALL_SIGSCAN_MULTI_RESULTS, Count), sizeof(UINT64), &Context.Count)))
+				Result = HRESULT_INVALID_DESTINATION_ADDR;
+		}
+
+		SpinUnlock(&sSigSetLock);
+
+		MmFreeVpte(Vpte);
+
+		if (Result != HRESULT_SUCCESS)
+			return VmAbortHypercall(Hypercall, (UINT16)Result);
 	} break;
 	case HYPERCALL_PHYS_TO_VIRT:
 	{
@@ -293,7 +984,7 @@ VmHandleHypercall(
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
 		UINT64 DirBase = 0;
-		if (VmFindProcessDirectoryBase(Vcpu, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
+		if (VmFindProcessDirectoryBase(Vcpu, GuestCr3, VirtEx, &DirBase) != VMM_EVENT_CONTINUE)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
 
 		UINT64 Result = MmResolveGuestVirtAddr(DirBase, GuestState->Rcx);
@@ -336,81 +1027,119 @@ VmHandleHypercall(
 			.Value = GuestState->Rbx
 		};
 
+		const PEPT_INFORMATION Ept = &Vcpu->Vmm->Ept;
+
+		if (RemapEx.SingleView && RemapEx.View >= Ept->ViewCount)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		SpinLock(&Ept->Lock);
+
 		// Target (RCX) and Buffer (RDX) are used as GPA and PA respectively
-		if (!NT_SUCCESS(
-			EptMapMemoryRange(
-				Vcpu->Vmm->Ept.Pml4,
-				GuestState->Rcx,
-				GuestState->Rdx,
-				RemapEx.Size,
-				RemapEx.Permissions)
-			))
-			return VmAbortHypercall(Hypercall, HRESULT_INVALID_GUEST_PHYSADDR);
+		NTSTATUS Status = RemapEx.SingleView ?
+			EptMapMemoryRange(Ept->Views[RemapEx.View].Pml4, GuestState->Rcx, GuestState->Rdx, RemapEx.Size, RemapEx.Permissions) :
+			EptMapMemoryRangeInViews(Ept, GuestState->Rcx, GuestState->Rdx, RemapEx.Size, RemapEx.Permissions);
+
+		// Large and super pages split to remap part of them are merged back once the whole page maps uniformly
+		// again, such as after a detour is removed. Part of the range may have been remapped even on failure
+		EptCoalesceRange(Ept, GuestState->Rcx, RemapEx.Size);
+
+		SpinUnlock(&Ept->Lock);
+
+		VcpuQueueEptInvalidation(Vcpu);
 
-		EptInvalidateCache();
+		if (!NT_SUCCESS(Status))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_GUEST_PHYSADDR);
 	} break;
 	case HYPERCALL_HIDE_HOST_RESOURCES:
 	{
+		NTSTATUS Status = STATUS_SUCCESS;
+
+		SpinLock(&Vcpu->Vmm->Ept.Lock);
+
 		// Loop condition is not wrong, head is always the last one used, one is ignored at the end
 		PIMP_ALLOC_RECORD CurrRecord = gHostAllocationsHead;
-		while (CurrRecord != NULL)
+		while (CurrRecord != NULL && NT_SUCCESS(Status))
 		{
 			// Only hide host allocations or memory allocations that aren't needed anymore
-			if ((CurrRecord->Flags & (IMP_SHADOW_ALLOCATION | IMP_HOST_ALLOCATION)) == 0)
-				goto skip;
-
-			if (!NT_SUCCESS(
-				EptMapMemoryRange(
-					Vcpu->Vmm->Ept.Pml4,
+			if ((CurrRecord->Flags & (IMP_SHADOW_ALLOCATION | IMP_HOST_ALLOCATION)) != 0)
+			{
+				Status = EptMapMemoryRangeInViews(
+					&Vcpu->Vmm->Ept,
 					CurrRecord->PhysAddr,
 					Vcpu->Vmm->Ept.DummyPagePhysAddr,
 					CurrRecord->Size,
-					EPT_PAGE_RW)
-				))
-				return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+					EPT_PAGE_RW
+				);
+			}
 
-		skip:
 			CurrRecord = (PIMP_ALLOC_RECORD)CurrRecord->Records.Blink;
 		}
 
-		EptInvalidateCache();
+		SpinUnlock(&Vcpu->Vmm->Ept.Lock);
+
+		VcpuQueueEptInvalidation(Vcpu);
+
+		if (!NT_SUCCESS(Status))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
 	} break;
 	case HYPERCALL_ADD_LOG_RECORD:
 	{
 		if (GuestState->Rcx == 0)
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SOURCE_ADDR);
 
-		PIMP_LOG_RECORD Log = NULL;
-		if (!NT_SUCCESS(ImpAllocateLogRecord(&Log)))
-			return VmAbortHypercall(Hypercall, HRESULT_LOG_RECORD_OVERFLOW);
-
-		if (!NT_SUCCESS(MmReadGuestVirt(GuestCr3, GuestState->Rcx, IMP_LOG_SIZE, Log->Buffer)))
+		CHAR Text[VM_MAX_LOG_TEXT_SIZE];
+		if (!NT_SUCCESS(VmReadGuestString(GuestCr3, GuestState->Rcx, sizeof(Text), Text)))
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SOURCE_ADDR);
-	}
+
+		ImpLogText(Text, strlen(Text));
+	} break;
 	case HYPERCALL_GET_LOG_RECORDS:
 	{
-		if (GuestState->Rcx == 0)
-			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SOURCE_ADDR);
+		if (GuestState->Rdx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
 
 		HYPERCALL_GET_LOGS_EX LogEx = {
 			.Value = GuestState->Rbx
 		};
 
-		SIZE_T Count = 0;
+		UINT64 Count = 0;
 		while (LogEx.Count > Count)
 		{
-			PIMP_LOG_RECORD CurrLog = NULL;
-			if (!NT_SUCCESS(ImpRetrieveLogRecord(&CurrLog)))
-				return VmAbortHypercall(Hypercall, HRESULT_LOG_RECORD_OVERFLOW);
+			IMP_LOG_ENTRY Entry;
+			if (!NT_SUCCESS(ImpRetrieveLogEntry(&Entry)))
+				break;
 
-			NTSTATUS Status = MmWriteGuestVirt(GuestCr3, GuestState->Rcx + IMP_LOG_SIZE * Count, IMP_LOG_SIZE, CurrLog->Buffer);
-			if (!NT_SUCCESS(Status))
-				return VmAbortHypercall(Hypercall, (UINT16)Status);
+			const UINT64 EntryAddr = GuestState->Rdx + FIELD_OFFSET(HYPERCALL_LOG_RECORDS, Entries) + Count * sizeof(IMP_LOG_ENTRY);
 
-			ImpFreeLogRecord(CurrLog);
+			if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, EntryAddr, sizeof(IMP_LOG_ENTRY), &Entry)))
+				return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
 
 			Count++;
 		}
+
+		const UINT64 Overflows = ImpGetLogOverflowCount();
+
+		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx + FIELD_OFFSET(HYPERCALL_LOG_RECORDS, Count), sizeof(UINT64), &Count)) ||
+			!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx + FIELD_OFFSET(HYPERCALL_LOG_RECORDS, Overflows), sizeof(UINT64), &Overflows)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+	} break;
+	case HYPERCALL_GET_LOG_FORMAT:
+	{
+		// RBX holds the format ID, RDX a buffer of IMP_LOG_MAX_FORMAT_SIZE bytes
+		if (GuestState->Rdx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		// Format strings are read through the guest's mapping of the image, parts of it may not be mapped in the host
+		PCSTR FormatAddr = ImpGetLogFormat((UINT32)GuestState->Rbx);
+		if (FormatAddr == NULL)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		CHAR Format[IMP_LOG_MAX_FORMAT_SIZE];
+		if (!NT_SUCCESS(VmReadGuestString(GuestCr3, (UINT64)FormatAddr, sizeof(Format), Format)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx, strlen(Format) + 1, Format)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
 	} break;
 	case HYPERCALL_GET_VPTE_COUNT:
 	{
@@ -424,6 +1153,270 @@ VmHandleHypercall(
 		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx, sizeof(SIZE_T), &VpteCount)))
 			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);		
 	} break;
+	case HYPERCALL_GET_VTLB_STATS:
+	{
+		if (GuestState->Rdx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		// Counters of other VCPUs are read without synchronisation, they are only used as statistics
+		MM_VTLB_STATS Stats = { 0 };
+		for (SIZE_T i = 0; i < Vcpu->Vmm->CpuCount; i++)
+		{
+			Stats.Hits += Vcpu->Vmm->VcpuTable[i].Vtlb.Stats.Hits;
+			Stats.Misses += Vcpu->Vmm->VcpuTable[i].Vtlb.Stats.Misses;
+		}
+
+		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx, sizeof(MM_VTLB_STATS), &Stats)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+	} break;
+	case HYPERCALL_GET_LOCK_STATS:
+	{
+		// RBX holds the capacity of the destination's array and RCX holds LOCK_STATS_* flags
+		if (GuestState->Rdx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		UINT64 Count = SpinGetTrackedLockCount();
+		if (Count > GuestState->Rbx)
+			Count = GuestState->Rbx;
+
+		// Statistics are read and reset without taking the locks, they are only ever approximate
+		for (SIZE_T i = 0; i < Count; i++)
+		{
+			PSPINLOCK_STATS Stats = SpinGetLockStats(i);
+
+			const UINT64 StatsAddr = GuestState->Rdx + FIELD_OFFSET(HYPERCALL_LOCK_STATS_RESULTS, Locks) + i * sizeof(SPINLOCK_STATS);
+
+			if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, StatsAddr, sizeof(SPINLOCK_STATS), Stats)))
+				return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+			if (GuestState->Rcx & LOCK_STATS_RESET)
+			{
+				Stats->Acquisitions = 0;
+				Stats->Contentions = 0;
+				Stats->SpinCycles = 0;
+			}
+		}
+
+		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx + FIELD_OFFSET(HYPERCALL_LOCK_STATS_RESULTS, Count), sizeof(UINT64), &Count)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+	} break;
+	case HYPERCALL_SETUP_RING:
+	{
+		// RCX holds the submission ring and RDX the completion ring, a null submission ring unregisters it. The ring
+		// belongs to the calling process, ring submissions can't register another
+		const NTSTATUS Status = GuestState->Rcx != 0 ? 
+			VmRingRegister(GuestCr3, WinGetProcessID(WinGetCurrentProcess()), GuestState->Rcx, GuestState->Rdx) : 
+			VmRingUnregister();
+
+		if (!NT_SUCCESS(Status))
+			return VmAbortHypercall(Hypercall, HRESULT_FROM_NTSTATUS(Status));
+	} break;
+	case HYPERCALL_RING_DOORBELL:
+	{
+		if (!VmRingDrain(Vcpu, VM_RING_ENTRY_COUNT, TRUE))
+			return VmAbortHypercall(Hypercall, HRESULT_RING_NOT_REGISTERED);
+	} break;
+	case HYPERCALL_SETUP_LOG_STREAM:
+	{
+		// RCX holds the stream, a null stream unregisters it. Like the ring, the stream belongs to the calling process
+		const NTSTATUS Status = GuestState->Rcx != 0 ? 
+			VmLogStreamRegister(GuestCr3, WinGetProcessID(WinGetCurrentProcess()), GuestState->Rcx) : 
+			VmLogStreamUnregister();
+
+		if (!NT_SUCCESS(Status))
+			return VmAbortHypercall(Hypercall, HRESULT_FROM_NTSTATUS(Status));
+	} break;
+	case HYPERCALL_LOG_STREAM_DOORBELL:
+	{
+		if (!VmLogStreamDrain(VM_LOG_STREAM_ENTRY_COUNT, TRUE))
+			return VmAbortHypercall(Hypercall, HRESULT_LOG_STREAM_NOT_REGISTERED);
+	} break;
+	case HYPERCALL_SET_LOG_CATEGORIES:
+	{
+		// RBX holds the categories to enable, RCX those to disable, and RDX optionally receives the new mask
+		LONG Mask = ImpSetLogCategories((LONG)GuestState->Rbx, (LONG)GuestState->Rcx);
+
+		if (GuestState->Rdx != 0 && !NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx, sizeof(UINT32), &Mask)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+	} break;
+	case HYPERCALL_GET_EXIT_PROFILE:
+	{
+		// RBX holds the VCPU to read or EXIT_PROFILE_ALL_VCPUS, RCX the EXIT_PROFILE_* flags
+		if (GuestState->Rdx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		const UINT64 VcpuId = GuestState->Rbx;
+		if (VcpuId != EXIT_PROFILE_ALL_VCPUS && VcpuId >= Vcpu->Vmm->CpuCount)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_EXT_INFO);
+
+		const SIZE_T FirstVcpu = VcpuId == EXIT_PROFILE_ALL_VCPUS ? 0 : VcpuId;
+		const SIZE_T LastVcpu = VcpuId == EXIT_PROFILE_ALL_VCPUS ? Vcpu->Vmm->CpuCount - 1 : VcpuId;
+
+		// Other VCPUs keep counting while this reads, so the snapshot may be slightly torn but is never invalid
+		for (SIZE_T i = 0; i < VCPU_EXIT_REASON_COUNT; i++)
+		{
+			VCPU_EXIT_PROFILE_ENTRY Entry = { 0 };
+
+			for (SIZE_T j = FirstVcpu; j <= LastVcpu; j++)
+			{
+				const PVCPU_EXIT_PROFILE_ENTRY VcpuEntry = &Vcpu->Vmm->VcpuTable[j].ExitProfile.Reasons[i];
+
+				Entry.Count += VcpuEntry->Count;
+				Entry.TotalCycles += VcpuEntry->TotalCycles;
+				Entry.MaxCycles = max(Entry.MaxCycles, VcpuEntry->MaxCycles);
+
+				for (SIZE_T k = 0; k < VCPU_EXIT_LATENCY_BUCKETS; k++)
+					Entry.Histogram[k] += VcpuEntry->Histogram[k];
+			}
+
+			const UINT64 EntryAddr = GuestState->Rdx + FIELD_OFFSET(HYPERCALL_EXIT_PROFILE_RESULTS, Reasons) + i * sizeof(VCPU_EXIT_PROFILE_ENTRY);
+
+			if (!NT_SUCCESS(VmWriteGuestBuffer(GuestCr3, EntryAddr, sizeof(VCPU_EXIT_PROFILE_ENTRY), &Entry)))
+				return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+		}
+
+		UINT64 VcpuCount = LastVcpu - FirstVcpu + 1;
+		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx + FIELD_OFFSET(HYPERCALL_EXIT_PROFILE_RESULTS, VcpuCount), sizeof(UINT64), &VcpuCount)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		// Each VCPU clears its own profile on its next exit, as it could be updating it right now
+		if (GuestState->Rcx & EXIT_PROFILE_RESET)
+		{
+			for (SIZE_T j = FirstVcpu; j <= LastVcpu; j++)
+				InterlockedExchange(&Vcpu->Vmm->VcpuTable[j].ExitProfileResetPending, TRUE);
+		}
+	} break;
+	case HYPERCALL_FLUSH_VTLB:
+	{
+		// Other VCPUs flush their own VTLB on their next lookup
+		for (SIZE_T i = 0; i < Vcpu->Vmm->CpuCount; i++)
+			InterlockedExchange(&Vcpu->Vmm->VcpuTable[i].Vtlb.FlushPending, TRUE);
+
+		MmVtlbFlush(&Vcpu->Vtlb);
+	} break;
+	case HYPERCALL_GET_DIRTY_PAGES:
+	{
+		// RCX holds the first GPA, RBX the amount of pages and RDX the destination bitmap, which is written in 
+		// whole UINT64s so it must be large enough for RBX rounded up to a multiple of 64 bits
+		if (!Vcpu->Vmm->Ept.DirtyLogging)
+			return VmAbortHypercall(Hypercall, HRESULT_DIRTY_LOGGING_UNSUPPORTED);
+
+		if (GuestState->Rdx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		if (GuestState->Rbx == 0 || GuestState->Rbx > VM_MAX_DIRTY_PAGES)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIZE);
+
+		if (PAGE_OFFSET(GuestState->Rcx) != 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_GUEST_PHYSADDR);
+
+		// The largest query's bitmap is a single page, which is written to the client in one go
+		UINT64 Bitmap[VM_MAX_DIRTY_PAGES / 64];
+		VcpuCollectDirtyPages(Vcpu, GuestState->Rcx, GuestState->Rbx, Bitmap);
+
+		if (!NT_SUCCESS(VmWriteGuestBuffer(GuestCr3, GuestState->Rdx, (GuestState->Rbx + 63) / 64 * sizeof(UINT64), Bitmap)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+	} break;
+	case HYPERCALL_DONATE_PAGE_TABLES:
+	{
+		// RCX holds the physical address of the first page and RBX the amount of contiguous pages
+		if (GuestState->Rbx == 0 || GuestState->Rbx > MM_MAX_HOST_PAGE_TABLES)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SIZE);
+
+		const UINT64 DonatedPhysAddr = GuestState->Rcx;
+		const SIZE_T DonatedSize = GuestState->Rbx * PAGE_SIZE;
+
+		// The pages the client shares with the VMM are guest memory, so they aren't caught by the allocation check
+		if (VmRingOverlapsRange(DonatedPhysAddr, DonatedSize) || VmLogStreamOverlapsRange(DonatedPhysAddr, DonatedSize))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SOURCE_ADDR);
+
+		NTSTATUS Status = MmCheckDonatedPageTables(DonatedPhysAddr, GuestState->Rbx);
+		if (Status == STATUS_NOT_SUPPORTED)
+			return VmAbortHypercall(Hypercall, HRESULT_NO_DIRECT_MAP);
+		if (Status == STATUS_INSUFFICIENT_RESOURCES)
+			return VmAbortHypercall(Hypercall, HRESULT_INSUFFICIENT_RESOURCES);
+		if (!NT_SUCCESS(Status))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_SOURCE_ADDR);
+
+		// A concurrent donation is turned away rather than waited for, as the one in flight waits on every VCPU
+		// and this one may have NMIs blocked
+		if (!SpinTryLock(&sDonationLock))
+			return VmAbortHypercall(Hypercall, HRESULT_INSUFFICIENT_RESOURCES);
+
+		SpinLock(&Vcpu->Vmm->Ept.Lock);
+
+		// Every page is hidden before any is linked, as another VCPU may allocate one as soon as it is. Each is 
+		// remapped on its own, as the whole range has to alias the same dummy page
+		SIZE_T HiddenCount = 0;
+		for (; HiddenCount < GuestState->Rbx && NT_SUCCESS(Status); HiddenCount++)
+		{
+			Status = EptMapMemoryRangeInViews(
+				&Vcpu->Vmm->Ept,
+				DonatedPhysAddr + HiddenCount * PAGE_SIZE,
+				Vcpu->Vmm->Ept.DummyPagePhysAddr,
+				PAGE_SIZE,
+				EPT_PAGE_RW
+			);
+		}
+
+		SpinUnlock(&Vcpu->Vmm->Ept.Lock);
+
+		// Every VCPU must have dropped its translations of the pages before the first is linked, or the guest could
+		// keep writing to a page the VMM is already using as a table
+		if (NT_SUCCESS(Status))
+		{
+			VcpuSynchroniseEptInvalidation(Vcpu);
+			Status = MmDonateHostPageTables(DonatedPhysAddr, GuestState->Rbx);
+		}
+
+		if (!NT_SUCCESS(Status))
+		{
+			IMP_LOG_ERROR(IMP_LOG_EPT, "[%02X] Failed to donate page tables %llX (%llu) - %X...\n", Vcpu->Id, DonatedPhysAddr, GuestState->Rbx, Status);
+
+			SpinLock(&Vcpu->Vmm->Ept.Lock);
+
+			// Nothing was linked, so give every page hidden so far back to the guest, including one that may have
+			// been hidden in only some of the views
+			for (SIZE_T i = 0; i < HiddenCount; i++)
+			{
+				EptMapMemoryRangeInViews(
+					&Vcpu->Vmm->Ept,
+					DonatedPhysAddr + i * PAGE_SIZE,
+					DonatedPhysAddr + i * PAGE_SIZE,
+					PAGE_SIZE,
+					EPT_PAGE_RWX
+				);
+			}
+
+			SpinUnlock(&Vcpu->Vmm->Ept.Lock);
+
+			VcpuQueueEptInvalidation(Vcpu);
+		}
+
+		SpinUnlock(&sDonationLock);
+
+		if (Status == STATUS_INSUFFICIENT_RESOURCES)
+			return VmAbortHypercall(Hypercall, HRESULT_INSUFFICIENT_RESOURCES);
+		if (!NT_SUCCESS(Status))
+			return VmAbortHypercall(Hypercall, HRESULT_FROM_NTSTATUS(Status));
+	} break;
+	case HYPERCALL_GET_PAGE_TABLE_STATS:
+	{
+		if (GuestState->Rdx == 0)
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+
+		MM_HOST_PT_STATS Stats = { 0 };
+		MmGetHostPageTableStats(&Stats);
+
+		if (!NT_SUCCESS(MmWriteGuestVirt(GuestCr3, GuestState->Rdx, sizeof(MM_HOST_PT_STATS), &Stats)))
+			return VmAbortHypercall(Hypercall, HRESULT_INVALID_DESTINATION_ADDR);
+	} break;
+	case HYPERCALL_RELEASE_PROCESS:
+	{
+		// RCX holds the ID of the exiting process
+		VmRingReleaseProcess(GuestState->Rcx);
+		VmLogStreamReleaseProcess(GuestState->Rcx);
+	} break;
 	default:
 		VmxInjectEvent(EXCEPTION_UNDEFINED_OPCODE, INTERRUPT_TYPE_HARDWARE_EXCEPTION, 0);
 		return VMM_EVENT_INTERRUPT;
@@ -538,11 +1531,45 @@ VmEptRemapPages(
 	return Hypercall.Result;
 }
 
+HYPERCALL_RESULT
+VmEptRemapViewPages(
+	_In_ UINT32 View,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size,
+	_In_ EPT_PAGE_PERMISSIONS Permissions
+)
+/*++
+Routine Description:
+	Remaps a range of guest physical memory in a single EPT view, leaving the other views untouched
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_EPT_REMAP_PAGES,
+		.Result = HRESULT_SUCCESS
+	};
+
+	HYPERCALL_REMAP_PAGES_EX RemapEx = {
+		.Permissions = Permissions,
+		.Size = Size,
+		.SingleView = TRUE,
+		.View = View
+	};
+
+	Hypercall = __vmcall(Hypercall, RemapEx.Value, (PVOID)GuestPhysAddr, (PVOID)PhysAddr);
+
+	return Hypercall.Result;
+}
+
 HYPERCALL_RESULT
 VmGetLogRecords(
-	_In_ PVOID Dst,
+	_Out_ PHYPERCALL_LOG_RECORDS Records,
 	_In_ SIZE_T Count
 )
+/*++
+Routine Description:
+	Retrieves up to `Count` of the oldest log entries into `Records`, which must have room for `Count` entries
+--*/
 {
 	HYPERCALL_INFO Hypercall = {
 		.Id = HYPERCALL_GET_LOG_RECORDS,
@@ -553,7 +1580,7 @@ VmGetLogRecords(
 		.Count = Count,
 	};
 
-	Hypercall = __vmcall(Hypercall, LogEx.Value, Dst, NULL);
+	Hypercall = __vmcall(Hypercall, LogEx.Value, NULL, Records);
 
 	return Hypercall.Result;
 }
@@ -572,3 +1599,44 @@ VmAddLogRecord(
 
 	return Hypercall.Result;
 }
+
+HYPERCALL_RESULT
+VmDonatePageTables(
+	_In_ PVOID Tables,
+	_In_ SIZE_T Count
+)
+/*++
+Routine Description:
+	Hands `Count` physically contiguous, page aligned pages over to the VMM to use as host page tables. They 
+	belong to the VMM from then on and must never be freed or accessed again
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_DONATE_PAGE_TABLES,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, Count, (PVOID)ImpGetPhysicalAddress(Tables), NULL);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmReleaseProcess(
+	_In_ ULONG_PTR ProcessId
+)
+/*++
+Routine Description:
+	Tells the VMM that a process is exiting, so shared pages it registered are never written to after they are
+	freed
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_RELEASE_PROCESS,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, (PVOID)ProcessId, NULL);
+
+	return Hypercall.Result;
+}
@@ -37,6 +37,18 @@
 #define HRESULT_INVALID_SIGSCAN_BUFFER (HRESULT_MARKER | 0x109)
 // An invalid guest physical address was supplied
 #define HRESULT_INVALID_GUEST_PHYSADDR (HRESULT_MARKER | 0x10A)
+// One or more entries of a batched read/write failed, see the status bitmap
+#define HRESULT_BATCH_INCOMPLETE (HRESULT_MARKER | 0x10B)
+// No submission ring is registered with the VMM
+#define HRESULT_RING_NOT_REGISTERED (HRESULT_MARKER | 0x10C)
+// The hypercall can't be submitted through the submission ring
+#define HRESULT_RING_UNSUPPORTED_HCID (HRESULT_MARKER | 0x10D)
+// No log stream is registered with the VMM
+#define HRESULT_LOG_STREAM_NOT_REGISTERED (HRESULT_MARKER | 0x10E)
+// Dirty page logging isn't built in (IMPROVISOR_DIRTY_LOGGING) or the processor doesn't support EPT dirty flags
+#define HRESULT_DIRTY_LOGGING_UNSUPPORTED (HRESULT_MARKER | 0x10F)
+// The VMM has no direct map to reach donated page tables through, so none can be donated
+#define HRESULT_NO_DIRECT_MAP (HRESULT_MARKER | 0x110)
 
 // VMM process ID type for reading/writing inside a processes address space
 typedef INT32 VM_PID, *PVM_PID;
@@ -68,11 +80,159 @@ typedef enum _HYPERCALL_ID
 	// Retrieve log records from VMM
 	HYPERCALL_GET_LOG_RECORDS,
 	// Get the amount of VPTEs being used by the VMM
-	HYPERCALL_GET_VPTE_COUNT
+	HYPERCALL_GET_VPTE_COUNT,
+	// Get the VTLB hit and miss counts summed over all VCPUs
+	HYPERCALL_GET_VTLB_STATS,
+	// Invalidate every cached guest translation in all VCPUs' VTLBs
+	HYPERCALL_FLUSH_VTLB,
+	// Read a list of guest virtual address ranges from a process's address space in one exit
+	HYPERCALL_READ_VIRT_BATCH,
+	// Write a list of guest virtual address ranges into a process's address space in one exit
+	HYPERCALL_WRITE_VIRT_BATCH,
+	// Register (or unregister) a shared submission/completion ring pair with the VMM
+	HYPERCALL_SETUP_RING,
+	// Synchronously process all pending submissions in the registered ring
+	HYPERCALL_RING_DOORBELL,
+	// Scan for a set of byte signatures in a single pass over a virtual address range
+	HYPERCALL_VIRT_SIGSCAN_MULTI,
+	// Get the contention statistics of all tracked locks
+	HYPERCALL_GET_LOCK_STATS,
+	// Get the format string of a binary log entry
+	HYPERCALL_GET_LOG_FORMAT,
+	// Register (or unregister) a client buffer the VMM continuously drains log entries into
+	HYPERCALL_SETUP_LOG_STREAM,
+	// Synchronously drain every pending log entry into the registered log stream
+	HYPERCALL_LOG_STREAM_DOORBELL,
+	// Enable and disable logging categories at runtime
+	HYPERCALL_SET_LOG_CATEGORIES,
+	// Get (and optionally reset) the per-reason VM-exit counts and latency histograms
+	HYPERCALL_GET_EXIT_PROFILE,
+	// Get a bitmap of the pages in a guest physical range written to since the last call, and reset it
+	HYPERCALL_GET_DIRTY_PAGES,
+	// Hand physically contiguous pages over to the VMM's host page table pool
+	HYPERCALL_DONATE_PAGE_TABLES,
+	// Get the usage statistics of the VMM's host page table pool
+	HYPERCALL_GET_PAGE_TABLE_STATS,
+	// Unregister anything an exiting process registered with the VMM, before its address space is freed
+	HYPERCALL_RELEASE_PROCESS
 } HYPERCALL_ID, PHYPERCALL_ID;
 
 typedef ULONG HYPERCALL_RESULT; 
 
+// Maximum amount of entries in a batched read/write, bounds the time spent in a single exit
+#define VM_MAX_BATCH_ENTRIES 1024
+
+// Maximum amount of pages in a dirty page query (128MB), bounds the time spent in a single exit and keeps the
+// bitmap to a single page
+#define VM_MAX_DIRTY_PAGES 0x8000
+
+// Descriptor of a single range in a batched read/write, aligned to its size so it never crosses a page
+typedef struct DECLSPEC_ALIGN(32) _HYPERCALL_BATCH_ENTRY
+{
+	// Address inside the target process's address space
+	UINT64 Address;
+	// Address of the caller's buffer to read into or write from, kernel-mode callers pass full 64-bit addresses
+	UINT64 Buffer;
+	UINT16 Size;
+} HYPERCALL_BATCH_ENTRY, *PHYPERCALL_BATCH_ENTRY;
+
+// Amount of entries in each of the submission and completion rings, must be a power of two
+#define VM_RING_ENTRY_COUNT 64
+
+// A hypercall submitted through the submission ring, laid out like the VMCALL registers
+typedef struct _HYPERCALL_RING_SUBMISSION
+{
+	// Copied untouched into the completion of this submission
+	UINT64 UserData;
+	// HYPERCALL_ID (RAX)
+	UINT64 Id;
+	// Extended hypercall info (RBX)
+	UINT64 Ext;
+	// Buffer address (RCX)
+	UINT64 Buffer;
+	// Target address (RDX)
+	UINT64 Target;
+} HYPERCALL_RING_SUBMISSION, *PHYPERCALL_RING_SUBMISSION;
+
+typedef struct _HYPERCALL_RING_COMPLETION
+{
+	UINT64 UserData;
+	UINT64 Result;
+} HYPERCALL_RING_COMPLETION, *PHYPERCALL_RING_COMPLETION;
+
+// Head and tail are free-running counters, each on its own cache line. The client produces submissions
+// and consumes completions; the VMM consumes submissions and produces completions. Each ring is one page
+typedef struct _HYPERCALL_SUBMISSION_RING
+{
+	DECLSPEC_ALIGN(64) volatile UINT32 Head;
+	DECLSPEC_ALIGN(64) volatile UINT32 Tail;
+	DECLSPEC_ALIGN(64) HYPERCALL_RING_SUBMISSION Entries[VM_RING_ENTRY_COUNT];
+} HYPERCALL_SUBMISSION_RING, *PHYPERCALL_SUBMISSION_RING;
+
+typedef struct _HYPERCALL_COMPLETION_RING
+{
+	DECLSPEC_ALIGN(64) volatile UINT32 Head;
+	DECLSPEC_ALIGN(64) volatile UINT32 Tail;
+	DECLSPEC_ALIGN(64) HYPERCALL_RING_COMPLETION Entries[VM_RING_ENTRY_COUNT];
+} HYPERCALL_COMPLETION_RING, *PHYPERCALL_COMPLETION_RING;
+
+// Maximum size of the text of a HYPERCALL_ADD_LOG_RECORD, including the terminator
+#define VM_MAX_LOG_TEXT_SIZE 512
+
+typedef struct _HYPERCALL_LOG_RECORDS
+{
+	// The amount of entries retrieved
+	UINT64 Count;
+	// Total amount of entries dropped by the VMM because their ring was full
+	UINT64 Overflows;
+	// Variable length array of entries, oldest first
+	IMP_LOG_ENTRY Entries[1];
+} HYPERCALL_LOG_RECORDS, *PHYPERCALL_LOG_RECORDS;
+
+// Amount of entries in a log stream, must be a power of two
+#define VM_LOG_STREAM_ENTRY_COUNT 1024
+
+// Head and tail are free-running counters, each on its own cache line. The VMM produces entries and publishes
+// Head, the client consumes them and publishes Tail. The VMM only drains on its own once at least WaitCount
+// entries are pending, so a client waiting for a batch isn't handed entries one at a time
+typedef struct _HYPERCALL_LOG_STREAM
+{
+	DECLSPEC_ALIGN(64) volatile UINT32 Head;
+	// Total amount of entries dropped by the VMM because their ring was full
+	volatile UINT64 Overflows;
+	DECLSPEC_ALIGN(64) volatile UINT32 Tail;
+	volatile UINT32 WaitCount;
+	DECLSPEC_ALIGN(64) IMP_LOG_ENTRY Entries[VM_LOG_STREAM_ENTRY_COUNT];
+} HYPERCALL_LOG_STREAM, *PHYPERCALL_LOG_STREAM;
+
+// Reset the statistics of every lock after they have been read
+#define LOCK_STATS_RESET 0x1
+
+// Reset the exit profiles that were read
+#define EXIT_PROFILE_RESET 0x1
+// Sum the exit profiles of every VCPU rather than reading a single one
+#define EXIT_PROFILE_ALL_VCPUS 0xFFFF
+
+// Only report the first hit of each pattern in a multi-pattern scan
+#define SIGSCAN_MULTI_FIRST_HIT 0x1
+
+// Descriptor of a single pattern in a multi-pattern scan, its ID is its index in the descriptor array
+typedef struct _HYPERCALL_SIGSCAN_PATTERN
+{
+	// Address of the pattern bytes
+	UINT64 Pattern;
+	// Address of the mask, each byte selects the bits of the pattern byte that must match
+	UINT64 Mask;
+	UINT32 Size;
+	UINT32 Reserved;
+} HYPERCALL_SIGSCAN_PATTERN, *PHYPERCALL_SIGSCAN_PATTERN;
+
+typedef struct _HYPERCALL_SIGSCAN_MATCH
+{
+	UINT64 Address;
+	UINT64 PatternId;
+} HYPERCALL_SIGSCAN_MATCH, *PHYPERCALL_SIGSCAN_MATCH;
+
 typedef union _HYPERCALL_INFO
 {
 	UINT64 Value;
@@ -91,6 +251,14 @@ VmHandleHypercall(
 	_In_ PHYPERCALL_INFO Hypercall
 );
 
+VMM_EVENT_STATUS
+VmDispatchHypercall(
+	_In_ PVCPU Vcpu,
+	_In_ UINT64 GuestCr3,
+	_In_ PGUEST_STATE GuestState,
+	_In_ PHYPERCALL_INFO Hypercall
+);
+
 //
 // Hypercall implementations
 //
@@ -128,9 +296,18 @@ VmEptRemapPages(
 	_In_ EPT_PAGE_PERMISSIONS Permissions
 );
 
+HYPERCALL_RESULT
+VmEptRemapViewPages(
+	_In_ UINT32 View,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size,
+	_In_ EPT_PAGE_PERMISSIONS Permissions
+);
+
 HYPERCALL_RESULT
 VmGetLogRecords(
-	_In_ PVOID Dst,
+	_Out_ PHYPERCALL_LOG_RECORDS Records,
 	_In_ SIZE_T Count
 );
 
@@ -139,4 +316,15 @@ VmAddLogRecord(
 	_In_ PVOID Src
 );
 
+HYPERCALL_RESULT
+VmDonatePageTables(
+	_In_ PVOID Tables,
+	_In_ SIZE_T Count
+);
+
+HYPERCALL_RESULT
+VmReleaseProcess(
+	_In_ ULONG_PTR ProcessId
+);
+
 #endif
@@ -1,10 +1,39 @@
 EXTERN VcpuHandleExit: PROC
 EXTERN VcpuShutdownVmx: PROC
+EXTERN VcpuResume: PROC
 EXTERN __cpu_save_state: PROC
 EXTERN __cpu_restore_state: PROC
 
 VMM_STATUS_ABORT equ 0
 
+VCPU_FAST_EXITS equ 9						; FIELD_OFFSET(VCPU, FastExits), see VCPU_FAST_EXITS_OFFSET
+VCPU_EPT_FLUSH_PENDING equ 10				; FIELD_OFFSET(VCPU, EptFlushPending), see VCPU_EPT_FLUSH_PENDING_OFFSET
+VCPU_CPUID equ 12							; FIELD_OFFSET(VCPU, Cpuid), see VCPU_CPUID_OFFSET
+VCPU_FAST_EXIT_CPUID equ 01h
+
+VMCS_VM_EXIT_REASON equ 04402h
+VMCS_VM_EXIT_INSTRUCTION_LEN equ 0440Ch
+VMCS_GUEST_RIP equ 0681Eh
+
+EXIT_REASON_CPUID equ 10
+
+CPUID_ANY_SUBLEAF equ 0FFFFFFFFh
+VCPU_VIRTUALISED_KEY equ 0441C88F24291161Fh	; See __vcpu_is_virtualised
+
+CPUID_ENTRY STRUCT
+_Leaf DWORD ?
+_Subleaf DWORD ?
+_Eax DWORD ?
+_Ebx DWORD ?
+_Ecx DWORD ?
+_Edx DWORD ?
+CPUID_ENTRY ENDS
+
+CPUID_CACHE STRUCT
+_Count DWORD ?
+_Entries CPUID_ENTRY <>
+CPUID_CACHE ENDS
+
 GUEST_STATE STRUCT
 _Rax QWORD ?
 _Rbx QWORD ?
@@ -29,16 +58,6 @@ _Xmm2 XMMWORD ?
 _Xmm3 XMMWORD ?
 _Xmm4 XMMWORD ?
 _Xmm5 XMMWORD ?
-_Xmm6 XMMWORD ?
-_Xmm7 XMMWORD ?
-_Xmm8 XMMWORD ?
-_Xmm9 XMMWORD ?
-_Xmm10 XMMWORD ?
-_Xmm11 XMMWORD ?
-_Xmm12 XMMWORD ?
-_Xmm13 XMMWORD ?
-_Xmm14 XMMWORD ?
-_Xmm15 XMMWORD ?
 GUEST_STATE ENDS
 
 CPU_STATE STRUCT
@@ -82,6 +101,83 @@ CPU_STATE ENDS
 .CODE
 
 __vmexit_entry PROC
+	push rax								; Only RAX and RDX are used to pick a fast path
+	push rdx
+	mov rax, VMCS_VM_EXIT_REASON
+	vmread rdx, rax
+	mov rax, fs:[0]							; Pending EPT invalidations are only performed by VcpuHandleExit
+	cmp byte ptr [rax + VCPU_EPT_FLUSH_PENDING], 0
+	jne full_exit
+	cmp edx, EXIT_REASON_CPUID				; Comparing the whole exit reason skips exits with any flags set
+	je fast_cpuid
+
+full_exit:
+	pop rdx									; Restore the guest's RAX and RDX and handle the exit normally
+	pop rax
+	jmp save_guest_state
+
+fast_cpuid:
+	mov rax, VCPU_VIRTUALISED_KEY			; Answer virtualisation checks, leaving everything but RSI untouched
+	cmp [rsp], rax
+	jne fast_cpuid_emulate
+	pop rdx
+	pop rax
+	mov esi, 1
+	jmp fast_exit_advance
+
+fast_cpuid_emulate:
+	mov rax, fs:[0]							; Load the address of the current VCPU into RAX
+	test byte ptr [rax + VCPU_FAST_EXITS], VCPU_FAST_EXIT_CPUID
+	jz full_exit
+	push rbx								; Look the leaf up in the VCPU's CPUID cache, see VcpuCpuidQuery
+	lea rbx, [rax + VCPU_CPUID]
+	mov edx, [rbx].CPUID_CACHE._Count
+	lea rbx, [rbx].CPUID_CACHE._Entries
+	mov eax, [rsp + 10h]					; The guest's EAX, ECX still holds the subleaf
+
+cpuid_lookup:
+	test edx, edx
+	jz cpuid_miss
+	cmp eax, [rbx].CPUID_ENTRY._Leaf
+	jne cpuid_next
+	cmp [rbx].CPUID_ENTRY._Subleaf, CPUID_ANY_SUBLEAF
+	je cpuid_hit
+	cmp ecx, [rbx].CPUID_ENTRY._Subleaf
+	je cpuid_hit
+cpuid_next:
+	add rbx, SIZEOF CPUID_ENTRY
+	dec edx
+	jmp cpuid_lookup
+
+cpuid_miss:
+	pop rbx									; Leave uncached leaves to VcpuHandleCpuid
+	jmp full_exit
+
+cpuid_hit:
+	mov eax, [rbx].CPUID_ENTRY._Eax			; The cached results already have the CPUID policy applied
+	mov ecx, [rbx].CPUID_ENTRY._Ecx
+	mov edx, [rbx].CPUID_ENTRY._Edx
+	mov ebx, [rbx].CPUID_ENTRY._Ebx
+	add rsp, 18h							; Discard the saved RBX, RDX and RAX, all of which are outputs
+	jmp fast_exit_advance
+
+fast_exit_advance:
+	push rax								; Advance the guest's RIP past the exiting instruction, see VmxAdvanceGuestRip
+	push rcx
+	push rdx
+	mov rax, VMCS_VM_EXIT_INSTRUCTION_LEN
+	vmread rdx, rax
+	mov rax, VMCS_GUEST_RIP
+	vmread rcx, rax
+	add rcx, rdx
+	vmwrite rax, rcx
+	pop rdx
+	pop rcx
+	pop rax
+	add rsp, 8								; Enter VcpuResume with the same stack pointer the full path returns into it with
+	jmp VcpuResume
+
+save_guest_state:
 	sub rsp, SIZEOF GUEST_STATE					; We are on the host stack now, which is guaranteed to be 16-byte aligned
 	mov [rsp].GUEST_STATE._Rax, rax				; Save guest system state
 	mov [rsp].GUEST_STATE._Rbx, rbx
@@ -102,17 +198,7 @@ __vmexit_entry PROC
 	movups [rsp].GUEST_STATE._Xmm2, xmm2
 	movups [rsp].GUEST_STATE._Xmm3, xmm3
 	movups [rsp].GUEST_STATE._Xmm4, xmm4
-	movups [rsp].GUEST_STATE._Xmm5, xmm5
-	movups [rsp].GUEST_STATE._Xmm6, xmm6
-	movups [rsp].GUEST_STATE._Xmm7, xmm7
-	movups [rsp].GUEST_STATE._Xmm8, xmm8
-	movups [rsp].GUEST_STATE._Xmm9, xmm9
-	movups [rsp].GUEST_STATE._Xmm10, xmm10
-	movups [rsp].GUEST_STATE._Xmm11, xmm11
-	movups [rsp].GUEST_STATE._Xmm12, xmm12
-	movups [rsp].GUEST_STATE._Xmm13, xmm13
-	movups [rsp].GUEST_STATE._Xmm14, xmm14
-	movups [rsp].GUEST_STATE._Xmm15, xmm15
+	movups [rsp].GUEST_STATE._Xmm5, xmm5			; XMM6-15 are nonvolatile, VcpuHandleExit and its callees preserve them
 	mov rbx, cr8
 	mov rax, 0Fh
 	mov cr8, rax
@@ -147,16 +233,6 @@ __vmexit_entry PROC
 	movups xmm3, [rsp].GUEST_STATE._Xmm3
 	movups xmm4, [rsp].GUEST_STATE._Xmm4
 	movups xmm5, [rsp].GUEST_STATE._Xmm5
-	movups xmm6, [rsp].GUEST_STATE._Xmm6
-	movups xmm7, [rsp].GUEST_STATE._Xmm7
-	movups xmm8, [rsp].GUEST_STATE._Xmm8
-	movups xmm9, [rsp].GUEST_STATE._Xmm9
-	movups xmm10, [rsp].GUEST_STATE._Xmm10
-	movups xmm11, [rsp].GUEST_STATE._Xmm11
-	movups xmm12, [rsp].GUEST_STATE._Xmm12
-	movups xmm13, [rsp].GUEST_STATE._Xmm13
-	movups xmm14, [rsp].GUEST_STATE._Xmm14
-	movups xmm15, [rsp].GUEST_STATE._Xmm15
 
 	test al, al								; Test if VcpuHandleExit returned FALSE
 	jne no_abort         
@@ -6,10 +6,14 @@
 #include <vcpu/vcpu.h>
 #include <vcpu/vmexit.h>
 #include <vcpu/vmcall.h>
+#include <vcpu/msr.h>
+#include <vcpu/ring.h>
+#include <vcpu/logstream.h>
 #include <pdb/pdb.h>
 #include <mm/mm.h>
 #include <mm/vpte.h>
 #include <detour.h>
+#include <spinlock.h>
 #include <macro.h>
 #include <ept.h>
 #include <vmm.h>
@@ -44,7 +48,9 @@ VMEXIT_HANDLER VcpuHandleMTFExit;
 VMEXIT_HANDLER VcpuHandleWbinvd;
 VMEXIT_HANDLER VcpuHandleXsetbv;
 VMEXIT_HANDLER VcpuHandleInvlpg;
+VMEXIT_HANDLER VcpuHandleInvpcid;
 VMEXIT_HANDLER VcpuHandleInvd;
+VMEXIT_HANDLER VcpuHandlePmlFull;
 
 VMM_RDATA static VMEXIT_HANDLER* sExitHandlers[] = {
 	VcpuHandleExceptionNmi,         // Exception or non-maskable interrupt (NMI)
@@ -55,13 +61,13 @@ VMM_RDATA static VMEXIT_HANDLER* sExitHandlers[] = {
 	VcpuUnknownExitReason, 			// I/O system-management interrupt (SMI)
 	VcpuUnknownExitReason, 			// Other SMI
 	VcpuUnknownExitReason, 			// Interrupt window
-	VcpuUnknownExitReason, 			// NMI window
+	VcpuHandleNmiWindow, 			// NMI window
 	VcpuUnknownExitReason, 			// Task switch
 	VcpuHandleCpuid,				// CPUID
 	VcpuHandleVmxInstruction, 		// GETSEC
 	VcpuUnknownExitReason, 			// HLT
 	VcpuHandleInvd, 				// INVD
-	VcpuUnknownExitReason, 			// INVLPG
+	VcpuHandleInvlpg, 				// INVLPG
 	VcpuUnknownExitReason, 			// RDPMC
 	VcpuHandleRdtsc, 			    // RDTSC
 	VcpuUnknownExitReason, 			// RSM
@@ -105,11 +111,11 @@ VMM_RDATA static VMEXIT_HANDLER* sExitHandlers[] = {
 	VcpuHandleXsetbv, 			    // XSETBV
 	VcpuUnknownExitReason, 			// APIC write
 	VcpuUnknownExitReason, 			// RDRAND
-	VcpuUnknownExitReason, 			// INVPCID
+	VcpuHandleInvpcid, 				// INVPCID
 	VcpuHandleVmxInstruction, 		// VMFUNC
 	VcpuUnknownExitReason, 			// ENCLS
 	VcpuUnknownExitReason, 			// RDSEED
-	VcpuUnknownExitReason, 			// Page-modification log full
+	VcpuHandlePmlFull, 				// Page-modification log full
 	VcpuUnknownExitReason, 			// XSAVES
 	VcpuUnknownExitReason, 			// XRSTORS
 	NULL,
@@ -139,6 +145,39 @@ Routine Description:
 	__debugbreak();
 }
 
+VMM_API
+VOID
+VcpuProfileExit(
+	_Inout_ PVCPU Vcpu,
+	_In_ UINT32 Reason,
+	_In_ UINT64 Cycles
+)
+/*++
+Routine Description:
+	Accounts the time spent handling an exit to its reason, clearing the profile first if a reset was requested.
+	The remaining register restore and VMRESUME aren't measured, but cost the same for every exit
+--*/
+{
+	if (Vcpu->ExitProfileResetPending)
+	{
+		RtlZeroMemory(&Vcpu->ExitProfile, sizeof(Vcpu->ExitProfile));
+		InterlockedExchange(&Vcpu->ExitProfileResetPending, FALSE);
+	}
+
+	if (Reason >= VCPU_EXIT_REASON_COUNT)
+		return;
+
+	PVCPU_EXIT_PROFILE_ENTRY Entry = &Vcpu->ExitProfile.Reasons[Reason];
+
+	ULONG Bucket = 0;
+	_BitScanReverse64(&Bucket, Cycles | 1);
+
+	Entry->Count++;
+	Entry->TotalCycles += Cycles;
+	Entry->MaxCycles = max(Entry->MaxCycles, Cycles);
+	Entry->Histogram[min(Bucket, VCPU_EXIT_LATENCY_BUCKETS - 1)]++;
+}
+
 VMM_API
 BOOLEAN
 VcpuHandleExit(
@@ -151,9 +190,13 @@ Routine Description:
 	by immediately shutting down this VCPU and signaling to the other VCPU's that they should shutdown too
 --*/
 {
+	const UINT64 ExitTimestamp = __rdtsc();
+
 	// TODO: Acknowledge interrupt on exit and check interrupt info in EPT violation handler?
 	Vcpu->Mode = VCPU_MODE_HOST;
-	Vcpu->Vmx.GuestRip = VmxRead(GUEST_RIP);
+	VmxCacheBegin(&Vcpu->Vmx);
+
+	Vcpu->Vmx.GuestRip = VmxCacheRead(&Vcpu->Vmx, GUEST_RIP);
 	Vcpu->Vmx.ExitReason.Value = (UINT32)VmxRead(VM_EXIT_REASON);
 
 	// Dont log VM-exit's for VMCALLs, as this would clutter the logs with things that don't matter
@@ -162,16 +205,14 @@ Routine Description:
 		PVMX_EXIT_LOG_ENTRY ExitLog = &Vcpu->Vmx.ExitLog[Vcpu->Vmx.ExitCount++ % 256];
 		ExitLog->Reason = Vcpu->Vmx.ExitReason;
 		ExitLog->Rip = Vcpu->Vmx.GuestRip;
-		ExitLog->ExitQualification = VmxRead(VM_EXIT_QUALIFICATION);
+		ExitLog->ExitQualification = VmxCacheRead(&Vcpu->Vmx, VM_EXIT_QUALIFICATION);
 
-#if 0
-		ImpLog("[%02X-#%03d]: VM-exit - Type: %i - RIP: %llX - EXIT QUAL: %llX\n",
+		IMP_LOG_TRACE(IMP_LOG_VMEXIT, "[%02X-#%03d]: VM-exit - Type: %i - RIP: %llX - EXIT QUAL: %llX\n",
 			Vcpu->Id,
 			Vcpu->Vmx.ExitCount,
 			ExitLog->Reason.BasicExitReason,
 			ExitLog->Rip,
 			ExitLog->ExitQualification);
-#endif
 	}
 
 	VMM_EVENT_STATUS Status = sExitHandlers[Vcpu->Vmx.ExitReason.BasicExitReason](Vcpu, GuestState);
@@ -193,11 +234,19 @@ Routine Description:
 			}
 		}
 
+		// VcpuShutdownVmx reads the guest state straight from the VMCS
+		VmxCacheFlush(&Vcpu->Vmx);
+
 		return FALSE;
 	}
 
 	GuestState->Rip = (UINT64)VcpuResume;
 
+	// Process any hypercalls submitted through the shared ring while we're in the host anyway
+	VmRingHandleExit(Vcpu);
+	// Move pending log entries into the client's stream
+	VmLogStreamHandleExit();
+
 	// Recover blocking by NMI based on if the VM-exit signalled that they 
 	// were unblocked when they shouldn't have been
 	VcpuRecoverNMIBlocking(Vcpu);
@@ -207,6 +256,17 @@ Routine Description:
 	if (Status == VMM_EVENT_CONTINUE)
 		VmxAdvanceGuestRip();
 
+	// Guest translations cached during this exit may be stale as soon as the guest runs, unless they belong to
+	// the address space it resumes in
+	if (Vcpu->Vtlb.Populated)
+		MmVtlbEndExit(&Vcpu->Vtlb, VmxCacheRead(&Vcpu->Vmx, GUEST_CR3));
+	// Write back any cached VMCS fields modified during this exit before resuming
+	VmxCacheFlush(&Vcpu->Vmx);
+	// Invalidate stale EPT translations once for every EPT change made since the last VM-entry
+	VcpuCommitEptInvalidation(Vcpu);
+
+	VcpuProfileExit(Vcpu, Vcpu->Vmx.ExitReason.BasicExitReason, __rdtsc() - ExitTimestamp);
+
 	Vcpu->Mode = VCPU_MODE_GUEST;
 
 	return TRUE;
@@ -223,8 +283,7 @@ Routine Description:
 	Emulates the CPUID instruction.
 --*/
 {
-	// Handle checks for CPU virtualisation, see vcpu.asm
-	// TODO: Do this in a better way in __vmexit_entry
+	// Handle checks for CPU virtualisation, see vcpu.asm. These are normally answered by the fast path in __vmexit_entry
 	if (GuestState->Rdx == 0x441C88F24291161F)
 	{
 		GuestState->Rsi = TRUE;
@@ -232,26 +291,12 @@ Routine Description:
 		return VMM_EVENT_CONTINUE;
 	}
 
-	X86_CPUID_ARGS CpuidArgs = {
-		.Eax = (UINT32)GuestState->Rax,
-		.Ebx = (UINT32)GuestState->Rbx,
-		.Ecx = (UINT32)GuestState->Rcx,
-		.Edx = (UINT32)GuestState->Rdx,
-	};
-
-	__cpuidex(CpuidArgs.Data, GuestState->Rax, GuestState->Rcx);
+	// Precomputed results and feature hiding rules are in vcpu/cpuid.c
+	X86_CPUID_ARGS CpuidArgs = {0};
+	VcpuCpuidQuery(&Vcpu->Cpuid, (UINT32)GuestState->Rax, (UINT32)GuestState->Rcx, &CpuidArgs);
 
-	switch (GuestState->Rax)
-	{
-	case FEATURE_LEAF(X86_FEATURE_HYPERVISOR):
-		CpuidArgs.Data[FEATURE_REG(X86_FEATURE_HYPERVISOR)] &= ~FEATURE_MASK(X86_FEATURE_HYPERVISOR);
-		break;
-	}
-
-#if 0
-	ImpLog("[0x%02X] CPUID %XH.%X request\n\t[%08X, %08X, %08X, %08X]\n", Vcpu->Id, GuestState->Rax, GuestState->Rcx,
+	IMP_LOG_TRACE(IMP_LOG_VMEXIT, "[0x%02X] CPUID %XH.%X request\n\t[%08X, %08X, %08X, %08X]\n", Vcpu->Id, GuestState->Rax, GuestState->Rcx,
 		CpuidArgs.Eax, CpuidArgs.Ebx, CpuidArgs.Ecx, CpuidArgs.Edx);
-#endif
 
 	GuestState->Rax = CpuidArgs.Eax;
 	GuestState->Rbx = CpuidArgs.Ebx;
@@ -282,7 +327,7 @@ Routine Description:
 {
 	UNREFERENCED_PARAMETER(GuestState);
 
-	ImpLog("[%02X] VM-entry failed due to invalid guest state...\n", Vcpu->Id);
+	IMP_LOG_ERROR(IMP_LOG_VMEXIT, "[%02X] VM-entry failed due to invalid guest state...\n", Vcpu->Id);
 
 	return VMM_EVENT_CONTINUE;
 }
@@ -336,14 +381,14 @@ Routine Description:
 	NTSTATUS Status = STATUS_SUCCESS;
 
 	X86_CR3 Cr3 = {
-		.Value = VmxRead(GUEST_CR3)
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CR3)
 	};
 
 	MM_PTE Pdptrs[4] = { 0, 0, 0, 0 };
 	Status = MmReadGuestPhys(PAGE_ADDRESS(Cr3.PageDirectoryBase), sizeof(Pdptrs), Pdptrs);
 	if (!NT_SUCCESS(Status))
 	{
-		ImpLog("[%02X] Failed to map CR3 PDPTR '%llX'... (%x)\n", Cr3.PageDirectoryBase, Status);
+		IMP_LOG_ERROR(IMP_LOG_VMEXIT, "[%02X] Failed to map CR3 PDPTR '%llX'... (%x)\n", Cr3.PageDirectoryBase, Status);
 		return Status;
 	}
 
@@ -377,13 +422,13 @@ VcpuHandleCrRead(
 	UINT64 ControlRegister = 0;
 	switch (ExitQual.ControlRegisterId)
 	{
-	case 3: ControlRegister = VmxRead(GUEST_CR3); break;
+	case 3: ControlRegister = VmxCacheRead(&Vcpu->Vmx, GUEST_CR3); break;
 	case 8: ControlRegister = GuestState->Cr8; break;
 	}
 
 	// Write to GUEST_RSP if the target register was RSP instead of the RSP inside of GUEST_STATE
 	if (ExitQual.ControlRegisterId == 4 /* RSP */)
-		VmxWrite(GUEST_RSP, ControlRegister);
+		VmxCacheWrite(&Vcpu->Vmx, GUEST_RSP, ControlRegister);
 	else
 	{
 		*LookupTargetReg(GuestState, ExitQual.RegisterId) = ControlRegister;
@@ -410,7 +455,9 @@ Routine Description:
 	are just in the guest/host mask to intercept people changing them (TRAP and FIXED)
 --*/
 {
-	UINT64 ReadShadow = VmxRead(RsEncoding);
+	PVMX_STATE Vmx = &VcpuGetActiveVcpu()->Vmx;
+
+	UINT64 ReadShadow = VmxCacheRead(Vmx, RsEncoding);
 
 	// Inject #GP(0) if there was an attempt to modify a reserved bit
 	if (DifferentBits & ReservedBits)
@@ -425,7 +472,7 @@ Routine Description:
 	ReadShadow &= ~(DifferentBits & RsUpdateableBits);
 	ReadShadow |= (NewValue & RsUpdateableBits);
 
-	VmxWrite(RsEncoding, ReadShadow);
+	VmxCacheWrite(Vmx, RsEncoding, ReadShadow);
 
 	// Bits which can be updated inside of the read shadow TODO: ~(SHADOWABLE | FIXED) 
 	const UINT64 CrUpdateableBits = ~ShadowableBits;
@@ -433,7 +480,7 @@ Routine Description:
 	ControlReg &= ~(DifferentBits & CrUpdateableBits);
 	ControlReg |= (NewValue & CrUpdateableBits);
 
-	VmxWrite(CrEncoding, ControlReg);
+	VmxCacheWrite(Vmx, CrEncoding, ControlReg);
 
 	return VMM_EVENT_CONTINUE;
 }
@@ -452,7 +499,7 @@ VcpuHandleCr0Write(
 {
 	VMM_EVENT_STATUS Status = VMM_EVENT_CONTINUE;
 
-	UINT64 ControlRegister = VmxRead(GUEST_CR0);
+	UINT64 ControlRegister = VmxCacheRead(&Vcpu->Vmx, GUEST_CR0);
 	UINT64 ShadowableBits = Vcpu->Cr0ShadowableBits;
 
 	const X86_CR0 DifferentBits = {
@@ -510,7 +557,7 @@ VcpuHandleCr0Write(
 		}
 
 		X86_CR4 Cr4 = {
-			.Value = VmxRead(GUEST_CR4)
+			.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CR4)
 		};
 
 		if (PagingDisabled && Cr4.PCIDEnable)
@@ -521,7 +568,10 @@ VcpuHandleCr0Write(
 
 		// If CR0.PG is changed to a 0, all TLBs are invalidated
 		if (DifferentBits.Paging && !NewCr.Paging)
+		{
 			VmxInvvpid(INV_SINGLE_CONTEXT, 1);
+			MmVtlbFlush(&Vcpu->Vtlb);
+		}
 	}
 
 	// If CR0.PG has been changed, update IA32_EFER.LMA
@@ -536,11 +586,11 @@ VcpuHandleCr0Write(
 		VcpuSetControl(Vcpu, VMX_CTL_GUEST_ADDRESS_SPACE_SIZE, (Efer.LongModeEnable && NewCr.Paging));
 
 		X86_CR4 Cr4 = {
-			.Value = VmxRead(GUEST_CR4)
+			.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CR4)
 		};
 
 		X86_SEGMENT_ACCESS_RIGHTS CsAr = {
-			.Value = VmxRead(GUEST_CS_ACCESS_RIGHTS)
+			.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CS_ACCESS_RIGHTS)
 		};
 
 		if (NewCr.Paging && Efer.LongModeEnable &&
@@ -607,7 +657,7 @@ VcpuHandleCr4Write(
 {
 	VMM_EVENT_STATUS Status = VMM_EVENT_CONTINUE;
 
-	UINT64 ControlRegister = VmxRead(GUEST_CR4);
+	UINT64 ControlRegister = VmxCacheRead(&Vcpu->Vmx, GUEST_CR4);
 	UINT64 ShadowableBits = Vcpu->Cr4ShadowableBits;
 
 	const X86_CR4 DifferentBits = {
@@ -623,7 +673,7 @@ VcpuHandleCr4Write(
 	};
 
 	if (DifferentBits.PCIDEnable && NewCr.PCIDEnable == 1 &&
-		((VmxRead(GUEST_CR3) & 0xFFF) != 0 || (Efer.LongModeActive == 0)))
+		((VmxCacheRead(&Vcpu->Vmx, GUEST_CR3) & 0xFFF) != 0 || (Efer.LongModeActive == 0)))
 	{
 		VmxInjectEvent(EXCEPTION_GENERAL_PROTECTION_FAULT, INTERRUPT_TYPE_HARDWARE_EXCEPTION, 0);
 		return VMM_EVENT_INTERRUPT;
@@ -637,7 +687,7 @@ VcpuHandleCr4Write(
 	}
 
 	X86_CR0 Cr0 = {
-		.Value = VmxRead(GUEST_CR0)
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CR0)
 	};
 
 	if (Cr0.Paging && Efer.LongModeActive && NewCr.PhysicalAddressExtension && DifferentBits.Value & CR4_PDPTR_CHANGE_BITS)
@@ -663,7 +713,10 @@ VcpuHandleCr4Write(
 		DifferentBits.PhysicalAddressExtension ||
 		(DifferentBits.PCIDEnable && NewCr.PCIDEnable == 0) ||
 		(DifferentBits.SmepEnable && NewCr.SmepEnable == 1))
+	{
 		VmxInvvpid(INV_SINGLE_CONTEXT, 1);
+		MmVtlbFlush(&Vcpu->Vtlb);
+	}
 
 	return Status;
 }
@@ -675,10 +728,23 @@ VcpuHandleCr3Write(
 	_In_ UINT64 NewValue
 )
 {
-	// TODO: Properly implement this
-	VmxWrite(GUEST_CR3, NewValue);
+	X86_CR4 Cr4 = {
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CR4)
+	};
 
-	VmxInvvpid(INV_SINGLE_CONTEXT_RETAIN_GLOBALS, VmxRead(CONTROL_VIRTUAL_PROCESSOR_ID));
+	// Bit 63 being set with PCIDs enabled means the write doesn't invalidate any translations, it is never
+	// stored in CR3 itself
+	const BOOLEAN Invalidate = !Cr4.PCIDEnable || (NewValue & (1ULL << 63)) == 0;
+	if (Cr4.PCIDEnable)
+		NewValue &= ~(1ULL << 63);
+
+	VmxCacheWrite(&Vcpu->Vmx, GUEST_CR3, NewValue);
+
+	if (Invalidate)
+	{
+		VmxInvvpid(INV_SINGLE_CONTEXT_RETAIN_GLOBALS, VmxRead(CONTROL_VIRTUAL_PROCESSOR_ID));
+		MmVtlbInvalidateDirectory(&Vcpu->Vtlb, NewValue);
+	}
 
 	return VMM_EVENT_CONTINUE;
 }
@@ -699,8 +765,8 @@ Routine Description:
 	const PUINT64 TargetReg = LookupTargetReg(GuestState, ExitQual.RegisterId);
 
 	UINT64 NewValue = 0;
-	if (ExitQual.ControlRegisterId == 4 /* RSP */)
-		NewValue = VmxRead(GUEST_RSP);
+	if (ExitQual.RegisterId == 4 /* RSP */)
+		NewValue = VmxCacheRead(&Vcpu->Vmx, GUEST_RSP);
 	else
 		NewValue = *TargetReg;
 
@@ -727,12 +793,12 @@ VcpuEmulateCLTS(
 )
 {
 	X86_CR0 Cr0 = {
-		.Value = VmxRead(GUEST_CR0)
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CR0)
 	};
 
 	Cr0.TaskSwitched = FALSE;
 
-	VmxWrite(GUEST_CR0, Cr0.Value);
+	VmxCacheWrite(&Vcpu->Vmx, GUEST_CR0, Cr0.Value);
 
 	return VMM_EVENT_CONTINUE;
 }
@@ -758,11 +824,11 @@ VcpuHandleCrAccess(
 	VMM_EVENT_STATUS Status = VMM_EVENT_CONTINUE;
 
 	VMX_MOV_CR_EXIT_QUALIFICATION ExitQual = {
-		.Value = VmxRead(VM_EXIT_QUALIFICATION)
+		.Value = VmxCacheRead(&Vcpu->Vmx, VM_EXIT_QUALIFICATION)
 	};
 
 	X86_SEGMENT_ACCESS_RIGHTS GuestCsAr = {
-		.Value = VmxRead(GUEST_CS_ACCESS_RIGHTS)
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CS_ACCESS_RIGHTS)
 	};
 
 	if (GuestCsAr.Dpl != 0)
@@ -829,7 +895,7 @@ Routine Description:
 	{
 		VcpuSetControl(Vcpu, VMX_CTL_VMX_PREEMPTION_TIMER, TRUE);
 
-		VmxWrite(GUEST_VMX_PREEMPTION_TIMER_VALUE, VTSC_WATCHDOG_QUANTUM);
+		VmxCacheWrite(&Vcpu->Vmx, GUEST_VMX_PREEMPTION_TIMER_VALUE, VTSC_WATCHDOG_QUANTUM);
 
 		VcpuPushPendingMTFEvent(Vcpu, MTF_EVENT_MEASURE_VMENTRY);
 
@@ -855,11 +921,11 @@ VcpuHandleRdtsc(
 )
 {
 	X86_CR4 Cr4 = {
-		.Value = VmxRead(CONTROL_CR4_READ_SHADOW)
+		.Value = VmxCacheRead(&Vcpu->Vmx, CONTROL_CR4_READ_SHADOW)
 	};
 
 	X86_SEGMENT_ACCESS_RIGHTS GuestCsAr = {
-		.Value = VmxRead(GUEST_CS_ACCESS_RIGHTS)
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CS_ACCESS_RIGHTS)
 	};
 
 	if (Cr4.TimeStampDisable && GuestCsAr.Dpl != 0)
@@ -894,11 +960,11 @@ VcpuHandleRdtscp(
 )
 {
 	X86_CR4 Cr4 = {
-		.Value = VmxRead(CONTROL_CR4_READ_SHADOW)
+		.Value = VmxCacheRead(&Vcpu->Vmx, CONTROL_CR4_READ_SHADOW)
 	};
 
 	X86_SEGMENT_ACCESS_RIGHTS GuestCsAr = {
-		.Value = VmxRead(GUEST_CS_ACCESS_RIGHTS)
+		.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_CS_ACCESS_RIGHTS)
 	};
 
 	if (Cr4.TimeStampDisable && GuestCsAr.Dpl != 0)
@@ -940,26 +1006,14 @@ VcpuHandleTimerExpire(
 		VcpuSetControl(Vcpu, VMX_CTL_VMX_PREEMPTION_TIMER, FALSE);
 		VcpuSetControl(Vcpu, VMX_CTL_RDTSC_EXITING, FALSE);
 
-		VmxWrite(GUEST_VMX_PREEMPTION_TIMER_VALUE, 0);
+		VmxCacheWrite(&Vcpu->Vmx, GUEST_VMX_PREEMPTION_TIMER_VALUE, 0);
 
 		Vcpu->Tsc.SpoofEnabled = FALSE;
 	}
 
-	return VMM_EVENT_CONTINUE;
-}
+	VmRingHandleTick(Vcpu);
 
-VMM_API
-BOOLEAN
-VcpuValidateMsr(
-	_In_ UINT64 Msr
-)
-/*++
-Routine Description:
-	Validates if an MSR is valid to read/write from
---*/
-{
-	// TODO: Finish this
-	return FALSE;
+	return VMM_EVENT_CONTINUE;
 }
 
 VMM_API
@@ -968,21 +1022,21 @@ VcpuHandleMsrWrite(
 	_Inout_ PVCPU Vcpu,
 	_Inout_ PGUEST_STATE GuestState
 )
+/*++
+Routine Description:
+	Handles WRMSR according to the MSR policy, injecting #GP for MSRs it has no entry for
+--*/
 {
-	UINT64 Msr = GuestState->Rcx;
+	LARGE_INTEGER MsrValue = {
+		.HighPart = GuestState->Rdx, .LowPart = GuestState->Rax
+	};
 
-	if (!VcpuValidateMsr(Msr))
+	if (!VcpuMsrWrite(Vcpu, (UINT32)GuestState->Rcx, MsrValue.QuadPart))
 	{
 		VmxInjectEvent(EXCEPTION_GENERAL_PROTECTION_FAULT, INTERRUPT_TYPE_HARDWARE_EXCEPTION, 0);
 		return VMM_EVENT_INTERRUPT;
 	}
 
-	LARGE_INTEGER MsrValue = {
-		.HighPart = GuestState->Rdx, .LowPart = GuestState->Rax
-	};
-
-	__writemsr(Msr, MsrValue.QuadPart);
-
 	return VMM_EVENT_CONTINUE;
 }
 
@@ -992,19 +1046,19 @@ VcpuHandleMsrRead(
 	_Inout_ PVCPU Vcpu,
 	_Inout_ PGUEST_STATE GuestState
 )
+/*++
+Routine Description:
+	Handles RDMSR according to the MSR policy, injecting #GP for MSRs it has no entry for
+--*/
 {
-	UINT64 Msr = GuestState->Rcx;
+	LARGE_INTEGER MsrValue = {0};
 
-	if (!VcpuValidateMsr(Msr))
+	if (!VcpuMsrRead(Vcpu, (UINT32)GuestState->Rcx, &MsrValue.QuadPart))
 	{
 		VmxInjectEvent(EXCEPTION_GENERAL_PROTECTION_FAULT, INTERRUPT_TYPE_HARDWARE_EXCEPTION, 0);
 		return VMM_EVENT_INTERRUPT;
 	}
 
-	LARGE_INTEGER MsrValue = {
-		.QuadPart = __readmsr(Msr)
-	};
-
 	GuestState->Rdx = MsrValue.HighPart;
 	GuestState->Rax = MsrValue.LowPart;
 
@@ -1023,7 +1077,7 @@ Routine Descriptions:
 --*/
 {
 	VMX_IDT_VECTORING_INFO VecInfo = {
-		.Value = VmxRead(IDT_VECTORING_INFO)
+		.Value = VmxCacheRead(&Vcpu->Vmx, IDT_VECTORING_INFO)
 	};
 
 	// NMI unblocking due to IRET execution faulted, re-set NMI blocking in the guest interruptibility state
@@ -1047,29 +1101,34 @@ Routine Descriptions:
 				return;
 
 			VMX_GUEST_INTERRUPTIBILITY_STATE InterruptibilityState = {
-				.Value = VmxRead(GUEST_INTERRUPTIBILITY_STATE)
+				.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_INTERRUPTIBILITY_STATE)
 			};
 
-			InterruptibilityState.BlockingByNMI = !IntrInfo.NmiUnblocking;
-
-			VmxWrite(GUEST_INTERRUPTIBILITY_STATE, InterruptibilityState.Value);
+			if (IntrInfo.NmiUnblocking)
+			{
+				InterruptibilityState.BlockingByNMI = TRUE;
+				VmxCacheWrite(&Vcpu->Vmx, GUEST_INTERRUPTIBILITY_STATE, InterruptibilityState.Value);
+			}
 		}
-		else if (Vcpu->Vmx.ExitReason.BasicExitReason == EXIT_REASON_EPT_VIOLATION)
+		else if (Vcpu->Vmx.ExitReason.BasicExitReason == EXIT_REASON_EPT_VIOLATION || 
+			Vcpu->Vmx.ExitReason.BasicExitReason == EXIT_REASON_PML_FULL)
 		{
 			// For VM exits due to EPT violations, page-modification log-full events, and SPP-related events, 
 			// NMI unblocking due to IRET is saved in bit 12 of the exit qualification (Section 27.2.1).
 
 			EPT_VIOLATION_EXIT_QUALIFICATION ExitQual = {
-				.Value = VmxRead(VM_EXIT_QUALIFICATION)
+				.Value = VmxCacheRead(&Vcpu->Vmx, VM_EXIT_QUALIFICATION)
 			};
 
 			VMX_GUEST_INTERRUPTIBILITY_STATE InterruptibilityState = {
-				.Value = VmxRead(GUEST_INTERRUPTIBILITY_STATE)
+				.Value = VmxCacheRead(&Vcpu->Vmx, GUEST_INTERRUPTIBILITY_STATE)
 			};
 
-			InterruptibilityState.BlockingByNMI = !ExitQual.NmiUnblocking;
-
-			VmxWrite(GUEST_INTERRUPTIBILITY_STATE, InterruptibilityState.Value);
+			if (ExitQual.NmiUnblocking)
+			{
+				InterruptibilityState.BlockingByNMI = TRUE;
+				VmxCacheWrite(&Vcpu->Vmx, GUEST_INTERRUPTIBILITY_STATE, InterruptibilityState.Value);
+			}
 		}
 	}
 }
@@ -1086,7 +1145,7 @@ Routine Description:
 --*/
 {
 	VMX_IDT_VECTORING_INFO VecInfo = {
-		.Value = VmxRead(IDT_VECTORING_INFO)
+		.Value = VmxCacheRead(&Vcpu->Vmx, IDT_VECTORING_INFO)
 	};
 
 	// No vectored exception waiting to be delivered, return
@@ -1102,7 +1161,7 @@ Routine Description:
 		// TODO: Handle #DF's
 	}
 
-	VmxInjectEvent(VecInfo.Vector, VecInfo.Type, VecInfo.ErrorCodeValid ? VmxRead(IDT_VECTORING_ERROR_CODE) : 0);
+	VmxInjectEvent(VecInfo.Vector, VecInfo.Type, VecInfo.ErrorCodeValid ? VmxCacheRead(&Vcpu->Vmx, IDT_VECTORING_ERROR_CODE) : 0);
 
 	return VMM_EVENT_INTERRUPT;
 }
@@ -1133,6 +1192,20 @@ VcpuHandleExceptionNmi(
 		.Value = VmxRead(VM_EXIT_INTERRUPT_INFO)
 	};
 
+	// NMIs sent to make this VCPU invalidate its EPT are only meant for the hypervisor, anything that was being
+	// delivered when one arrived still has to be. Every other NMI is queued for the guest's next NMI window, as
+	// injecting it now would overwrite that event or deliver it while the guest still blocks NMIs
+	if (IntrInfo.Type == INTERRUPT_TYPE_NMI)
+	{
+		if (!VcpuHandleEptFlushNmi(Vcpu))
+		{
+			InterlockedIncrement(&Vcpu->NumQueuedNMIs);
+			VcpuSetControl(Vcpu, VMX_CTL_NMI_WINDOW_EXITING, TRUE);
+		}
+
+		return VcpuHandleVectoredExceptions(Vcpu) == VMM_EVENT_INTERRUPT ? VMM_EVENT_INTERRUPT : VMM_EVENT_RETRY;
+	}
+
 	// Handle vectored exceptions and possible double faults
 	// If this function successfully injects its own event and not the
 	// event from VM_EXIT_INTERRUPT_INFO, return now and signal and interrupt
@@ -1148,30 +1221,6 @@ VcpuHandleExceptionNmi(
 		else
 			VmxInjectEvent(IntrInfo.Vector, IntrInfo.Type, VmxRead(VM_EXIT_INTERRUPT_ERROR_CODE));
 	} break;
-#if 0 // NOTE: I don't use NMI exiting at the minute
-	case EXCEPTION_NON_MASKABLE_INTERRUPT:
-	{
-		// TODO: NMI executed, NMI blocking is in effect
-		Vcpu->NMIsBlocked = TRUE;
-
-		// TODO: This should never happen (unless i start instrumenting NMI's for something and end up injecting an event because of it?)
-		if (VmxIsAnyEventPending())
-		{
-			// Add one pending NMI
-			InterlockedIncrement(&Vcpu->NumQueuedNMIs);
-			// Start exiting on NMI windows
-			VcpuSetControl(Vcpu, VMX_CTL_NMI_WINDOW_EXITING, TRUE);
-			// Nothing else to do here, continue
-			return VMM_EVENT_CONTINUE;
-		}
-		else
-		{
-			// TODO: CHECK BLOCKING BY NMI IN GUEST INTERRUPTIBILITY
-			// Inject this NMI now, no need to make it pending
-			VmxInjectEvent(EXCEPTION_NON_MASKABLE_INTERRUPT, INTERRUPT_TYPE_NMI, 0);
-		}
-	} break;
-#endif
 	default:
 	{
 		VmxInjectEvent(IntrInfo.Vector, IntrInfo.Type, VmxRead(VM_EXIT_INTERRUPT_ERROR_CODE));
@@ -1204,7 +1253,7 @@ VcpuHandleNmiWindow(
 
 	VmxInjectEvent(EXCEPTION_NMI, INTERRUPT_TYPE_NMI, 0);
 
-	return VMM_EVENT_CONTINUE;
+	return VMM_EVENT_INTERRUPT;
 }
 
 VMM_API
@@ -1227,7 +1276,7 @@ VcpuHandleEptViolation(
 	// TODO: Check IDT-vectoring information to see if this EPT violation was caused by event delivery
 
 	EPT_VIOLATION_EXIT_QUALIFICATION ExitQual = {
-		.Value = VmxRead(VM_EXIT_QUALIFICATION)
+		.Value = VmxCacheRead(&Vcpu->Vmx, VM_EXIT_QUALIFICATION)
 	};
 
 	if (EhHandleEptViolation(Vcpu))
@@ -1236,26 +1285,30 @@ VcpuHandleEptViolation(
 	// Handle vectored exceptions and possible double faults
 	VcpuHandleVectoredExceptions(Vcpu);
 
-	UINT64 AttemptedAddress = VmxRead(GUEST_PHYSICAL_ADDRESS);
+	UINT64 AttemptedAddress = VmxCacheRead(&Vcpu->Vmx, GUEST_PHYSICAL_ADDRESS);
+
+	SpinLock(&Vcpu->Vmm->Ept.Lock);
+
+	NTSTATUS Status = EptMapMemoryRangeInViews(
+		&Vcpu->Vmm->Ept,
+		AttemptedAddress,
+		AttemptedAddress,
+		PAGE_SIZE,
+		EPT_PAGE_RWX
+	);
+
+	SpinUnlock(&Vcpu->Vmm->Ept.Lock);
 
-	if (!NT_SUCCESS(
-		EptMapMemoryRange(
-			Vcpu->Vmm->Ept.Pml4,
-			AttemptedAddress,
-			AttemptedAddress,
-			PAGE_SIZE,
-			EPT_PAGE_RWX)
-	))
+	if (!NT_SUCCESS(Status))
 	{
-		ImpLog("[%02X] Failed to map %llX -> %llX...\n", Vcpu->Id, AttemptedAddress, AttemptedAddress);
+		IMP_LOG_ERROR(IMP_LOG_EPT, "[%02X] Failed to map %llX -> %llX...\n", Vcpu->Id, AttemptedAddress, AttemptedAddress);
 		return VMM_EVENT_ABORT;
 	}
 
-	ImpLog("[%02X-#%03d] %llX: Mapped %llX -> %llX...\n", Vcpu->Id, Vcpu->Vmx.ExitCount, Vcpu->Vmx.GuestRip, AttemptedAddress, AttemptedAddress);
+	IMP_LOG_TRACE(IMP_LOG_EPT, "[%02X-#%03d] %llX: Mapped %llX -> %llX...\n", Vcpu->Id, Vcpu->Vmx.ExitCount, Vcpu->Vmx.GuestRip, AttemptedAddress, AttemptedAddress);
 
-	// NOTE: Don't think this is necessary
-	//       EPT violations for address X automatically invalidate all EPT cache entries for address X
-	EptInvalidateCache();
+	// No invalidation is needed as permissions were only added, EPT violations for address X automatically 
+	// invalidate all EPT cache entries for address X on the processor they happen on
 
 	return VMM_EVENT_RETRY;
 }
@@ -1268,7 +1321,7 @@ VcpuHandleEptMisconfig(
 )
 {
 	// TODO: Panic
-	ImpLog("[%02X] EPT misconfig, aborting...\n", Vcpu->Id);
+	IMP_LOG_ERROR(IMP_LOG_EPT, "[%02X] EPT misconfig, aborting...\n", Vcpu->Id);
 
 	return VMM_EVENT_ABORT;
 }
@@ -1380,35 +1433,40 @@ VcpuHandleMTFExit(
 		{
 		case MTF_EVENT_MEASURE_VMENTRY:
 		{
-			GuestState->Rax = VTSC_WATCHDOG_QUANTUM - VmxRead(GUEST_VMX_PREEMPTION_TIMER_VALUE) - Vcpu->Tsc.VmExitLatency;
+			GuestState->Rax = VTSC_WATCHDOG_QUANTUM - VmxCacheRead(&Vcpu->Vmx, GUEST_VMX_PREEMPTION_TIMER_VALUE) - Vcpu->Tsc.VmExitLatency;
 		} break;
 		case MTF_EVENT_RESET_EPT_PERMISSIONS:
 		{
 			// NOTE: This doesn't check user-execution
 			if ((Event.Permissions & EPT_PAGE_RWX) != 0)
 			{
-				ImpLog("[%02X] Invalid MTF_EVENT_RESET_EPT_PERMISSIONS permissions (%x)...\n", Event.Permissions);
+				IMP_LOG_ERROR(IMP_LOG_EPT, "[%02X] Invalid MTF_EVENT_RESET_EPT_PERMISSIONS permissions (%x)...\n", Event.Permissions);
 				return VMM_EVENT_CONTINUE;
 			}
 
-			if (!NT_SUCCESS(
-				EptMapMemoryRange(
-					Vcpu->Vmm->Ept.Pml4,
-					Event.GuestPhysAddr,
-					Event.PhysAddr,
-					PAGE_SIZE,
-					Event.Permissions)
-			))
+			SpinLock(&Vcpu->Vmm->Ept.Lock);
+
+			NTSTATUS Status = EptMapMemoryRangeInViews(
+				&Vcpu->Vmm->Ept,
+				Event.GuestPhysAddr,
+				Event.PhysAddr,
+				PAGE_SIZE,
+				Event.Permissions
+			);
+
+			SpinUnlock(&Vcpu->Vmm->Ept.Lock);
+
+			if (!NT_SUCCESS(Status))
 			{
-				ImpLog("[%02X] Failed to remap page permissions for %llx->%llx...\n", Vcpu->Id, Event.GuestPhysAddr, Event.PhysAddr);
+				IMP_LOG_ERROR(IMP_LOG_EPT, "[%02X] Failed to remap page permissions for %llx->%llx...\n", Vcpu->Id, Event.GuestPhysAddr, Event.PhysAddr);
 				return VMM_EVENT_ABORT;
 			}
 
-			EptInvalidateCache();
-		}
+			VcpuQueueEptInvalidation(Vcpu);
+		} break;
 		default:
 		{
-			ImpLog("[%02X] Unknown MTF event (%x)...\n", Vcpu->Id, Event);
+			IMP_LOG_WARN(IMP_LOG_VMEXIT, "[%02X] Unknown MTF event (%x)...\n", Vcpu->Id, Event);
 		} break;
 		}
 	}
@@ -1442,6 +1500,25 @@ GetXCR0SupportedMask(VOID)
 	return -1;
 }
 
+VMM_API
+VMM_EVENT_STATUS
+VcpuHandlePmlFull(
+	_Inout_ PVCPU Vcpu,
+	_Inout_ PGUEST_STATE GuestState
+)
+/*++
+Routine Description:
+	Empties the page-modification log, the write that would have been logged didn't happen and is retried
+--*/
+{
+	// The write may have been part of delivering an event, such as pushing an exception frame
+	VcpuHandleVectoredExceptions(Vcpu);
+
+	VcpuDrainPml(Vcpu);
+
+	return VMM_EVENT_RETRY;
+}
+
 VMM_API
 VMM_EVENT_STATUS
 VcpuHandleXsetbv(
@@ -1450,7 +1527,7 @@ VcpuHandleXsetbv(
 )
 {
 	X86_CR4 Cr4 = {
-		.Value = VmxRead(CONTROL_CR4_READ_SHADOW)
+		.Value = VmxCacheRead(&Vcpu->Vmx, CONTROL_CR4_READ_SHADOW)
 	};
 
 	if (Cr4.XSaveEnable)
@@ -1502,7 +1579,152 @@ VcpuHandleInvlpg(
 	_Inout_ PVCPU Vcpu,
 	_Inout_ PGUEST_STATE GuestState
 )
+/*++
+Routine Description:
+	Emulates INVLPG by invalidating the linear address in the exit qualification from both the guest's TLB
+	and the VCPU's VTLB
+--*/
+{
+	const UINT64 LinearAddr = VmxCacheRead(&Vcpu->Vmx, VM_EXIT_QUALIFICATION);
+
+	VmxInvvpidAddress((UINT16)VmxRead(CONTROL_VIRTUAL_PROCESSOR_ID), LinearAddr);
+	MmVtlbInvalidateAddress(&Vcpu->Vtlb, LinearAddr);
+
+	return VMM_EVENT_CONTINUE;
+}
+
+VMM_API
+BOOLEAN
+VcpuReadInvalidationRegister(
+	_Inout_ PVCPU Vcpu,
+	_In_ PGUEST_STATE GuestState,
+	_In_ UINT64 RegisterId,
+	_Out_ PUINT64 Value
+)
+/*++
+Routine Description:
+	Reads a register operand of an invalidation instruction, returning FALSE for RBP as the guest's value of it 
+	isn't saved on VM-exit
+--*/
+{
+	if (RegisterId == 5 /* RBP */)
+		return FALSE;
+
+	if (RegisterId == 4 /* RSP */)
+		*Value = VmxCacheRead(&Vcpu->Vmx, GUEST_RSP);
+	else
+		*Value = *LookupTargetReg(GuestState, RegisterId);
+
+	return TRUE;
+}
+
+VMM_API
+BOOLEAN
+VcpuReadInvpcidOperands(
+	_Inout_ PVCPU Vcpu,
+	_In_ PGUEST_STATE GuestState,
+	_Out_ PUINT64 Type,
+	_Out_ PX86_INVPCID_DESCRIPTOR Desc
+)
+/*++
+Routine Description:
+	Decodes the INVPCID type and reads its descriptor from guest memory, returning FALSE if either can't be
+--*/
+{
+	VMX_INVALIDATION_INSTRUCTION_INFO Info = {
+		.Value = (UINT32)VmxRead(VM_EXIT_INSTRUCTION_INFO)
+	};
+
+	if (!VcpuReadInvalidationRegister(Vcpu, GuestState, Info.Register2, Type))
+		return FALSE;
+
+	// The displacement is in the exit qualification
+	UINT64 LinearAddr = VmxCacheRead(&Vcpu->Vmx, VM_EXIT_QUALIFICATION);
+	UINT64 Operand = 0;
+
+	if (!Info.BaseRegisterInvalid)
+	{
+		if (!VcpuReadInvalidationRegister(Vcpu, GuestState, Info.BaseRegister, &Operand))
+			return FALSE;
+
+		LinearAddr += Operand;
+	}
+
+	if (!Info.IndexRegisterInvalid)
+	{
+		if (!VcpuReadInvalidationRegister(Vcpu, GuestState, Info.IndexRegister, &Operand))
+			return FALSE;
+
+		LinearAddr += Operand << Info.Scaling;
+	}
+
+	// Only FS and GS have a base in 64-bit mode
+	if (Info.SegmentRegister == 4)
+		LinearAddr += VmxRead(GUEST_FS_BASE);
+	else if (Info.SegmentRegister == 5)
+		LinearAddr += VmxRead(GUEST_GS_BASE);
+
+	// 16, 32 or 64-bit address size
+	if (Info.AddressSize == 0)
+		LinearAddr &= 0xFFFF;
+	else if (Info.AddressSize == 1)
+		LinearAddr &= 0xFFFFFFFF;
+
+	return NT_SUCCESS(MmReadGuestVirt(VmxCacheRead(&Vcpu->Vmx, GUEST_CR3), LinearAddr, sizeof(*Desc), Desc));
+}
+
+VMM_API
+VMM_EVENT_STATUS
+VcpuHandleInvpcid(
+	_Inout_ PVCPU Vcpu,
+	_Inout_ PGUEST_STATE GuestState
+)
+/*++
+Routine Description:
+	Emulates INVPCID, which exits along with INVLPG. The guest's translations are tagged with its VPID, so the
+	invalidation is done with INVVPID and may be wider than the one requested, which the architecture allows.
+	Operands that can't be decoded fall back to invalidating everything
+--*/
 {
+	const UINT16 Vpid = (UINT16)VmxRead(CONTROL_VIRTUAL_PROCESSOR_ID);
+
+	UINT64 Type = 0;
+	X86_INVPCID_DESCRIPTOR Desc = { 0 };
+
+	if (!VcpuReadInvpcidOperands(Vcpu, GuestState, &Type, &Desc))
+	{
+		VmxInvvpid(INV_SINGLE_CONTEXT, Vpid);
+		MmVtlbFlush(&Vcpu->Vtlb);
+
+		return VMM_EVENT_CONTINUE;
+	}
+
+	switch (Type)
+	{
+	case INVPCID_INDIVIDUAL_ADDRESS:
+	{
+		VmxInvvpidAddress(Vpid, Desc.LinearAddr);
+		MmVtlbInvalidateAddress(&Vcpu->Vtlb, Desc.LinearAddr);
+	} break;
+	case INVPCID_SINGLE_CONTEXT:
+	case INVPCID_ALL_CONTEXT_RETAIN_GLOBALS:
+	{
+		// The VTLB isn't tagged with PCIDs, so it can only drop everything
+		VmxInvvpid(INV_SINGLE_CONTEXT_RETAIN_GLOBALS, Vpid);
+		MmVtlbFlush(&Vcpu->Vtlb);
+	} break;
+	case INVPCID_ALL_CONTEXT:
+	{
+		VmxInvvpid(INV_SINGLE_CONTEXT, Vpid);
+		MmVtlbFlush(&Vcpu->Vtlb);
+	} break;
+	default:
+	{
+		VmxInjectEvent(EXCEPTION_GENERAL_PROTECTION_FAULT, INTERRUPT_TYPE_HARDWARE_EXCEPTION, 0);
+		return VMM_EVENT_INTERRUPT;
+	}
+	}
+
 	return VMM_EVENT_CONTINUE;
 }
 
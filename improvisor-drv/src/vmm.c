@@ -54,10 +54,10 @@ Routine Description:
 		return Status;
 	}
 
-	Status = ImpReserveLogRecords(0x1000);
+	Status = ImpReserveLogRings(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
 	if (!NT_SUCCESS(Status))
 	{
-		ImpDebugPrint("Failed to allocate log record pool (%X)...\n", Status);
+		ImpDebugPrint("Failed to allocate log rings (%X)...\n", Status);
 		return Status;
 	}
 
@@ -158,6 +158,8 @@ Routine Description:
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
+	ImpBindLogRings(VmmContext->VcpuTable);
+
 	for (UINT8 i = 0; i < CpuCount; i++)
 	{
 		Status = VcpuSetup(&VmmContext->VcpuTable[i], i);
@@ -289,12 +291,12 @@ Routine Description:
 	return STATUS_SUCCESS;
 }
 
-VOID
+NTSTATUS
 VmmShutdownHypervisor(VOID)
 /*++
 Routine Description:
 	Shuts down the hypervisor by sending an NMI out to all active processors, and shutting them down   
-	individually
+	individually. Anything the VMM may still use must be kept around if this fails
  */
 {
 	volatile VCPU_SHUTDOWN_PARAMS Params = {
@@ -308,10 +310,12 @@ Routine Description:
 	{
 		ImpDebugPrint("Failed to shutdown VCPU on cores (%x)... (%x)\n", Params.FailedCoreMask, Params.Status);
 		// TODO: Panic
-		return;
+		return NT_SUCCESS(Params.Status) ? STATUS_UNSUCCESSFUL : Params.Status;
 	}
 
 	// VmmFreeResources(Params.VmmContext);
+
+	return STATUS_SUCCESS;
 }
 
 VOID
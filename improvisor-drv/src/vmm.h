@@ -28,7 +28,7 @@ VmmStartHypervisor(
 	VOID
 );
 
-VOID 
+NTSTATUS 
 VmmShutdownHypervisor(
    VOID 
 );
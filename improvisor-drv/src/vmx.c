@@ -3,15 +3,11 @@
 #include <arch/cpuid.h>
 #include <arch/msr.h>
 #include <arch/cr.h>
+#include <arch/cpu.h>
 #include <vmx.h>
+#include <vcpu/vcpu.h>
 #include <intrin.h>
 
-VOID
-__invvpid(
-	_In_ UINT8 Vpid, 
-	_In_ PVMX_INVVPID_DESCRIPTOR Desc
-);
-
 UINT64
 VmxGetFixedBits(
 	_In_ UINT64 VmxCapability
@@ -172,7 +168,7 @@ Routine Description:
 		return FALSE;
 
 	X86_CR0 Cr0 = {
-		.Value = VmxRead(GUEST_CR0)
+		.Value = VmxCacheRead(&VcpuGetActiveVcpu()->Vmx, GUEST_CR0)
 	};
 
 	if (!Cr0.ProtectedMode)
@@ -202,6 +198,8 @@ Routine Description:
 	Injects a VMX event by filling out the VM-entry interrupt information VMCS component 
 --*/
 {
+	PVMX_STATE Vmx = &VcpuGetActiveVcpu()->Vmx;
+
 	VMX_ENTRY_INTERRUPT_INFO Interrupt = {0};
 
 	Interrupt.Valid = TRUE;
@@ -210,12 +208,12 @@ Routine Description:
 	Interrupt.DeliverErrorCode = VmxShouldPushErrorCode(Interrupt);
 
 	VmxWrite(CONTROL_VMENTRY_EXCEPTION_ERROR_CODE, ErrorCode);
-	VmxWrite(CONTROL_VMENTRY_INTERRUPT_INFO, Interrupt.Value);
+	VmxCacheWrite(Vmx, CONTROL_VMENTRY_INTERRUPT_INFO, Interrupt.Value);
 
 	if (Interrupt.Type == INTERRUPT_TYPE_SOFTWARE_EXCEPTION ||
 		Interrupt.Type == INTERRUPT_TYPE_SOFTWARE_INTERRUPT ||
 		Interrupt.Type == INTERRUPT_TYPE_PRIVILEGED_SOFTWARE_INTERRUPT)
-		VmxWrite(CONTROL_VMENTRY_INSTRUCTION_LEN, VmxRead(VM_EXIT_INSTRUCTION_LEN));
+		VmxWrite(CONTROL_VMENTRY_INSTRUCTION_LEN, VmxCacheRead(Vmx, VM_EXIT_INSTRUCTION_LEN));
 }
 
 VMM_API
@@ -230,7 +228,7 @@ Routine Description:
 --*/
 {
 	VMX_ENTRY_INTERRUPT_INFO Interrupt = {
-		.Value = VmxRead(CONTROL_VMENTRY_INTERRUPT_INFO)
+		.Value = VmxCacheRead(&VcpuGetActiveVcpu()->Vmx, CONTROL_VMENTRY_INTERRUPT_INFO)
 	};
 
 	if (Interrupt.Valid == FALSE)
@@ -252,7 +250,7 @@ Routine Description:
 --*/
 {
 	VMX_ENTRY_INTERRUPT_INFO Interrupt = {
-		.Value = VmxRead(CONTROL_VMENTRY_INTERRUPT_INFO)
+		.Value = VmxCacheRead(&VcpuGetActiveVcpu()->Vmx, CONTROL_VMENTRY_INTERRUPT_INFO)
 	};
 
 	return Interrupt.Valid;
@@ -288,6 +286,147 @@ Routine Description:
 	__vmx_vmwrite(Component, Value);
 }
 
+VMM_API
+VMX_CACHED_FIELD
+VmxGetCacheSlot(
+	_In_ VMCS Component
+)
+/*++
+Routine Description:
+	Returns the cache slot of a VMCS component, or VMX_CACHED_NONE if it isn't cached
+--*/
+{
+	switch (Component)
+	{
+	case GUEST_RIP: return VMX_CACHED_GUEST_RIP;
+	case GUEST_RSP: return VMX_CACHED_GUEST_RSP;
+	case GUEST_RFLAGS: return VMX_CACHED_GUEST_RFLAGS;
+	case GUEST_CR0: return VMX_CACHED_GUEST_CR0;
+	case GUEST_CR3: return VMX_CACHED_GUEST_CR3;
+	case GUEST_CR4: return VMX_CACHED_GUEST_CR4;
+	case GUEST_CS_ACCESS_RIGHTS: return VMX_CACHED_GUEST_CS_ACCESS_RIGHTS;
+	case GUEST_INTERRUPTIBILITY_STATE: return VMX_CACHED_GUEST_INTERRUPTIBILITY_STATE;
+	case GUEST_PHYSICAL_ADDRESS: return VMX_CACHED_GUEST_PHYSICAL_ADDRESS;
+	case GUEST_VMX_PREEMPTION_TIMER_VALUE: return VMX_CACHED_GUEST_VMX_PREEMPTION_TIMER_VALUE;
+	case CONTROL_CR0_READ_SHADOW: return VMX_CACHED_CONTROL_CR0_READ_SHADOW;
+	case CONTROL_CR4_READ_SHADOW: return VMX_CACHED_CONTROL_CR4_READ_SHADOW;
+	case CONTROL_VMENTRY_INTERRUPT_INFO: return VMX_CACHED_CONTROL_VMENTRY_INTERRUPT_INFO;
+	case VM_EXIT_QUALIFICATION: return VMX_CACHED_VM_EXIT_QUALIFICATION;
+	case VM_EXIT_INSTRUCTION_LEN: return VMX_CACHED_VM_EXIT_INSTRUCTION_LEN;
+	case IDT_VECTORING_INFO: return VMX_CACHED_IDT_VECTORING_INFO;
+	case IDT_VECTORING_ERROR_CODE: return VMX_CACHED_IDT_VECTORING_ERROR_CODE;
+	default: return VMX_CACHED_NONE;
+	}
+}
+
+// The VMCS component of each cache slot, used to write back dirty slots
+VMM_RDATA static const VMCS sVmxCachedComponents[VMX_CACHED_FIELD_COUNT] = {
+	[VMX_CACHED_GUEST_RIP] = GUEST_RIP,
+	[VMX_CACHED_GUEST_RSP] = GUEST_RSP,
+	[VMX_CACHED_GUEST_RFLAGS] = GUEST_RFLAGS,
+	[VMX_CACHED_GUEST_CR0] = GUEST_CR0,
+	[VMX_CACHED_GUEST_CR3] = GUEST_CR3,
+	[VMX_CACHED_GUEST_CR4] = GUEST_CR4,
+	[VMX_CACHED_GUEST_CS_ACCESS_RIGHTS] = GUEST_CS_ACCESS_RIGHTS,
+	[VMX_CACHED_GUEST_INTERRUPTIBILITY_STATE] = GUEST_INTERRUPTIBILITY_STATE,
+	[VMX_CACHED_GUEST_PHYSICAL_ADDRESS] = GUEST_PHYSICAL_ADDRESS,
+	[VMX_CACHED_GUEST_VMX_PREEMPTION_TIMER_VALUE] = GUEST_VMX_PREEMPTION_TIMER_VALUE,
+	[VMX_CACHED_CONTROL_CR0_READ_SHADOW] = CONTROL_CR0_READ_SHADOW,
+	[VMX_CACHED_CONTROL_CR4_READ_SHADOW] = CONTROL_CR4_READ_SHADOW,
+	[VMX_CACHED_CONTROL_VMENTRY_INTERRUPT_INFO] = CONTROL_VMENTRY_INTERRUPT_INFO,
+	[VMX_CACHED_VM_EXIT_QUALIFICATION] = VM_EXIT_QUALIFICATION,
+	[VMX_CACHED_VM_EXIT_INSTRUCTION_LEN] = VM_EXIT_INSTRUCTION_LEN,
+	[VMX_CACHED_IDT_VECTORING_INFO] = IDT_VECTORING_INFO,
+	[VMX_CACHED_IDT_VECTORING_ERROR_CODE] = IDT_VECTORING_ERROR_CODE
+};
+
+VMM_API
+VOID
+VmxCacheBegin(
+	_Inout_ PVMX_STATE Vmx
+)
+/*++
+Routine Description:
+	Starts caching VMCS fields for a new VM-exit, nothing from the previous exit is trusted
+--*/
+{
+	Vmx->Cache.Valid = 0;
+	Vmx->Cache.Dirty = 0;
+	Vmx->Cache.Active = TRUE;
+}
+
+VMM_API
+VOID
+VmxCacheFlush(
+	_Inout_ PVMX_STATE Vmx
+)
+/*++
+Routine Description:
+	Writes every dirty field back to the VMCS and deactivates the cache, this must happen before the guest is
+	resumed or VMX operation is shut down
+--*/
+{
+	UINT32 Dirty = Vmx->Cache.Dirty;
+
+	ULONG Slot = 0;
+	while (_BitScanForward(&Slot, Dirty))
+	{
+		__vmx_vmwrite(sVmxCachedComponents[Slot], Vmx->Cache.Values[Slot]);
+		Dirty &= Dirty - 1;
+	}
+
+	Vmx->Cache.Dirty = 0;
+	Vmx->Cache.Active = FALSE;
+}
+
+VMM_API
+UINT64
+VmxCacheRead(
+	_Inout_ PVMX_STATE Vmx,
+	_In_ VMCS Component
+)
+/*++
+Routine Description:
+	Reads a VMCS component, only executing VMREAD the first time a cached component is read during an exit
+--*/
+{
+	const VMX_CACHED_FIELD Slot = VmxGetCacheSlot(Component);
+	if (!Vmx->Cache.Active || Slot == VMX_CACHED_NONE)
+		return VmxRead(Component);
+
+	if ((Vmx->Cache.Valid & (1UL << Slot)) == 0)
+	{
+		__vmx_vmread(Component, &Vmx->Cache.Values[Slot]);
+		Vmx->Cache.Valid |= 1UL << Slot;
+	}
+
+	return Vmx->Cache.Values[Slot];
+}
+
+VMM_API
+VOID
+VmxCacheWrite(
+	_Inout_ PVMX_STATE Vmx,
+	_In_ VMCS Component,
+	_In_ UINT64 Value
+)
+/*++
+Routine Description:
+	Writes a VMCS component, cached components are only written back to the VMCS by VmxCacheFlush
+--*/
+{
+	const VMX_CACHED_FIELD Slot = VmxGetCacheSlot(Component);
+	if (!Vmx->Cache.Active || Slot == VMX_CACHED_NONE)
+	{
+		VmxWrite(Component, Value);
+		return;
+	}
+
+	Vmx->Cache.Values[Slot] = Value;
+	Vmx->Cache.Valid |= 1UL << Slot;
+	Vmx->Cache.Dirty |= 1UL << Slot;
+}
+
 VMM_API
 VOID
 VmxInvvpid(
@@ -302,6 +441,24 @@ VmxInvvpid(
 	__invvpid(InvMode, &Desc);
 }
 
+VOID
+VmxInvvpidAddress(
+	_In_ UINT16 Vpid,
+	_In_ UINT64 LinearAddr
+)
+/*++
+Routine Description:
+	Invalidates the translations of a single linear address tagged with `Vpid`
+--*/
+{
+	VMX_INVVPID_DESCRIPTOR Desc = {
+		.Vpid = Vpid,
+		.LinearAddr = LinearAddr
+	};
+
+	__invvpid(INV_ADDRESS, &Desc);
+}
+
 UINT64
 VmxGetFixedBits(
 	_In_ UINT64 VmxCapability
@@ -363,10 +520,16 @@ Routine Description:
 	if (VmxGetFixedBits(TargetCap) & VMX_CONTROL_MASK(Control))
 		return;
 	
+	const UINT32 PrevControls = *TargetControls;
+
 	if (State)
 		*TargetControls |= VMX_CONTROL_MASK(Control);
 	else
 		*TargetControls &= ~VMX_CONTROL_MASK(Control);
+
+	// Only changed fields are written by the next VcpuCommitVmxState
+	if (*TargetControls != PrevControls)
+		Vmx->DirtyControls |= 1UL << VMX_CONTROL_FIELD(Control);
 }
 
 VMM_API
@@ -440,6 +603,9 @@ Routine Description:
 		.Controls.SecondaryProcbasedCtls = SecProcbasedCap.OnBits,
 		.Controls.VmEntryCtls = VmEntryCap.OnBits,
 		.Controls.VmExitCtls = VmExitCap.OnBits,
+
+		// Nothing has been written to the VMCS yet
+		.DirtyControls = VMX_ALL_CONTROL_FIELDS
 	};
 }
 
@@ -451,5 +617,7 @@ Routine Description:
 	Advances the guest's RIP to the next instruction
 --*/
 {
-	VmxWrite(GUEST_RIP, VmxRead(GUEST_RIP) + VmxRead(VM_EXIT_INSTRUCTION_LEN));
+	PVMX_STATE Vmx = &VcpuGetActiveVcpu()->Vmx;
+
+	VmxCacheWrite(Vmx, GUEST_RIP, VmxCacheRead(Vmx, GUEST_RIP) + VmxCacheRead(Vmx, VM_EXIT_INSTRUCTION_LEN));
 }
@@ -59,6 +59,26 @@ typedef union _VMX_MOV_CR_EXIT_QUALIFICATION
 	};
 } VMX_MOV_CR_EXIT_QUALIFICATION, *PVMX_MOV_CR_EXIT_QUALIFICATION;
 
+// VM-exit instruction information for INVEPT, INVPCID and INVVPID
+typedef union _VMX_INVALIDATION_INSTRUCTION_INFO
+{
+	UINT32 Value;
+
+	struct
+	{
+		UINT32 Scaling : 2;
+		UINT32 Reserved1 : 5;
+		UINT32 AddressSize : 3;
+		UINT32 Reserved2 : 5;
+		UINT32 SegmentRegister : 3;
+		UINT32 IndexRegister : 4;
+		UINT32 IndexRegisterInvalid : 1;
+		UINT32 BaseRegister : 4;
+		UINT32 BaseRegisterInvalid : 1;
+		UINT32 Register2 : 4;
+	};
+} VMX_INVALIDATION_INSTRUCTION_INFO, *PVMX_INVALIDATION_INSTRUCTION_INFO;
+
 typedef union _VMX_ENTRY_INTERRUPT_INFO
 {
 	UINT32 Value;
@@ -137,12 +157,49 @@ typedef struct _VMX_EXIT_LOG_ENTRY
 	UINT64 ExitQualification;
 } VMX_EXIT_LOG_ENTRY, *PVMX_EXIT_LOG_ENTRY;
 
+// VMCS fields read or written more than once on common exit paths, each gets a slot in the VMX_FIELD_CACHE
+typedef enum _VMX_CACHED_FIELD
+{
+	VMX_CACHED_GUEST_RIP,
+	VMX_CACHED_GUEST_RSP,
+	VMX_CACHED_GUEST_RFLAGS,
+	VMX_CACHED_GUEST_CR0,
+	VMX_CACHED_GUEST_CR3,
+	VMX_CACHED_GUEST_CR4,
+	VMX_CACHED_GUEST_CS_ACCESS_RIGHTS,
+	VMX_CACHED_GUEST_INTERRUPTIBILITY_STATE,
+	VMX_CACHED_GUEST_PHYSICAL_ADDRESS,
+	VMX_CACHED_GUEST_VMX_PREEMPTION_TIMER_VALUE,
+	VMX_CACHED_CONTROL_CR0_READ_SHADOW,
+	VMX_CACHED_CONTROL_CR4_READ_SHADOW,
+	VMX_CACHED_CONTROL_VMENTRY_INTERRUPT_INFO,
+	VMX_CACHED_VM_EXIT_QUALIFICATION,
+	VMX_CACHED_VM_EXIT_INSTRUCTION_LEN,
+	VMX_CACHED_IDT_VECTORING_INFO,
+	VMX_CACHED_IDT_VECTORING_ERROR_CODE,
+	VMX_CACHED_FIELD_COUNT,
+	VMX_CACHED_NONE = VMX_CACHED_FIELD_COUNT
+} VMX_CACHED_FIELD, *PVMX_CACHED_FIELD;
+
+// A lazily populated copy of the cached VMCS fields, only valid for the duration of a single VM-exit.
+//
+// Bit N of `Valid` is set once slot N has been read or written, and of `Dirty` once it has been written
+// but not yet flushed to the VMCS. Outside of an exit the cache is inactive and accesses go straight to the VMCS
+typedef struct _VMX_FIELD_CACHE
+{
+	BOOLEAN Active;
+	UINT32 Valid;
+	UINT32 Dirty;
+	UINT64 Values[VMX_CACHED_FIELD_COUNT];
+} VMX_FIELD_CACHE, *PVMX_FIELD_CACHE;
+
 typedef struct _VMX_STATE
 {
 	VMX_EXIT_LOG_ENTRY ExitLog[256];
 	UINT64 ExitCount;
 	UINT64 GuestRip;
 	VMX_EXIT_REASON ExitReason;
+	VMX_FIELD_CACHE Cache;
 
 	struct
 	{
@@ -153,6 +210,9 @@ typedef struct _VMX_STATE
 		UINT32 VmEntryCtls;
 	} Controls;
 
+	// Bit N is set when control field N (VMX_CONTROL_FIELD) changed since it was last written to the VMCS
+	UINT32 DirtyControls;
+
 	struct
 	{
 		UINT64 PinbasedCtls;
@@ -169,9 +229,12 @@ typedef enum _VMX_CONTROL_FIELD
 	VMX_PRIM_PROCBASED_CTLS,
 	VMX_SEC_PROCBASED_CTLS,
 	VMX_EXIT_CTLS,
-	VMX_ENTRY_CTLS
+	VMX_ENTRY_CTLS,
+	VMX_CONTROL_FIELD_COUNT
 } VMX_CONTROL_FIELD, * PVMX_CONTROL_FIELD;
 
+#define VMX_ALL_CONTROL_FIELDS ((1UL << VMX_CONTROL_FIELD_COUNT) - 1)
+
 typedef enum _VMX_CR_ACCESS_TYPE
 {
 	CR_ACCESS_WRITE,
@@ -562,12 +625,41 @@ VmxWrite(
 	_In_ UINT64 Value
 );
 
+VOID
+VmxCacheBegin(
+	_Inout_ PVMX_STATE Vmx
+);
+
+VOID
+VmxCacheFlush(
+	_Inout_ PVMX_STATE Vmx
+);
+
+UINT64
+VmxCacheRead(
+	_Inout_ PVMX_STATE Vmx,
+	_In_ VMCS Component
+);
+
+VOID
+VmxCacheWrite(
+	_Inout_ PVMX_STATE Vmx,
+	_In_ VMCS Component,
+	_In_ UINT64 Value
+);
+
 VOID
 VmxInvvpid(
 	_In_ VMX_INVEPT_MODE InvMode,
 	_In_ UINT16 Vpid
 );
 
+VOID
+VmxInvvpidAddress(
+	_In_ UINT16 Vpid,
+	_In_ UINT64 LinearAddr
+);
+
 VOID
 VmxSetControl(
 	_Inout_ PVMX_STATE Vmx,
@@ -41,7 +41,7 @@ PVOID
 WinGetCurrentThread(VOID)
 {
 	PVOID Thread = NULL;
-	if (!NT_SUCCESS(MmReadGuestVirt(VmxRead(GUEST_CR3), RVA_PTR(WinGetGuestGs(), gCurrentThreadOffset), sizeof(PVOID), &Thread)))
+	if (!NT_SUCCESS(MmReadGuestVirt(VmxCacheRead(&VcpuGetActiveVcpu()->Vmx, GUEST_CR3), RVA_PTR(WinGetGuestGs(), gCurrentThreadOffset), sizeof(PVOID), &Thread)))
 		return NULL;
 
 	return Thread;
@@ -0,0 +1,132 @@
+#ifndef IMP_TEST_INTRIN_H
+#define IMP_TEST_INTRIN_H
+
+#include <ntdef.h>
+#include <x86intrin.h>
+
+#define _ReadWriteBarrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define _ReadBarrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define _WriteBarrier() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define YieldProcessor() _mm_pause()
+
+#define InterlockedIncrement(Target) __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target) __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64 InterlockedIncrement
+#define InterlockedDecrement64 InterlockedDecrement
+#define InterlockedIncrement16 InterlockedIncrement
+#define _InterlockedIncrement16 InterlockedIncrement
+#define InterlockedExchange(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange8 InterlockedExchange
+#define InterlockedExchange16 InterlockedExchange
+#define InterlockedExchange64 InterlockedExchange
+#define InterlockedExchangePointer InterlockedExchange
+#define InterlockedExchangeAdd(Target, Value) __atomic_fetch_add((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64 InterlockedExchangeAdd
+#define InterlockedAdd(Target, Value) __atomic_add_fetch((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64 InterlockedAdd
+#define InterlockedOr(Target, Value) __atomic_fetch_or((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedOr64 InterlockedOr
+#define InterlockedAnd(Target, Value) __atomic_fetch_and((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAnd64 InterlockedAnd
+#define InterlockedBitTestAndSet64(Target, Bit) \
+	((__atomic_fetch_or((Target), 1LL << (Bit), __ATOMIC_SEQ_CST) >> (Bit)) & 1)
+#define InterlockedBitTestAndReset64(Target, Bit) \
+	((__atomic_fetch_and((Target), ~(1LL << (Bit)), __ATOMIC_SEQ_CST) >> (Bit)) & 1)
+
+#define InterlockedCompareExchange(Target, Exchange, Comparand) \
+	ShimCompareExchange32((volatile LONG*)(Target), (Exchange), (Comparand))
+#define InterlockedCompareExchange64(Target, Exchange, Comparand) \
+	ShimCompareExchange64((volatile LONG64*)(Target), (Exchange), (Comparand))
+#define InterlockedCompareExchangePointer(Target, Exchange, Comparand) \
+	ShimCompareExchangePointer((PVOID volatile*)(Target), (Exchange), (Comparand))
+
+static inline LONG
+ShimCompareExchange32(volatile LONG* Target, LONG Exchange, LONG Comparand)
+{
+	__atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+static inline LONG64
+ShimCompareExchange64(volatile LONG64* Target, LONG64 Exchange, LONG64 Comparand)
+{
+	__atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+static inline PVOID
+ShimCompareExchangePointer(PVOID volatile* Target, PVOID Exchange, PVOID Comparand)
+{
+	__atomic_compare_exchange_n(Target, &Comparand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+static inline BOOLEAN
+_BitScanForward64(PULONG Index, UINT64 Mask)
+{
+	if (Mask == 0)
+		return FALSE;
+
+	*Index = (ULONG)__builtin_ctzll(Mask);
+	return TRUE;
+}
+
+static inline BOOLEAN
+_BitScanReverse64(PULONG Index, UINT64 Mask)
+{
+	if (Mask == 0)
+		return FALSE;
+
+	*Index = 63 - (ULONG)__builtin_clzll(Mask);
+	return TRUE;
+}
+
+static inline BOOLEAN
+_BitScanForward(PULONG Index, ULONG Mask)
+{
+	return _BitScanForward64(Index, Mask);
+}
+
+#define __popcnt64(Value) ((UINT64)__builtin_popcountll(Value))
+#define _tzcnt_u32(Value) ((UINT32)__builtin_ctz(Value))
+
+// Privileged instructions are only declared, the code under test that executes them is never linked in, except
+// for VMREAD and VMWRITE which operate on a simulated VMCS in shim.c
+
+UINT64 __readcr0(VOID);
+UINT64 __readcr3(VOID);
+UINT64 __readcr4(VOID);
+VOID __writecr0(UINT64 Value);
+VOID __writecr3(UINT64 Value);
+VOID __writecr4(UINT64 Value);
+UINT64 __readdr(UINT32 Register);
+VOID __writedr(UINT32 Register, UINT64 Value);
+VOID __sidt(PVOID Idtr);
+VOID __lidt(PVOID Idtr);
+ULONG __segmentlimit(ULONG Selector);
+PVOID _AddressOfReturnAddress(VOID);
+VOID __debugbreak(VOID);
+VOID __cpuidex(INT32 Info[4], INT32 Leaf, INT32 Subleaf);
+UCHAR __vmx_on(PUINT64 VmxonPhysAddr);
+VOID __vmx_off(VOID);
+UCHAR __vmx_vmclear(PUINT64 VmcsPhysAddr);
+UCHAR __vmx_vmptrld(PUINT64 VmcsPhysAddr);
+UCHAR __vmx_vmlaunch(VOID);
+UCHAR __vmx_vmresume(VOID);
+UCHAR __vmx_vmread(SIZE_T Field, PUINT64 Value);
+UCHAR __vmx_vmwrite(SIZE_T Field, UINT64 Value);
+
+// Model specific registers are served from a table the tests fill in
+UINT64
+__readmsr(
+	ULONG Msr
+);
+
+VOID
+__writemsr(
+	ULONG Msr,
+	UINT64 Value
+);
+
+#endif
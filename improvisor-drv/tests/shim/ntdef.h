@@ -0,0 +1,144 @@
+#ifndef IMP_TEST_NTDEF_H
+#define IMP_TEST_NTDEF_H
+
+// Just enough of the WDK for the platform independent parts of the driver to build as ordinary user-mode code
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define VOID void
+typedef char CHAR;
+typedef unsigned char UCHAR;
+typedef short SHORT;
+typedef unsigned short USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int64_t LONG64;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONG64;
+typedef uint64_t ULONGLONG;
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef ptrdiff_t SSIZE_T;
+typedef UCHAR BOOLEAN;
+typedef LONG NTSTATUS;
+
+typedef VOID* PVOID;
+typedef CHAR* PCHAR;
+typedef UCHAR* PUCHAR;
+typedef LONG* PLONG;
+typedef ULONG* PULONG;
+typedef UINT8* PUINT8;
+typedef UINT16* PUINT16;
+typedef UINT32* PUINT32;
+typedef UINT64* PUINT64;
+typedef SIZE_T* PSIZE_T;
+typedef BOOLEAN* PBOOLEAN;
+typedef CHAR* PSTR;
+typedef const CHAR* PCSTR;
+typedef const CHAR* LPCSTR;
+
+typedef union _LARGE_INTEGER
+{
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+
+typedef struct _LIST_ENTRY
+{
+	struct _LIST_ENTRY* Flink;
+	struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define TRUE 1
+#define FALSE 0
+
+#define NT_SUCCESS(Status) ((NTSTATUS)(Status) >= 0)
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_INVALID_BUFFER_SIZE ((NTSTATUS)0xC0000206L)
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#define STATUS_CONFLICTING_ADDRESSES ((NTSTATUS)0xC0000018L)
+#define STATUS_NO_MEMORY ((NTSTATUS)0xC0000017L)
+#define STATUS_INVALID_ADDRESS ((NTSTATUS)0xC0000141L)
+#define STATUS_NO_MORE_ENTRIES ((NTSTATUS)0x8000001AL)
+
+#define MAXUINT64 UINT64_MAX
+
+#define PAGE_SIZE 0x1000
+#define BYTES_TO_PAGES(Size) (((Size) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+#define FIELD_OFFSET(Type, Field) offsetof(Type, Field)
+#define C_ASSERT(Expr) _Static_assert(Expr, #Expr)
+#define UNREFERENCED_PARAMETER(P) ((VOID)(P))
+#define CONTAINING_RECORD(Address, Type, Field) ((Type*)((PCHAR)(Address) - offsetof(Type, Field)))
+
+#ifndef min
+#define min(A, B) (((A) < (B)) ? (A) : (B))
+#endif
+#ifndef max
+#define max(A, B) (((A) > (B)) ? (A) : (B))
+#endif
+
+#define DECLSPEC_ALIGN(N) __attribute__((aligned(N)))
+#define DECLSPEC_NOINLINE __attribute__((noinline))
+#define __declspec(X)
+#define DECLSPEC_NORETURN __attribute__((noreturn))
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define EXTERN_C extern
+#define NTAPI
+
+// SAL annotations
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _In_reads_(N)
+#define _In_reads_bytes_(N)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(N)
+#define _Out_writes_bytes_(N)
+#define _Inout_
+#define _Inout_opt_
+#define _Inout_updates_(N)
+#define _Printf_format_string_
+#define _Must_inspect_result_
+#define _IRQL_requires_max_(Irql)
+
+#define RtlZeroMemory(Dest, Size) memset((Dest), 0, (Size))
+#define RtlCopyMemory(Dest, Src, Size) memcpy((Dest), (Src), (Size))
+#define RtlMoveMemory(Dest, Src, Size) memmove((Dest), (Src), (Size))
+#define RtlFillMemory(Dest, Size, Fill) memset((Dest), (Fill), (Size))
+#define RtlCompareMemory(A, B, Size) ShimCompareMemory((A), (B), (Size))
+
+static inline SIZE_T
+ShimCompareMemory(
+	const VOID* A,
+	const VOID* B,
+	SIZE_T Size
+)
+{
+	SIZE_T i = 0;
+	while (i < Size && ((const UCHAR*)A)[i] == ((const UCHAR*)B)[i])
+		i++;
+
+	return i;
+}
+
+#endif
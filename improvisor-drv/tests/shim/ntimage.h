@@ -0,0 +1,42 @@
+#ifndef IMP_TEST_NTIMAGE_H
+#define IMP_TEST_NTIMAGE_H
+
+#include <ntdef.h>
+
+// PE images are never parsed by the tests, these only have to declare what the headers reference
+
+typedef struct _IMAGE_SECTION_HEADER
+{
+	UCHAR Name[8];
+	ULONG VirtualSize;
+	ULONG VirtualAddress;
+	ULONG SizeOfRawData;
+	ULONG PointerToRawData;
+	ULONG PointerToRelocations;
+	ULONG PointerToLinenumbers;
+	USHORT NumberOfRelocations;
+	USHORT NumberOfLinenumbers;
+	ULONG Characteristics;
+} IMAGE_SECTION_HEADER, *PIMAGE_SECTION_HEADER;
+
+// Only the fields read by the code under test, shim.c provides an image made of just these headers
+
+typedef struct _IMAGE_DOS_HEADER
+{
+	USHORT e_magic;
+	USHORT e_reserved[29];
+	LONG e_lfanew;
+} IMAGE_DOS_HEADER, *PIMAGE_DOS_HEADER;
+
+typedef struct _IMAGE_OPTIONAL_HEADER64
+{
+	ULONG SizeOfImage;
+} IMAGE_OPTIONAL_HEADER64, *PIMAGE_OPTIONAL_HEADER64;
+
+typedef struct _IMAGE_NT_HEADERS64
+{
+	ULONG Signature;
+	IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+} IMAGE_NT_HEADERS64, *PIMAGE_NT_HEADERS;
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef IMP_SECTION_H
+#define IMP_SECTION_H
+
+#include <ntdef.h>
+
+// Section placement only matters inside the driver image
+#define VMM_API DECLSPEC_NOINLINE
+#define VSC_API DECLSPEC_NOINLINE
+#define VMM_DATA
+#define VMM_SDATA
+#define VMM_RDATA
+
+#endif
@@ -0,0 +1,413 @@
+#include <improvisor.h>
+#include <ntimage.h>
+#include <stdio.h>
+
+// Only a handful of MSRs are ever read by a test, a linear table is enough
+#define SHIM_MAX_MSRS 64
+
+typedef struct _SHIM_MSR
+{
+	ULONG Msr;
+	UINT64 Value;
+} SHIM_MSR, *PSHIM_MSR;
+
+static SHIM_MSR sMsrs[SHIM_MAX_MSRS];
+static SIZE_T sMsrCount = 0;
+
+static _Thread_local ULONG sProcessorNumber = 0;
+
+// Field encodings are all below 0x8000, each thread has its own VMCS like each processor would
+#define SHIM_VMCS_FIELD_COUNT 0x8000
+
+static _Thread_local UINT64 sVmcs[SHIM_VMCS_FIELD_COUNT];
+
+_Thread_local UINT64 gShimVmreadCount = 0;
+_Thread_local UINT64 gShimVmwriteCount = 0;
+
+// TSC ticks every VMWRITE is charged, see ShimSetVmwriteCost
+static UINT64 sVmwriteCost = 0;
+
+static SHIM_INVEPT_HOOK sInveptHook = NULL;
+static SHIM_WRMSR_HOOK sWrmsrHook = NULL;
+
+// The driver image is only ever used as the base of log format IDs and for its size
+static struct
+{
+	IMAGE_DOS_HEADER DosHeader;
+	IMAGE_NT_HEADERS64 NtHeaders;
+} sShimImage = {
+	.DosHeader.e_lfanew = sizeof(IMAGE_DOS_HEADER),
+	.NtHeaders.OptionalHeader.SizeOfImage = sizeof(sShimImage)
+};
+
+extern IMAGE_DOS_HEADER __ImageBase __attribute__((alias("sShimImage")));
+
+static PHYSICAL_MEMORY_RANGE sPhysMemRanges[64];
+static SIZE_T sPhysMemRangeCount = 0;
+
+PIMP_ALLOC_RECORD gHostAllocationsHead = NULL;
+
+UINT64
+__readmsr(
+	ULONG Msr
+)
+{
+	for (SIZE_T i = 0; i < sMsrCount; i++)
+	{
+		if (sMsrs[i].Msr == Msr)
+			return sMsrs[i].Value;
+	}
+
+	return 0;
+}
+
+VOID
+__writemsr(
+	ULONG Msr,
+	UINT64 Value
+)
+{
+	ShimSetMsr(Msr, Value);
+
+	if (sWrmsrHook != NULL)
+		sWrmsrHook(Msr, Value);
+}
+
+VOID
+ShimSetWrmsrHook(
+	SHIM_WRMSR_HOOK Hook
+)
+{
+	sWrmsrHook = Hook;
+}
+
+VOID
+ShimSetMsr(
+	ULONG Msr,
+	UINT64 Value
+)
+{
+	for (SIZE_T i = 0; i < sMsrCount; i++)
+	{
+		if (sMsrs[i].Msr == Msr)
+		{
+			sMsrs[i].Value = Value;
+			return;
+		}
+	}
+
+	if (sMsrCount < SHIM_MAX_MSRS)
+		sMsrs[sMsrCount++] = (SHIM_MSR){ Msr, Value };
+}
+
+VOID
+ShimResetMsrs(VOID)
+{
+	sMsrCount = 0;
+}
+
+UCHAR
+__vmx_vmread(
+	SIZE_T Field,
+	PUINT64 Value
+)
+{
+	gShimVmreadCount++;
+
+	*Value = sVmcs[Field % SHIM_VMCS_FIELD_COUNT];
+	return 0;
+}
+
+UCHAR
+__vmx_vmwrite(
+	SIZE_T Field,
+	UINT64 Value
+)
+{
+	gShimVmwriteCount++;
+
+	if (sVmwriteCost != 0)
+	{
+		const UINT64 End = __rdtsc() + sVmwriteCost;
+		while (__rdtsc() < End)
+			;
+	}
+
+	sVmcs[Field % SHIM_VMCS_FIELD_COUNT] = Value;
+	return 0;
+}
+
+VOID
+ShimSetVmwriteCost(
+	UINT64 Ticks
+)
+{
+	sVmwriteCost = Ticks;
+}
+
+UINT64
+ShimReadVmcs(
+	SIZE_T Field
+)
+{
+	return sVmcs[Field % SHIM_VMCS_FIELD_COUNT];
+}
+
+VOID
+ShimWriteVmcs(
+	SIZE_T Field,
+	UINT64 Value
+)
+{
+	sVmcs[Field % SHIM_VMCS_FIELD_COUNT] = Value;
+}
+
+VOID
+__invept(
+	UINT64 Type,
+	PVOID Descriptor
+)
+{
+	if (sInveptHook != NULL)
+		sInveptHook(Type, Descriptor);
+}
+
+VOID
+ShimSetInveptHook(
+	SHIM_INVEPT_HOOK Hook
+)
+{
+	sInveptHook = Hook;
+}
+
+ULONG
+KeGetCurrentProcessorNumber(VOID)
+{
+	return sProcessorNumber;
+}
+
+ULONG
+KeQueryActiveProcessorCount(
+	PVOID Affinity
+)
+{
+	UNREFERENCED_PARAMETER(Affinity);
+	return 64;
+}
+
+ULONG
+KeQueryActiveProcessorCountEx(
+	USHORT GroupNumber
+)
+{
+	UNREFERENCED_PARAMETER(GroupNumber);
+	return 64;
+}
+
+VOID
+ShimSetProcessorNumber(
+	ULONG Number
+)
+{
+	sProcessorNumber = Number;
+}
+
+PVOID
+ExAllocatePoolWithTag(
+	POOL_TYPE Type,
+	SIZE_T Size,
+	ULONG Tag
+)
+{
+	UNREFERENCED_PARAMETER(Type);
+	UNREFERENCED_PARAMETER(Tag);
+
+	return calloc(1, Size);
+}
+
+VOID
+ExFreePoolWithTag(
+	PVOID Memory,
+	ULONG Tag
+)
+{
+	UNREFERENCED_PARAMETER(Tag);
+	free(Memory);
+}
+
+VOID
+ExFreePool(
+	PVOID Memory
+)
+{
+	free(Memory);
+}
+
+VOID
+ShimSetPhysicalMemoryRanges(
+	const PHYSICAL_MEMORY_RANGE* Ranges,
+	SIZE_T Count
+)
+{
+	sPhysMemRangeCount = min(Count, sizeof(sPhysMemRanges) / sizeof(*sPhysMemRanges) - 1);
+	memcpy(sPhysMemRanges, Ranges, sPhysMemRangeCount * sizeof(*Ranges));
+}
+
+PPHYSICAL_MEMORY_RANGE
+MmGetPhysicalMemoryRanges(VOID)
+{
+	// Terminated by a zeroed range, the same as the real one
+	PPHYSICAL_MEMORY_RANGE Ranges = calloc(sPhysMemRangeCount + 1, sizeof(PHYSICAL_MEMORY_RANGE));
+	if (Ranges != NULL)
+		memcpy(Ranges, sPhysMemRanges, sPhysMemRangeCount * sizeof(*Ranges));
+
+	return Ranges;
+}
+
+VOID
+RtlInitializeBitMap(
+	PRTL_BITMAP BitMap,
+	PULONG Buffer,
+	ULONG Size
+)
+{
+	BitMap->Buffer = Buffer;
+	BitMap->SizeOfBitMap = Size;
+}
+
+VOID
+RtlSetBit(
+	PRTL_BITMAP BitMap,
+	ULONG Bit
+)
+{
+	BitMap->Buffer[Bit / 32] |= 1U << (Bit % 32);
+}
+
+VOID
+RtlClearBit(
+	PRTL_BITMAP BitMap,
+	ULONG Bit
+)
+{
+	BitMap->Buffer[Bit / 32] &= ~(1U << (Bit % 32));
+}
+
+BOOLEAN
+RtlTestBit(
+	PRTL_BITMAP BitMap,
+	ULONG Bit
+)
+{
+	return (BitMap->Buffer[Bit / 32] >> (Bit % 32)) & 1;
+}
+
+VOID
+RtlSetBits(
+	PRTL_BITMAP BitMap,
+	ULONG Start,
+	ULONG Count
+)
+{
+	for (ULONG i = Start; i < Start + Count; i++)
+		RtlSetBit(BitMap, i);
+}
+
+VOID
+RtlClearBits(
+	PRTL_BITMAP BitMap,
+	ULONG Start,
+	ULONG Count
+)
+{
+	for (ULONG i = Start; i < Start + Count; i++)
+		RtlClearBit(BitMap, i);
+}
+
+PVOID
+ImpAllocateNpPoolEx(
+	_In_ SIZE_T Size,
+	_In_ UINT64 Flags
+)
+{
+	UNREFERENCED_PARAMETER(Flags);
+
+	// Everything is page aligned, as reserved page tables are carved out of pool allocations
+	PVOID Memory = aligned_alloc(PAGE_SIZE, (Size + PAGE_SIZE - 1) & ~(SIZE_T)(PAGE_SIZE - 1));
+	if (Memory != NULL)
+		memset(Memory, 0, Size);
+
+	return Memory;
+}
+
+PVOID
+ImpAllocateNpPool(
+	_In_ SIZE_T Size
+)
+{
+	return ImpAllocateNpPoolEx(Size, IMP_DEFAULT);
+}
+
+PVOID
+ImpAllocateHostNpPool(
+	_In_ SIZE_T Size
+)
+{
+	return ImpAllocateNpPoolEx(Size, IMP_HOST_ALLOCATION);
+}
+
+PVOID
+ImpAllocateContiguousMemoryEx(
+	_In_ SIZE_T Size,
+	_In_ UINT64 Flags
+)
+{
+	return ImpAllocateNpPoolEx(Size, Flags);
+}
+
+PVOID
+ImpAllocateContiguousMemory(
+	_In_ SIZE_T Size
+)
+{
+	return ImpAllocateContiguousMemoryEx(Size, IMP_DEFAULT);
+}
+
+PVOID
+ImpAllocateHostContiguousMemory(
+	_In_ SIZE_T Size
+)
+{
+	return ImpAllocateContiguousMemoryEx(Size, IMP_HOST_ALLOCATION);
+}
+
+VOID
+ImpFreeAllocation(
+	_In_ PVOID Memory
+)
+{
+	free(Memory);
+}
+
+UINT64
+ImpGetPhysicalAddress(
+	_In_ PVOID Address
+)
+{
+	// User-mode has no physical addresses, the virtual address stands in for one
+	return (UINT64)Address;
+}
+
+VOID
+ImpDebugPrint(
+	_In_ PCSTR Str, ...
+)
+{
+	if (getenv("IMP_TEST_VERBOSE") == NULL)
+		return;
+
+	va_list Args;
+	va_start(Args, Str);
+	vprintf(Str, Args);
+	va_end(Args);
+}
@@ -0,0 +1,279 @@
+#ifndef IMP_TEST_SHIM_H
+#define IMP_TEST_SHIM_H
+
+#include <ntdef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+// Kernel services used by the code under test, implemented in shim.c on top of the C runtime
+
+typedef enum _POOL_TYPE
+{
+	NonPagedPool,
+	NonPagedPoolNx,
+	PagedPool
+} POOL_TYPE;
+
+typedef struct _PHYSICAL_MEMORY_RANGE
+{
+	LARGE_INTEGER BaseAddress;
+	LARGE_INTEGER NumberOfBytes;
+} PHYSICAL_MEMORY_RANGE, *PPHYSICAL_MEMORY_RANGE;
+
+typedef struct _MDL* PMDL;
+
+#define STATUS_ABANDONED ((NTSTATUS)0x00000080L)
+#define STATUS_APP_INIT_FAILURE ((NTSTATUS)0xC0000145L)
+
+#define EXCEPTION_DIVIDED_BY_ZERO 0
+#define EXCEPTION_DEBUG 1
+#define EXCEPTION_NMI 2
+#define EXCEPTION_INT3 3
+#define EXCEPTION_BOUND_CHECK 5
+#define EXCEPTION_INVALID_OPCODE 6
+#define EXCEPTION_NPX_NOT_AVAILABLE 7
+#define EXCEPTION_DOUBLE_FAULT 8
+#define EXCEPTION_NPX_OVERRUN 9
+#define EXCEPTION_INVALID_TSS 0x0A
+#define EXCEPTION_SEGMENT_NOT_PRESENT 0x0B
+#define EXCEPTION_STACK_FAULT 0x0C
+#define EXCEPTION_GP_FAULT 0x0D
+#define EXCEPTION_RESERVED_TRAP 0x0F
+#define EXCEPTION_NPX_ERROR 0x10
+#define EXCEPTION_ALIGNMENT_CHECK 0x11
+
+typedef struct _RTL_BITMAP
+{
+	ULONG SizeOfBitMap;
+	PULONG Buffer;
+} RTL_BITMAP, *PRTL_BITMAP;
+
+PVOID
+ExAllocatePoolWithTag(
+	POOL_TYPE Type,
+	SIZE_T Size,
+	ULONG Tag
+);
+
+VOID
+ExFreePoolWithTag(
+	PVOID Memory,
+	ULONG Tag
+);
+
+VOID
+ExFreePool(
+	PVOID Memory
+);
+
+PPHYSICAL_MEMORY_RANGE
+MmGetPhysicalMemoryRanges(VOID);
+
+PVOID
+MmGetVirtualForPhysical(
+	PHYSICAL_ADDRESS PhysAddr
+);
+
+static inline VOID
+InitializeListHead(
+	PLIST_ENTRY Head
+)
+{
+	Head->Flink = Head->Blink = Head;
+}
+
+static inline BOOLEAN
+IsListEmpty(
+	const LIST_ENTRY* Head
+)
+{
+	return Head->Flink == Head;
+}
+
+static inline BOOLEAN
+RemoveEntryList(
+	PLIST_ENTRY Entry
+)
+{
+	PLIST_ENTRY Flink = Entry->Flink;
+	PLIST_ENTRY Blink = Entry->Blink;
+
+	Blink->Flink = Flink;
+	Flink->Blink = Blink;
+
+	return Flink == Blink;
+}
+
+static inline PLIST_ENTRY
+RemoveHeadList(
+	PLIST_ENTRY Head
+)
+{
+	PLIST_ENTRY Entry = Head->Flink;
+	RemoveEntryList(Entry);
+
+	return Entry;
+}
+
+static inline VOID
+InsertTailList(
+	PLIST_ENTRY Head,
+	PLIST_ENTRY Entry
+)
+{
+	Entry->Flink = Head;
+	Entry->Blink = Head->Blink;
+	Head->Blink->Flink = Entry;
+	Head->Blink = Entry;
+}
+
+static inline VOID
+InsertHeadList(
+	PLIST_ENTRY Head,
+	PLIST_ENTRY Entry
+)
+{
+	Entry->Flink = Head->Flink;
+	Entry->Blink = Head;
+	Head->Flink->Blink = Entry;
+	Head->Flink = Entry;
+}
+
+// User-mode code can't be interrupted by anything that logs, so raising the IRQL has nothing to do
+
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define HIGH_LEVEL 15
+
+static inline VOID
+KeRaiseIrql(
+	KIRQL NewIrql,
+	PKIRQL OldIrql
+)
+{
+	UNREFERENCED_PARAMETER(NewIrql);
+	*OldIrql = 0;
+}
+
+static inline VOID
+KeLowerIrql(
+	KIRQL NewIrql
+)
+{
+	UNREFERENCED_PARAMETER(NewIrql);
+}
+
+ULONG
+KeGetCurrentProcessorNumber(VOID);
+
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+
+ULONG
+KeQueryActiveProcessorCount(
+	PVOID Affinity
+);
+
+ULONG
+KeQueryActiveProcessorCountEx(
+	USHORT GroupNumber
+);
+
+VOID
+RtlInitializeBitMap(
+	PRTL_BITMAP BitMap,
+	PULONG Buffer,
+	ULONG Size
+);
+
+VOID
+RtlSetBits(
+	PRTL_BITMAP BitMap,
+	ULONG Start,
+	ULONG Count
+);
+
+VOID
+RtlClearBits(
+	PRTL_BITMAP BitMap,
+	ULONG Start,
+	ULONG Count
+);
+
+VOID
+RtlSetBit(
+	PRTL_BITMAP BitMap,
+	ULONG Bit
+);
+
+VOID
+RtlClearBit(
+	PRTL_BITMAP BitMap,
+	ULONG Bit
+);
+
+BOOLEAN
+RtlTestBit(
+	PRTL_BITMAP BitMap,
+	ULONG Bit
+);
+
+// Test controls
+
+VOID
+ShimSetMsr(
+	ULONG Msr,
+	UINT64 Value
+);
+
+VOID
+ShimResetMsrs(VOID);
+
+// Called for every WRMSR executed after the MSR is updated, writes to registers like the x2APIC ICR act through it
+typedef VOID(*SHIM_WRMSR_HOOK)(ULONG Msr, UINT64 Value);
+
+VOID
+ShimSetWrmsrHook(
+	SHIM_WRMSR_HOOK Hook
+);
+
+VOID
+ShimSetProcessorNumber(
+	ULONG Number
+);
+
+// Counts of VMREADs and VMWRITEs executed against the simulated VMCS
+extern _Thread_local UINT64 gShimVmreadCount;
+extern _Thread_local UINT64 gShimVmwriteCount;
+
+// Makes every VMWRITE spin for `Ticks` TSC ticks, so benchmarks pay for them like on hardware
+VOID
+ShimSetVmwriteCost(
+	UINT64 Ticks
+);
+
+UINT64
+ShimReadVmcs(
+	SIZE_T Field
+);
+
+VOID
+ShimWriteVmcs(
+	SIZE_T Field,
+	UINT64 Value
+);
+
+// Called for every INVEPT executed, on the thread that executed it
+typedef VOID(*SHIM_INVEPT_HOOK)(UINT64 Type, PVOID Descriptor);
+
+VOID
+ShimSetInveptHook(
+	SHIM_INVEPT_HOOK Hook
+);
+
+VOID
+ShimSetPhysicalMemoryRanges(
+	const PHYSICAL_MEMORY_RANGE* Ranges,
+	SIZE_T Count
+);
+
+#endif
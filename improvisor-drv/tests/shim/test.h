@@ -0,0 +1,41 @@
+#ifndef IMP_TEST_TEST_H
+#define IMP_TEST_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Minimal assertion helpers shared by the host tests, a failed check reports its location and exits
+
+#define TEST_CHECK(Expr) \
+	do \
+	{ \
+		if (!(Expr)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #Expr); \
+			exit(1); \
+		} \
+	} while (0)
+
+#define TEST_CHECK_EQ(Actual, Expected) \
+	do \
+	{ \
+		const unsigned long long _Actual = (unsigned long long)(Actual); \
+		const unsigned long long _Expected = (unsigned long long)(Expected); \
+		if (_Actual != _Expected) \
+		{ \
+			fprintf(stderr, "%s:%d: %s is %llX, expected %llX\n", __FILE__, __LINE__, #Actual, _Actual, _Expected); \
+			exit(1); \
+		} \
+	} while (0)
+
+static inline double
+TestNow(void)
+{
+	struct timespec Now;
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+
+	return Now.tv_sec + Now.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,3 @@
+#include <ntdef.h>
+#include <intrin.h>
+#include <shim.h>
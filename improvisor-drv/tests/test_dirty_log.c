@@ -0,0 +1,366 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <arch/apic.h>
+#include <arch/msr.h>
+#include <arch/mtrr.h>
+#include <mm/mm.h>
+#include <mm/vpte.h>
+#include <vcpu/vcpu.h>
+#include <ept.h>
+#include <vmm.h>
+#include <vmx.h>
+
+#include <test.h>
+
+// Model of dirty page logging: a few simulated VCPUs write to guest memory the way a processor with EPT dirty
+// flags and page-modification logging does. The first write through a translation without the dirty flag set sets
+// it and appends the page to the VCPU's log, a full log ends in a VM-exit that drains it, and the translation is
+// kept in a TLB of its own that only the INVEPT executed on that VCPU clears. Writes through a cached translation
+// whose dirty flag was set aren't logged again. Dirty page queries are made from random VCPUs, and check that:
+//
+//  - every page written to since the last query of it is reported, whichever VCPU wrote it and whether its log
+//    entry was still in that VCPU's log
+//  - once a query returns, no VCPU still holds a translation with a dirty flag it just cleared
+//
+// NMIs sent through the x2APIC are taken right away, the way a VCPU running the guest would
+
+#define MODEL_CPU_COUNT 4
+#define MODEL_APIC_ID(Cpu) ((Cpu) * 2 + 1)
+#define MODEL_RAM_BASE GB(1)
+#define MODEL_RAM_SIZE MB(64)
+// Writes stay in a few thousand pages so they keep hitting cached translations
+#define MODEL_SPAN MB(16)
+#define MODEL_TLB_SIZE 256
+// Largest range a single query covers
+#define MODEL_MAX_QUERY_PAGES 0x400
+
+#define MODEL_SPAN_PAGES (MODEL_SPAN / PAGE_SIZE)
+
+typedef struct _MODEL_CPU
+{
+	// Guest pages whose translation was cached with the dirty flag set, 0 if none
+	UINT64 DirtyTlb[MODEL_TLB_SIZE];
+	UINT16 PmlIndex;
+	UINT64 PmlFullExits;
+} MODEL_CPU, *PMODEL_CPU;
+
+static VMM_CONTEXT sVmm;
+static VCPU sVcpus[MODEL_CPU_COUNT];
+static MODEL_CPU sCpus[MODEL_CPU_COUNT];
+
+// Pages written to since they were last reported
+static UINT64 sWritten[MODEL_SPAN_PAGES / 64];
+
+static UINT64 sNmiCount = 0;
+
+// Every IPI is sent through the x2APIC
+
+NTSTATUS
+MmAllocateVpte(
+	_Out_ PMM_VPTE* pVpte
+)
+{
+	*pVpte = NULL;
+
+	TEST_CHECK(FALSE);
+	return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+MmMapGuestPhys(
+	_Inout_ PMM_VPTE Vpte,
+	_In_ UINT64 PhysAddr
+)
+{
+	UNREFERENCED_PARAMETER(Vpte);
+	UNREFERENCED_PARAMETER(PhysAddr);
+}
+
+static UINT64
+NextRandom(
+	_Inout_ PUINT64 State
+)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+
+	return *State;
+}
+
+static VOID
+ModelInvept(
+	_In_ UINT64 Type,
+	_In_ PVOID Descriptor
+)
+/*++
+Routine Description:
+	Drops every translation the current processor has cached
+--*/
+{
+	UNREFERENCED_PARAMETER(Descriptor);
+
+	TEST_CHECK_EQ(Type, INV_ALL_CONTEXT);
+
+	RtlZeroMemory(sCpus[KeGetCurrentProcessorNumber()].DirtyTlb, sizeof(sCpus[0].DirtyTlb));
+}
+
+static VOID
+ModelWrmsr(
+	_In_ ULONG Msr,
+	_In_ UINT64 Value
+)
+/*++
+Routine Description:
+	Delivers an NMI sent through the x2APIC interrupt command register to the VCPU with the destination APIC ID,
+	which takes it before the sender's next instruction
+--*/
+{
+	if (Msr != IA32_X2APIC_ICR)
+		return;
+
+	APIC_ICR Icr = {
+		.Value = Value
+	};
+
+	TEST_CHECK_EQ(Icr.DeliveryMode, APIC_DELIVERY_NMI);
+
+	const ULONG Sender = KeGetCurrentProcessorNumber();
+
+	for (ULONG i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		if (MODEL_APIC_ID(i) != Icr.Destination)
+			continue;
+
+		TEST_CHECK(i != Sender);
+
+		ShimSetProcessorNumber(i);
+		TEST_CHECK(VcpuHandleEptFlushNmi(&sVcpus[i]));
+		ShimSetProcessorNumber(Sender);
+
+		sNmiCount++;
+		return;
+	}
+
+	TEST_CHECK(FALSE);
+}
+
+static VOID
+LoadPmlIndex(
+	_In_ ULONG CpuIndex
+)
+/*++
+Routine Description:
+	Switches to a VCPU for a VM-exit, the VMCS only holds the log index of the VCPU that is exiting
+--*/
+{
+	ShimSetProcessorNumber(CpuIndex);
+	ShimWriteVmcs(GUEST_PML_INDEX, sCpus[CpuIndex].PmlIndex);
+}
+
+static VOID
+StorePmlIndex(
+	_In_ ULONG CpuIndex
+)
+{
+	sCpus[CpuIndex].PmlIndex = (UINT16)ShimReadVmcs(GUEST_PML_INDEX);
+}
+
+static VOID
+GuestWrite(
+	_In_ ULONG CpuIndex,
+	_In_ UINT64 GuestPhysAddr
+)
+/*++
+Routine Description:
+	Writes to a page the way the processor would, logging it only if the translation used didn't have the dirty
+	flag set already
+--*/
+{
+	PMODEL_CPU Cpu = &sCpus[CpuIndex];
+
+	const UINT64 Pfn = PAGE_FRAME_NUMBER(GuestPhysAddr - MODEL_RAM_BASE);
+	sWritten[Pfn / 64] |= 1ULL << (Pfn % 64);
+
+	PUINT64 TlbEntry = &Cpu->DirtyTlb[PAGE_FRAME_NUMBER(GuestPhysAddr) % MODEL_TLB_SIZE];
+	if (*TlbEntry == GuestPhysAddr)
+		return;
+
+	UINT64 LeafSize = 0;
+	PEPT_PTE Leaf = EptGetLeafPte(sVmm.Ept.Views[EPT_VIEW_DEFAULT].Pml4, GuestPhysAddr, &LeafSize);
+	TEST_CHECK(Leaf != NULL);
+	TEST_CHECK_EQ(LeafSize, PAGE_SIZE);
+
+	if (!Leaf->Dirty)
+	{
+		// A full log exits before the write, which is retried once the log is drained
+		if (Cpu->PmlIndex >= EPT_PML_ENTRY_COUNT)
+		{
+			LoadPmlIndex(CpuIndex);
+			VcpuDrainPml(&sVcpus[CpuIndex]);
+			VcpuCommitEptInvalidation(&sVcpus[CpuIndex]);
+			StorePmlIndex(CpuIndex);
+
+			TEST_CHECK_EQ(Cpu->PmlIndex, EPT_PML_ENTRY_COUNT - 1);
+			Cpu->PmlFullExits++;
+		}
+
+		Leaf->Accessed = TRUE;
+		Leaf->Dirty = TRUE;
+
+		sVcpus[CpuIndex].PmlBuffer[Cpu->PmlIndex--] = GuestPhysAddr;
+	}
+
+	*TlbEntry = GuestPhysAddr;
+}
+
+static VOID
+Query(
+	_In_ ULONG CpuIndex,
+	_In_ UINT64 FirstPage,
+	_In_ UINT64 PageCount,
+	_Inout_ PUINT64 Reported
+)
+/*++
+Routine Description:
+	Queries the dirty pages of a range from a VM-exit on a VCPU, the same way HYPERCALL_GET_DIRTY_PAGES does, and
+	checks every page written to is reported
+--*/
+{
+	static UINT64 Bitmap[MODEL_MAX_QUERY_PAGES / 64];
+
+	LoadPmlIndex(CpuIndex);
+	VcpuCollectDirtyPages(&sVcpus[CpuIndex], MODEL_RAM_BASE + FirstPage * PAGE_SIZE, PageCount, Bitmap);
+	VcpuCommitEptInvalidation(&sVcpus[CpuIndex]);
+	StorePmlIndex(CpuIndex);
+
+	for (UINT64 i = 0; i < PageCount; i++)
+	{
+		const UINT64 Pfn = FirstPage + i;
+		const BOOLEAN Written = (sWritten[Pfn / 64] & (1ULL << (Pfn % 64))) != 0;
+		const BOOLEAN Dirty = (Bitmap[i / 64] & (1ULL << (i % 64))) != 0;
+
+		TEST_CHECK(!Written || Dirty);
+
+		sWritten[Pfn / 64] &= ~(1ULL << (Pfn % 64));
+		*Reported += Dirty;
+	}
+
+	// Nothing may write to a page the query just cleaned without logging it again
+	for (ULONG i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		for (SIZE_T j = 0; j < MODEL_TLB_SIZE; j++)
+		{
+			const UINT64 GuestPhysAddr = sCpus[i].DirtyTlb[j];
+			if (GuestPhysAddr == 0)
+				continue;
+
+			UINT64 LeafSize = 0;
+			PEPT_PTE Leaf = EptGetLeafPte(sVmm.Ept.Views[EPT_VIEW_DEFAULT].Pml4, GuestPhysAddr, &LeafSize);
+			TEST_CHECK(Leaf->Dirty);
+		}
+	}
+}
+
+int
+main(int argc, char** argv)
+{
+	const SIZE_T StepCount = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000;
+
+	IA32_MTRR_DEFAULT_TYPE_MSR DefaultType = {
+		.Type = MT_WRITEBACK,
+		.EnableMtrr = TRUE
+	};
+
+	// Only 4KB pages, so each page has a dirty flag of its own
+	IA32_VMX_EPT_VPID_CAP_MSR EptVpidCap = {
+		.AccessedDirtyFlagsSupport = TRUE
+	};
+
+	ShimSetMsr(IA32_MTRR_CAPABILITIES, 0);
+	ShimSetMsr(IA32_MTRR_DEFAULT_TYPE, DefaultType.Value);
+	ShimSetMsr(IA32_VMX_EPT_VPID_CAP, EptVpidCap.Value);
+
+	IA32_APIC_BASE_MSR ApicBase = {
+		.APICEnable = TRUE,
+		.X2APICMode = TRUE
+	};
+
+	ShimSetMsr(IA32_APIC_BASE, ApicBase.Value);
+
+	const PHYSICAL_MEMORY_RANGE Ram = {
+		.BaseAddress.QuadPart = MODEL_RAM_BASE,
+		.NumberOfBytes.QuadPart = MODEL_RAM_SIZE
+	};
+
+	ShimSetPhysicalMemoryRanges(&Ram, 1);
+	ShimSetInveptHook(ModelInvept);
+	ShimSetWrmsrHook(ModelWrmsr);
+
+	TEST_CHECK(NT_SUCCESS(MtrrInitialise()));
+	TEST_CHECK(NT_SUCCESS(MmHostReservePageTables(MM_MAX_HOST_PAGE_TABLES)));
+	TEST_CHECK(NT_SUCCESS(EptInitialise(&sVmm.Ept)));
+	TEST_CHECK(sVmm.Ept.DirtyLogging);
+
+	sVmm.CpuCount = MODEL_CPU_COUNT;
+	sVmm.VcpuTable = sVcpus;
+
+	for (SIZE_T i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		sVcpus[i].Vmm = &sVmm;
+		sVcpus[i].Mode = VCPU_MODE_GUEST;
+		sVcpus[i].ApicId = MODEL_APIC_ID(i);
+
+		sVcpus[i].PmlBuffer = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+		TEST_CHECK(sVcpus[i].PmlBuffer != NULL);
+
+		for (SIZE_T j = 0; j < EPT_PML_ENTRY_COUNT; j++)
+			sVcpus[i].PmlBuffer[j] = EPT_PML_EMPTY_ENTRY;
+
+		sCpus[i].PmlIndex = EPT_PML_ENTRY_COUNT - 1;
+	}
+
+	UINT64 Seed = 0x9E3779B97F4A7C15;
+	UINT64 Writes = 0;
+	UINT64 Queries = 0;
+	UINT64 Reported = 0;
+
+	for (SIZE_T Step = 0; Step < StepCount; Step++)
+	{
+		const ULONG CpuIndex = (ULONG)(NextRandom(&Seed) % MODEL_CPU_COUNT);
+
+		if (NextRandom(&Seed) % 256 != 0)
+		{
+			GuestWrite(CpuIndex, MODEL_RAM_BASE + PAGE_ADDRESS(NextRandom(&Seed) % MODEL_SPAN_PAGES));
+			Writes++;
+			continue;
+		}
+
+		const UINT64 PageCount = 1 + NextRandom(&Seed) % MODEL_MAX_QUERY_PAGES;
+		const UINT64 FirstPage = NextRandom(&Seed) % (MODEL_SPAN_PAGES - PageCount + 1);
+
+		Query(CpuIndex, FirstPage, PageCount, &Reported);
+		Queries++;
+	}
+
+	// Whatever is left is still reported by one last query of everything
+	for (UINT64 Page = 0; Page < MODEL_SPAN_PAGES; Page += MODEL_MAX_QUERY_PAGES)
+		Query(0, Page, MODEL_MAX_QUERY_PAGES, &Reported);
+
+	for (SIZE_T i = 0; i < MODEL_SPAN_PAGES / 64; i++)
+		TEST_CHECK_EQ(sWritten[i], 0);
+
+	UINT64 PmlFullExits = 0;
+	for (SIZE_T i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		PmlFullExits += sCpus[i].PmlFullExits;
+		free(sVcpus[i].PmlBuffer);
+	}
+
+	printf("%zu steps on %d VCPUs: %llu guest writes, %llu log-full VM-exits\n", StepCount, MODEL_CPU_COUNT,
+		(unsigned long long)Writes, (unsigned long long)PmlFullExits);
+	printf("%llu queries reported %llu dirty pages, %llu NMIs were sent to flush cached dirty translations\n",
+		(unsigned long long)Queries, (unsigned long long)Reported, (unsigned long long)sNmiCount);
+
+	return 0;
+}
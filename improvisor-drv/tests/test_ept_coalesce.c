@@ -0,0 +1,355 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <arch/msr.h>
+#include <arch/mtrr.h>
+#include <mm/mm.h>
+#include <ept.h>
+
+#include <test.h>
+
+// Splits large and super pages of a simulated EPT the way detours do, then checks EptCoalesceRange only merges
+// a table back once all 512 of its entries map one aligned, contiguous range the same way, and that the tables
+// it retires wait for the right invalidation generation before returning to the reserve
+
+#define COALESCE_RAM_BASE GB(1)
+#define COALESCE_RAM_SIZE GB(2)
+
+static EPT_INFORMATION sEpt;
+
+static VOID
+SetPageSupport(
+	_In_ BOOLEAN SuperPages
+)
+{
+	IA32_VMX_EPT_VPID_CAP_MSR EptVpidCap = {
+		.LargePdeSupport = TRUE,
+		.SuperPdpteSupport = SuperPages
+	};
+
+	ShimSetMsr(IA32_VMX_EPT_VPID_CAP, EptVpidCap.Value);
+}
+
+static UINT64
+GetLeafSize(
+	_In_ UINT64 GuestPhysAddr
+)
+/*++
+Routine Description:
+	Returns the size of the page mapping `GuestPhysAddr`, which must be the same in every view
+--*/
+{
+	UINT64 LeafSize = 0;
+	PEPT_PTE Leaf = EptGetLeafPte(sEpt.Views[0].Pml4, GuestPhysAddr, &LeafSize);
+	TEST_CHECK(Leaf != NULL);
+
+	for (UINT32 View = 1; View < sEpt.ViewCount; View++)
+	{
+		UINT64 ViewLeafSize = 0;
+		TEST_CHECK(EptGetLeafPte(sEpt.Views[View].Pml4, GuestPhysAddr, &ViewLeafSize) != NULL);
+		TEST_CHECK_EQ(ViewLeafSize, LeafSize);
+	}
+
+	return LeafSize;
+}
+
+static UINT64
+Remap(
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ UINT64 Size,
+	_In_ EPT_PAGE_PERMISSIONS Permissions
+)
+/*++
+Routine Description:
+	Remaps a range in every view and coalesces it, the same way HYPERCALL_EPT_REMAP_PAGES does, returning the
+	amount of tables retired
+--*/
+{
+	TEST_CHECK(NT_SUCCESS(EptMapMemoryRangeInViews(&sEpt, GuestPhysAddr, PhysAddr, Size, Permissions)));
+
+	return EptCoalesceRange(&sEpt, GuestPhysAddr, Size);
+}
+
+static VOID
+ReleaseAll(VOID)
+/*++
+Routine Description:
+	Releases every retired table, as if every VCPU had invalidated its EPT since
+--*/
+{
+	EptReleaseRetiredTables(&sEpt, sEpt.FlushGeneration + 1);
+	TEST_CHECK_EQ(sEpt.RetiredTableCount, 0);
+}
+
+static VOID
+TestRoundTrip(VOID)
+/*++
+Routine Description:
+	Detouring a page splits its super page down to 4KB pages, restoring it merges both tables back in every view
+--*/
+{
+	const UINT64 Page = COALESCE_RAM_BASE + MB(6) + 3 * PAGE_SIZE;
+
+	SetPageSupport(TRUE);
+
+	TEST_CHECK_EQ(Remap(Page, COALESCE_RAM_BASE + GB(1), PAGE_SIZE, EPT_PAGE_RW), 0);
+	TEST_CHECK_EQ(GetLeafSize(Page), PAGE_SIZE);
+	TEST_CHECK_EQ(GetLeafSize(Page + MB(2)), MB(2));
+
+	// The rest of the split page still maps what it did
+	UINT64 LeafSize = 0;
+	TEST_CHECK_EQ(PAGE_ADDRESS(EptGetLeafPte(sEpt.Views[0].Pml4, Page + PAGE_SIZE, &LeafSize)->PageFrameNumber), Page + PAGE_SIZE);
+	TEST_CHECK_EQ(PAGE_ADDRESS(EptGetLeafPte(sEpt.Views[0].Pml4, Page, &LeafSize)->PageFrameNumber), COALESCE_RAM_BASE + GB(1));
+
+	const UINT64 Generation = sEpt.FlushGeneration;
+
+	// A PT and a PD in each view
+	TEST_CHECK_EQ(Remap(Page, Page, PAGE_SIZE, EPT_PAGE_RWX), 2 * sEpt.ViewCount);
+	TEST_CHECK_EQ(GetLeafSize(Page), GB(1));
+	TEST_CHECK_EQ(sEpt.RetiredTableCount, 2 * sEpt.ViewCount);
+
+	PEPT_PTE Pdpte = EptGetLeafPte(sEpt.Views[0].Pml4, Page, &LeafSize);
+	TEST_CHECK_EQ(PAGE_ADDRESS(Pdpte->PageFrameNumber), COALESCE_RAM_BASE);
+	TEST_CHECK_EQ(Pdpte->MemoryType, MT_WRITEBACK);
+	TEST_CHECK(Pdpte->ReadAccess && Pdpte->WriteAccess && Pdpte->ExecuteAccess);
+
+	// Retired tables wait for an invalidation requested after they became unreachable
+	for (UINT32 i = 0; i < sEpt.RetiredTableCount; i++)
+		TEST_CHECK_EQ(sEpt.RetiredTables[i].Generation, Generation + 1);
+
+	MM_HOST_PT_STATS Before;
+	MmGetHostPageTableStats(&Before);
+
+	EptReleaseRetiredTables(&sEpt, Generation);
+	TEST_CHECK_EQ(sEpt.RetiredTableCount, 2 * sEpt.ViewCount);
+
+	EptReleaseRetiredTables(&sEpt, Generation + 1);
+	TEST_CHECK_EQ(sEpt.RetiredTableCount, 0);
+
+	MM_HOST_PT_STATS After;
+	MmGetHostPageTableStats(&After);
+	TEST_CHECK_EQ(After.Free - Before.Free, 2 * sEpt.ViewCount);
+}
+
+static VOID
+TestIneligible(VOID)
+/*++
+Routine Description:
+	Tables whose entries differ in permissions, aren't contiguous or aren't aligned to the page they would merge
+	into are left alone
+--*/
+{
+	const UINT64 Region = COALESCE_RAM_BASE + MB(32);
+	const UINT64 Page = Region + 17 * PAGE_SIZE;
+
+	SetPageSupport(FALSE);
+
+	// Same address, different permissions
+	TEST_CHECK_EQ(Remap(Page, Page, PAGE_SIZE, EPT_PAGE_READ), 0);
+	TEST_CHECK_EQ(GetLeafSize(Page), PAGE_SIZE);
+
+	// Same permissions, not contiguous
+	TEST_CHECK_EQ(Remap(Page, Page + PAGE_SIZE, PAGE_SIZE, EPT_PAGE_RWX), 0);
+	TEST_CHECK_EQ(GetLeafSize(Page), PAGE_SIZE);
+
+	TEST_CHECK_EQ(Remap(Page, Page, PAGE_SIZE, EPT_PAGE_RWX), sEpt.ViewCount);
+	TEST_CHECK_EQ(GetLeafSize(Page), MB(2));
+
+	// Contiguous and uniform, but starting a page into a large page
+	TEST_CHECK_EQ(Remap(Region, Region + PAGE_SIZE, MB(2), EPT_PAGE_RWX), 0);
+	TEST_CHECK_EQ(GetLeafSize(Region), PAGE_SIZE);
+
+	TEST_CHECK_EQ(Remap(Region, Region, MB(2), EPT_PAGE_RWX), sEpt.ViewCount);
+	TEST_CHECK_EQ(GetLeafSize(Region), MB(2));
+
+	ReleaseAll();
+}
+
+static VOID
+TestAccessedDirty(VOID)
+/*++
+Routine Description:
+	Accessed and dirty flags set by the processor don't stop a merge, and the merged entry starts out clean
+--*/
+{
+	const UINT64 Region = COALESCE_RAM_BASE + MB(64);
+
+	SetPageSupport(FALSE);
+
+	TEST_CHECK_EQ(Remap(Region, Region + PAGE_SIZE, PAGE_SIZE, EPT_PAGE_RWX), 0);
+
+	for (UINT64 Offset = 0; Offset < MB(2); Offset += 5 * PAGE_SIZE)
+	{
+		for (UINT32 View = 0; View < sEpt.ViewCount; View++)
+		{
+			UINT64 LeafSize = 0;
+			PEPT_PTE Pte = EptGetLeafPte(sEpt.Views[View].Pml4, Region + Offset, &LeafSize);
+			Pte->Accessed = TRUE;
+			Pte->Dirty = (Offset / PAGE_SIZE) % 2;
+		}
+	}
+
+	TEST_CHECK_EQ(Remap(Region, Region, PAGE_SIZE, EPT_PAGE_RWX), sEpt.ViewCount);
+
+	for (UINT32 View = 0; View < sEpt.ViewCount; View++)
+	{
+		UINT64 LeafSize = 0;
+		PEPT_PTE Pde = EptGetLeafPte(sEpt.Views[View].Pml4, Region, &LeafSize);
+		TEST_CHECK_EQ(LeafSize, MB(2));
+		TEST_CHECK(!Pde->Accessed && !Pde->Dirty);
+	}
+
+	ReleaseAll();
+}
+
+static VOID
+TestPartialDirectory(VOID)
+/*++
+Routine Description:
+	A PD only merges into a super page once every one of its PDEs is a large page again
+--*/
+{
+	const UINT64 First = COALESCE_RAM_BASE + MB(100);
+	const UINT64 Second = COALESCE_RAM_BASE + MB(500);
+
+	SetPageSupport(TRUE);
+
+	TEST_CHECK_EQ(Remap(First, 0, PAGE_SIZE, EPT_PAGE_RW), 0);
+	TEST_CHECK_EQ(Remap(Second, 0, PAGE_SIZE, EPT_PAGE_RW), 0);
+
+	// Only the PT of the first page goes, the second keeps the PD split
+	TEST_CHECK_EQ(Remap(First, First, PAGE_SIZE, EPT_PAGE_RWX), sEpt.ViewCount);
+	TEST_CHECK_EQ(GetLeafSize(First), MB(2));
+	TEST_CHECK_EQ(GetLeafSize(Second), PAGE_SIZE);
+
+	TEST_CHECK_EQ(Remap(Second, Second, PAGE_SIZE, EPT_PAGE_RWX), 2 * sEpt.ViewCount);
+	TEST_CHECK_EQ(GetLeafSize(First), GB(1));
+
+	ReleaseAll();
+}
+
+static VOID
+TestRetiredLimit(VOID)
+/*++
+Routine Description:
+	Once the retired table list is full tables stay split, and merge on the next remap after it is released
+--*/
+{
+	SetPageSupport(FALSE);
+
+	const UINT64 Limit = EPT_MAX_RETIRED_TABLES / sEpt.ViewCount;
+
+	for (UINT64 i = 0; i <= Limit; i++)
+	{
+		const UINT64 Page = COALESCE_RAM_BASE + GB(1) + i * MB(2);
+
+		TEST_CHECK_EQ(Remap(Page, 0, PAGE_SIZE, EPT_PAGE_RW), 0);
+		TEST_CHECK_EQ(Remap(Page, Page, PAGE_SIZE, EPT_PAGE_RWX), i < Limit ? sEpt.ViewCount : 0);
+	}
+
+	const UINT64 Last = COALESCE_RAM_BASE + GB(1) + Limit * MB(2);
+
+	TEST_CHECK_EQ(sEpt.RetiredTableCount, EPT_MAX_RETIRED_TABLES);
+	TEST_CHECK_EQ(GetLeafSize(Last), PAGE_SIZE);
+
+	ReleaseAll();
+
+	TEST_CHECK_EQ(EptCoalesceRange(&sEpt, Last, PAGE_SIZE), sEpt.ViewCount);
+	TEST_CHECK_EQ(GetLeafSize(Last), MB(2));
+
+	ReleaseAll();
+}
+
+static VOID
+TestExhaustedReserve(VOID)
+/*++
+Routine Description:
+	Splitting a page with too few host page tables left fails without touching the entry being split, and gives
+	back any table it took
+--*/
+{
+	static UINT64 Taken[MM_MAX_HOST_PAGE_TABLES];
+	SIZE_T TakenCount = 0;
+
+	PVOID Table = NULL;
+	while (NT_SUCCESS(MmAllocateHostPageTable(&Table, &Taken[TakenCount])))
+		TakenCount++;
+
+	TEST_CHECK(!NT_SUCCESS(EptMapMemoryRangeInViews(&sEpt, COALESCE_RAM_BASE, 0, PAGE_SIZE, EPT_PAGE_RW)));
+	TEST_CHECK_EQ(GetLeafSize(COALESCE_RAM_BASE), GB(1));
+
+	// Without large pages the new PD is allocated, but not the first of the PTs it needs
+	IA32_VMX_EPT_VPID_CAP_MSR EptVpidCap = {
+		.SuperPdpteSupport = TRUE
+	};
+
+	ShimSetMsr(IA32_VMX_EPT_VPID_CAP, EptVpidCap.Value);
+	MmFreeHostPageTable(Taken[--TakenCount]);
+
+	TEST_CHECK(!NT_SUCCESS(EptMapMemoryRangeInViews(&sEpt, COALESCE_RAM_BASE, 0, PAGE_SIZE, EPT_PAGE_RW)));
+	TEST_CHECK_EQ(GetLeafSize(COALESCE_RAM_BASE), GB(1));
+
+	MM_HOST_PT_STATS Stats;
+	MmGetHostPageTableStats(&Stats);
+	TEST_CHECK_EQ(Stats.Free, 1);
+
+	SetPageSupport(TRUE);
+
+	while (TakenCount != 0)
+		MmFreeHostPageTable(Taken[--TakenCount]);
+}
+
+int
+main(VOID)
+{
+	IA32_MTRR_DEFAULT_TYPE_MSR DefaultType = {
+		.Type = MT_WRITEBACK,
+		.EnableMtrr = TRUE
+	};
+
+	ShimSetMsr(IA32_MTRR_CAPABILITIES, 0);
+	ShimSetMsr(IA32_MTRR_DEFAULT_TYPE, DefaultType.Value);
+	SetPageSupport(TRUE);
+
+	const PHYSICAL_MEMORY_RANGE Ram = {
+		.BaseAddress.QuadPart = COALESCE_RAM_BASE,
+		.NumberOfBytes.QuadPart = COALESCE_RAM_SIZE
+	};
+
+	ShimSetPhysicalMemoryRanges(&Ram, 1);
+
+	TEST_CHECK(NT_SUCCESS(MtrrInitialise()));
+	TEST_CHECK(NT_SUCCESS(MmHostReservePageTables(MM_MAX_HOST_PAGE_TABLES)));
+	TEST_CHECK(NT_SUCCESS(EptInitialise(&sEpt)));
+
+	MM_HOST_PT_STATS Before;
+	MmGetHostPageTableStats(&Before);
+
+	TestRoundTrip();
+	TestIneligible();
+	TestAccessedDirty();
+	TestPartialDirectory();
+	TestRetiredLimit();
+	TestExhaustedReserve();
+
+	// Only the PD split while super pages were off is left, after that every table is back in the reserve
+	SetPageSupport(TRUE);
+	TEST_CHECK_EQ(EptCoalesceRange(&sEpt, COALESCE_RAM_BASE, COALESCE_RAM_SIZE), sEpt.ViewCount);
+	ReleaseAll();
+
+	TEST_CHECK_EQ(GetLeafSize(COALESCE_RAM_BASE), GB(1));
+	TEST_CHECK_EQ(GetLeafSize(COALESCE_RAM_BASE + GB(1)), GB(1));
+
+	// A table freed twice only goes back to the reserve once
+	PVOID Table = NULL;
+	UINT64 TablePhysAddr = 0;
+	TEST_CHECK(NT_SUCCESS(MmAllocateHostPageTable(&Table, &TablePhysAddr)));
+	TEST_CHECK(NT_SUCCESS(MmFreeHostPageTable(TablePhysAddr)));
+	TEST_CHECK(!NT_SUCCESS(MmFreeHostPageTable(TablePhysAddr)));
+
+	MM_HOST_PT_STATS After;
+	MmGetHostPageTableStats(&After);
+	TEST_CHECK_EQ(After.Free, Before.Free);
+
+	return 0;
+}
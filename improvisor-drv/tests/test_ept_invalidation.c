@@ -0,0 +1,595 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <arch/apic.h>
+#include <arch/msr.h>
+#include <arch/mtrr.h>
+#include <mm/mm.h>
+#include <mm/vpte.h>
+#include <spinlock.h>
+#include <vcpu/vcpu.h>
+#include <ept.h>
+#include <vmm.h>
+#include <vmx.h>
+
+#include <test.h>
+
+// Model of deferred EPT invalidation: a few simulated VCPUs run the guest against a TLB and paging-structure
+// caches of their own, which only the INVEPT executed on them clears. VM-exits detour and restore pages, which
+// splits and coalesces the EPT the way the remap hypercall does, and every exit ends in VcpuCommitEptInvalidation
+// before VM-entry. Checks that:
+//
+//  - a VCPU never re-enters the guest with a cached translation or table the EPT no longer holds
+//  - a table retired by coalescing is only returned to the reserve once no VCPU can still walk through it
+//  - a VCPU that never exits by itself, like one idling in HLT, is sent an NMI before it holds back so many
+//    retired tables that coalescing has to stop
+//
+// Other VCPUs keep using their stale translations until their own next VM-exit, which is the deferral the
+// design accepts, so those accesses are only counted
+
+#define MODEL_CPU_COUNT 4
+// VCPU that only exits when it is sent an NMI
+#define MODEL_IDLE_CPU (MODEL_CPU_COUNT - 1)
+// APIC IDs don't have to match processor numbers
+#define MODEL_APIC_ID(Cpu) ((Cpu) * 2 + 1)
+#define MODEL_RAM_BASE GB(1)
+#define MODEL_RAM_SIZE GB(2)
+// Guest accesses and detours stay in a few large pages so they keep hitting the same split tables
+#define MODEL_SPAN MB(16)
+#define MODEL_MAX_DETOURS 32
+#define MODEL_TLB_SIZE 256
+#define MODEL_PT_CACHE_SIZE 64
+#define MODEL_PD_CACHE_SIZE 4
+
+#define MODEL_PAGE(Address) ((Address) & ~(PAGE_SIZE - 1))
+
+typedef struct _MODEL_CACHE_ENTRY
+{
+	BOOLEAN Valid;
+	// Guest page for the TLB, guest region mapped by the referencing entry for the paging-structure caches
+	UINT64 Tag;
+	// Host physical address of the page, or of the table the entry references
+	UINT64 PhysAddr;
+} MODEL_CACHE_ENTRY, *PMODEL_CACHE_ENTRY;
+
+typedef struct _MODEL_CPU
+{
+	MODEL_CACHE_ENTRY Tlb[MODEL_TLB_SIZE];
+	// Page tables referenced by non-large PDEs, tagged by 2MB region
+	MODEL_CACHE_ENTRY PtCache[MODEL_PT_CACHE_SIZE];
+	// Page directories referenced by non-super PDPTEs, tagged by 1GB region
+	MODEL_CACHE_ENTRY PdCache[MODEL_PD_CACHE_SIZE];
+	UINT64 Invalidations;
+} MODEL_CPU, *PMODEL_CPU;
+
+typedef struct _MODEL_DETOUR
+{
+	UINT64 GuestPhysAddr;
+	UINT64 PhysAddr;
+} MODEL_DETOUR, *PMODEL_DETOUR;
+
+static VMM_CONTEXT sVmm;
+static VCPU sVcpus[MODEL_CPU_COUNT];
+static MODEL_CPU sCpus[MODEL_CPU_COUNT];
+
+static MODEL_DETOUR sDetours[MODEL_MAX_DETOURS];
+static SIZE_T sDetourCount = 0;
+
+// NMIs sent to each VCPU which haven't been taken yet
+static BOOLEAN sNmiPending[MODEL_CPU_COUNT];
+static UINT64 sNmiCount = 0;
+
+// Every IPI is sent through the x2APIC
+
+NTSTATUS
+MmAllocateVpte(
+	_Out_ PMM_VPTE* pVpte
+)
+{
+	*pVpte = NULL;
+
+	TEST_CHECK(FALSE);
+	return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+MmMapGuestPhys(
+	_Inout_ PMM_VPTE Vpte,
+	_In_ UINT64 PhysAddr
+)
+{
+	UNREFERENCED_PARAMETER(Vpte);
+	UNREFERENCED_PARAMETER(PhysAddr);
+}
+
+static UINT64
+NextRandom(
+	_Inout_ PUINT64 State
+)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+
+	return *State;
+}
+
+static VOID
+ModelInvept(
+	_In_ UINT64 Type,
+	_In_ PVOID Descriptor
+)
+/*++
+Routine Description:
+	Drops everything the current processor has cached, an all-context INVEPT covers every EPT view
+--*/
+{
+	UNREFERENCED_PARAMETER(Descriptor);
+
+	TEST_CHECK_EQ(Type, INV_ALL_CONTEXT);
+
+	PMODEL_CPU Cpu = &sCpus[KeGetCurrentProcessorNumber()];
+
+	RtlZeroMemory(Cpu->Tlb, sizeof(Cpu->Tlb));
+	RtlZeroMemory(Cpu->PtCache, sizeof(Cpu->PtCache));
+	RtlZeroMemory(Cpu->PdCache, sizeof(Cpu->PdCache));
+
+	Cpu->Invalidations++;
+}
+
+static VOID
+ModelWrmsr(
+	_In_ ULONG Msr,
+	_In_ UINT64 Value
+)
+/*++
+Routine Description:
+	Delivers NMIs sent through the x2APIC interrupt command register to the VCPU with the destination APIC ID
+--*/
+{
+	if (Msr != IA32_X2APIC_ICR)
+		return;
+
+	APIC_ICR Icr = {
+		.Value = Value
+	};
+
+	TEST_CHECK_EQ(Icr.DeliveryMode, APIC_DELIVERY_NMI);
+	TEST_CHECK_EQ(Icr.DestinationShorthand, 0);
+
+	for (ULONG i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		if (MODEL_APIC_ID(i) != Icr.Destination)
+			continue;
+
+		TEST_CHECK(i != KeGetCurrentProcessorNumber());
+
+		sNmiPending[i] = TRUE;
+		sNmiCount++;
+		return;
+	}
+
+	TEST_CHECK(FALSE);
+}
+
+static PEPT_PTE
+ReadTable(
+	_In_ UINT64 TablePhysAddr
+)
+{
+	PEPT_PTE Table = MmGetHostPageTableVirtAddr(TablePhysAddr);
+	TEST_CHECK(Table != NULL);
+
+	return Table;
+}
+
+static EPT_PTE
+ReadPdpte(
+	_In_ UINT64 GuestPhysAddr
+)
+{
+	EPT_GPA Gpa = {
+		.Value = GuestPhysAddr
+	};
+
+	const EPT_PTE Pml4e = sVmm.Ept.Views[EPT_VIEW_DEFAULT].Pml4[Gpa.Pml4Index];
+	TEST_CHECK(Pml4e.Present);
+
+	const EPT_PTE Pdpte = ReadTable(PAGE_ADDRESS(Pml4e.PageFrameNumber))[Gpa.PdptIndex];
+	TEST_CHECK(Pdpte.Present);
+
+	return Pdpte;
+}
+
+static UINT64
+ExpectedTranslation(
+	_In_ UINT64 GuestPhysAddr
+)
+{
+	for (SIZE_T i = 0; i < sDetourCount; i++)
+	{
+		if (sDetours[i].GuestPhysAddr == MODEL_PAGE(GuestPhysAddr))
+			return sDetours[i].PhysAddr + PAGE_OFFSET(GuestPhysAddr);
+	}
+
+	return GuestPhysAddr;
+}
+
+static UINT64
+GuestAccess(
+	_In_ ULONG CpuIndex,
+	_In_ UINT64 GuestPhysAddr
+)
+/*++
+Routine Description:
+	Translates `GuestPhysAddr` the way the processor would, through whatever the VCPU has cached first and the
+	EPT of the default view for the rest, caching everything it walked through
+--*/
+{
+	PMODEL_CPU Cpu = &sCpus[CpuIndex];
+
+	const UINT64 GuestPage = MODEL_PAGE(GuestPhysAddr);
+
+	PMODEL_CACHE_ENTRY TlbEntry = &Cpu->Tlb[PAGE_FRAME_NUMBER(GuestPage) % MODEL_TLB_SIZE];
+	if (TlbEntry->Valid && TlbEntry->Tag == GuestPage)
+		return TlbEntry->PhysAddr + PAGE_OFFSET(GuestPhysAddr);
+
+	EPT_GPA Gpa = {
+		.Value = GuestPhysAddr
+	};
+
+	PMODEL_CACHE_ENTRY PtEntry = &Cpu->PtCache[(GuestPhysAddr / MB(2)) % MODEL_PT_CACHE_SIZE];
+	PMODEL_CACHE_ENTRY PdEntry = &Cpu->PdCache[(GuestPhysAddr / GB(1)) % MODEL_PD_CACHE_SIZE];
+
+	EPT_PTE Leaf;
+	UINT64 LeafSize = PAGE_SIZE;
+
+	if (PtEntry->Valid && PtEntry->Tag == (GuestPhysAddr & ~(MB(2) - 1)))
+	{
+		Leaf = ReadTable(PtEntry->PhysAddr)[Gpa.PtIndex];
+	}
+	else
+	{
+		EPT_PTE Pde;
+
+		if (PdEntry->Valid && PdEntry->Tag == (GuestPhysAddr & ~(GB(1) - 1)))
+		{
+			Pde = ReadTable(PdEntry->PhysAddr)[Gpa.PdIndex];
+		}
+		else
+		{
+			const EPT_PTE Pdpte = ReadPdpte(GuestPhysAddr);
+
+			if (Pdpte.LargePage)
+			{
+				Leaf = Pdpte;
+				LeafSize = GB(1);
+				goto leaf;
+			}
+
+			PdEntry->Valid = TRUE;
+			PdEntry->Tag = GuestPhysAddr & ~(GB(1) - 1);
+			PdEntry->PhysAddr = PAGE_ADDRESS(Pdpte.PageFrameNumber);
+
+			Pde = ReadTable(PdEntry->PhysAddr)[Gpa.PdIndex];
+		}
+
+		TEST_CHECK(Pde.Present);
+
+		if (Pde.LargePage)
+		{
+			Leaf = Pde;
+			LeafSize = MB(2);
+			goto leaf;
+		}
+
+		PtEntry->Valid = TRUE;
+		PtEntry->Tag = GuestPhysAddr & ~(MB(2) - 1);
+		PtEntry->PhysAddr = PAGE_ADDRESS(Pde.PageFrameNumber);
+
+		Leaf = ReadTable(PtEntry->PhysAddr)[Gpa.PtIndex];
+	}
+
+leaf:
+	// Reading through a table that went back to the reserve finds it zeroed
+	TEST_CHECK(Leaf.Present);
+
+	TlbEntry->Valid = TRUE;
+	TlbEntry->Tag = GuestPage;
+	TlbEntry->PhysAddr = PAGE_ADDRESS(Leaf.PageFrameNumber) + (GuestPage & (LeafSize - 1));
+
+	return TlbEntry->PhysAddr + PAGE_OFFSET(GuestPhysAddr);
+}
+
+static VOID
+CheckCachesCurrent(
+	_In_ ULONG CpuIndex
+)
+/*++
+Routine Description:
+	Checks that everything the VCPU has cached matches the EPT as it is now, which must hold on every VM-entry
+--*/
+{
+	PMODEL_CPU Cpu = &sCpus[CpuIndex];
+
+	for (SIZE_T i = 0; i < MODEL_TLB_SIZE; i++)
+	{
+		if (Cpu->Tlb[i].Valid)
+			TEST_CHECK_EQ(Cpu->Tlb[i].PhysAddr, ExpectedTranslation(Cpu->Tlb[i].Tag));
+	}
+
+	for (SIZE_T i = 0; i < MODEL_PT_CACHE_SIZE; i++)
+	{
+		if (!Cpu->PtCache[i].Valid)
+			continue;
+
+		const EPT_PTE Pdpte = ReadPdpte(Cpu->PtCache[i].Tag);
+		TEST_CHECK(!Pdpte.LargePage);
+
+		EPT_GPA Gpa = {
+			.Value = Cpu->PtCache[i].Tag
+		};
+
+		const EPT_PTE Pde = ReadTable(PAGE_ADDRESS(Pdpte.PageFrameNumber))[Gpa.PdIndex];
+		TEST_CHECK(!Pde.LargePage);
+		TEST_CHECK_EQ(PAGE_ADDRESS(Pde.PageFrameNumber), Cpu->PtCache[i].PhysAddr);
+	}
+
+	for (SIZE_T i = 0; i < MODEL_PD_CACHE_SIZE; i++)
+	{
+		if (!Cpu->PdCache[i].Valid)
+			continue;
+
+		const EPT_PTE Pdpte = ReadPdpte(Cpu->PdCache[i].Tag);
+		TEST_CHECK(!Pdpte.LargePage);
+		TEST_CHECK_EQ(PAGE_ADDRESS(Pdpte.PageFrameNumber), Cpu->PdCache[i].PhysAddr);
+	}
+}
+
+static VOID
+CheckTableUnreferenced(
+	_In_ UINT64 TablePhysAddr
+)
+{
+	for (SIZE_T i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		for (SIZE_T j = 0; j < MODEL_PT_CACHE_SIZE; j++)
+			TEST_CHECK(!sCpus[i].PtCache[j].Valid || sCpus[i].PtCache[j].PhysAddr != TablePhysAddr);
+
+		for (SIZE_T j = 0; j < MODEL_PD_CACHE_SIZE; j++)
+			TEST_CHECK(!sCpus[i].PdCache[j].Valid || sCpus[i].PdCache[j].PhysAddr != TablePhysAddr);
+	}
+}
+
+static VOID
+ExitAndEnter(
+	_In_ ULONG CpuIndex
+)
+/*++
+Routine Description:
+	Ends a VM-exit on a VCPU the way __vmexit_entry does, then checks what it re-enters the guest with and that
+	every table released meanwhile is out of every VCPU's reach
+--*/
+{
+	static EPT_RETIRED_TABLE Retired[EPT_MAX_RETIRED_TABLES];
+
+	const UINT32 RetiredCount = sVmm.Ept.RetiredTableCount;
+	RtlCopyMemory(Retired, sVmm.Ept.RetiredTables, RetiredCount * sizeof(*Retired));
+
+	VcpuCommitEptInvalidation(&sVcpus[CpuIndex]);
+
+	for (UINT32 i = 0; i < RetiredCount; i++)
+	{
+		BOOLEAN Kept = FALSE;
+		for (UINT32 j = 0; j < sVmm.Ept.RetiredTableCount; j++)
+			Kept |= sVmm.Ept.RetiredTables[j].PhysAddr == Retired[i].PhysAddr;
+
+		if (!Kept)
+			CheckTableUnreferenced(Retired[i].PhysAddr);
+	}
+
+	CheckCachesCurrent(CpuIndex);
+}
+
+static VOID
+RemapPage(
+	_In_ ULONG CpuIndex,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ UINT64 PhysAddr
+)
+/*++
+Routine Description:
+	Remaps a page in every view from a VM-exit on a VCPU, the same way HYPERCALL_EPT_REMAP_PAGES does
+--*/
+{
+	SpinLock(&sVmm.Ept.Lock);
+
+	TEST_CHECK(NT_SUCCESS(EptMapMemoryRangeInViews(&sVmm.Ept, GuestPhysAddr, PhysAddr, PAGE_SIZE, EPT_PAGE_RWX)));
+	EptCoalesceRange(&sVmm.Ept, GuestPhysAddr, PAGE_SIZE);
+
+	SpinUnlock(&sVmm.Ept.Lock);
+
+	VcpuQueueEptInvalidation(&sVcpus[CpuIndex]);
+}
+
+static VOID
+TakeNmis(VOID)
+/*++
+Routine Description:
+	Has every VCPU that was sent an NMI exit because of it, the way VcpuHandleExceptionNmi handles one
+--*/
+{
+	for (ULONG i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		if (!sNmiPending[i])
+			continue;
+
+		sNmiPending[i] = FALSE;
+
+		ShimSetProcessorNumber(i);
+		TEST_CHECK(VcpuHandleEptFlushNmi(&sVcpus[i]));
+
+		ExitAndEnter(i);
+	}
+}
+
+int
+main(int argc, char** argv)
+{
+	const SIZE_T StepCount = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000;
+
+	IA32_MTRR_DEFAULT_TYPE_MSR DefaultType = {
+		.Type = MT_WRITEBACK,
+		.EnableMtrr = TRUE
+	};
+
+	IA32_VMX_EPT_VPID_CAP_MSR EptVpidCap = {
+		.LargePdeSupport = TRUE,
+		.SuperPdpteSupport = TRUE
+	};
+
+	ShimSetMsr(IA32_MTRR_CAPABILITIES, 0);
+	ShimSetMsr(IA32_MTRR_DEFAULT_TYPE, DefaultType.Value);
+	ShimSetMsr(IA32_VMX_EPT_VPID_CAP, EptVpidCap.Value);
+
+	IA32_APIC_BASE_MSR ApicBase = {
+		.APICEnable = TRUE,
+		.X2APICMode = TRUE
+	};
+
+	ShimSetMsr(IA32_APIC_BASE, ApicBase.Value);
+
+	const PHYSICAL_MEMORY_RANGE Ram = {
+		.BaseAddress.QuadPart = MODEL_RAM_BASE,
+		.NumberOfBytes.QuadPart = MODEL_RAM_SIZE
+	};
+
+	ShimSetPhysicalMemoryRanges(&Ram, 1);
+	ShimSetInveptHook(ModelInvept);
+	ShimSetWrmsrHook(ModelWrmsr);
+
+	TEST_CHECK(NT_SUCCESS(MtrrInitialise()));
+	TEST_CHECK(NT_SUCCESS(MmHostReservePageTables(MM_MAX_HOST_PAGE_TABLES)));
+	TEST_CHECK(NT_SUCCESS(EptInitialise(&sVmm.Ept)));
+
+	MM_HOST_PT_STATS Before;
+	MmGetHostPageTableStats(&Before);
+
+	sVmm.CpuCount = MODEL_CPU_COUNT;
+	sVmm.VcpuTable = sVcpus;
+
+	for (SIZE_T i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		sVcpus[i].Vmm = &sVmm;
+		sVcpus[i].Mode = VCPU_MODE_GUEST;
+		sVcpus[i].ApicId = MODEL_APIC_ID(i);
+	}
+
+	UINT64 Seed = 0xD1B54A32D192ED03;
+	UINT64 Accesses = 0;
+	UINT64 StaleAccesses = 0;
+	UINT64 Changes = 0;
+	UINT32 MaxRetired = 0;
+
+	for (SIZE_T Step = 0; Step < StepCount; Step++)
+	{
+		TakeNmis();
+
+		MaxRetired = max(MaxRetired, sVmm.Ept.RetiredTableCount);
+
+		const ULONG CpuIndex = (ULONG)(NextRandom(&Seed) % MODEL_CPU_COUNT);
+		const UINT64 Action = NextRandom(&Seed) % 32;
+
+		ShimSetProcessorNumber(CpuIndex);
+
+		if (Action < 29)
+		{
+			const UINT64 GuestPhysAddr = MODEL_RAM_BASE + NextRandom(&Seed) % MODEL_SPAN;
+
+			Accesses++;
+			if (GuestAccess(CpuIndex, GuestPhysAddr) != ExpectedTranslation(GuestPhysAddr))
+				StaleAccesses++;
+
+			continue;
+		}
+
+		if (CpuIndex == MODEL_IDLE_CPU)
+			continue;
+
+		if (Action == 29 && sDetourCount < MODEL_MAX_DETOURS)
+		{
+			PMODEL_DETOUR Detour = &sDetours[sDetourCount];
+
+			Detour->GuestPhysAddr = MODEL_PAGE(MODEL_RAM_BASE + NextRandom(&Seed) % MODEL_SPAN);
+			Detour->PhysAddr = MODEL_PAGE(MODEL_RAM_BASE + GB(1) + NextRandom(&Seed) % GB(1));
+
+			if (ExpectedTranslation(Detour->GuestPhysAddr) == Detour->GuestPhysAddr)
+			{
+				RemapPage(CpuIndex, Detour->GuestPhysAddr, Detour->PhysAddr);
+				sDetourCount++;
+				Changes++;
+			}
+		}
+		else if (Action == 30 && sDetourCount != 0)
+		{
+			const MODEL_DETOUR Detour = sDetours[NextRandom(&Seed) % sDetourCount];
+
+			// Restored first so the expected map is already up to date when coalescing retires tables
+			for (SIZE_T i = 0; i < sDetourCount; i++)
+			{
+				if (sDetours[i].GuestPhysAddr == Detour.GuestPhysAddr)
+					sDetours[i] = sDetours[--sDetourCount];
+			}
+
+			RemapPage(CpuIndex, Detour.GuestPhysAddr, Detour.GuestPhysAddr);
+			Changes++;
+		}
+
+		ExitAndEnter(CpuIndex);
+	}
+
+	// Once every detour is gone and every VCPU has exited, all of it is one super page again and every retired
+	// table is back in the reserve
+	ShimSetProcessorNumber(0);
+	while (sDetourCount != 0)
+	{
+		const UINT64 GuestPhysAddr = sDetours[--sDetourCount].GuestPhysAddr;
+		RemapPage(0, GuestPhysAddr, GuestPhysAddr);
+	}
+
+	for (ULONG i = 0; i < MODEL_CPU_COUNT; i++)
+	{
+		ShimSetProcessorNumber(i);
+		ExitAndEnter(i);
+	}
+
+	TEST_CHECK_EQ(sVmm.Ept.RetiredTableCount, 0);
+
+	// Coalescing never ran out of room for retired tables, even with the idle VCPU holding them back
+	TEST_CHECK(MaxRetired < EPT_MAX_RETIRED_TABLES);
+	TEST_CHECK(sNmiCount != 0);
+
+	for (UINT32 View = 0; View < sVmm.Ept.ViewCount; View++)
+	{
+		UINT64 LeafSize = 0;
+		TEST_CHECK(EptGetLeafPte(sVmm.Ept.Views[View].Pml4, MODEL_RAM_BASE, &LeafSize) != NULL);
+		TEST_CHECK_EQ(LeafSize, GB(1));
+	}
+
+	MM_HOST_PT_STATS After;
+	MmGetHostPageTableStats(&After);
+	TEST_CHECK_EQ(After.Free, Before.Free);
+
+	UINT64 Invalidations = 0;
+	for (SIZE_T i = 0; i < MODEL_CPU_COUNT; i++)
+		Invalidations += sCpus[i].Invalidations;
+
+	printf("%zu steps on %d VCPUs: %llu EPT changes, %llu INVEPTs, %llu when invalidating every VCPU per change\n",
+		StepCount, MODEL_CPU_COUNT, (unsigned long long)Changes, (unsigned long long)Invalidations, 
+		(unsigned long long)Changes * MODEL_CPU_COUNT);
+	printf("%llu guest accesses, %llu used a translation another VCPU had changed before their next VM-exit\n",
+		(unsigned long long)Accesses, (unsigned long long)StaleAccesses);
+	printf("%llu NMIs sent to VCPUs holding retired tables back, at most %u tables were retired at once\n",
+		(unsigned long long)sNmiCount, MaxRetired);
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <arch/msr.h>
+#include <arch/mtrr.h>
+#include <mm/mm.h>
+#include <ept.h>
+
+#include <test.h>
+
+// Builds a simulated 64GB identity map from large pages, splits a few thousand of them into 4KB pages as EPT
+// violations and detours do, then walks random addresses through it. Each walk is done twice: once resolving
+// tables through the PFN lookup table, and once scanning the list of reserved tables as EptReadExistingPte used to
+
+#define WALK_MAP_SIZE GB(64)
+#define WALK_SPLIT_COUNT 4000
+
+typedef PEPT_PTE(*WALK_TABLE_LOOKUP)(UINT64 TablePfn);
+
+static PMM_RESERVED_PT sLegacyTail = NULL;
+
+static PEPT_PTE
+IndexedLookup(
+	_In_ UINT64 TablePfn
+)
+{
+	return (PEPT_PTE)MmGetHostPageTableVirtAddr(PAGE_ADDRESS(TablePfn));
+}
+
+static PEPT_PTE
+LegacyLookup(
+	_In_ UINT64 TablePfn
+)
+/*++
+Routine Description:
+	The lookup EptReadExistingPte did before the PFN index, walks every reserved table back from the tail
+--*/
+{
+	PMM_RESERVED_PT Curr = sLegacyTail;
+	while (Curr != NULL)
+	{
+		if (PAGE_FRAME_NUMBER(Curr->TablePhysAddr) == TablePfn)
+			return Curr->TableAddr;
+
+		Curr = (PMM_RESERVED_PT)Curr->Links.Blink;
+	}
+
+	return NULL;
+}
+
+static VOID
+SnapshotLegacyList(VOID)
+/*++
+Routine Description:
+	Copies the freshly reserved tables into a doubly linked list in reservation order, the layout the old
+	gHostPageTablesTail list had
+--*/
+{
+	static MM_RESERVED_PT Legacy[MM_MAX_HOST_PAGE_TABLES];
+
+	PMM_RESERVED_PT Prev = NULL;
+	SIZE_T Count = 0;
+
+	for (PMM_RESERVED_PT Curr = gHostPageTablesHead; Curr != NULL; Curr = (PMM_RESERVED_PT)Curr->Links.Flink)
+	{
+		Legacy[Count].TableAddr = Curr->TableAddr;
+		Legacy[Count].TablePhysAddr = Curr->TablePhysAddr;
+		Legacy[Count].Links.Blink = &Prev->Links;
+		Legacy[Count].Links.Flink = NULL;
+
+		Prev = &Legacy[Count++];
+	}
+
+	sLegacyTail = Prev;
+}
+
+static PEPT_PTE
+WalkLeaf(
+	_In_ PEPT_PTE Pml4,
+	_In_ UINT64 GuestPhysAddr,
+	_In_ WALK_TABLE_LOOKUP Lookup
+)
+{
+	EPT_GPA Gpa = {
+		.Value = GuestPhysAddr
+	};
+
+	PEPT_PTE Pml4e = &Pml4[Gpa.Pml4Index];
+	if (!Pml4e->Present)
+		return NULL;
+
+	PEPT_PTE Pdpte = &Lookup(Pml4e->PageFrameNumber)[Gpa.PdptIndex];
+	if (!Pdpte->Present || Pdpte->LargePage)
+		return Pdpte;
+
+	PEPT_PTE Pde = &Lookup(Pdpte->PageFrameNumber)[Gpa.PdIndex];
+	if (!Pde->Present || Pde->LargePage)
+		return Pde;
+
+	return &Lookup(Pde->PageFrameNumber)[Gpa.PtIndex];
+}
+
+static UINT64
+NextRandom(
+	_Inout_ PUINT64 State
+)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+
+	return *State;
+}
+
+static double
+BenchWalks(
+	_In_ PEPT_PTE Pml4,
+	_In_ WALK_TABLE_LOOKUP Lookup,
+	_In_ SIZE_T WalkCount
+)
+{
+	UINT64 Seed = 0x9E3779B97F4A7C15;
+	UINT64 Sink = 0;
+
+	const double Start = TestNow();
+
+	for (SIZE_T i = 0; i < WalkCount; i++)
+		Sink += WalkLeaf(Pml4, NextRandom(&Seed) % WALK_MAP_SIZE, Lookup)->Value;
+
+	const double Elapsed = TestNow() - Start;
+
+	TEST_CHECK(Sink != 0);
+
+	return Elapsed * 1e9 / WalkCount;
+}
+
+int
+main(int argc, char** argv)
+{
+	const SIZE_T WalkCount = argc > 1 ? strtoull(argv[1], NULL, 0) : 200000;
+
+	// WB everywhere, no variable or fixed ranges, 2MB EPT pages but no 1GB ones
+	IA32_MTRR_DEFAULT_TYPE_MSR DefaultType = {
+		.Type = MT_WRITEBACK,
+		.EnableMtrr = TRUE
+	};
+
+	IA32_VMX_EPT_VPID_CAP_MSR EptVpidCap = {
+		.LargePdeSupport = TRUE
+	};
+
+	ShimSetMsr(IA32_MTRR_CAPABILITIES, 0);
+	ShimSetMsr(IA32_MTRR_DEFAULT_TYPE, DefaultType.Value);
+	ShimSetMsr(IA32_VMX_EPT_VPID_CAP, EptVpidCap.Value);
+
+	TEST_CHECK(NT_SUCCESS(MtrrInitialise()));
+	TEST_CHECK(NT_SUCCESS(MmHostReservePageTables(MM_MAX_HOST_PAGE_TABLES)));
+
+	SnapshotLegacyList();
+
+	PEPT_PTE Pml4 = NULL;
+	UINT64 Pml4PhysAddr = 0;
+	TEST_CHECK(NT_SUCCESS(MmAllocateHostPageTable(&Pml4, &Pml4PhysAddr)));
+
+	const double MapStart = TestNow();
+	TEST_CHECK(NT_SUCCESS(EptMapMemoryRange(Pml4, 0, 0, WALK_MAP_SIZE, EPT_PAGE_RWX)));
+	const double MapElapsed = TestNow() - MapStart;
+
+	UINT64 Seed = 0xD1B54A32D192ED03;
+	for (SIZE_T i = 0; i < WALK_SPLIT_COUNT; i++)
+	{
+		const UINT64 Page = (NextRandom(&Seed) % WALK_MAP_SIZE) & ~(PAGE_SIZE - 1);
+		TEST_CHECK(NT_SUCCESS(EptMapMemoryRange(Pml4, Page, Page, PAGE_SIZE, EPT_PAGE_READ)));
+	}
+
+	MM_HOST_PT_STATS Stats;
+	MmGetHostPageTableStats(&Stats);
+
+	// Both lookups have to agree and every address must still be identity mapped
+	for (SIZE_T i = 0; i < 100000; i++)
+	{
+		const UINT64 GuestPhysAddr = NextRandom(&Seed) % WALK_MAP_SIZE;
+
+		PEPT_PTE Leaf = WalkLeaf(Pml4, GuestPhysAddr, IndexedLookup);
+		TEST_CHECK(Leaf == WalkLeaf(Pml4, GuestPhysAddr, LegacyLookup));
+		TEST_CHECK(Leaf->Present);
+
+		const UINT64 LeafSize = Leaf->LargePage ? MB(2) : PAGE_SIZE;
+		TEST_CHECK_EQ(PAGE_ADDRESS(Leaf->PageFrameNumber), GuestPhysAddr & ~(LeafSize - 1));
+		TEST_CHECK_EQ(Leaf->MemoryType, MT_WRITEBACK);
+	}
+
+	const double IndexedNs = BenchWalks(Pml4, IndexedLookup, WalkCount);
+	const double LegacyNs = BenchWalks(Pml4, LegacyLookup, WalkCount);
+
+	printf("mapped %llu GB in %.2f ms, %llu page tables in use\n",
+		(unsigned long long)(WALK_MAP_SIZE / GB(1)), MapElapsed * 1e3, (unsigned long long)Stats.Allocations);
+	printf("%zu walks: list scan %.1f ns/walk, PFN index %.1f ns/walk (%.0fx)\n",
+		WalkCount, LegacyNs, IndexedNs, LegacyNs / IndexedNs);
+
+	return 0;
+}
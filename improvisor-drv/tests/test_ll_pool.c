@@ -0,0 +1,215 @@
+#include <improvisor.h>
+#include <ll.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <test.h>
+
+// Contention benchmark for LINKED_LIST_POOL: every thread stands in for a VCPU and repeatedly allocates and frees
+// a few elements, like mapping VPTEs during a page walk does. Each element records its owner while allocated, so
+// an element handed out twice at once is caught
+
+#define POOL_ELEMENT_COUNT 4096
+#define POOL_BURST_SIZE 4
+#define POOL_MAX_THREADS 32
+
+typedef struct _POOL_ELEMENT
+{
+	LIST_ENTRY Links;
+	volatile LONG Owner;
+} POOL_ELEMENT, *PPOOL_ELEMENT;
+
+typedef struct _POOL_THREAD
+{
+	pthread_t Thread;
+	PLINKED_LIST_POOL Pool;
+	BOOLEAN PerCpu;
+	SIZE_T Cpu;
+	SIZE_T Iterations;
+	double Start;
+	double End;
+} POOL_THREAD, *PPOOL_THREAD;
+
+static pthread_barrier_t sStartBarrier;
+
+static VOID
+ClaimElement(
+	_In_ PPOOL_ELEMENT Element,
+	_In_ LONG Owner
+)
+{
+	TEST_CHECK(Element != NULL);
+	TEST_CHECK(InterlockedCompareExchange(&Element->Owner, Owner, 0) == 0);
+}
+
+static VOID
+ReleaseElement(
+	_In_ PPOOL_ELEMENT Element,
+	_In_ LONG Owner
+)
+{
+	TEST_CHECK(InterlockedCompareExchange(&Element->Owner, 0, Owner) == Owner);
+}
+
+static PVOID
+PoolThread(
+	_In_ PVOID Context
+)
+{
+	PPOOL_THREAD Thread = Context;
+	PLINKED_LIST_POOL Pool = Thread->Pool;
+
+	const LONG Owner = (LONG)Thread->Cpu + 1;
+
+	ShimSetProcessorNumber((ULONG)Thread->Cpu);
+
+	pthread_barrier_wait(&sStartBarrier);
+
+	Thread->Start = TestNow();
+
+	PPOOL_ELEMENT Burst[POOL_BURST_SIZE];
+
+	for (SIZE_T i = 0; i < Thread->Iterations; i++)
+	{
+		for (SIZE_T j = 0; j < POOL_BURST_SIZE; j++)
+		{
+			Burst[j] = Thread->PerCpu ? LlAllocateLocal(Pool, Thread->Cpu) : LlAllocate(Pool);
+			ClaimElement(Burst[j], Owner);
+		}
+
+		for (SIZE_T j = POOL_BURST_SIZE; j-- > 0;)
+		{
+			ReleaseElement(Burst[j], Owner);
+
+			if (Thread->PerCpu)
+				LlFreeLocal(Pool, Thread->Cpu, &Burst[j]->Links);
+			else
+				LlFree(Pool, &Burst[j]->Links);
+		}
+	}
+
+	Thread->End = TestNow();
+
+	return NULL;
+}
+
+static double
+RunContention(
+	_In_ UINT32 Flags,
+	_In_ SIZE_T ThreadCount,
+	_In_ SIZE_T Iterations
+)
+/*++
+Routine Description:
+	Runs `ThreadCount` threads against a fresh pool created with `Flags`, returning the average time of an
+	allocation and free pair in nanoseconds
+--*/
+{
+	static POOL_THREAD Threads[POOL_MAX_THREADS];
+	LINKED_LIST_POOL Pool;
+
+	TEST_CHECK(NT_SUCCESS(LlCreatePool(&Pool, FIELD_OFFSET(POOL_ELEMENT, Links), sizeof(POOL_ELEMENT), POOL_ELEMENT_COUNT, Flags)));
+
+	for (SIZE_T i = 0; i < POOL_ELEMENT_COUNT; i++)
+		((PPOOL_ELEMENT)LlElementAt(&Pool, i))->Owner = 0;
+
+	pthread_barrier_init(&sStartBarrier, NULL, (unsigned)ThreadCount);
+
+	for (SIZE_T i = 0; i < ThreadCount; i++)
+	{
+		Threads[i].Pool = &Pool;
+		Threads[i].PerCpu = (Flags & LL_POOL_PER_CPU) != 0;
+		Threads[i].Cpu = i;
+		Threads[i].Iterations = Iterations;
+
+		TEST_CHECK(pthread_create(&Threads[i].Thread, NULL, PoolThread, &Threads[i]) == 0);
+	}
+
+	double Start = 0, End = 0;
+	for (SIZE_T i = 0; i < ThreadCount; i++)
+	{
+		pthread_join(Threads[i].Thread, NULL);
+
+		Start = (i == 0 || Threads[i].Start < Start) ? Threads[i].Start : Start;
+		End = Threads[i].End > End ? Threads[i].End : End;
+	}
+
+	pthread_barrier_destroy(&sStartBarrier);
+
+	TEST_CHECK_EQ(LlGetUsedCount(&Pool), 0);
+	if (Flags & LL_POOL_ENUMERABLE)
+		TEST_CHECK(LlIsEmpty(&Pool));
+
+	ImpFreeAllocation(Pool.Buffer);
+	if (Pool.Magazines != NULL)
+		ImpFreeAllocation(Pool.Magazines);
+
+	// Threads run side by side, so this is the wall time of one allocation and free on a single thread
+	return (End - Start) * 1e9 / (Iterations * POOL_BURST_SIZE);
+}
+
+static VOID
+TestCrossCpuFree(VOID)
+/*++
+Routine Description:
+	Elements freed on another CPU than they were allocated on end up in that CPU's magazine, the pool must
+	still account for them and hand every element out again
+--*/
+{
+	LINKED_LIST_POOL Pool;
+	TEST_CHECK(NT_SUCCESS(LL_CREATE_PER_CPU_POOL(&Pool, POOL_ELEMENT, 256)));
+
+	static PPOOL_ELEMENT Elements[256];
+
+	for (SIZE_T i = 0; i < 256; i++)
+	{
+		Elements[i] = LlAllocateLocal(&Pool, 0);
+		TEST_CHECK(Elements[i] != NULL);
+	}
+
+	TEST_CHECK(LlAllocateLocal(&Pool, 0) == NULL);
+	TEST_CHECK_EQ(LlGetUsedCount(&Pool), 256);
+
+	for (SIZE_T i = 0; i < 256; i++)
+		LlFreeLocal(&Pool, 1 + i % 3, &Elements[i]->Links);
+
+	TEST_CHECK_EQ(LlGetUsedCount(&Pool), 0);
+	TEST_CHECK(LlIsEmpty(&Pool));
+
+	// Everything stranded in the other magazines is flushed back eventually, but CPU 0 can always get at
+	// what reached the depot
+	SIZE_T Count = 0;
+	while (LlAllocateLocal(&Pool, 0) != NULL)
+		Count++;
+
+	TEST_CHECK(Count >= 256 - 3 * Pool.MagazineCapacity);
+}
+
+int
+main(int argc, char** argv)
+{
+	const SIZE_T Iterations = argc > 1 ? strtoull(argv[1], NULL, 0) : 200000;
+
+	// VCPUs are never preempted in the host, but threads are. More threads than CPUs would measure lock holders
+	// being preempted with waiters spinning behind them, so there is one thread per CPU at most
+	const long CpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	const SIZE_T ThreadCount = CpuCount > POOL_MAX_THREADS ? POOL_MAX_THREADS : (SIZE_T)CpuCount;
+
+	TestCrossCpuFree();
+
+	printf("%zu threads, %zu iterations of %d allocations each:\n", ThreadCount, Iterations, POOL_BURST_SIZE);
+
+	const UINT32 Configs[] = { LL_POOL_ENUMERABLE, 0, LL_POOL_PER_CPU };
+	const char* Names[] = { "shared, enumerable", "shared", "per-CPU magazines" };
+
+	for (SIZE_T i = 0; i < sizeof(Configs) / sizeof(*Configs); i++)
+	{
+		const double SingleNs = RunContention(Configs[i], 1, Iterations);
+		const double ContendedNs = RunContention(Configs[i], ThreadCount, Iterations);
+
+		printf("  %-20s %7.1f ns uncontended, %7.1f ns with %zu threads\n", Names[i], SingleNs, ContendedNs, ThreadCount);
+	}
+
+	return 0;
+}
@@ -0,0 +1,172 @@
+#include <improvisor.h>
+#include <arch/msr.h>
+#include <vcpu/vcpu.h>
+#include <ll.h>
+
+#include <stdio.h>
+
+#include <test.h>
+
+// Benchmark of logging from the VM-exit path into the per-VCPU binary log rings, against the pool of formatted
+// records they replaced, which took a record from a locked pool and formatted the message into it. The host is
+// simulated by pointing the FS base at a VCPU. Also checks that:
+//
+//  - entries go into the ring of the VCPU whose host is running, and into the guest ring otherwise
+//  - only the arguments actually passed are stored, the remaining slots are cleared
+
+#define LOG_VCPU_COUNT 4
+// Entries logged before the consumer catches up, well under a ring's size so none are dropped
+#define LOG_BATCH_SIZE 256
+// Size of each record in the formatted pool
+#define LOG_RECORD_SIZE 512
+
+#define LOG_EXIT_FORMAT "[%02X-#%03d]: VM-exit - Type: %i - RIP: %llX - EXIT QUAL: %llX\n"
+
+typedef struct _LOG_RECORD
+{
+	LIST_ENTRY Links;
+	CHAR Buffer[LOG_RECORD_SIZE];
+} LOG_RECORD, *PLOG_RECORD;
+
+static VCPU sVcpus[LOG_VCPU_COUNT];
+
+static VOID
+PoolLog(
+	_Inout_ PLINKED_LIST_POOL Pool,
+	_In_ LPCSTR Fmt, ...
+)
+{
+	PLOG_RECORD Record = LlAllocate(Pool);
+	if (Record == NULL)
+		return;
+
+	va_list Args;
+	va_start(Args, Fmt);
+	vsnprintf(Record->Buffer, sizeof(Record->Buffer), Fmt, Args);
+	va_end(Args);
+}
+
+static VOID
+CheckRouting(VOID)
+{
+	IMP_LOG_ENTRY Entry;
+
+	// Any FS base that isn't a VCPU is the guest's
+	ShimSetMsr(IA32_FS_BASE, 0x7FF7A0000000);
+
+	ImpLog("Guest %llX %llX\n", 0x11ULL, 0x22ULL);
+
+	TEST_CHECK(NT_SUCCESS(ImpRetrieveLogEntry(&Entry)));
+	TEST_CHECK_EQ(Entry.VcpuId, IMP_LOG_GUEST_VCPU);
+	TEST_CHECK_EQ(Entry.Args[0], 0x11);
+	TEST_CHECK_EQ(Entry.Args[1], 0x22);
+
+	for (SIZE_T i = 2; i < IMP_LOG_MAX_ARGS; i++)
+		TEST_CHECK_EQ(Entry.Args[i], 0);
+
+	ShimSetMsr(IA32_FS_BASE, (UINT64)&sVcpus[2]);
+
+	ImpLog("Host %llX\n", 0x33ULL);
+	IMP_LOG_ERROR(IMP_LOG_GENERAL, "No arguments\n");
+
+	TEST_CHECK(NT_SUCCESS(ImpRetrieveLogEntry(&Entry)));
+	TEST_CHECK_EQ(Entry.VcpuId, 2);
+	TEST_CHECK_EQ(Entry.Args[0], 0x33);
+
+	for (SIZE_T i = 1; i < IMP_LOG_MAX_ARGS; i++)
+		TEST_CHECK_EQ(Entry.Args[i], 0);
+
+	TEST_CHECK(NT_SUCCESS(ImpRetrieveLogEntry(&Entry)));
+	TEST_CHECK_EQ(Entry.VcpuId, 2);
+	TEST_CHECK_EQ(Entry.Level, IMP_LOG_LEVEL_ERROR);
+
+	for (SIZE_T i = 0; i < IMP_LOG_MAX_ARGS; i++)
+		TEST_CHECK_EQ(Entry.Args[i], 0);
+
+	TEST_CHECK(ImpRetrieveLogEntry(&Entry) == STATUS_NO_MORE_ENTRIES);
+}
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	const SIZE_T Iterations = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000;
+	const SIZE_T BatchCount = (Iterations + LOG_BATCH_SIZE - 1) / LOG_BATCH_SIZE;
+
+	TEST_CHECK(NT_SUCCESS(ImpReserveLogRings(LOG_VCPU_COUNT)));
+
+	for (UINT8 i = 0; i < LOG_VCPU_COUNT; i++)
+		sVcpus[i].Id = i;
+
+	ImpBindLogRings(sVcpus);
+
+	CheckRouting();
+
+	LINKED_LIST_POOL Pool = { 0 };
+	TEST_CHECK(NT_SUCCESS(LL_CREATE_POOL(&Pool, LOG_RECORD, LOG_BATCH_SIZE)));
+
+	double PoolProduce = 0, PoolConsume = 0;
+	SIZE_T PoolConsumed = 0;
+
+	for (SIZE_T Batch = 0; Batch < BatchCount; Batch++)
+	{
+		double Start = TestNow();
+
+		for (SIZE_T i = 0; i < LOG_BATCH_SIZE; i++)
+			PoolLog(&Pool, LOG_EXIT_FORMAT, 0, (INT)i, 48, 0xFFFFF80012345678ULL + i, 0x181ULL);
+
+		PoolProduce += TestNow() - Start;
+		Start = TestNow();
+
+		for (PLOG_RECORD Record = LlBegin(&Pool); Record != NULL; Record = LlBegin(&Pool))
+		{
+			LlFree(&Pool, &Record->Links);
+			PoolConsumed++;
+		}
+
+		PoolConsume += TestNow() - Start;
+	}
+
+	// Log as the host of VCPU 0, like the VM-exit handler would
+	ShimSetMsr(IA32_FS_BASE, (UINT64)&sVcpus[0]);
+
+	double RingProduce = 0, RingConsume = 0;
+	SIZE_T RingConsumed = 0;
+
+	for (SIZE_T Batch = 0; Batch < BatchCount; Batch++)
+	{
+		double Start = TestNow();
+
+		for (SIZE_T i = 0; i < LOG_BATCH_SIZE; i++)
+			ImpLog(LOG_EXIT_FORMAT, 0, (INT)i, 48, 0xFFFFF80012345678ULL + i, 0x181ULL);
+
+		RingProduce += TestNow() - Start;
+		Start = TestNow();
+
+		IMP_LOG_ENTRY Entry;
+		while (NT_SUCCESS(ImpRetrieveLogEntry(&Entry)))
+		{
+			TEST_CHECK_EQ(Entry.Args[1], RingConsumed % LOG_BATCH_SIZE);
+			RingConsumed++;
+		}
+
+		RingConsume += TestNow() - Start;
+	}
+
+	const SIZE_T Logged = BatchCount * LOG_BATCH_SIZE;
+
+	TEST_CHECK_EQ(PoolConsumed, Logged);
+	TEST_CHECK_EQ(RingConsumed, Logged);
+	TEST_CHECK_EQ(ImpGetLogOverflowCount(), 0);
+
+	printf("%zu VM-exit entries of 5 arguments, consumed every %d:\n", Logged, LOG_BATCH_SIZE);
+	printf("                               per entry logged   per entry consumed\n");
+	printf("  formatted record pool:         %8.1f ns          %8.1f ns\n",
+		PoolProduce * 1e9 / Logged, PoolConsume * 1e9 / Logged);
+	printf("  binary log rings:              %8.1f ns          %8.1f ns\n",
+		RingProduce * 1e9 / Logged, RingConsume * 1e9 / Logged);
+
+	return 0;
+}
@@ -0,0 +1,184 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <vcpu/vmcall.h>
+#include <vcpu/logstream.h>
+#include <mm/vpte.h>
+#include <mm/dmap.h>
+#include <mm/mm.h>
+
+#include <test.h>
+
+// Owner teardown test of the log stream. User-mode has a single address space, so the stream's pages double as
+// guest physical memory. Checks that:
+//
+//  - drained entries land in the stream in order and the head is published
+//  - nothing is written to the stream once any of its pages is unmapped from the client, and entries that
+//    weren't written stay in the log rings
+//  - only the exit of the process that registered the stream unregisters it
+
+#define TEST_DIRBASE 0x1AB000
+#define TEST_OWNER_ID 0x1234
+#define TEST_STREAM_SIZE (PAGE_SIZE * BYTES_TO_PAGES(sizeof(HYPERCALL_LOG_STREAM)))
+
+static PHYPERCALL_LOG_STREAM sStream;
+
+// Page frame of the stream that has disappeared from the client's address space, if not 0
+static UINT64 sUnmappedPfn = 0;
+
+NTSTATUS
+MmTranslateGuestVirt(
+	_In_ UINT64 TargetCr3,
+	_In_ UINT64 VirtAddr,
+	_Out_ PUINT64 PhysAddr
+)
+{
+	TEST_CHECK_EQ(TargetCr3, TEST_DIRBASE);
+
+	if (PAGE_FRAME_NUMBER(VirtAddr) == sUnmappedPfn)
+		return STATUS_INVALID_PARAMETER;
+
+	*PhysAddr = VirtAddr;
+	return STATUS_SUCCESS;
+}
+
+PVOID
+MmGetDirectMapAddress(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+)
+{
+	UNREFERENCED_PARAMETER(Size);
+
+	// Writing to a page after it's unmapped is what the stream must never do
+	TEST_CHECK(PAGE_FRAME_NUMBER(PhysAddr) != sUnmappedPfn);
+
+	return (PVOID)PhysAddr;
+}
+
+// Everything is reached through the direct map, so the VPTE fallback is never taken
+
+NTSTATUS
+MmAllocateVpte(
+	_Out_ PMM_VPTE* pVpte
+)
+{
+	*pVpte = NULL;
+	return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+MmFreeVpte(
+	_Inout_ PMM_VPTE Vpte
+)
+{
+	UNREFERENCED_PARAMETER(Vpte);
+}
+
+VOID
+MmMapGuestPhys(
+	_Inout_ PMM_VPTE Vpte,
+	_In_ UINT64 PhysAddr
+)
+{
+	UNREFERENCED_PARAMETER(Vpte);
+	UNREFERENCED_PARAMETER(PhysAddr);
+}
+
+static VOID
+Register(VOID)
+{
+	memset(sStream, 0, TEST_STREAM_SIZE);
+
+	sUnmappedPfn = 0;
+
+	TEST_CHECK(NT_SUCCESS(VmLogStreamRegister(TEST_DIRBASE, TEST_OWNER_ID, (UINT64)sStream)));
+}
+
+static VOID
+LogSequence(
+	_In_ UINT64 Start,
+	_In_ UINT64 Count
+)
+{
+	for (UINT64 i = Start; i < Start + Count; i++)
+		ImpLog("Entry %llu\n", i);
+}
+
+static VOID
+CheckStream(
+	_In_ UINT64 Start,
+	_In_ UINT64 Count
+)
+{
+	for (UINT64 i = Start; i < Start + Count; i++)
+		TEST_CHECK_EQ(sStream->Entries[i & (VM_LOG_STREAM_ENTRY_COUNT - 1)].Args[0], i);
+}
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	UNREFERENCED_PARAMETER(argc);
+	UNREFERENCED_PARAMETER(argv);
+
+	TEST_CHECK(NT_SUCCESS(ImpReserveLogRings(1)));
+
+	// Only the entries logged by the test itself end up in the rings
+	ImpSetLogCategories(0, IMP_LOG_ALL_CATEGORIES);
+
+	sStream = aligned_alloc(PAGE_SIZE, TEST_STREAM_SIZE);
+	TEST_CHECK(sStream != NULL);
+
+	Register();
+
+	LogSequence(0, 100);
+
+	TEST_CHECK(VmLogStreamDrain(VM_LOG_STREAM_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sStream->Head, 100);
+	TEST_CHECK_EQ(ImpGetPendingLogCount(), 0);
+	CheckStream(0, 100);
+
+	// Another process exiting leaves the stream alone
+	VmLogStreamReleaseProcess(TEST_OWNER_ID + 4);
+
+	sStream->Tail = 100;
+	LogSequence(100, 100);
+
+	TEST_CHECK(VmLogStreamDrain(VM_LOG_STREAM_DRAIN_BATCH, FALSE));
+	TEST_CHECK_EQ(sStream->Head, 100 + VM_LOG_STREAM_DRAIN_BATCH);
+	CheckStream(100, VM_LOG_STREAM_DRAIN_BATCH);
+
+	// The page the next entry goes into disappears, the drain must stop before taking it from its ring
+	sUnmappedPfn = PAGE_FRAME_NUMBER(&sStream->Entries[sStream->Head & (VM_LOG_STREAM_ENTRY_COUNT - 1)]);
+
+	const UINT64 Pending = ImpGetPendingLogCount();
+
+	TEST_CHECK(!VmLogStreamDrain(VM_LOG_STREAM_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sStream->Head, 100 + VM_LOG_STREAM_DRAIN_BATCH);
+	TEST_CHECK_EQ(ImpGetPendingLogCount(), Pending);
+
+	// The stream stays unregistered, even once the page is back
+	sUnmappedPfn = 0;
+	TEST_CHECK(!VmLogStreamDrain(VM_LOG_STREAM_ENTRY_COUNT, TRUE));
+
+	// Registering again delivers what is still pending, then the owner exits
+	Register();
+
+	TEST_CHECK(VmLogStreamDrain(VM_LOG_STREAM_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sStream->Head, Pending);
+
+	for (UINT64 i = 0; i < Pending; i++)
+		TEST_CHECK_EQ(sStream->Entries[i].Args[0], 100 + VM_LOG_STREAM_DRAIN_BATCH + i);
+
+	VmLogStreamReleaseProcess(TEST_OWNER_ID);
+
+	LogSequence(200, 1);
+	TEST_CHECK(!VmLogStreamDrain(VM_LOG_STREAM_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(ImpGetPendingLogCount(), 1);
+
+	free(sStream);
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+#include <improvisor.h>
+#include <arch/msr.h>
+#include <vcpu/vcpu.h>
+#include <vcpu/msr.h>
+#include <vmx.h>
+
+#include <test.h>
+
+// Compiles the MSR policy into an MSR bitmap and checks the RDMSR/WRMSR handlers find and apply every entry of it,
+// and nothing else
+
+static VCPU sVcpu;
+static DECLSPEC_ALIGN(4096) CHAR sMsrBitmap[PAGE_SIZE];
+
+static BOOLEAN
+TestBitmapBit(
+	_In_ SIZE_T Offset,
+	_In_ UINT32 Msr
+)
+{
+	const SIZE_T Bit = Msr & 0x1FFF;
+
+	return (sMsrBitmap[Offset + Bit / 8] >> (Bit % 8)) & 1;
+}
+
+static BOOLEAN
+IsReadIntercepted(
+	_In_ UINT32 Msr
+)
+{
+	return TestBitmapBit(VMX_MSR_READ_BITMAP_OFFS + (Msr >= 0xC0000000 ? VMX_MSR_HI_BITMAP_OFFS : VMX_MSR_LO_BITMAP_OFFS), Msr);
+}
+
+static BOOLEAN
+IsWriteIntercepted(
+	_In_ UINT32 Msr
+)
+{
+	return TestBitmapBit(VMX_MSR_WRITE_BITMAP_OFFS + (Msr >= 0xC0000000 ? VMX_MSR_HI_BITMAP_OFFS : VMX_MSR_LO_BITMAP_OFFS), Msr);
+}
+
+static VOID
+SetupVcpu(VOID)
+/*++
+Routine Description:
+	Sets up the MSR bitmap views the same way VcpuSetup does
+--*/
+{
+	RtlZeroMemory(&sVcpu, sizeof(sVcpu));
+	RtlZeroMemory(sMsrBitmap, sizeof(sMsrBitmap));
+
+	sVcpu.MsrBitmap = sMsrBitmap;
+
+	RtlInitializeBitMap(&sVcpu.MsrLoReadBitmap, sMsrBitmap + VMX_MSR_READ_BITMAP_OFFS + VMX_MSR_LO_BITMAP_OFFS, 1024 * 8);
+	RtlInitializeBitMap(&sVcpu.MsrHiReadBitmap, sMsrBitmap + VMX_MSR_READ_BITMAP_OFFS + VMX_MSR_HI_BITMAP_OFFS, 1024 * 8);
+	RtlInitializeBitMap(&sVcpu.MsrLoWriteBitmap, sMsrBitmap + VMX_MSR_WRITE_BITMAP_OFFS + VMX_MSR_LO_BITMAP_OFFS, 1024 * 8);
+	RtlInitializeBitMap(&sVcpu.MsrHiWriteBitmap, sMsrBitmap + VMX_MSR_WRITE_BITMAP_OFFS + VMX_MSR_HI_BITMAP_OFFS, 1024 * 8);
+}
+
+static VOID
+TestBitmap(VOID)
+{
+	SetupVcpu();
+
+	TEST_CHECK(NT_SUCCESS(VcpuMsrApplyPolicy(&sVcpu)));
+
+	// Emulated in both directions
+	TEST_CHECK(IsReadIntercepted(IA32_FEATURE_CONTROL));
+	TEST_CHECK(IsWriteIntercepted(IA32_FEATURE_CONTROL));
+
+	// Only writes are logged
+	TEST_CHECK(!IsReadIntercepted(IA32_SYSENTER_EIP));
+	TEST_CHECK(IsWriteIntercepted(IA32_SYSENTER_EIP));
+	TEST_CHECK(!IsReadIntercepted(IA32_LSTAR));
+	TEST_CHECK(IsWriteIntercepted(IA32_LSTAR));
+	TEST_CHECK(!IsReadIntercepted(IA32_CSTAR));
+	TEST_CHECK(IsWriteIntercepted(IA32_CSTAR));
+
+	// Everything else is passed through
+	SIZE_T SetBits = 0;
+	for (SIZE_T i = 0; i < sizeof(sMsrBitmap); i++)
+		SetBits += __builtin_popcount((UCHAR)sMsrBitmap[i]);
+
+	TEST_CHECK_EQ(SetBits, 5);
+}
+
+static VOID
+TestDispatch(VOID)
+{
+	UINT64 Value = 0;
+
+	SetupVcpu();
+	ShimResetMsrs();
+
+	ShimSetMsr(IA32_FEATURE_CONTROL, 0x5);
+	ShimSetMsr(IA32_LSTAR, 0xFFFFF80000001000);
+
+	VcpuMsrInitialiseShadows(&sVcpu);
+
+	// Set by VMXON after the shadows were taken, the guest must not see it
+	ShimSetMsr(IA32_FEATURE_CONTROL, 0x7);
+
+	TEST_CHECK(VcpuMsrRead(&sVcpu, IA32_FEATURE_CONTROL, &Value));
+	TEST_CHECK_EQ(Value, 0x5);
+
+	// Emulated writes only reach the shadow
+	TEST_CHECK(VcpuMsrWrite(&sVcpu, IA32_FEATURE_CONTROL, 0x1));
+	TEST_CHECK(VcpuMsrRead(&sVcpu, IA32_FEATURE_CONTROL, &Value));
+	TEST_CHECK_EQ(Value, 0x1);
+	TEST_CHECK_EQ(__readmsr(IA32_FEATURE_CONTROL), 0x7);
+
+	// Logged writes reach the hardware
+	TEST_CHECK(VcpuMsrWrite(&sVcpu, IA32_LSTAR, 0xFFFFF80000002000));
+	TEST_CHECK_EQ(__readmsr(IA32_LSTAR), 0xFFFFF80000002000);
+	TEST_CHECK(VcpuMsrRead(&sVcpu, IA32_LSTAR, &Value));
+	TEST_CHECK_EQ(Value, 0xFFFFF80000002000);
+
+	TEST_CHECK(VcpuMsrWrite(&sVcpu, IA32_SYSENTER_EIP, 0x1234));
+	TEST_CHECK_EQ(__readmsr(IA32_SYSENTER_EIP), 0x1234);
+	TEST_CHECK(VcpuMsrWrite(&sVcpu, IA32_CSTAR, 0x5678));
+	TEST_CHECK_EQ(__readmsr(IA32_CSTAR), 0x5678);
+
+	// MSRs without a policy entry, on either side of and between the entries, aren't found
+	static const UINT32 Unknown[] = {
+		0, IA32_FEATURE_CONTROL - 1, IA32_FEATURE_CONTROL + 1, IA32_SYSENTER_EIP - 1, IA32_SYSENTER_EIP + 1,
+		0x1FFF, 0xC0000000, IA32_LSTAR - 1, IA32_CSTAR + 1, 0xC0001FFF, 0xFFFFFFFF
+	};
+
+	for (SIZE_T i = 0; i < sizeof(Unknown) / sizeof(*Unknown); i++)
+	{
+		TEST_CHECK(!VcpuMsrRead(&sVcpu, Unknown[i], &Value));
+		TEST_CHECK(!VcpuMsrWrite(&sVcpu, Unknown[i], 0));
+	}
+}
+
+int
+main(VOID)
+{
+	TestBitmap();
+	TestDispatch();
+
+	return 0;
+}
@@ -0,0 +1,174 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <arch/msr.h>
+#include <arch/mtrr.h>
+
+#include <test.h>
+
+// Feeds synthetic MTRR MSRs to MtrrInitialise and checks the resolved region table
+
+#define MTRR_TEST_PHYS_LIMIT (1ULL << 48)
+
+static VOID
+SetVariableRange(
+	_In_ SIZE_T Index,
+	_In_ UINT64 Base,
+	_In_ UINT64 Size,
+	_In_ MEMORY_TYPE Type
+)
+{
+	IA32_MTRR_PHYSBASE_N_MSR PhysBase = {
+		.Type = Type,
+		.Base = PAGE_FRAME_NUMBER(Base)
+	};
+
+	IA32_MTRR_PHYSMASK_N_MSR PhysMask = {
+		.Valid = TRUE,
+		.Mask = PAGE_FRAME_NUMBER(~(Size - 1) & (MTRR_TEST_PHYS_LIMIT - 1))
+	};
+
+	ShimSetMsr(IA32_MTRR_PHYSBASE_0 + Index * 2, PhysBase.Value);
+	ShimSetMsr(IA32_MTRR_PHYSMASK_0 + Index * 2, PhysMask.Value);
+}
+
+static VOID
+SetFixedRange(
+	_In_ ULONG Msr,
+	_In_ MEMORY_TYPE Type
+)
+{
+	IA32_MTRR_FIXED_RANGE_MSR FixedRange;
+	for (SIZE_T i = 0; i < 8; i++)
+		FixedRange.Types[i] = (UINT8)Type;
+
+	ShimSetMsr(Msr, FixedRange.Value);
+}
+
+static VOID
+SetupMtrrs(
+	_In_ BOOLEAN EnableMtrr,
+	_In_ BOOLEAN EnableFixedMtrr
+)
+/*++
+Routine Description:
+	Describes a machine with WB by default and:
+	- [0, 0xA0000) WB, [0xA0000, 0xC0000) UC, [0xC0000, 0xC8000) WT, [0xC8000, 1MB) WB through the fixed ranges,
+	  with a UC variable range underneath them all
+	- [3GB, 4GB) UC overlapping a WT range, UC has to win
+	- [4GB, 8GB) WT overlapping a WB range, WT has to win
+	- [16GB, 17GB) WC overlapping a WB range, which is undefined and has to resolve to UC
+--*/
+{
+	ShimResetMsrs();
+
+	IA32_MTRR_CAPABILITIES_MSR MtrrCap = {
+		.VariableRangeRegCount = 7,
+		.FixedRangeRegSupport = TRUE
+	};
+
+	IA32_MTRR_DEFAULT_TYPE_MSR DefaultType = {
+		.Type = MT_WRITEBACK,
+		.EnableFixedMtrr = EnableFixedMtrr,
+		.EnableMtrr = EnableMtrr
+	};
+
+	ShimSetMsr(IA32_MTRR_CAPABILITIES, MtrrCap.Value);
+	ShimSetMsr(IA32_MTRR_DEFAULT_TYPE, DefaultType.Value);
+
+	SetVariableRange(0, GB(3), GB(1), MT_UNCACHABLE);
+	SetVariableRange(1, GB(3), MB(256), MT_WRITE_THROUGH);
+	SetVariableRange(2, GB(4), GB(4), MT_WRITE_THROUGH);
+	SetVariableRange(3, GB(4), GB(1), MT_WRITEBACK);
+	SetVariableRange(4, 0, MB(1), MT_UNCACHABLE);
+	SetVariableRange(5, GB(16), GB(1), MT_WRITE_COMBINING);
+	SetVariableRange(6, GB(16), GB(2), MT_WRITEBACK);
+
+	SetFixedRange(IA32_MTRR_FIX64K_00000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX16K_80000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX16K_A0000, MT_UNCACHABLE);
+	SetFixedRange(IA32_MTRR_FIX4K_C0000, MT_WRITE_THROUGH);
+	SetFixedRange(IA32_MTRR_FIX4K_C8000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX4K_D0000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX4K_D8000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX4K_E0000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX4K_E8000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX4K_F0000, MT_WRITEBACK);
+	SetFixedRange(IA32_MTRR_FIX4K_F8000, MT_WRITEBACK);
+
+	TEST_CHECK(NT_SUCCESS(MtrrInitialise()));
+}
+
+static VOID
+TestPrecedence(VOID)
+{
+	SetupMtrrs(TRUE, TRUE);
+
+	// Fixed ranges override the UC variable range below 1MB, adjacent WB ranges are merged
+	TEST_CHECK_EQ(MtrrGetRegionType(0), MT_WRITEBACK);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(0), 0xA0000);
+	TEST_CHECK_EQ(MtrrGetRegionType(0xA0000), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetRegionType(0xBF000), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetRegionType(0xC0000), MT_WRITE_THROUGH);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(0xC1000), 0x7000);
+	TEST_CHECK_EQ(MtrrGetRegionType(0xC8000), MT_WRITEBACK);
+
+	// WB from the fixed ranges runs on through the default type until the UC range at 3GB
+	TEST_CHECK_EQ(MtrrGetUniformExtent(0xC8000), GB(3) - 0xC8000);
+	TEST_CHECK_EQ(MtrrGetRegionEnd(MB(1)), GB(3));
+
+	// UC beats WT
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(3)), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(3) + MB(100)), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(GB(3)), GB(1));
+
+	// WT beats WB
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(4)), MT_WRITE_THROUGH);
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(5)), MT_WRITE_THROUGH);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(GB(4)), GB(4));
+	TEST_CHECK_EQ(MtrrGetUniformExtent(GB(8) - PAGE_SIZE), PAGE_SIZE);
+
+	// WC overlapping WB is undefined and treated as UC, the rest of the WB range merges with the default type
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(8)), MT_WRITEBACK);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(GB(8)), GB(8));
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(16)), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(GB(16)), GB(1));
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(17)), MT_WRITEBACK);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(GB(17)), MTRR_TEST_PHYS_LIMIT - GB(17));
+
+	// Nothing past the covered address space
+	TEST_CHECK_EQ(MtrrGetUniformExtent(MTRR_TEST_PHYS_LIMIT), 0);
+}
+
+static VOID
+TestFixedRangesDisabled(VOID)
+{
+	SetupMtrrs(TRUE, FALSE);
+
+	// Only the UC variable range applies below 1MB
+	TEST_CHECK_EQ(MtrrGetRegionType(0), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetRegionType(0xC0000), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(0), MB(1));
+	TEST_CHECK_EQ(MtrrGetRegionType(MB(1)), MT_WRITEBACK);
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(4)), MT_WRITE_THROUGH);
+}
+
+static VOID
+TestMtrrsDisabled(VOID)
+{
+	SetupMtrrs(FALSE, TRUE);
+
+	// With MTRRs disabled all of memory is UC, regardless of the ranges or the default type
+	TEST_CHECK_EQ(MtrrGetRegionType(0), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetRegionType(GB(4)), MT_UNCACHABLE);
+	TEST_CHECK_EQ(MtrrGetUniformExtent(0), MTRR_TEST_PHYS_LIMIT);
+}
+
+int
+main(VOID)
+{
+	TestPrecedence();
+	TestFixedRangesDisabled();
+	TestMtrrsDisabled();
+
+	return 0;
+}
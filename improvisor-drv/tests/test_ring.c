@@ -0,0 +1,368 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <vcpu/vmcall.h>
+#include <vcpu/ring.h>
+#include <mm/vpte.h>
+#include <mm/dmap.h>
+#include <mm/mm.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <test.h>
+
+// Producer/consumer stress test of the submission ring: a client thread submits hypercalls and reaps their
+// completions like the loader does, while VCPU threads drain the ring in bounded batches as if on VM-exits. User-
+// mode has a single address space, so the client's ring pages double as guest physical memory. Checks that:
+//
+//  - every submission completes exactly once and in order, over many laps of both rings
+//  - a full completion ring holds submissions back instead of overwriting completions not yet reaped
+//  - a drain never executes more than it was asked to, nor anything behind a tail the ring can't hold
+//  - nothing is written to the ring pages once they are unmapped from the client or it exits
+
+#define TEST_DIRBASE 0x1AB000
+#define TEST_OWNER_ID 0x1234
+#define TEST_MAX_VCPUS 4
+
+static PHYPERCALL_SUBMISSION_RING sSubmissionRing;
+static PHYPERCALL_COMPLETION_RING sCompletionRing;
+
+static VCPU sVcpus[TEST_MAX_VCPUS];
+
+// Set to make the ring pages disappear from the client's address space
+static volatile BOOLEAN sRingUnmapped = FALSE;
+
+static volatile LONG64 sExecuted = 0;
+static volatile LONG sExecuting = 0;
+
+static volatile BOOLEAN sStopDraining = FALSE;
+
+NTSTATUS
+MmTranslateGuestVirt(
+	_In_ UINT64 TargetCr3,
+	_In_ UINT64 VirtAddr,
+	_Out_ PUINT64 PhysAddr
+)
+{
+	UNREFERENCED_PARAMETER(TargetCr3);
+
+	if (sRingUnmapped)
+		return STATUS_INVALID_PARAMETER;
+
+	*PhysAddr = VirtAddr;
+	return STATUS_SUCCESS;
+}
+
+PVOID
+MmGetDirectMapAddress(
+	_In_ UINT64 PhysAddr,
+	_In_ SIZE_T Size
+)
+{
+	UNREFERENCED_PARAMETER(Size);
+	return (PVOID)PhysAddr;
+}
+
+// Everything is reached through the direct map, so the VPTE fallback is never taken
+
+NTSTATUS
+MmAllocateVpte(
+	_Out_ PMM_VPTE* pVpte
+)
+{
+	*pVpte = NULL;
+	return STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+MmFreeVpte(
+	_Inout_ PMM_VPTE Vpte
+)
+{
+	UNREFERENCED_PARAMETER(Vpte);
+}
+
+VOID
+MmMapGuestPhys(
+	_Inout_ PMM_VPTE Vpte,
+	_In_ UINT64 PhysAddr
+)
+{
+	UNREFERENCED_PARAMETER(Vpte);
+	UNREFERENCED_PARAMETER(PhysAddr);
+}
+
+VMM_EVENT_STATUS
+VmDispatchHypercall(
+	_In_ PVCPU Vcpu,
+	_In_ UINT64 GuestCr3,
+	_In_ PGUEST_STATE GuestState,
+	_In_ PHYPERCALL_INFO Hypercall
+)
+{
+	UNREFERENCED_PARAMETER(Vcpu);
+
+	TEST_CHECK_EQ(GuestCr3, TEST_DIRBASE);
+
+	// Only one VCPU may be executing submissions at a time
+	TEST_CHECK(InterlockedCompareExchange(&sExecuting, 1, 0) == 0);
+
+	// The result echoes the submission, so the client can tell it was executed as submitted
+	Hypercall->Result = (UINT16)GuestState->Rbx;
+	InterlockedIncrement64(&sExecuted);
+
+	InterlockedExchange(&sExecuting, 0);
+
+	return VMM_EVENT_CONTINUE;
+}
+
+static BOOLEAN
+Submit(
+	_In_ UINT64 Sequence
+)
+{
+	const UINT32 Tail = sSubmissionRing->Tail;
+
+	if (Tail - sSubmissionRing->Head >= VM_RING_ENTRY_COUNT)
+		return FALSE;
+
+	sSubmissionRing->Entries[Tail & (VM_RING_ENTRY_COUNT - 1)] = (HYPERCALL_RING_SUBMISSION){
+		.UserData = Sequence,
+		.Id = HYPERCALL_GET_VPTE_COUNT,
+		.Ext = Sequence
+	};
+
+	// Publish the entry before the tail
+	__atomic_store_n(&sSubmissionRing->Tail, Tail + 1, __ATOMIC_RELEASE);
+
+	return TRUE;
+}
+
+static BOOLEAN
+Reap(
+	_Inout_ PUINT64 NextSequence
+)
+{
+	const UINT32 Head = sCompletionRing->Head;
+
+	if (Head == __atomic_load_n(&sCompletionRing->Tail, __ATOMIC_ACQUIRE))
+		return FALSE;
+
+	const HYPERCALL_RING_COMPLETION Completion = sCompletionRing->Entries[Head & (VM_RING_ENTRY_COUNT - 1)];
+
+	TEST_CHECK_EQ(Completion.UserData, *NextSequence);
+	TEST_CHECK_EQ(Completion.Result, (UINT16)*NextSequence);
+
+	__atomic_store_n(&sCompletionRing->Head, Head + 1, __ATOMIC_RELEASE);
+
+	(*NextSequence)++;
+
+	return TRUE;
+}
+
+static VOID
+Register(VOID)
+{
+	memset(sSubmissionRing, 0, PAGE_SIZE);
+	memset(sCompletionRing, 0, PAGE_SIZE);
+
+	sRingUnmapped = FALSE;
+
+	TEST_CHECK(NT_SUCCESS(VmRingRegister(TEST_DIRBASE, TEST_OWNER_ID, (UINT64)sSubmissionRing, (UINT64)sCompletionRing)));
+}
+
+static VOID
+TestBoundedDrain(VOID)
+{
+	UINT64 NextSequence = 0;
+
+	Register();
+
+	// A full submission ring refuses more
+	for (UINT64 i = 0; i < VM_RING_ENTRY_COUNT; i++)
+		TEST_CHECK(Submit(i));
+
+	TEST_CHECK(!Submit(VM_RING_ENTRY_COUNT));
+
+	// A VM-exit only executes its batch
+	sExecuted = 0;
+	TEST_CHECK(VmRingDrain(&sVcpus[0], VM_RING_DRAIN_BATCH, FALSE));
+	TEST_CHECK_EQ(sExecuted, VM_RING_DRAIN_BATCH);
+	TEST_CHECK_EQ(sSubmissionRing->Head, VM_RING_DRAIN_BATCH);
+	TEST_CHECK_EQ(sCompletionRing->Tail, VM_RING_DRAIN_BATCH);
+
+	TEST_CHECK(VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, VM_RING_ENTRY_COUNT);
+
+	// The completion ring is now full, so nothing more is executed until the client reaps
+	for (UINT64 i = VM_RING_ENTRY_COUNT; i < 2 * VM_RING_ENTRY_COUNT; i++)
+		TEST_CHECK(Submit(i));
+
+	TEST_CHECK(VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, VM_RING_ENTRY_COUNT);
+
+	for (SIZE_T i = 0; i < 10; i++)
+		TEST_CHECK(Reap(&NextSequence));
+
+	TEST_CHECK(VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, VM_RING_ENTRY_COUNT + 10);
+
+	while (Reap(&NextSequence))
+		;
+
+	TEST_CHECK_EQ(NextSequence, VM_RING_ENTRY_COUNT + 10);
+}
+
+static VOID
+TestCorruptTail(VOID)
+{
+	Register();
+
+	// A tail further ahead than the ring can hold is ignored, the ring isn't unregistered for it
+	sSubmissionRing->Tail = VM_RING_ENTRY_COUNT + 1;
+
+	sExecuted = 0;
+	TEST_CHECK(VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, 0);
+	TEST_CHECK_EQ(sSubmissionRing->Head, 0);
+	TEST_CHECK_EQ(sCompletionRing->Tail, 0);
+
+	// Once fixed, the pending submissions are executed
+	sSubmissionRing->Tail = 0;
+	TEST_CHECK(Submit(0));
+	TEST_CHECK(VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, 1);
+}
+
+static VOID
+TestOwnerGone(VOID)
+{
+	Register();
+
+	// Exits of other processes leave the ring alone
+	TEST_CHECK(Submit(0));
+	VmRingReleaseProcess(TEST_OWNER_ID + 4);
+
+	sExecuted = 0;
+	TEST_CHECK(VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, 1);
+
+	// The owner exiting unregisters it
+	TEST_CHECK(Submit(1));
+	VmRingReleaseProcess(TEST_OWNER_ID);
+
+	TEST_CHECK(!VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, 1);
+	TEST_CHECK_EQ(sCompletionRing->Tail, 1);
+
+	// As does finding its pages unmapped, before anything is written to them
+	Register();
+	TEST_CHECK(Submit(0));
+
+	sRingUnmapped = TRUE;
+	sExecuted = 0;
+
+	TEST_CHECK(!VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK_EQ(sExecuted, 0);
+	TEST_CHECK_EQ(sSubmissionRing->Head, 0);
+	TEST_CHECK_EQ(sCompletionRing->Tail, 0);
+
+	sRingUnmapped = FALSE;
+	TEST_CHECK(!VmRingDrain(&sVcpus[0], VM_RING_ENTRY_COUNT, TRUE));
+	TEST_CHECK(!VmRingOverlapsRange((UINT64)sSubmissionRing, PAGE_SIZE));
+}
+
+static PVOID
+DrainThread(
+	_In_ PVOID Context
+)
+{
+	PVCPU Vcpu = Context;
+
+	ShimSetProcessorNumber((ULONG)(Vcpu - sVcpus));
+
+	// The guest runs between VM-exits
+	while (!sStopDraining)
+	{
+		VmRingDrain(Vcpu, VM_RING_DRAIN_BATCH, FALSE);
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+static VOID
+TestStress(
+	_In_ UINT64 Count
+)
+{
+	pthread_t Threads[TEST_MAX_VCPUS];
+
+	// The client needs a CPU of its own, threads spinning on the others would only measure the scheduler
+	const long CpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	const SIZE_T ThreadCount = CpuCount > TEST_MAX_VCPUS ? TEST_MAX_VCPUS : CpuCount > 1 ? (SIZE_T)CpuCount - 1 : 1;
+
+	Register();
+
+	sExecuted = 0;
+	sStopDraining = FALSE;
+
+	for (SIZE_T i = 0; i < ThreadCount; i++)
+		pthread_create(&Threads[i], NULL, DrainThread, &sVcpus[i]);
+
+	const double Start = TestNow();
+
+	// Reap in bursts of varying size, so the VCPUs keep running into the end of either ring
+	UINT64 NextSubmission = 0, NextCompletion = 0;
+	for (SIZE_T Burst = 1; NextCompletion < Count; Burst = Burst % VM_RING_ENTRY_COUNT + 1)
+	{
+		while (NextSubmission < Count && Submit(NextSubmission))
+			NextSubmission++;
+
+		SIZE_T Reaped = 0;
+		while (Reaped < Burst && Reap(&NextCompletion))
+			Reaped++;
+
+		if (Reaped == 0)
+			sched_yield();
+	}
+
+	const double End = TestNow();
+
+	sStopDraining = TRUE;
+
+	for (SIZE_T i = 0; i < ThreadCount; i++)
+		pthread_join(Threads[i], NULL);
+
+	TEST_CHECK_EQ(sExecuted, Count);
+	TEST_CHECK_EQ(sSubmissionRing->Head, (UINT32)Count);
+	TEST_CHECK_EQ(sCompletionRing->Tail, (UINT32)Count);
+
+	printf("%llu submissions over %llu laps with %zu VCPUs draining: %.1f ns each\n", (unsigned long long)Count,
+		(unsigned long long)(Count / VM_RING_ENTRY_COUNT), ThreadCount, (End - Start) * 1e9 / Count);
+}
+
+int
+main(
+	int Argc,
+	char** Argv
+)
+{
+	const UINT64 Count = Argc > 1 ? strtoull(Argv[1], NULL, 0) : 1000000;
+
+	sSubmissionRing = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+	sCompletionRing = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+	TestBoundedDrain();
+	TestCorruptTail();
+	TestOwnerGone();
+	TestStress(Count);
+
+	VmRingUnregister();
+
+	free(sSubmissionRing);
+	free(sCompletionRing);
+
+	return 0;
+}
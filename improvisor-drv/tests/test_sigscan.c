@@ -0,0 +1,163 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <vcpu/sigscan.h>
+
+#include <test.h>
+
+// Benchmarks SigScanBuffer against the byte-by-byte scan over a synthetic code-like buffer, and checks both find
+// exactly the same matches
+
+#define SCAN_PATTERN_COUNT 16
+#define SCAN_MAX_MATCHES 4096
+
+typedef struct _SCAN_MATCHES
+{
+	SIZE_T Count;
+	SIZE_T Offsets[SCAN_MAX_MATCHES];
+} SCAN_MATCHES, *PSCAN_MATCHES;
+
+static UINT64
+NextRandom(
+	_Inout_ PUINT64 State
+)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+
+	return *State;
+}
+
+static VOID
+FillCodeLike(
+	_Out_ PUCHAR Data,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Fills `Data` with bytes roughly distributed like x64 code, about half of them drawn from the most common ones
+--*/
+{
+	static const UCHAR CommonBytes[] = { 0x00, 0xFF, 0xCC, 0x48, 0x8B, 0x89, 0x0F, 0xE8, 0x4C, 0x24, 0x90, 0x83 };
+
+	UINT64 Seed = 0x2545F4914F6CDD1D;
+	for (SIZE_T i = 0; i < Size; i++)
+	{
+		const UINT64 Random = NextRandom(&Seed);
+		Data[i] = (Random & 1) ? CommonBytes[(Random >> 8) % sizeof(CommonBytes)] : (UCHAR)(Random >> 16);
+	}
+}
+
+static BOOLEAN
+RecordMatch(
+	_In_ PVOID Context,
+	_In_ SIZE_T Offset
+)
+{
+	PSCAN_MATCHES Matches = Context;
+	if (Matches->Count < SCAN_MAX_MATCHES)
+		Matches->Offsets[Matches->Count] = Offset;
+
+	Matches->Count++;
+	return TRUE;
+}
+
+static VOID
+NaiveScan(
+	_In_ PSIG_PATTERN Pattern,
+	_In_ PUCHAR Data,
+	_In_ SIZE_T Size,
+	_Inout_ PSCAN_MATCHES Matches
+)
+/*++
+Routine Description:
+	The scan the sigscan hypercall used to do, comparing the whole pattern at every offset
+--*/
+{
+	for (SIZE_T i = 0; i + Pattern->Size <= Size; i++)
+	{
+		if (SigVerifyMatch(Pattern, Data + i))
+			RecordMatch(Matches, i);
+	}
+}
+
+int
+main(int argc, char** argv)
+{
+	const SIZE_T Size = argc > 1 ? strtoull(argv[1], NULL, 0) : MB(64);
+
+	PUCHAR Data = malloc(Size);
+	TEST_CHECK(Data != NULL);
+
+	FillCodeLike(Data, Size);
+
+	// Patterns are taken from the buffer so each has at least one match, some wildcard a 4 byte displacement
+	// and some contain int3 padding, which must match like any other byte
+	SIG_PATTERN Patterns[SCAN_PATTERN_COUNT];
+
+	UINT64 Seed = 0x9E3779B97F4A7C15;
+	for (SIZE_T i = 0; i < SCAN_PATTERN_COUNT; i++)
+	{
+		UCHAR Mask[32];
+		const SIZE_T PatternSize = 12 + (i % 3) * 8;
+		const SIZE_T Offset = NextRandom(&Seed) % (Size - PatternSize);
+
+		RtlFillMemory(Mask, sizeof(Mask), 0xFF);
+		if (i % 2)
+			RtlZeroMemory(Mask + 4, 4);
+
+		if (i % 4 == 0)
+			Data[Offset + 1] = 0xCC;
+
+		TEST_CHECK(NT_SUCCESS(SigPreparePattern(&Patterns[i], Data + Offset, Mask, PatternSize)));
+	}
+
+	static SCAN_MATCHES Expected;
+	static SCAN_MATCHES Actual;
+
+	double NaiveTime = 0;
+	double ScanTime = 0;
+
+	for (SIZE_T i = 0; i < SCAN_PATTERN_COUNT; i++)
+	{
+		Expected.Count = Actual.Count = 0;
+
+		double Start = TestNow();
+		NaiveScan(&Patterns[i], Data, Size, &Expected);
+		NaiveTime += TestNow() - Start;
+
+		Start = TestNow();
+		TEST_CHECK(SigScanBuffer(&Patterns[i], Data, Size, SIZE_MAX, RecordMatch, &Actual));
+		ScanTime += TestNow() - Start;
+
+		TEST_CHECK(Expected.Count != 0);
+		TEST_CHECK_EQ(Actual.Count, Expected.Count);
+
+		for (SIZE_T j = 0; j < min(Expected.Count, SCAN_MAX_MATCHES); j++)
+			TEST_CHECK_EQ(Actual.Offsets[j], Expected.Offsets[j]);
+	}
+
+	// Matches must lie entirely inside the buffer and start before the limit
+	SIG_PATTERN Tail;
+	UCHAR TailMask[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+	TEST_CHECK(NT_SUCCESS(SigPreparePattern(&Tail, Data + Size - 4, TailMask, 4)));
+
+	Actual.Count = 0;
+	TEST_CHECK(SigScanBuffer(&Tail, Data, Size - 1, SIZE_MAX, RecordMatch, &Actual));
+	for (SIZE_T j = 0; j < min(Actual.Count, SCAN_MAX_MATCHES); j++)
+		TEST_CHECK(Actual.Offsets[j] + 4 <= Size - 1);
+
+	Actual.Count = 0;
+	TEST_CHECK(SigScanBuffer(&Tail, Data, Size, Size - 4, RecordMatch, &Actual));
+	for (SIZE_T j = 0; j < min(Actual.Count, SCAN_MAX_MATCHES); j++)
+		TEST_CHECK(Actual.Offsets[j] < Size - 4);
+
+	printf("%d patterns over %zu MB: byte-by-byte %.1f MB/s, prefiltered %.1f MB/s (%.1fx)\n",
+		SCAN_PATTERN_COUNT, Size / MB(1),
+		SCAN_PATTERN_COUNT * (Size / 1e6) / NaiveTime, SCAN_PATTERN_COUNT * (Size / 1e6) / ScanTime,
+		NaiveTime / ScanTime);
+
+	free(Data);
+
+	return 0;
+}
@@ -0,0 +1,326 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <mm/mm.h>
+#include <mm/vtlb.h>
+#include <vcpu/sigset.h>
+
+#include <test.h>
+
+// Benchmark harness for signature sets: resolves a game build's worth of signatures over a synthetic module in
+// a single pass, fed page by page like the multi-pattern sigscan hypercall does, and compares it with scanning
+// once per pattern. Both must report exactly the same matches.
+//
+// In the hypercall every pass also has to translate each guest page again. The module is mapped by guest page
+// tables of its own, and every pass is charged for translating its pages the way MmTranslateGuestVirt does:
+// a VTLB lookup and a walk of the tables on a miss
+
+#define SET_PATTERN_COUNT 48
+
+// Address the module is mapped at, 1GB aligned so one page directory maps all of it
+#define SET_MODULE_BASE 0x7FF600000000
+#define SET_DIRBASE 0x1AB000
+
+typedef struct _SET_RESULTS
+{
+	PUCHAR Data;
+	SIZE_T Size;
+	PSIG_SET Set;
+	// Offset of the page currently being fed through the automaton
+	SIZE_T PageOffset;
+	SIZE_T Counts[SET_PATTERN_COUNT];
+	// Sum of the match offsets of each pattern, so the matches themselves don't need storing
+	UINT64 Sums[SET_PATTERN_COUNT];
+} SET_RESULTS, *PSET_RESULTS;
+
+typedef struct _SCAN_RESULT
+{
+	SIZE_T Count;
+	UINT64 Sum;
+} SCAN_RESULT, *PSCAN_RESULT;
+
+static SIG_SET sSet;
+
+// The PML4, PDPT, page directory and page tables mapping the module, in that order
+static PMM_PTE sTables;
+
+static MM_VTLB sVtlb;
+
+static UINT64
+NextRandom(
+	_Inout_ PUINT64 State
+)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+
+	return *State;
+}
+
+static VOID
+FillCodeLike(
+	_Out_ PUCHAR Data,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Fills `Data` with bytes roughly distributed like x64 code, about half of them drawn from the most common ones
+--*/
+{
+	static const UCHAR CommonBytes[] = { 0x00, 0xFF, 0xCC, 0x48, 0x8B, 0x89, 0x0F, 0xE8, 0x4C, 0x24, 0x90, 0x83 };
+
+	UINT64 Seed = 0x2545F4914F6CDD1D;
+	for (SIZE_T i = 0; i < Size; i++)
+	{
+		const UINT64 Random = NextRandom(&Seed);
+		Data[i] = (Random & 1) ? CommonBytes[(Random >> 8) % sizeof(CommonBytes)] : (UCHAR)(Random >> 16);
+	}
+}
+
+static VOID
+BuildPageTables(
+	_In_ PUCHAR Data,
+	_In_ SIZE_T Size
+)
+/*++
+Routine Description:
+	Maps the module at SET_MODULE_BASE, user-mode has no physical addresses so host addresses stand in for them
+--*/
+{
+	const SIZE_T PtCount = (Size + MB(2) - 1) / MB(2);
+
+	sTables = aligned_alloc(PAGE_SIZE, (3 + PtCount) * PAGE_SIZE);
+	TEST_CHECK(sTables != NULL);
+	memset(sTables, 0, (3 + PtCount) * PAGE_SIZE);
+
+	const X86_LA48 Base = {
+		.Value = SET_MODULE_BASE
+	};
+
+	const MM_PTE Table = {
+		.Present = TRUE,
+		.WriteAllowed = TRUE
+	};
+
+	PMM_PTE Pml4 = sTables, Pdpt = sTables + 512, Pd = sTables + 1024;
+
+	Pml4[Base.Pml4Index] = Table;
+	Pml4[Base.Pml4Index].PageFrameNumber = PAGE_FRAME_NUMBER(Pdpt);
+	Pdpt[Base.PdptIndex] = Table;
+	Pdpt[Base.PdptIndex].PageFrameNumber = PAGE_FRAME_NUMBER(Pd);
+
+	for (SIZE_T i = 0; i < PtCount; i++)
+	{
+		Pd[i] = Table;
+		Pd[i].PageFrameNumber = PAGE_FRAME_NUMBER(sTables + (3 + i) * 512);
+	}
+
+	for (SIZE_T i = 0; i < BYTES_TO_PAGES(Size); i++)
+	{
+		sTables[3 * 512 + i] = Table;
+		sTables[3 * 512 + i].PageFrameNumber = PAGE_FRAME_NUMBER(Data + i * PAGE_SIZE);
+	}
+}
+
+static PUCHAR
+Translate(
+	_In_ UINT64 VirtAddr
+)
+/*++
+Routine Description:
+	Translates a module address like MmTranslateGuestVirt does, reading every level of the tables
+--*/
+{
+	UINT64 PhysAddr = 0;
+	if (MmVtlbLookup(&sVtlb, SET_DIRBASE, VirtAddr, &PhysAddr))
+		return (PUCHAR)PhysAddr;
+
+	const X86_LA48 LinearAddr = {
+		.Value = VirtAddr
+	};
+
+	const UINT64 Indices[] = { LinearAddr.Pml4Index, LinearAddr.PdptIndex, LinearAddr.PdIndex, LinearAddr.PtIndex };
+
+	MM_PTE Pte = {
+		.PageFrameNumber = PAGE_FRAME_NUMBER(sTables)
+	};
+
+	for (SIZE_T i = 0; i < sizeof(Indices) / sizeof(*Indices); i++)
+	{
+		Pte = ((volatile MM_PTE*)PAGE_ADDRESS(Pte.PageFrameNumber))[Indices[i]];
+		TEST_CHECK(Pte.Present);
+	}
+
+	PhysAddr = PAGE_ADDRESS(Pte.PageFrameNumber) + PAGE_OFFSET(VirtAddr);
+	MmVtlbInsert(&sVtlb, SET_DIRBASE, VirtAddr, PhysAddr, VTLB_PAGE_4KB, Pte.Value);
+
+	return (PUCHAR)PhysAddr;
+}
+
+static double
+TimeTranslations(
+	_In_ PUCHAR Data,
+	_In_ SIZE_T Size,
+	_In_ SIZE_T PassCount
+)
+/*++
+Routine Description:
+	Returns the time taken to translate every page of the module in `PassCount` passes, each its own hypercall
+--*/
+{
+	const double Start = TestNow();
+
+	for (SIZE_T Pass = 0; Pass < PassCount; Pass++)
+	{
+		// Translations don't outlive the VM-exit they were cached in
+		MmVtlbFlush(&sVtlb);
+
+		for (SIZE_T Offset = 0; Offset < Size; Offset += PAGE_SIZE)
+			TEST_CHECK(Translate(SET_MODULE_BASE + Offset) == Data + Offset);
+	}
+
+	return TestNow() - Start;
+}
+
+static BOOLEAN
+SetMatchCallback(
+	_In_ PVOID Context,
+	_In_ SIZE_T PatternId,
+	_In_ SIZE_T KeyEndOffset
+)
+/*++
+Routine Description:
+	Verifies a key hit against the whole pattern, the same way VmSigScanMultiMatchCallback does
+--*/
+{
+	PSET_RESULTS Results = Context;
+	PSIG_SET_ENTRY Entry = &Results->Set->Patterns[PatternId];
+
+	const SIZE_T KeyEnd = Results->PageOffset + KeyEndOffset;
+	const SIZE_T KeyEndIndex = Entry->KeyOffset + Entry->KeySize - 1;
+
+	if (KeyEnd < KeyEndIndex || KeyEnd - KeyEndIndex + Entry->Pattern.Size > Results->Size)
+		return TRUE;
+
+	const SIZE_T Start = KeyEnd - KeyEndIndex;
+	if (!SigVerifyMatch(&Entry->Pattern, Results->Data + Start))
+		return TRUE;
+
+	Results->Counts[PatternId]++;
+	Results->Sums[PatternId] += Start;
+
+	return TRUE;
+}
+
+static BOOLEAN
+ScanMatchCallback(
+	_In_ PVOID Context,
+	_In_ SIZE_T Offset
+)
+{
+	PSCAN_RESULT Result = Context;
+
+	Result->Count++;
+	Result->Sum += Offset;
+
+	return TRUE;
+}
+
+int
+main(int argc, char** argv)
+{
+	const SIZE_T Size = argc > 1 ? strtoull(argv[1], NULL, 0) : MB(16);
+
+	// Page aligned, so the module's pages are the host's
+	PUCHAR Data = aligned_alloc(PAGE_SIZE, PAGE_SIZE * BYTES_TO_PAGES(Size));
+	TEST_CHECK(Data != NULL);
+
+	FillCodeLike(Data, Size);
+
+	// Patterns are taken from the module so each has at least one match, most wildcard a displacement or an
+	// immediate somewhere in the middle like real signatures do
+	SigSetInitialise(&sSet);
+
+	UINT64 Seed = 0x9E3779B97F4A7C15;
+	for (SIZE_T i = 0; i < SET_PATTERN_COUNT; i++)
+	{
+		UCHAR Mask[32];
+		const SIZE_T PatternSize = 10 + NextRandom(&Seed) % 20;
+		const SIZE_T Offset = NextRandom(&Seed) % (Size - PatternSize);
+
+		RtlFillMemory(Mask, sizeof(Mask), 0xFF);
+		if (i % 4 != 0)
+			RtlZeroMemory(Mask + 2 + NextRandom(&Seed) % (PatternSize - 6), 4);
+
+		TEST_CHECK(NT_SUCCESS(SigSetAddPattern(&sSet, Data + Offset, Mask, PatternSize)));
+	}
+
+	SigSetCompile(&sSet);
+
+	static SET_RESULTS Results;
+	Results.Data = Data;
+	Results.Size = Size;
+	Results.Set = &sSet;
+
+	double Start = TestNow();
+
+	UINT16 State = 0;
+	for (Results.PageOffset = 0; Results.PageOffset < Size; Results.PageOffset += PAGE_SIZE)
+	{
+		const SIZE_T PageSize = min(PAGE_SIZE, Size - Results.PageOffset);
+		TEST_CHECK(SigSetScanBuffer(&sSet, &State, Data + Results.PageOffset, PageSize, SetMatchCallback, &Results));
+	}
+
+	const double SetTime = TestNow() - Start;
+
+	double ScanTime = 0;
+	double NaiveTime = 0;
+
+	for (SIZE_T i = 0; i < SET_PATTERN_COUNT; i++)
+	{
+		PSIG_PATTERN Pattern = &sSet.Patterns[i].Pattern;
+
+		SCAN_RESULT Expected = { 0 };
+
+		Start = TestNow();
+		TEST_CHECK(SigScanBuffer(Pattern, Data, Size, SIZE_MAX, ScanMatchCallback, &Expected));
+		ScanTime += TestNow() - Start;
+
+		SCAN_RESULT Naive = { 0 };
+
+		Start = TestNow();
+		for (SIZE_T j = 0; j + Pattern->Size <= Size; j++)
+		{
+			if (SigVerifyMatch(Pattern, Data + j))
+				ScanMatchCallback(&Naive, j);
+		}
+		NaiveTime += TestNow() - Start;
+
+		TEST_CHECK(Expected.Count != 0);
+		TEST_CHECK_EQ(Naive.Count, Expected.Count);
+		TEST_CHECK_EQ(Naive.Sum, Expected.Sum);
+		TEST_CHECK_EQ(Results.Counts[i], Expected.Count);
+		TEST_CHECK_EQ(Results.Sums[i], Expected.Sum);
+	}
+
+	BuildPageTables(Data, Size);
+
+	const SIZE_T PageCount = BYTES_TO_PAGES(Size);
+	const double SetTranslateTime = TimeTranslations(Data, Size, 1);
+	const double ScanTranslateTime = TimeTranslations(Data, Size, SET_PATTERN_COUNT);
+
+	printf("%d patterns, %zu states (%zu with full tables) over %zu MB, %.1f ns per page translation:\n", 
+		SET_PATTERN_COUNT, sSet.StateCount, sSet.DenseCount, Size / MB(1), ScanTranslateTime * 1e9 / (PageCount * SET_PATTERN_COUNT));
+	printf("                                    scanning   translations         total\n");
+	printf("  one pass:                         %8.2f ms %8.2f ms %6zu %8.2f ms\n", 
+		SetTime * 1e3, SetTranslateTime * 1e3, PageCount, (SetTime + SetTranslateTime) * 1e3);
+	printf("  a prefiltered pass per pattern:   %8.2f ms %8.2f ms %6zu %8.2f ms\n", 
+		ScanTime * 1e3, ScanTranslateTime * 1e3, PageCount * SET_PATTERN_COUNT, (ScanTime + ScanTranslateTime) * 1e3);
+	printf("  a byte-by-byte pass per pattern:  %8.2f ms %8.2f ms %6zu %8.2f ms\n", 
+		NaiveTime * 1e3, ScanTranslateTime * 1e3, PageCount * SET_PATTERN_COUNT, (NaiveTime + ScanTranslateTime) * 1e3);
+
+	free(sTables);
+	free(Data);
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+#include <improvisor.h>
+#include <vcpu/vcpu.h>
+#include <vmx.h>
+
+#include <test.h>
+
+// Checks that VmxSetControl only marks control fields that actually changed, and that VcpuCommitVmxState writes
+// exactly those to the simulated VMCS. Then benchmarks the VMWRITEs and time a run of exits needs against
+// rewriting all five control fields every time, with every VMWRITE charged about what one takes on hardware
+
+// All controls can be set either way
+#define TEST_VMX_CAP_FLEXIBLE 0xFFFFFFFF00000000ULL
+// TSC ticks charged for each VMWRITE, a VMWRITE to a control field takes a few dozen cycles
+#define TEST_VMWRITE_COST 40
+
+static VCPU sVcpu;
+
+static VOID
+ResetVcpu(VOID)
+{
+	RtlZeroMemory(&sVcpu, sizeof(sVcpu));
+
+	sVcpu.Vmx.Cap.PinbasedCtls = TEST_VMX_CAP_FLEXIBLE;
+	sVcpu.Vmx.Cap.PrimaryProcbasedCtls = TEST_VMX_CAP_FLEXIBLE;
+	sVcpu.Vmx.Cap.SecondaryProcbasedCtls = TEST_VMX_CAP_FLEXIBLE;
+	sVcpu.Vmx.Cap.VmExitCtls = TEST_VMX_CAP_FLEXIBLE;
+	sVcpu.Vmx.Cap.VmEntryCtls = TEST_VMX_CAP_FLEXIBLE;
+}
+
+static VOID
+TestDirtyTracking(VOID)
+{
+	ResetVcpu();
+
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_MONITOR_TRAP_FLAG, TRUE);
+	TEST_CHECK_EQ(sVcpu.Vmx.DirtyControls, 1UL << VMX_PRIM_PROCBASED_CTLS);
+
+	UINT64 Writes = gShimVmwriteCount;
+	VcpuCommitVmxState(&sVcpu);
+
+	TEST_CHECK_EQ(gShimVmwriteCount - Writes, 1);
+	TEST_CHECK_EQ(ShimReadVmcs(CONTROL_PRIMARY_PROCBASED_CONTROLS), VMX_CONTROL_MASK(VMX_CTL_MONITOR_TRAP_FLAG));
+	TEST_CHECK_EQ(sVcpu.Vmx.DirtyControls, 0);
+
+	// Nothing changed since, so nothing is written
+	Writes = gShimVmwriteCount;
+	VcpuCommitVmxState(&sVcpu);
+	TEST_CHECK_EQ(gShimVmwriteCount - Writes, 0);
+
+	// Setting a control to the state it's already in doesn't dirty its field
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_MONITOR_TRAP_FLAG, TRUE);
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_RDTSC_EXITING, FALSE);
+	TEST_CHECK_EQ(sVcpu.Vmx.DirtyControls, 0);
+
+	// Each field is written once however many of its controls changed
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_MONITOR_TRAP_FLAG, FALSE);
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_RDTSC_EXITING, TRUE);
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_ENABLE_RDTSCP, TRUE);
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_NMI_EXITING, TRUE);
+
+	Writes = gShimVmwriteCount;
+	VcpuCommitVmxState(&sVcpu);
+
+	TEST_CHECK_EQ(gShimVmwriteCount - Writes, 3);
+	TEST_CHECK_EQ(ShimReadVmcs(CONTROL_PRIMARY_PROCBASED_CONTROLS), VMX_CONTROL_MASK(VMX_CTL_RDTSC_EXITING));
+	TEST_CHECK_EQ(ShimReadVmcs(CONTROL_SECONDARY_PROCBASED_CONTROLS), VMX_CONTROL_MASK(VMX_CTL_ENABLE_RDTSCP));
+	TEST_CHECK_EQ(ShimReadVmcs(CONTROL_PINBASED_CONTROLS), VMX_CONTROL_MASK(VMX_CTL_NMI_EXITING));
+
+	// Controls the CPU fixes can't be changed, so they never dirty anything
+	ResetVcpu();
+	sVcpu.Vmx.Cap.PrimaryProcbasedCtls = 0;
+
+	VmxSetControl(&sVcpu.Vmx, VMX_CTL_MONITOR_TRAP_FLAG, TRUE);
+	TEST_CHECK_EQ(sVcpu.Vmx.DirtyControls, 0);
+	TEST_CHECK_EQ(sVcpu.Vmx.Controls.PrimaryProcbasedCtls, 0);
+}
+
+static VOID
+CommitAllControls(
+	_Inout_ PVCPU Vcpu
+)
+{
+	VmxWrite(CONTROL_PINBASED_CONTROLS, Vcpu->Vmx.Controls.PinbasedCtls);
+	VmxWrite(CONTROL_PRIMARY_PROCBASED_CONTROLS, Vcpu->Vmx.Controls.PrimaryProcbasedCtls);
+	VmxWrite(CONTROL_SECONDARY_PROCBASED_CONTROLS, Vcpu->Vmx.Controls.SecondaryProcbasedCtls);
+	VmxWrite(CONTROL_VMENTRY_CONTROLS, Vcpu->Vmx.Controls.VmEntryCtls);
+	VmxWrite(CONTROL_VMEXIT_CONTROLS, Vcpu->Vmx.Controls.VmExitCtls);
+
+	Vcpu->Vmx.DirtyControls = 0;
+}
+
+static double
+RunExits(
+	_In_ SIZE_T ExitCount,
+	_In_ BOOLEAN DirtyTracked,
+	_Out_ PUINT64 Writes
+)
+{
+	ResetVcpu();
+
+	const UINT64 StartWrites = gShimVmwriteCount;
+	const double Start = TestNow();
+
+	// Exits mostly leave the controls alone, MTF is stepped over a detour every so often and TSC spoofing
+	// flips RDTSC exiting now and then
+	for (SIZE_T i = 0; i < ExitCount; i++)
+	{
+		if (i % 64 == 0)
+			VmxSetControl(&sVcpu.Vmx, VMX_CTL_MONITOR_TRAP_FLAG, TRUE);
+		else if (i % 64 == 1)
+			VmxSetControl(&sVcpu.Vmx, VMX_CTL_MONITOR_TRAP_FLAG, FALSE);
+
+		if (i % 10000 == 0)
+			VmxSetControl(&sVcpu.Vmx, VMX_CTL_RDTSC_EXITING, (i / 10000) % 2 == 0);
+
+		if (DirtyTracked)
+			VcpuCommitVmxState(&sVcpu);
+		else
+			CommitAllControls(&sVcpu);
+	}
+
+	const double Elapsed = TestNow() - Start;
+
+	*Writes = gShimVmwriteCount - StartWrites;
+
+	return Elapsed;
+}
+
+int
+main(int argc, char** argv)
+{
+	const SIZE_T ExitCount = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000;
+
+	TestDirtyTracking();
+
+	ShimSetVmwriteCost(TEST_VMWRITE_COST);
+
+	UINT64 DirtyWrites = 0, AllWrites = 0;
+
+	const double DirtyTime = RunExits(ExitCount, TRUE, &DirtyWrites);
+	const double AllTime = RunExits(ExitCount, FALSE, &AllWrites);
+
+	printf("%zu exits, %d TSC ticks per VMWRITE:\n", ExitCount, TEST_VMWRITE_COST);
+	printf("  dirty-tracked controls:     %10llu VMWRITEs  %6.1f ns per exit\n",
+		(unsigned long long)DirtyWrites, DirtyTime * 1e9 / ExitCount);
+	printf("  every control on each exit: %10llu VMWRITEs  %6.1f ns per exit\n",
+		(unsigned long long)AllWrites, AllTime * 1e9 / ExitCount);
+
+	TEST_CHECK_EQ(AllWrites, (UINT64)ExitCount * 5);
+	TEST_CHECK(DirtyWrites < ExitCount / 16);
+	TEST_CHECK(DirtyTime < AllTime);
+
+	return 0;
+}
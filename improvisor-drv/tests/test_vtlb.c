@@ -0,0 +1,271 @@
+#include <improvisor.h>
+#include <arch/memory.h>
+#include <mm/mm.h>
+#include <mm/vtlb.h>
+
+#include <test.h>
+
+// Exercises the per-VCPU software TLB: hits and misses, ASID and way eviction, large pages, every invalidation
+// path and what is kept across VM-entries
+
+#define TEST_DIRBASE_A 0x1AB000
+#define TEST_DIRBASE_B 0x2CD000
+
+static MM_VTLB sVtlb;
+
+static BOOLEAN
+Lookup(
+	_In_ UINT64 DirBase,
+	_In_ UINT64 VirtAddr,
+	_Out_ PUINT64 PhysAddr
+)
+{
+	*PhysAddr = 0;
+	return MmVtlbLookup(&sVtlb, DirBase, VirtAddr, PhysAddr);
+}
+
+static VOID
+InsertPage(
+	_In_ UINT64 DirBase,
+	_In_ UINT64 VirtAddr,
+	_In_ UINT64 PhysAddr,
+	_In_ MM_VTLB_PAGE_SIZE PageSize
+)
+{
+	MM_PTE Pte = {
+		.Present = TRUE,
+		.WriteAllowed = TRUE,
+		.LargePage = PageSize != VTLB_PAGE_4KB,
+		.PageFrameNumber = PAGE_FRAME_NUMBER(PhysAddr)
+	};
+
+	MmVtlbInsert(&sVtlb, DirBase, VirtAddr, PhysAddr, PageSize, Pte.Value);
+}
+
+static VOID
+Insert(
+	_In_ UINT64 DirBase,
+	_In_ UINT64 VirtAddr,
+	_In_ UINT64 PhysAddr
+)
+{
+	InsertPage(DirBase, VirtAddr, PhysAddr, VTLB_PAGE_4KB);
+}
+
+static VOID
+TestHitMiss(VOID)
+{
+	UINT64 PhysAddr;
+
+	MmVtlbFlush(&sVtlb);
+
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0x7FF612340000, &PhysAddr));
+
+	Insert(TEST_DIRBASE_A, 0x7FF612340000, 0x5000);
+	TEST_CHECK(sVtlb.Populated);
+
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0x7FF612340123, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0x5123);
+
+	// PCID and the no-flush bit don't identify the address space
+	TEST_CHECK(Lookup(TEST_DIRBASE_A | 0x7 | (1ULL << 63), 0x7FF612340010, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0x5010);
+
+	// Neither another address space nor the neighbouring page hit
+	TEST_CHECK(!Lookup(TEST_DIRBASE_B, 0x7FF612340000, &PhysAddr));
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0x7FF612341000, &PhysAddr));
+
+	// Kernel addresses are sign extended
+	Insert(TEST_DIRBASE_A, 0xFFFFF80012345000, 0x9000);
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0xFFFFF80012345678, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0x9678);
+}
+
+static VOID
+TestInvalidation(VOID)
+{
+	UINT64 PhysAddr;
+
+	MmVtlbFlush(&sVtlb);
+
+	Insert(TEST_DIRBASE_A, 0x10000, 0x1000);
+	Insert(TEST_DIRBASE_B, 0x10000, 0x2000);
+	Insert(TEST_DIRBASE_A, 0x20000, 0x3000);
+	Insert(TEST_DIRBASE_A, 0xFFFFF80012345000, 0x4000);
+
+	// INVLPG drops the address in every address space and leaves the rest
+	MmVtlbInvalidateAddress(&sVtlb, 0x10000);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0x10000, &PhysAddr));
+	TEST_CHECK(!Lookup(TEST_DIRBASE_B, 0x10000, &PhysAddr));
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0x20000, &PhysAddr));
+
+	MmVtlbInvalidateAddress(&sVtlb, 0xFFFFF80012345000);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0xFFFFF80012345000, &PhysAddr));
+
+	// A CR3 write drops only that address space
+	Insert(TEST_DIRBASE_B, 0x20000, 0x5000);
+	MmVtlbInvalidateDirectory(&sVtlb, TEST_DIRBASE_A);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0x20000, &PhysAddr));
+	TEST_CHECK(Lookup(TEST_DIRBASE_B, 0x20000, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0x5000);
+
+	// A flush requested by another VCPU is done before the next lookup
+	InterlockedExchange(&sVtlb.FlushPending, TRUE);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_B, 0x20000, &PhysAddr));
+	TEST_CHECK(!sVtlb.FlushPending);
+}
+
+static VOID
+TestEviction(VOID)
+{
+	UINT64 PhysAddr;
+
+	MmVtlbFlush(&sVtlb);
+
+	// Pages VTLB_SET_COUNT apart share a set, one more than there are ways evicts one of them
+	for (SIZE_T i = 0; i <= VTLB_WAY_COUNT; i++)
+		Insert(TEST_DIRBASE_A, PAGE_ADDRESS(i * VTLB_SET_COUNT), PAGE_ADDRESS(i + 1));
+
+	SIZE_T Hits = 0;
+	for (SIZE_T i = 0; i <= VTLB_WAY_COUNT; i++)
+	{
+		if (Lookup(TEST_DIRBASE_A, PAGE_ADDRESS(i * VTLB_SET_COUNT), &PhysAddr))
+		{
+			TEST_CHECK_EQ(PhysAddr, PAGE_ADDRESS(i + 1));
+			Hits++;
+		}
+	}
+
+	TEST_CHECK_EQ(Hits, VTLB_WAY_COUNT);
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, PAGE_ADDRESS(VTLB_WAY_COUNT * VTLB_SET_COUNT), &PhysAddr));
+
+	// Running out of ASIDs recycles the oldest one along with its translations
+	MmVtlbFlush(&sVtlb);
+
+	for (SIZE_T i = 0; i <= VTLB_ASID_COUNT; i++)
+		Insert(PAGE_ADDRESS(i + 1), 0x10000 + PAGE_ADDRESS(i), PAGE_ADDRESS(i + 1));
+
+	TEST_CHECK(!Lookup(PAGE_ADDRESS(1), 0x10000, &PhysAddr));
+
+	for (SIZE_T i = 1; i <= VTLB_ASID_COUNT; i++)
+	{
+		TEST_CHECK(Lookup(PAGE_ADDRESS(i + 1), 0x10000 + PAGE_ADDRESS(i), &PhysAddr));
+		TEST_CHECK_EQ(PhysAddr, PAGE_ADDRESS(i + 1));
+	}
+}
+
+static VOID
+TestLargePages(VOID)
+{
+	UINT64 PhysAddr;
+
+	MmVtlbFlush(&sVtlb);
+
+	// One entry covers the whole large page, wherever in it the walk was for
+	InsertPage(TEST_DIRBASE_A, 0xFFFFF80000234567, 0x40234567, VTLB_PAGE_2MB);
+	InsertPage(TEST_DIRBASE_A, 0x7FF640012345, 0x80012345, VTLB_PAGE_1GB);
+
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0xFFFFF800003FF123, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0x403FF123);
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0xFFFFF80000200000, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0x40200000);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0xFFFFF80000400000, &PhysAddr));
+
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0x7FF67FFFF000, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0xBFFFF000);
+
+	// Large pages with neighbouring page numbers don't compete for one set
+	for (SIZE_T i = 0; i <= VTLB_WAY_COUNT; i++)
+		InsertPage(TEST_DIRBASE_B, MB(2) * i, MB(2) * (i + 1), VTLB_PAGE_2MB);
+
+	for (SIZE_T i = 0; i <= VTLB_WAY_COUNT; i++)
+	{
+		TEST_CHECK(Lookup(TEST_DIRBASE_B, MB(2) * i + 0x1234, &PhysAddr));
+		TEST_CHECK_EQ(PhysAddr, MB(2) * (i + 1) + 0x1234);
+	}
+
+	// INVLPG of any address in a large page drops the whole page
+	MmVtlbInvalidateAddress(&sVtlb, 0xFFFFF80000323000);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0xFFFFF80000234567, &PhysAddr));
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0xFFFFF80000200000, &PhysAddr));
+
+	MmVtlbInvalidateAddress(&sVtlb, 0x7FF655555000);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0x7FF640012345, &PhysAddr));
+
+	TEST_CHECK(Lookup(TEST_DIRBASE_B, MB(2) + 0x1234, &PhysAddr));
+}
+
+static VOID
+TestEndExit(VOID)
+{
+	UINT64 PhysAddr;
+
+	MmVtlbFlush(&sVtlb);
+
+	// With the guest's TLB invalidations intercepted, translations of the address space it resumes in are kept
+	// across VM-entries, other address spaces are dropped
+	sVtlb.Intercepted = TRUE;
+
+	Insert(TEST_DIRBASE_A, 0x10000, 0x1000);
+	Insert(TEST_DIRBASE_B, 0x10000, 0x2000);
+	MmVtlbEndExit(&sVtlb, TEST_DIRBASE_A | 0x5);
+
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0x10000, &PhysAddr));
+	TEST_CHECK_EQ(PhysAddr, 0x1000);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_B, 0x10000, &PhysAddr));
+
+	// A dropped address space that is cached again doesn't bring back its old translations
+	Insert(TEST_DIRBASE_B, 0x20000, 0x3000);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_B, 0x10000, &PhysAddr));
+	TEST_CHECK(Lookup(TEST_DIRBASE_B, 0x20000, &PhysAddr));
+
+	// Otherwise everything only lives for the VM-exit it was cached in
+	sVtlb.Intercepted = FALSE;
+
+	MmVtlbEndExit(&sVtlb, TEST_DIRBASE_A);
+	TEST_CHECK(!sVtlb.Populated);
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0x10000, &PhysAddr));
+
+	for (SIZE_T i = 0; i < VTLB_ASID_COUNT; i++)
+		TEST_CHECK_EQ(sVtlb.DirBases[i], 0);
+}
+
+static VOID
+TestGenerationWrap(VOID)
+{
+	UINT64 PhysAddr;
+
+	MmVtlbFlush(&sVtlb);
+
+	const UINT32 Asid = sVtlb.NextAsid % VTLB_ASID_COUNT;
+	Insert(TEST_DIRBASE_A, 0x10000, 0x1000);
+
+	// An entry must not come back when the generation it was cached in comes around again, even if its address
+	// space is given the same ASID
+	const UINT16 Generation = sVtlb.Generations[Asid];
+	do
+	{
+		MmVtlbFlush(&sVtlb);
+	} while (sVtlb.Generations[Asid] != Generation);
+
+	sVtlb.NextAsid = Asid;
+	Insert(TEST_DIRBASE_A, 0x20000, 0x2000);
+
+	TEST_CHECK(!Lookup(TEST_DIRBASE_A, 0x10000, &PhysAddr));
+	TEST_CHECK(Lookup(TEST_DIRBASE_A, 0x20000, &PhysAddr));
+}
+
+int
+main(VOID)
+{
+	TestHitMiss();
+	TestInvalidation();
+	TestEviction();
+	TestLargePages();
+	TestEndExit();
+	TestGenerationWrap();
+
+	TEST_CHECK(sVtlb.Stats.Hits != 0 && sVtlb.Stats.Misses != 0);
+
+	return 0;
+}
@@ -0,0 +1,210 @@
+#include "log.h"
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+// Amount of format strings kept around so each one is only fetched from the VMM once
+#define LOG_FORMAT_CACHE_SIZE 256
+
+typedef struct _LOG_FORMAT_CACHE_ENTRY
+{
+	UINT32 FormatId;
+	BOOLEAN Valid;
+	CHAR Format[VM_LOG_MAX_FORMAT_SIZE];
+} LOG_FORMAT_CACHE_ENTRY, *PLOG_FORMAT_CACHE_ENTRY;
+
+static LOG_FORMAT_CACHE_ENTRY sFormatCache[LOG_FORMAT_CACHE_SIZE];
+
+PCSTR
+LogGetCategoryName(
+	UINT8 Category
+)
+/*++
+Routine Description:
+	Returns the short name of a VM_LOG_CATEGORY, as shown in front of each entry
+--*/
+{
+	static PCSTR sCategoryNames[VM_LOG_CATEGORY_COUNT] = {
+		[VM_LOG_GENERAL] = "GEN",
+		[VM_LOG_EPT] = "EPT",
+		[VM_LOG_TSC] = "TSC",
+		[VM_LOG_HYPERCALL] = "HCALL",
+		[VM_LOG_DETOUR] = "DETOUR",
+		[VM_LOG_PDB] = "PDB",
+		[VM_LOG_VMEXIT] = "VMEXIT",
+		[VM_LOG_MSR] = "MSR"
+	};
+
+	return Category < VM_LOG_CATEGORY_COUNT ? sCategoryNames[Category] : "?";
+}
+
+PCSTR
+LogGetFormat(
+	UINT32 FormatId
+)
+/*++
+Routine Description:
+	Gets the format string of `FormatId`, fetching it from the VMM if it isn't already cached
+--*/
+{
+	// Format IDs are image offsets of 1 byte granularity, so mix the bits a little before indexing
+	PLOG_FORMAT_CACHE_ENTRY Entry = &sFormatCache[(FormatId ^ (FormatId >> 8)) % LOG_FORMAT_CACHE_SIZE];
+	if (Entry->Valid && Entry->FormatId == FormatId)
+		return Entry->Format;
+
+	if (VmGetLogFormat(FormatId, Entry->Format) != HRESULT_SUCCESS)
+	{
+		Entry->Valid = FALSE;
+		return NULL;
+	}
+
+	Entry->Format[VM_LOG_MAX_FORMAT_SIZE - 1] = '\0';
+	Entry->FormatId = FormatId;
+	Entry->Valid = TRUE;
+
+	return Entry->Format;
+}
+
+SIZE_T
+LogFormatEntry(
+	PVM_LOG_ENTRY Entry,
+	PCHAR Buffer,
+	SIZE_T Size
+)
+/*++
+Routine Description:
+	Expands a binary log entry into `Buffer`, returning the amount of characters written. Arguments are
+	substituted by their raw value, strings can't be dereferenced from user mode so they are printed as
+	the address they were logged with.
+--*/
+{
+	if (Size == 0)
+		return 0;
+
+	if (Entry->FormatId == VM_LOG_FORMAT_TEXT)
+	{
+		SIZE_T Length = strnlen(Entry->Text, sizeof(Entry->Text));
+		Length = min(Length, Size - 1);
+
+		memcpy(Buffer, Entry->Text, Length);
+		Buffer[Length] = '\0';
+		return Length;
+	}
+
+	PCSTR Format = LogGetFormat(Entry->FormatId);
+	if (Format == NULL)
+		return (SIZE_T)max(0, snprintf(Buffer, Size, "<unknown format %X>\n", Entry->FormatId));
+
+	SIZE_T Written = 0, ArgIndex = 0;
+
+#define LOG_NEXT_ARG() \
+	(ArgIndex < VM_LOG_MAX_ARGS ? Entry->Args[ArgIndex++] : (ArgIndex++, 0))
+
+	while (*Format != '\0' && Written < Size - 1)
+	{
+		if (*Format != '%')
+		{
+			Buffer[Written++] = *Format++;
+			continue;
+		}
+
+		// Rebuild the conversion with an explicit argument size so it can be handed to snprintf on its own
+		CHAR Spec[32] = "%";
+		SIZE_T SpecLength = 1;
+		BOOLEAN Is64Bit = FALSE;
+
+		Format++;
+		if (*Format == '%')
+		{
+			Buffer[Written++] = *Format++;
+			continue;
+		}
+
+		// Flags
+		while (*Format != '\0' && strchr("-+ #0", *Format) != NULL && SpecLength < sizeof(Spec) - 8)
+			Spec[SpecLength++] = *Format++;
+
+		// Width and precision, '*' consumes an argument just like it did when the entry was logged
+		while ((isdigit((UCHAR)*Format) || *Format == '.' || *Format == '*') && SpecLength < sizeof(Spec) - 8)
+		{
+			if (*Format == '*')
+			{
+				SpecLength += snprintf(&Spec[SpecLength], sizeof(Spec) - SpecLength, "%d", (INT)LOG_NEXT_ARG());
+				Format++;
+			}
+			else
+				Spec[SpecLength++] = *Format++;
+		}
+
+		// Length modifiers, only the argument size matters as every argument was stored as 64 bits
+		if (strncmp(Format, "I64", 3) == 0)
+			Is64Bit = TRUE, Format += 3;
+		else if (strncmp(Format, "I32", 3) == 0)
+			Format += 3;
+		else if (strncmp(Format, "ll", 2) == 0 || strncmp(Format, "hh", 2) == 0)
+			Is64Bit = Format[0] == 'l', Format += 2;
+		else if (*Format != '\0' && strchr("Izjt", *Format) != NULL)
+			Is64Bit = TRUE, Format++;
+		else if (*Format != '\0' && strchr("hlw", *Format) != NULL)
+			Format++;
+
+		CHAR Conversion = *Format;
+		if (Conversion == '\0')
+			break;
+
+		Format++;
+
+		INT Result = 0;
+		UINT64 Arg = LOG_NEXT_ARG();
+
+		switch (ArgIndex > VM_LOG_MAX_ARGS ? '?' : Conversion)
+		{
+		case '?':
+			// The VMM only stores the first VM_LOG_MAX_ARGS arguments
+			Result = snprintf(&Buffer[Written], Size - Written, "<?>");
+			break;
+		case 's':
+		case 'S':
+		case 'Z':
+			Result = snprintf(&Buffer[Written], Size - Written, "<str %p>", (PVOID)Arg);
+			break;
+		case 'p':
+			Result = snprintf(&Buffer[Written], Size - Written, "%p", (PVOID)Arg);
+			break;
+		case 'c':
+		case 'C':
+			Result = snprintf(&Buffer[Written], Size - Written, "%c", (CHAR)Arg);
+			break;
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			if (Is64Bit)
+			{
+				Spec[SpecLength++] = 'l';
+				Spec[SpecLength++] = 'l';
+			}
+
+			Spec[SpecLength++] = Conversion;
+			Spec[SpecLength] = '\0';
+
+			Result = Is64Bit ? 
+				snprintf(&Buffer[Written], Size - Written, Spec, Arg) :
+				snprintf(&Buffer[Written], Size - Written, Spec, (UINT32)Arg);
+			break;
+		default:
+			Result = snprintf(&Buffer[Written], Size - Written, "<%%%c %llX>", Conversion, Arg);
+			break;
+		}
+
+		// snprintf returns the untruncated length, clamp so `Written` never goes past the terminator
+		Written += min((SIZE_T)max(0, Result), Size - Written - 1);
+	}
+
+#undef LOG_NEXT_ARG
+
+	Buffer[Written] = '\0';
+	return Written;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <Windows.h>
+#include "vmcall.h"
+
+PCSTR
+LogGetCategoryName(
+	UINT8 Category
+);
+
+SIZE_T
+LogFormatEntry(
+	PVM_LOG_ENTRY Entry,
+	PCHAR Buffer,
+	SIZE_T Size
+);
@@ -2,12 +2,21 @@
 #include <winternl.h>
 #include <winnt.h>
 #include <stdio.h>
+#include <conio.h>
+#include <intrin.h>
 #include "vmcall.h"
+#include "log.h"
 #include "macro.h"
 #include "hash.h"
 
 #pragma comment(lib, "ntdll.lib")
 
+// Maximum amount of log entries retrieved by a single 'L' command
+#define LDR_LOG_BATCH_SIZE 64
+// Amount of log entries the streaming mode waits for before printing, and the longest it waits for them (ms)
+#define LDR_LOG_STREAM_BATCH_SIZE 256
+#define LDR_LOG_STREAM_TIMEOUT 100
+
 #define REG_DRV_SERVICE_NAME L"impv"
 #define REG_SERVICES_NT_PATH (L"\\Registry\\Machine\\SYSTEM\\CurrentControlSet\\Services\\" REG_DRV_SERVICE_NAME)
 #define REG_SERVICES_PATH (L"SYSTEM\\CurrentControlSet\\Services\\" REG_DRV_SERVICE_NAME)
@@ -19,6 +28,211 @@ typedef enum _ARGV_INDICES
 	ARGV_COUNT
 } ARGV_INDICES;
 
+VOID
+LdrPrintLogEntry(
+	PVM_LOG_ENTRY Entry
+)
+{
+	CHAR Buffer[VM_MAX_LOG_TEXT_SIZE] = {0};
+	LogFormatEntry(Entry, Buffer, sizeof(Buffer));
+
+	// Entries logged from the guest don't belong to any VCPU
+	if (Entry->VcpuId == VM_LOG_GUEST_VCPU)
+		printf("[--][%s] %s", LogGetCategoryName(Entry->Category), Buffer);
+	else
+		printf("[%02X][%s] %s", Entry->VcpuId, LogGetCategoryName(Entry->Category), Buffer);
+}
+
+// Names of each basic exit reason, indexed by reason
+static PCSTR sExitReasonNames[VM_EXIT_REASON_COUNT] = {
+	"Exception/NMI",
+	"External interrupt",
+	"Triple fault",
+	"INIT",
+	"SIPI",
+	"I/O SMI",
+	"Other SMI",
+	"Interrupt window",
+	"NMI window",
+	"Task switch",
+	"CPUID",
+	"GETSEC",
+	"HLT",
+	"INVD",
+	"INVLPG",
+	"RDPMC",
+	"RDTSC",
+	"RSM",
+	"VMCALL",
+	"VMCLEAR",
+	"VMLAUNCH",
+	"VMPTRLD",
+	"VMPTRST",
+	"VMREAD",
+	"VMRESUME",
+	"VMWRITE",
+	"VMXOFF",
+	"VMXON",
+	"CR access",
+	"MOV DR",
+	"I/O instruction",
+	"RDMSR",
+	"WRMSR",
+	"Invalid guest state",
+	"MSR loading",
+	"Reserved (35)",
+	"MWAIT",
+	"MTF",
+	"Reserved (38)",
+	"MONITOR",
+	"PAUSE",
+	"Machine-check",
+	"Reserved (42)",
+	"TPR below threshold",
+	"APIC access",
+	"Virtualized EOI",
+	"GDTR/IDTR access",
+	"LDTR/TR access",
+	"EPT violation",
+	"EPT misconfig",
+	"INVEPT",
+	"RDTSCP",
+	"Preemption timer",
+	"INVVPID",
+	"WBINVD",
+	"XSETBV",
+	"APIC write",
+	"RDRAND",
+	"INVPCID",
+	"VMFUNC",
+	"ENCLS",
+	"RDSEED",
+	"PML full",
+	"XSAVES",
+	"XRSTORS",
+	"Reserved (65)",
+	"SPP",
+	"UMWAIT",
+	"TPAUSE",
+	"LOADIWKEY"
+};
+
+UINT64
+LdrGetExitLatencyPercentile(
+	PVM_EXIT_PROFILE_ENTRY Entry,
+	UINT64 Percentile
+)
+/*++
+Routine Description:
+	Estimates a latency percentile from a log2 histogram, returning the upper bound of the bucket it falls in
+--*/
+{
+	const UINT64 Threshold = (Entry->Count * Percentile + 99) / 100;
+
+	UINT64 Sum = 0;
+	for (SIZE_T i = 0; i < VM_EXIT_LATENCY_BUCKETS; i++)
+	{
+		Sum += Entry->Histogram[i];
+		if (Sum >= Threshold)
+			return 2ULL << i;
+	}
+
+	return Entry->MaxCycles;
+}
+
+VOID
+LdrPrintExitProfile(
+	PVM_EXIT_PROFILE Profile,
+	SIZE_T TopCount
+)
+/*++
+Routine Description:
+	Prints the `TopCount` exit reasons that took up the most time in the host, most expensive first
+--*/
+{
+	UINT64 TotalCycles = 0;
+	for (SIZE_T i = 0; i < VM_EXIT_REASON_COUNT; i++)
+		TotalCycles += Profile->Reasons[i].TotalCycles;
+
+	printf("%-20s %12s %16s %7s %10s %10s %10s %12s\n", "Reason", "Count", "Cycles", "Share", "Average", "p50<=", "p99<=", "Max");
+
+	// Selection of the largest remaining entry each time, the table is too small to bother sorting
+	BOOLEAN Printed[VM_EXIT_REASON_COUNT] = {0};
+	for (SIZE_T n = 0; n < TopCount; n++)
+	{
+		SIZE_T Top = VM_EXIT_REASON_COUNT;
+		for (SIZE_T i = 0; i < VM_EXIT_REASON_COUNT; i++)
+		{
+			if (!Printed[i] && Profile->Reasons[i].Count != 0 && 
+				(Top == VM_EXIT_REASON_COUNT || Profile->Reasons[i].TotalCycles > Profile->Reasons[Top].TotalCycles))
+				Top = i;
+		}
+
+		if (Top == VM_EXIT_REASON_COUNT)
+			break;
+
+		Printed[Top] = TRUE;
+
+		PVM_EXIT_PROFILE_ENTRY Entry = &Profile->Reasons[Top];
+		printf("%-20s %12llu %16llu %6.2f%% %10llu %10llu %10llu %12llu\n",
+			sExitReasonNames[Top], 
+			Entry->Count, 
+			Entry->TotalCycles,
+			TotalCycles != 0 ? 100.0 * Entry->TotalCycles / TotalCycles : 0.0,
+			Entry->TotalCycles / Entry->Count,
+			LdrGetExitLatencyPercentile(Entry, 50),
+			LdrGetExitLatencyPercentile(Entry, 99),
+			Entry->MaxCycles);
+	}
+}
+
+typedef struct _LDR_ROUND_TRIP_STATS
+{
+	UINT64 Min;
+	UINT64 Total;
+} LDR_ROUND_TRIP_STATS, *PLDR_ROUND_TRIP_STATS;
+
+VOID
+LdrBenchmarkExitPath(
+	UINT32 Iterations
+)
+/*++
+Routine Description:
+	Measures VMCALL and CPUID round trips from the guest, each one being a full VM-exit, handler and VM-entry.
+	The thread is pinned to its current core so all timestamps come from the same TSC
+--*/
+{
+	LDR_ROUND_TRIP_STATS Vmcall = { .Min = MAXUINT64 };
+	LDR_ROUND_TRIP_STATS Cpuid = { .Min = MAXUINT64 };
+
+	const DWORD_PTR PrevAffinity = SetThreadAffinityMask(GetCurrentThread(), 1ULL << GetCurrentProcessorNumber());
+
+	for (UINT32 i = 0; i < Iterations; i++)
+	{
+		UINT64 Start = __rdtsc();
+		VmNullHypercall();
+		UINT64 Elapsed = __rdtsc() - Start;
+
+		Vmcall.Total += Elapsed;
+		Vmcall.Min = min(Vmcall.Min, Elapsed);
+
+		INT CpuInfo[4] = {0};
+
+		Start = __rdtsc();
+		__cpuid(CpuInfo, 0);
+		Elapsed = __rdtsc() - Start;
+
+		Cpuid.Total += Elapsed;
+		Cpuid.Min = min(Cpuid.Min, Elapsed);
+	}
+
+	if (PrevAffinity != 0)
+		SetThreadAffinityMask(GetCurrentThread(), PrevAffinity);
+
+	printf("VMCALL round trip: Average: %llu Min: %llu cycles\n", Vmcall.Total / Iterations, Vmcall.Min);
+	printf("CPUID round trip:  Average: %llu Min: %llu cycles\n", Cpuid.Total / Iterations, Cpuid.Min);
+}
+
 INT
 LdrPrintUsage(
 	VOID
@@ -226,13 +440,125 @@ int main(int argc, char** argv)
 		// Exit and unload the driver
 		case 'x':
 		case 'X': Active = FALSE; break;
-		// Get one log record and print it
+		// Get a batch of log entries and print them
 		case 'l':
 		case 'L':
 		{
-			CHAR Buffer[512] = {0};
-			if (VmGetLogRecords(Buffer, 1) == HRESULT_SUCCESS)
-				printf("%s", Buffer);
+			static UINT64 sLastOverflows = 0;
+			static UINT8 sRecords[sizeof(HYPERCALL_LOG_RECORDS) + (LDR_LOG_BATCH_SIZE - 1) * sizeof(VM_LOG_ENTRY)];
+
+			PHYPERCALL_LOG_RECORDS Records = (PHYPERCALL_LOG_RECORDS)sRecords;
+			HRESULT Result = VmGetLogRecords(Records, LDR_LOG_BATCH_SIZE);
+			if (Result != HRESULT_SUCCESS)
+			{
+				printf("VmGetLogRecords failed: %X\n", Result);
+				break;
+			}
+
+			if (Records->Overflows != sLastOverflows)
+			{
+				printf("*** %llu log entries dropped ***\n", Records->Overflows - sLastOverflows);
+				sLastOverflows = Records->Overflows;
+			}
+
+			for (SIZE_T i = 0; i < Records->Count; i++)
+				LdrPrintLogEntry(&Records->Entries[i]);
+		} break;
+		// Stream log entries as they are logged until a key is pressed
+		case 's':
+		case 'S':
+		{
+			PHYPERCALL_LOG_STREAM Stream = NULL;
+			HRESULT Result = VmCreateLogStream(&Stream);
+			if (Result != HRESULT_SUCCESS)
+			{
+				printf("VmCreateLogStream failed: %X\n", Result);
+				break;
+			}
+
+			static VM_LOG_ENTRY sEntries[LDR_LOG_STREAM_BATCH_SIZE];
+			UINT64 LastOverflows = Stream->Overflows;
+
+			while (!_kbhit())
+			{
+				VmLogStreamWait(Stream, LDR_LOG_STREAM_BATCH_SIZE, LDR_LOG_STREAM_TIMEOUT);
+
+				if (Stream->Overflows != LastOverflows)
+				{
+					printf("*** %llu log entries dropped ***\n", Stream->Overflows - LastOverflows);
+					LastOverflows = Stream->Overflows;
+				}
+
+				const SIZE_T Count = VmLogStreamRead(Stream, sEntries, LDR_LOG_STREAM_BATCH_SIZE);
+				for (SIZE_T i = 0; i < Count; i++)
+					LdrPrintLogEntry(&sEntries[i]);
+			}
+
+			// Swallow the key that stopped the stream so it isn't parsed as a command
+			_getch();
+
+			VmDestroyLogStream(Stream);
+		} break;
+		// Enable and disable logging categories
+		case 'c':
+		case 'C':
+		{
+			UINT32 Enable = 0, Disable = 0;
+			if (scanf_s(" %x %x", &Enable, &Disable) == 2)
+			{
+				UINT32 Mask = 0;
+				HRESULT Result = VmSetLogCategories(Enable, Disable, &Mask);
+				if (Result != HRESULT_SUCCESS)
+				{
+					printf("VmSetLogCategories failed: %X\n", Result);
+					break;
+				}
+
+				for (UINT8 i = 0; i < VM_LOG_CATEGORY_COUNT; i++)
+					printf("%-8s %s\n", LogGetCategoryName(i), (Mask & VM_LOG_CATEGORY_BIT(i)) ? "On" : "Off");
+			}
+			else
+			{
+				printf("\n\tUsage: [C|c] [Categories to enable (Hex)] [Categories to disable (Hex)]\n\n");
+			}
+		} break;
+		// Print the most expensive VM-exit reasons summed over all VCPUs, and reset their profiles
+		case 'e':
+		case 'E':
+		{
+			UINT32 TopCount = 0;
+			if (scanf_s(" %u", &TopCount) == 1)
+			{
+				static VM_EXIT_PROFILE sProfile;
+
+				HRESULT Result = VmGetExitProfile(EXIT_PROFILE_ALL_VCPUS, TRUE, &sProfile);
+				if (Result != HRESULT_SUCCESS)
+				{
+					printf("VmGetExitProfile failed: %X\n", Result);
+					break;
+				}
+
+				printf("Exit profile of %llu VCPUs:\n", sProfile.VcpuCount);
+				LdrPrintExitProfile(&sProfile, TopCount);
+			}
+			else
+			{
+				printf("\n\tUsage: [E|e] [Amount of exit reasons to show]\n\n");
+			}
+		} break;
+		// Measure the latency of exit path round trips from the guest
+		case 'b':
+		case 'B':
+		{
+			UINT32 Iterations = 0;
+			if (scanf_s(" %u", &Iterations) == 1 && Iterations != 0)
+			{
+				LdrBenchmarkExitPath(Iterations);
+			}
+			else
+			{
+				printf("\n\tUsage: [B|b] [Amount of round trips]\n\n");
+			}
 		} break;
 		case 'r':
 		case 'R':
@@ -294,6 +620,62 @@ int main(int argc, char** argv)
 
 			printf("VPTE Count: %llX\n", VpteCount);
 		} break;
+		case 't':
+		case 'T':
+		{
+			VM_VTLB_STATS Stats = {0};
+			// Get the VTLB hit/miss counts of the VMM
+			HRESULT Result = VmGetVtlbStats(&Stats);
+			if (Result != HRESULT_SUCCESS)
+			{
+				printf("VmGetVtlbStats failed: %X\n", Result);
+				break;
+			}
+
+			printf("VTLB Hits: %llu Misses: %llu\n", Stats.Hits, Stats.Misses);
+		} break;
+		case 'g':
+		case 'G':
+		{
+			VM_PAGE_TABLE_STATS Stats = {0};
+			// Get the usage statistics of the VMM's host page table pool
+			HRESULT Result = VmGetPageTableStats(&Stats);
+			if (Result != HRESULT_SUCCESS)
+			{
+				printf("VmGetPageTableStats failed: %X\n", Result);
+				break;
+			}
+
+			printf("Page tables Total: %llu Free: %llu LowestFree: %llu Allocations: %llu Frees: %llu Failures: %llu\n",
+				Stats.Total, Stats.Free, Stats.LowestFree, Stats.Allocations, Stats.Frees, Stats.Failures);
+			printf("Refill requests: %llu Donated: %llu\n", Stats.RefillRequests, Stats.Donated);
+		} break;
+		case 'f':
+		case 'F':
+		{
+			HRESULT Result = VmFlushVtlb();
+			if (Result != HRESULT_SUCCESS)
+				printf("VmFlushVtlb failed: %X\n", Result);
+		} break;
+		case 'k':
+		case 'K':
+		{
+			VM_LOCK_STATS Stats[16] = {0};
+			SIZE_T Count = 0;
+			// Get and reset the contention statistics of the VMM's tracked locks
+			HRESULT Result = VmGetLockStats(Stats, sizeof(Stats) / sizeof(*Stats), TRUE, &Count);
+			if (Result != HRESULT_SUCCESS)
+			{
+				printf("VmGetLockStats failed: %X\n", Result);
+				break;
+			}
+
+			for (SIZE_T i = 0; i < Count; i++)
+			{
+				printf("%-16.16s Acquisitions: %llu Contentions: %llu SpinCycles: %llu\n", 
+					Stats[i].Name, Stats[i].Acquisitions, Stats[i].Contentions, Stats[i].SpinCycles);
+			}
+		} break;
 		// Do nothing with unknown commands
 		default: break;
 		}
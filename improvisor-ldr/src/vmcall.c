@@ -1,5 +1,8 @@
 #include "vmcall.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 // Information relevant to caching, reading or writing virtual addresses in an address space
 typedef union _HYPERCALL_VIRT_EX 
 {
@@ -12,16 +15,56 @@ typedef union _HYPERCALL_VIRT_EX
 	};
 } HYPERCALL_VIRT_EX, *PHYPERCALL_VIRT_EX;
 
-typedef union _HYPERCALL_SIGSCAN_BUFFER
+typedef struct _HYPERCALL_SIGSCAN_BUFFER
 {
 	// The virtual address to start the scan from
 	UINT64 Address;
 	// The size of the pattern
-	SIZE_T PatternSize;
-	// Variable length array containing the pattern
+	UINT32 PatternSize;
+	// The maximum amount of matches to return
+	UINT32 MaxMatches;
+	// Variable length array containing the pattern, followed by a mask of the same size selecting the bits that must match
 	UCHAR Pattern[1];
 } HYPERCALL_SIGSCAN_BUFFER, *PHYPERCALL_SIGSCAN_BUFFER;
 
+typedef struct _HYPERCALL_SIGSCAN_RESULTS
+{
+	// The amount of matches found
+	UINT64 Count;
+	// Variable length array of the addresses matched, in ascending order
+	UINT64 Matches[1];
+} HYPERCALL_SIGSCAN_RESULTS, *PHYPERCALL_SIGSCAN_RESULTS;
+
+typedef struct _HYPERCALL_SIGSCAN_MULTI_BUFFER
+{
+	// The virtual address to start the scan from
+	UINT64 Address;
+	UINT32 PatternCount;
+	// SIGSCAN_MULTI_* flags
+	UINT32 Flags;
+	// The maximum amount of matches to return
+	UINT32 MaxMatches;
+	UINT32 Reserved;
+	// Variable length array of pattern descriptors
+	HYPERCALL_SIGSCAN_PATTERN Patterns[1];
+} HYPERCALL_SIGSCAN_MULTI_BUFFER, *PHYPERCALL_SIGSCAN_MULTI_BUFFER;
+
+typedef struct _HYPERCALL_SIGSCAN_MULTI_RESULTS
+{
+	// The amount of matches found
+	UINT64 Count;
+	// Variable length array of the matches, in the order their keys were found
+	HYPERCALL_SIGSCAN_MATCH Matches[1];
+} HYPERCALL_SIGSCAN_MULTI_RESULTS, *PHYPERCALL_SIGSCAN_MULTI_RESULTS;
+
+typedef struct _HYPERCALL_LOCK_STATS_RESULTS
+{
+	// The amount of locks written
+	UINT64 Count;
+	// Variable length array of lock statistics, in the order the locks were registered
+	VM_LOCK_STATS Locks[1];
+} HYPERCALL_LOCK_STATS_RESULTS, *PHYPERCALL_LOCK_STATS_RESULTS;
+
 typedef union _HYPERCALL_REMAP_PAGES_EX
 {
 	UINT64 Value;
@@ -30,6 +73,9 @@ typedef union _HYPERCALL_REMAP_PAGES_EX
 	{
 		UINT64 Size : 32;
 		UINT64 Permissions : 8;
+		// Only remap the pages in `View` rather than in every EPT view
+		UINT64 SingleView : 1;
+		UINT64 View : 9;
 	};
 } HYPERCALL_REMAP_PAGES_EX, *PHYPERCALL_REMAP_PAGES_EX;
 
@@ -62,9 +108,13 @@ __vmcall(
 
 HYPERCALL_RESULT
 VmGetLogRecords(
-	PVOID Dst,
+	PHYPERCALL_LOG_RECORDS Records,
 	SIZE_T Count
 )
+/*++
+Routine Description:
+	Retrieves up to `Count` of the oldest log entries into `Records`, which must have room for `Count` entries
+--*/
 {
 	HYPERCALL_INFO Hypercall = {
 		.Id = HYPERCALL_GET_LOG_RECORDS,
@@ -75,7 +125,27 @@ VmGetLogRecords(
 		.Count = Count,
 	};
 
-	Hypercall = __vmcall(Hypercall, LogEx.Value, Dst, NULL);
+	Hypercall = __vmcall(Hypercall, LogEx.Value, NULL, Records);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmGetLogFormat(
+	UINT32 FormatId,
+	PCHAR Format
+)
+/*++
+Routine Description:
+	Retrieves the format string of a log entry into `Format`, which must be VM_LOG_MAX_FORMAT_SIZE bytes
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_GET_LOG_FORMAT,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, FormatId, NULL, Format);
 
 	return Hypercall.Result;
 }
@@ -126,6 +196,321 @@ VmWriteMemory(
 	return Hypercall.Result;
 }
 
+HYPERCALL_RESULT
+VmReadMemoryBatch(
+    VM_PID Pid,
+	PHYPERCALL_BATCH_ENTRY Entries,
+	SIZE_T Count,
+	PUINT64 StatusBitmap
+)
+/*++
+Routine Description:
+	Reads every entry in `Entries` from the address space of `Pid` in a single hypercall. `StatusBitmap` must 
+	hold at least (Count + 63) / 64 values, each bit is set if the corresponding entry was read
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_READ_VIRT_BATCH,
+		.Result = HRESULT_SUCCESS
+	};
+
+	HYPERCALL_VIRT_EX VirtEx = {
+		.Pid = Pid,
+		.Size = Count
+	};
+
+	Hypercall = __vmcall(Hypercall, VirtEx.Value, Entries, StatusBitmap);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmWriteMemoryBatch(
+    VM_PID Pid,
+	PHYPERCALL_BATCH_ENTRY Entries,
+	SIZE_T Count,
+	PUINT64 StatusBitmap
+)
+/*++
+Routine Description:
+	Writes every entry in `Entries` into the address space of `Pid` in a single hypercall. `StatusBitmap` must 
+	hold at least (Count + 63) / 64 values, each bit is set if the corresponding entry was written
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_WRITE_VIRT_BATCH,
+		.Result = HRESULT_SUCCESS
+	};
+
+	HYPERCALL_VIRT_EX VirtEx = {
+		.Pid = Pid,
+		.Size = Count
+	};
+
+	Hypercall = __vmcall(Hypercall, VirtEx.Value, Entries, StatusBitmap);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmCreateRing(
+	PHYPERCALL_SUBMISSION_RING* SubmissionRing,
+	PHYPERCALL_COMPLETION_RING* CompletionRing
+)
+/*++
+Routine Description:
+	Allocates and locks a submission and completion ring page, and registers them with the VMM. Submissions 
+	are then processed on any VM-exit or periodic tick without needing a VMCALL each
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_SETUP_RING,
+		.Result = HRESULT_SUCCESS
+	};
+
+	// The VMM only translates the ring pages once, so they must stay resident. VirtualAlloc returns page aligned memory
+	PVOID Submission = VirtualAlloc(NULL, sizeof(HYPERCALL_SUBMISSION_RING), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	PVOID Completion = VirtualAlloc(NULL, sizeof(HYPERCALL_COMPLETION_RING), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	if (Submission == NULL || Completion == NULL || 
+		!VirtualLock(Submission, sizeof(HYPERCALL_SUBMISSION_RING)) || !VirtualLock(Completion, sizeof(HYPERCALL_COMPLETION_RING)))
+	{
+		if (Submission != NULL)
+			VirtualFree(Submission, 0, MEM_RELEASE);
+
+		if (Completion != NULL)
+			VirtualFree(Completion, 0, MEM_RELEASE);
+
+		return HRESULT_INSUFFICIENT_RESOURCES;
+	}
+
+	Hypercall = __vmcall(Hypercall, 0, Submission, Completion);
+	if (Hypercall.Result != HRESULT_SUCCESS)
+	{
+		VirtualFree(Submission, 0, MEM_RELEASE);
+		VirtualFree(Completion, 0, MEM_RELEASE);
+
+		return Hypercall.Result;
+	}
+
+	*SubmissionRing = Submission;
+	*CompletionRing = Completion;
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmDestroyRing(
+	PHYPERCALL_SUBMISSION_RING SubmissionRing,
+	PHYPERCALL_COMPLETION_RING CompletionRing
+)
+/*++
+Routine Description:
+	Unregisters the ring pair from the VMM and frees it
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_SETUP_RING,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, NULL);
+
+	VirtualFree(SubmissionRing, 0, MEM_RELEASE);
+	VirtualFree(CompletionRing, 0, MEM_RELEASE);
+
+	return Hypercall.Result;
+}
+
+BOOLEAN
+VmRingSubmit(
+	PHYPERCALL_SUBMISSION_RING SubmissionRing,
+	PHYPERCALL_RING_SUBMISSION Submission
+)
+/*++
+Routine Description:
+	Queues a hypercall in the submission ring, returns FALSE if the ring is full
+--*/
+{
+	const UINT32 Tail = SubmissionRing->Tail;
+
+	if (Tail - SubmissionRing->Head >= VM_RING_ENTRY_COUNT)
+		return FALSE;
+
+	SubmissionRing->Entries[Tail & (VM_RING_ENTRY_COUNT - 1)] = *Submission;
+
+	// The entry must be visible before the new tail is
+	MemoryBarrier();
+	SubmissionRing->Tail = Tail + 1;
+
+	return TRUE;
+}
+
+BOOLEAN
+VmRingReap(
+	PHYPERCALL_COMPLETION_RING CompletionRing,
+	PHYPERCALL_RING_COMPLETION Completion
+)
+/*++
+Routine Description:
+	Takes the oldest completion from the completion ring, returns FALSE if there are none
+--*/
+{
+	const UINT32 Head = CompletionRing->Head;
+
+	if (Head == CompletionRing->Tail)
+		return FALSE;
+
+	// Don't read the entry before the tail that published it
+	MemoryBarrier();
+	*Completion = CompletionRing->Entries[Head & (VM_RING_ENTRY_COUNT - 1)];
+
+	CompletionRing->Head = Head + 1;
+
+	return TRUE;
+}
+
+HYPERCALL_RESULT
+VmRingDoorbell(
+	VOID
+)
+/*++
+Routine Description:
+	Makes the VMM process all pending submissions before returning
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_RING_DOORBELL,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, NULL);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmSigScan(
+	VM_PID Pid,
+	PVOID Address,
+	SIZE_T Size,
+	PUCHAR Pattern,
+	PUCHAR Mask,
+	SIZE_T PatternSize,
+	PUINT64 Matches,
+	SIZE_T MaxMatches,
+	PSIZE_T MatchCount
+)
+/*++
+Routine Description:
+	Scans `Size` bytes from `Address` in the address space of `Pid` for `Pattern`, where each byte of `Mask` 
+	selects the bits of the pattern byte that must match. Up to `MaxMatches` addresses are written to `Matches`
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_VIRT_SIGSCAN,
+		.Result = HRESULT_SUCCESS
+	};
+
+	HYPERCALL_VIRT_EX VirtEx = {
+		.Pid = Pid,
+		.Size = Size
+	};
+
+	PHYPERCALL_SIGSCAN_BUFFER SigScan = malloc(sizeof(HYPERCALL_SIGSCAN_BUFFER) + PatternSize * 2);
+	PHYPERCALL_SIGSCAN_RESULTS Results = malloc(sizeof(HYPERCALL_SIGSCAN_RESULTS) + MaxMatches * sizeof(UINT64));
+
+	if (SigScan == NULL || Results == NULL)
+	{
+		free(SigScan);
+		free(Results);
+
+		return HRESULT_INSUFFICIENT_RESOURCES;
+	}
+
+	SigScan->Address = (UINT64)Address;
+	SigScan->PatternSize = (UINT32)PatternSize;
+	SigScan->MaxMatches = (UINT32)MaxMatches;
+
+	memcpy(SigScan->Pattern, Pattern, PatternSize);
+	memcpy(SigScan->Pattern + PatternSize, Mask, PatternSize);
+
+	Hypercall = __vmcall(Hypercall, VirtEx.Value, SigScan, Results);
+
+	if (Hypercall.Result == HRESULT_SUCCESS)
+	{
+		memcpy(Matches, Results->Matches, Results->Count * sizeof(UINT64));
+		*MatchCount = Results->Count;
+	}
+
+	free(SigScan);
+	free(Results);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmSigScanMulti(
+	VM_PID Pid,
+	PVOID Address,
+	SIZE_T Size,
+	PHYPERCALL_SIGSCAN_PATTERN Patterns,
+	SIZE_T PatternCount,
+	UINT32 Flags,
+	PHYPERCALL_SIGSCAN_MATCH Matches,
+	SIZE_T MaxMatches,
+	PSIZE_T MatchCount
+)
+/*++
+Routine Description:
+	Scans `Size` bytes from `Address` in the address space of `Pid` for every pattern in `Patterns` in a single
+	pass. Each match reports the index of the pattern it belongs to, with SIGSCAN_MULTI_FIRST_HIT only the
+	first match of each pattern is reported
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_VIRT_SIGSCAN_MULTI,
+		.Result = HRESULT_SUCCESS
+	};
+
+	HYPERCALL_VIRT_EX VirtEx = {
+		.Pid = Pid,
+		.Size = Size
+	};
+
+	PHYPERCALL_SIGSCAN_MULTI_BUFFER SigScan = malloc(sizeof(HYPERCALL_SIGSCAN_MULTI_BUFFER) + PatternCount * sizeof(HYPERCALL_SIGSCAN_PATTERN));
+	PHYPERCALL_SIGSCAN_MULTI_RESULTS Results = malloc(sizeof(HYPERCALL_SIGSCAN_MULTI_RESULTS) + MaxMatches * sizeof(HYPERCALL_SIGSCAN_MATCH));
+
+	if (SigScan == NULL || Results == NULL)
+	{
+		free(SigScan);
+		free(Results);
+
+		return HRESULT_INSUFFICIENT_RESOURCES;
+	}
+
+	SigScan->Address = (UINT64)Address;
+	SigScan->PatternCount = (UINT32)PatternCount;
+	SigScan->Flags = Flags;
+	SigScan->MaxMatches = (UINT32)MaxMatches;
+	SigScan->Reserved = 0;
+
+	memcpy(SigScan->Patterns, Patterns, PatternCount * sizeof(HYPERCALL_SIGSCAN_PATTERN));
+
+	Hypercall = __vmcall(Hypercall, VirtEx.Value, SigScan, Results);
+
+	if (Hypercall.Result == HRESULT_SUCCESS)
+	{
+		memcpy(Matches, Results->Matches, Results->Count * sizeof(HYPERCALL_SIGSCAN_MATCH));
+		*MatchCount = Results->Count;
+	}
+
+	free(SigScan);
+	free(Results);
+
+	return Hypercall.Result;
+}
+
 HYPERCALL_RESULT
 VmOpenProcess(
 	_In_ UINT64 Name,
@@ -164,3 +549,332 @@ Routine Description:
 
 	return Hypercall.Result;
 }
+
+HYPERCALL_RESULT
+VmGetVtlbStats(
+    PVM_VTLB_STATS Stats
+)
+/*++
+Routine Description:
+	Returns the VTLB hit and miss counts of the VMM, summed over all VCPUs
+--*/
+{
+    HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_GET_VTLB_STATS,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, Stats);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmFlushVtlb(
+    VOID
+)
+/*++
+Routine Description:
+	Invalidates all guest translations cached by the VMM
+--*/
+{
+    HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_FLUSH_VTLB,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, NULL);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmNullHypercall(
+    VOID
+)
+/*++
+Routine Description:
+	Performs a hypercall the VMM handles without doing any work, only useful to measure the exit path
+--*/
+{
+    HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_GET_SYSTEM_CR3,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, NULL);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmGetLockStats(
+	PVM_LOCK_STATS Stats,
+	SIZE_T MaxCount,
+	BOOLEAN Reset,
+	PSIZE_T Count
+)
+/*++
+Routine Description:
+	Returns the contention statistics of up to `MaxCount` locks tracked by the VMM, optionally resetting them
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_GET_LOCK_STATS,
+		.Result = HRESULT_SUCCESS
+	};
+
+	PHYPERCALL_LOCK_STATS_RESULTS Results = malloc(sizeof(HYPERCALL_LOCK_STATS_RESULTS) + MaxCount * sizeof(VM_LOCK_STATS));
+	if (Results == NULL)
+		return HRESULT_INSUFFICIENT_RESOURCES;
+
+	Hypercall = __vmcall(Hypercall, MaxCount, (PVOID)(UINT64)(Reset ? LOCK_STATS_RESET : 0), Results);
+
+	if (Hypercall.Result == HRESULT_SUCCESS)
+	{
+		memcpy(Stats, Results->Locks, Results->Count * sizeof(VM_LOCK_STATS));
+		*Count = Results->Count;
+	}
+
+	free(Results);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmCreateLogStream(
+	PHYPERCALL_LOG_STREAM* Stream
+)
+/*++
+Routine Description:
+	Allocates and locks a log stream and registers it with the VMM, which then drains log entries into it on 
+	VM-exits. Entries are consumed with VmLogStreamRead without needing a VMCALL each
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_SETUP_LOG_STREAM,
+		.Result = HRESULT_SUCCESS
+	};
+
+	// The VMM only translates the stream pages once, so they must stay resident. VirtualAlloc returns page aligned memory
+	PHYPERCALL_LOG_STREAM NewStream = VirtualAlloc(NULL, sizeof(HYPERCALL_LOG_STREAM), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (NewStream == NULL)
+		return HRESULT_INSUFFICIENT_RESOURCES;
+
+	// The default working set is too small to lock the whole stream alongside everything else
+	SIZE_T MinWorkingSet = 0, MaxWorkingSet = 0;
+	if (GetProcessWorkingSetSize(GetCurrentProcess(), &MinWorkingSet, &MaxWorkingSet))
+		SetProcessWorkingSetSize(GetCurrentProcess(), MinWorkingSet + sizeof(HYPERCALL_LOG_STREAM), MaxWorkingSet + sizeof(HYPERCALL_LOG_STREAM));
+
+	if (!VirtualLock(NewStream, sizeof(HYPERCALL_LOG_STREAM)))
+	{
+		VirtualFree(NewStream, 0, MEM_RELEASE);
+		return HRESULT_INSUFFICIENT_RESOURCES;
+	}
+
+	Hypercall = __vmcall(Hypercall, 0, NewStream, NULL);
+	if (Hypercall.Result != HRESULT_SUCCESS)
+	{
+		VirtualFree(NewStream, 0, MEM_RELEASE);
+		return Hypercall.Result;
+	}
+
+	*Stream = NewStream;
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmDestroyLogStream(
+	PHYPERCALL_LOG_STREAM Stream
+)
+/*++
+Routine Description:
+	Unregisters the log stream from the VMM and frees it
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_SETUP_LOG_STREAM,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, NULL);
+
+	VirtualFree(Stream, 0, MEM_RELEASE);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmLogStreamDoorbell(
+	VOID
+)
+/*++
+Routine Description:
+	Makes the VMM drain every pending log entry into the stream, as far as it has room, before returning
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_LOG_STREAM_DOORBELL,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, NULL);
+
+	return Hypercall.Result;
+}
+
+SIZE_T
+VmLogStreamRead(
+	PHYPERCALL_LOG_STREAM Stream,
+	PVM_LOG_ENTRY Entries,
+	SIZE_T MaxCount
+)
+/*++
+Routine Description:
+	Copies up to `MaxCount` entries out of the stream and hands their slots back to the VMM in one go, returning 
+	the amount copied
+--*/
+{
+	const UINT32 Tail = Stream->Tail;
+	const UINT32 Head = Stream->Head;
+
+	// Head is published after the entries, so everything before it is complete
+	MemoryBarrier();
+
+	SIZE_T Count = min((SIZE_T)(Head - Tail), MaxCount);
+	for (SIZE_T i = 0; i < Count; i++)
+		Entries[i] = Stream->Entries[(Tail + i) & (VM_LOG_STREAM_ENTRY_COUNT - 1)];
+
+	MemoryBarrier();
+
+	Stream->Tail = Tail + (UINT32)Count;
+
+	return Count;
+}
+
+SIZE_T
+VmLogStreamWait(
+	PHYPERCALL_LOG_STREAM Stream,
+	SIZE_T Count,
+	DWORD Timeout
+)
+/*++
+Routine Description:
+	Waits until at least `Count` entries are ready in the stream or `Timeout` milliseconds have passed, returning 
+	the amount ready. The VMM holds off draining until that many entries are pending so they arrive in a batch, 
+	once the timeout expires the doorbell collects whatever is pending instead
+--*/
+{
+	Count = min(Count, VM_LOG_STREAM_ENTRY_COUNT);
+
+	Stream->WaitCount = (UINT32)Count;
+
+	const ULONGLONG Deadline = GetTickCount64() + Timeout;
+
+	while ((SIZE_T)(Stream->Head - Stream->Tail) < Count)
+	{
+		if (GetTickCount64() >= Deadline)
+		{
+			VmLogStreamDoorbell();
+			break;
+		}
+
+		Sleep(1);
+	}
+
+	return Stream->Head - Stream->Tail;
+}
+
+HYPERCALL_RESULT
+VmSetLogCategories(
+	UINT32 Enable,
+	UINT32 Disable,
+	PUINT32 Mask
+)
+/*++
+Routine Description:
+	Enables and disables sets of VM_LOG_CATEGORY_BIT logging categories in the VMM, returning the resulting mask
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_SET_LOG_CATEGORIES,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, Enable, (PVOID)(UINT64)Disable, Mask);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmGetExitProfile(
+	UINT16 VcpuId,
+	BOOLEAN Reset,
+	PVM_EXIT_PROFILE Profile
+)
+/*++
+Routine Description:
+	Returns the VM-exit profile of a VCPU, or the sum over all of them with EXIT_PROFILE_ALL_VCPUS, optionally 
+	resetting it
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_GET_EXIT_PROFILE,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, VcpuId, (PVOID)(UINT64)(Reset ? EXIT_PROFILE_RESET : 0), Profile);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmGetDirtyPages(
+	UINT64 GuestPhysAddr,
+	UINT64 PageCount,
+	PUINT64 Bitmap
+)
+/*++
+Routine Description:
+	Sets a bit in `Bitmap` for each page of the guest physical range written to since the last query of that page,
+	`Bitmap` must hold `PageCount` bits rounded up to a multiple of 64. Ranges larger than VM_MAX_DIRTY_PAGES are
+	queried a piece at a time
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_GET_DIRTY_PAGES,
+		.Result = HRESULT_SUCCESS
+	};
+
+	// An empty range is still passed on, so it fails the same way it always has
+	UINT64 i = 0;
+	do
+	{
+		const UINT64 Count = min(PageCount - i, VM_MAX_DIRTY_PAGES);
+
+		Hypercall = __vmcall(Hypercall, Count, (PVOID)(GuestPhysAddr + i * 0x1000), Bitmap + i / 64);
+		i += VM_MAX_DIRTY_PAGES;
+	} while (Hypercall.Result == HRESULT_SUCCESS && i < PageCount);
+
+	return Hypercall.Result;
+}
+
+HYPERCALL_RESULT
+VmGetPageTableStats(
+	PVM_PAGE_TABLE_STATS Stats
+)
+/*++
+Routine Description:
+	Returns the usage statistics of the VMM's host page table pool
+--*/
+{
+	HYPERCALL_INFO Hypercall = {
+		.Id = HYPERCALL_GET_PAGE_TABLE_STATS,
+		.Result = HRESULT_SUCCESS
+	};
+
+	Hypercall = __vmcall(Hypercall, 0, NULL, Stats);
+
+	return Hypercall.Result;
+}